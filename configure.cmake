@@ -26,6 +26,13 @@ else()
   message( STATUS "AcesContainer not found, you can brew it" )
 endif()
 
+find_package( OpenEXR QUIET )
+if (OpenEXR_FOUND)
+  message( STATUS "Found OpenEXR, version ${OpenEXR_VERSION}" )
+else()
+  message( STATUS "OpenEXR not found, float output (--out-format 1/2) disabled" )
+endif()
+
 find_package( libraw QUIET )
 if (libraw_FOUND)
   message( STATUS "Found LibRaw, version ${libraw_VERSION}" )
@@ -43,4 +50,5 @@ if ( Boost_FOUND )
   message( STATUS "Found Boost_FOUND, version ${Boost_VERSION}" )
 else ()
   message( STATUS "Boost not found, you can brew it" )
-endif()
\ No newline at end of file
+endif()
+find_package( Threads REQUIRED )
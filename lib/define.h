@@ -56,6 +56,7 @@
 
 #include <assert.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdexcept>
 #include <string>
 #include <math.h>
@@ -66,6 +67,11 @@
 #include <unordered_map>
 #include <mutex>
 #include <thread>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <dirent.h>
 #include <half.h>
 #include <Eigen/Core>
@@ -88,6 +94,8 @@
 // suppress sprintf-related warning. sprintf() is permitted in sample code
 #include <string.h>
 #include <windows.h>
+#include <io.h>
+#include <fcntl.h>
 #define snprintf _snprintf
 #define _CRT_SECURE_NO_WARNINGS
 #define cmp_str stricmp
@@ -122,6 +130,26 @@ using ceres::Solver;
 
 enum matMethods_t { matMethod0, matMethod1, matMethod2 };
 enum wbMethods_t { wbMethod0, wbMethod1, wbMethod2, wbMethod3, wbMethod4 };
+enum outFormats_t { outFormat0, outFormat1, outFormat2 };
+enum previewModes_t { previewMode0, previewMode1, previewMode2 };
+enum stdoutModes_t { stdoutMode0, stdoutMode1, stdoutMode2, stdoutMode3, stdoutMode4 };
+enum priorities_t { priority0, priority1, priority2 };
+enum wbEstimators_t { wbEstimator0, wbEstimator1, wbEstimator2 };
+
+//  A grey box of "--wb-method 3" / "--wb-box", in pixels of the visible,
+//  unrotated image
+struct wbBox {
+    unsigned x, y, w, h;
+};
+
+//  One of the outputs requested with "--variant": the source of the IDT
+//  matrix, the adopted white (nullptr = from the white balance of the
+//  file) and the highlight headroom
+struct outputVariant {
+    matMethods_t mat_method;
+    char * illumType;
+    float scale;
+};
 
 struct Option {
     int ret;
@@ -136,13 +164,41 @@ struct Option {
     int get_illums;
     int get_cameras;
     int get_libraw_cameras;
+    int use_inspect;
+    int threads;
+    size_t max_memory;
+    int largest_first;
+    int prefetch;
+    int band_rows;
+    int shard_index;
+    int shard_count;
+    int use_claim;
+    int use_verify;
+    int hash_input;
+    int use_stdout;
+    int use_stats;
+    int use_profile;
+    int fit_threads;
+    int reserve;
     
     matMethods_t mat_method;
     wbMethods_t wb_method;
+    outFormats_t out_format;
+    previewModes_t preview_mode;
+    stdoutModes_t stdout_mode;
+    priorities_t priority;
+    wbEstimators_t wb_estimator;
     
     char * illumType;
+    char * cache_dir;
+    char * manifest;
+    char * queue;
     float scale;
+    double fit_threshold;
+    double deadline;
     vector <string> envPaths;
+    vector <outputVariant> variants;
+    vector <wbBox> wb_boxes;
     
 #ifndef WIN32
     void *iobuffer;
@@ -255,6 +311,13 @@ static const double XYZ_acesrgb_4[4][4] = {
     
 };
 
+//  Linear sRGB (D65) to XYZ, as "xyz_rgb" in LibRaw
+static const double srgb_XYZ_3[3][3] = {
+    { 0.412453,             0.357580,              0.180423 },
+    { 0.212671,             0.715160,              0.072169 },
+    { 0.019334,             0.119193,              0.950227 }
+};
+
 static const double acesrgb_XYZ_3[3][3] = {
     { 0.952552395938186,    0.0,                   9.36786316604686e-05 },
     { 0.343966449765075,    0.728166096613485,     -0.0721325463785608  },
@@ -335,6 +398,8 @@ inline vector < string > openDir ( string path = "." ) {
     vector <string> fPaths;
     
     dir = opendir(path.c_str());
+    if (!dir)
+        return fPaths;
     
     while ((pDir = readdir(dir))) {
         string fPath = path + "/" + pDir->d_name;
@@ -345,6 +410,8 @@ inline vector < string > openDir ( string path = "." ) {
         fPaths.push_back(fPath);
     }
     
+    closedir(dir);
+    
     return fPaths;
 };
 
@@ -57,6 +57,11 @@
 
 #include "define.h"
 
+#if defined(__GNUC__) && ( defined(__x86_64__) || defined(__i386__) )
+#include <immintrin.h>
+#define RTA_F16C_DISPATCH 1
+#endif
+
 //using namespace Eigen;
 
 // Non-class functions
@@ -373,7 +378,7 @@ vector < T > mulVector ( const vector < T > & vct1,
 
 template<typename T>
 T * mulVectorArray ( T * data,
-                     const uint32_t total,
+                     const size_t total,
                      const uint8_t dim,
                      const vector < vector < double > > & vct ) {
     assert(vct.size() == dim
@@ -393,7 +398,7 @@ T * mulVectorArray ( T * data,
     */
     
     if(dim == 3) {
-        for(uint32_t i = 0; i < total; i+=dim ) {
+        for(size_t i = 0; i < total; i+=dim ) {
             data[i] = vct[0][0]*data[i] + vct[0][1]*data[i+1]
             + vct[0][2]*data[i+2];
             data[i+1] = vct[1][0]*data[i] + vct[1][1]*data[i+1]
@@ -403,7 +408,7 @@ T * mulVectorArray ( T * data,
         }
     }
     else if (dim == 4) {
-        for(uint32_t i = 0; i < total; i+=4 ){
+        for(size_t i = 0; i < total; i+=4 ){
             data[i] = vct[0][0]*data[i] + vct[0][1]*data[i+1]
             + vct[0][2]*data[i+2] + vct[0][3]*data[i+3];
             data[i+1] = vct[1][0]*data[i] + vct[1][1]*data[i+1]
@@ -419,6 +424,102 @@ T * mulVectorArray ( T * data,
     return data;
 };
 
+//  Scale floats and convert them to half bits in the same pass
+//  ( portable path through Imath::half )
+inline void scaleToHalfScalar ( const float * src,
+                                unsigned short * dst,
+                                size_t total,
+                                float scale ) {
+    for ( size_t i = 0; i < total; i++ ) {
+        half tmpV ( src[i] * scale );
+        dst[i] = tmpV.bits();
+    }
+};
+
+#ifdef RTA_F16C_DISPATCH
+//  Same as scaleToHalfScalar() using F16C ( vcvtps2ph ), 8 samples at
+//  a time; rounds to nearest even like Imath::half
+__attribute__ (( target ( "avx,f16c" ) ))
+inline void scaleToHalfF16C ( const float * src,
+                              unsigned short * dst,
+                              size_t total,
+                              float scale ) {
+    __m256 sc = _mm256_set1_ps ( scale );
+    size_t i = 0;
+    
+    for ( ; i + 8 <= total; i += 8 ) {
+        __m256 v = _mm256_mul_ps ( _mm256_loadu_ps ( src + i ), sc );
+        _mm_storeu_si128 ( (__m128i *) ( dst + i ),
+                           _mm256_cvtps_ph ( v, _MM_FROUND_TO_NEAREST_INT ) );
+    }
+    
+    scaleToHalfScalar ( src + i, dst + i, total - i, scale );
+};
+#endif
+
+//  Scale floats and convert them to half bits, dispatching to F16C
+//  when the CPU supports it
+inline void scaleToHalf ( const float * src,
+                          unsigned short * dst,
+                          size_t total,
+                          float scale ) {
+    assert ( src && dst );
+    
+#ifdef RTA_F16C_DISPATCH
+    static const int hasF16C = __builtin_cpu_supports ( "avx" ) &&
+                               __builtin_cpu_supports ( "f16c" );
+    if ( hasF16C ) {
+        scaleToHalfF16C ( src, dst, total, scale );
+        return;
+    }
+#endif
+    
+    scaleToHalfScalar ( src, dst, total, scale );
+};
+
+//  C (cols x n) = A^T * B for row-major, contiguous A (rows x cols) and
+//  B (rows x n); rows of A are streamed in blocks of its columns so that
+//  the block of C stays in cache (no transpose is formed)
+template<typename T>
+void mulTransposedMatrix ( const T * A,
+                           size_t rows,
+                           size_t cols,
+                           const T * B,
+                           size_t n,
+                           T * C ) {
+    const size_t block = 256;
+    std::fill ( C, C + cols * n, T(0) );
+    
+    for ( size_t c0 = 0; c0 < cols; c0 += block ) {
+        size_t c1 = std::min ( cols, c0 + block );
+        
+        for ( size_t r = 0; r < rows; r++ ) {
+            const T * pA = A + r * cols;
+            const T * pB = B + r * n;
+            
+            for ( size_t c = c0; c < c1; c++ ) {
+                const T a = pA[c];
+                T * pC = C + c * n;
+                for ( size_t k = 0; k < n; k++ )
+                    pC[k] += a * pB[k];
+            }
+        }
+    }
+};
+
+//  Copy a 2D vector into one contiguous row-major buffer
+template<typename T>
+void flattenVM ( const vector < vector < T > > & vMtx, vector < T > & flat ) {
+    assert( vMtx.size() != 0 );
+    
+    size_t cols = vMtx[0].size();
+    flat.resize ( vMtx.size() * cols );
+    FORI ( vMtx.size() ) {
+        assert ( vMtx[i].size() == cols );
+        std::copy ( vMtx[i].begin(), vMtx[i].end(), flat.begin() + i * cols );
+    }
+};
+
 template<typename T>
 vector < vector<T> > solveVM ( const vector < vector < T > > & vct1,
                                const vector < vector < T > > & vct2 ) {
@@ -567,7 +668,7 @@ vector < vector < T > > getCAT ( const vector < T > & src,
 
 template<typename T>
 vector < vector<T> > XYZtoLAB ( const vector < vector < T > > & XYZ ) {
-    assert(XYZ.size() == 190);
+    assert(XYZ.size() > 0);
     T add = T(16.0/116.0);
     
     vector < vector<T> > tmpXYZ(XYZ.size(), vector<T>(3, T(1.0)));
@@ -597,7 +698,7 @@ vector < vector<T> > XYZtoLAB ( const vector < vector < T > > & XYZ ) {
 template<typename T>
 vector< vector<T> > getCalcXYZt ( const vector < vector < T > > & RGB,
                                   const T B[6] ) {
-    assert( RGB.size() == 190 );
+    assert( RGB.size() > 0 );
     
     vector < vector<T> > BV (3, vector < T >(3));
     vector < vector <T> > M (3, vector < T >(3));
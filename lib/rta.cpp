@@ -305,7 +305,7 @@ namespace rta {
     //	outputs:
     //		const vector < double > : the SPD data of the Illuminant
 
-    const vector < double > Illum::getIllumData() const {
+    const vector < double > & Illum::getIllumData() const {
         return _data;
     }
 
@@ -394,38 +394,56 @@ namespace rta {
         }
     }
     
-    Spst::Spst ( const Spst& spstobject ) {
-        assert ( spstobject._brand != null_ptr
-                 && spstobject._model != null_ptr );
+    //  Copy of the brand or model of a Spst; null_ptr if not loaded yet
+    static char * copyName ( const char * name ) {
+        if ( name == null_ptr )
+            return null_ptr;
         
-        size_t lenb = strlen(spstobject._brand);
-        assert(lenb < 64);
+        size_t len = strlen(name);
+        assert(len < 64);
         
-        if(lenb > 64) lenb = 64;
+        if(len > 64) len = 64;
         
-        _brand = (char *) malloc(lenb+1);
-        memset(_brand, 0x0, lenb);
-        memcpy(_brand, spstobject._brand, lenb);
-        _brand[lenb] = '\0';
-
-        size_t lenm = strlen(spstobject._model);
-        assert(lenm < 64);
+        char * copy = (char *) malloc(len+1);
+        memcpy(copy, name, len);
+        copy[len] = '\0';
         
-        if(lenm > 64) lenm = 64;
+        return copy;
+    }
+    
+    //  A Spst that has not loaded any data (e.g. the camera of an Idt
+    //  before loadCameraSpst()) is copied as it is
+    Spst::Spst ( const Spst& spstobject ) {
+        _brand = copyName ( spstobject._brand );
+        _model = copyName ( spstobject._model );
         
-        _model = (char *) malloc(lenm+1);
-        memset(_model, 0x0, lenm);
-        memcpy(_model, spstobject._model, lenm);
-        _model[lenm] = '\0';
+        _increment = spstobject._increment;
+        _spstMaxCol = spstobject._spstMaxCol;
+        _rgbsen = spstobject._rgbsen;
+    }
+    
+    Spst & Spst::operator= ( const Spst& spstobject ) {
+        if ( this == &spstobject )
+            return *this;
+        
+        char * brand = copyName ( spstobject._brand );
+        char * model = copyName ( spstobject._model );
+        
+        free ( _brand );
+        free ( _model );
+        _brand = brand;
+        _model = model;
         
         _increment = spstobject._increment;
         _spstMaxCol = spstobject._spstMaxCol;
         _rgbsen = spstobject._rgbsen;
+        
+        return *this;
     }
     
     Spst::~Spst() {
-        delete _brand;
-        delete _model;
+        free ( _brand );
+        free ( _model );
         
         vector< RGBSen >().swap( _rgbsen );
     }
@@ -477,9 +495,9 @@ namespace rta {
     //      N/A
     //
     //	outputs:
-    //		const vector <RGBSen>: the sensitivity (in vector) of the camera
+    //		const vector <RGBSen> &: the sensitivity (in vector) of the camera
     
-    const vector <RGBSen>  Spst::getSensitivity() const {
+    const vector <RGBSen> & Spst::getSensitivity() const {
         return _rgbsen;
     }
     
@@ -549,13 +567,13 @@ namespace rta {
             ptree pt;
             read_json ( path, pt );
             
-            const char * cmaker = (pt.get<string>( "header.manufacturer" )).c_str();
-            if ( cmp_str(maker, cmaker) ) return 0;
-            setBrand(cmaker);
+            string cmaker = pt.get<string>( "header.manufacturer" );
+            if ( cmp_str(maker, cmaker.c_str()) ) return 0;
+            setBrand(cmaker.c_str());
             
-            const char * cmodel = (pt.get<string>( "header.model" )).c_str();
-            if ( cmp_str(model, cmodel) ) return 0;
-            setModel(cmodel);
+            string cmodel = pt.get<string>( "header.model" );
+            if ( cmp_str(model, cmodel.c_str()) ) return 0;
+            setModel(cmodel.c_str());
             
             vector <int> wavs;
             int inc;
@@ -654,6 +672,7 @@ namespace rta {
         
         if(len > 64) len = 64;
         
+        free ( _brand );
         _brand = (char *) malloc(len+1);
         memset(_brand, 0x0, len);
         memcpy(_brand, brand, len);
@@ -680,6 +699,7 @@ namespace rta {
         
         if(len > 64) len = 64;
         
+        free ( _model );
         _model = (char *)malloc(len+1);
         memset(_model, 0x0, len);
         memcpy(_model, model, len);
@@ -722,13 +742,21 @@ namespace rta {
     // ------------------------------------------------------//
 
     
+    //  Spectral tables parsed so far, keyed by file path
+    static std::mutex _tableMutex;
+    static unordered_map < string, trainDataPtr > _trainingTables;
+    static unordered_map < string, cmfPtr > _cmfTables;
+    
     Idt::Idt() {
         _verbosity = 0;
+        _warmStart = 0;
+        _deltaEThreshold = 0.0;
+        _threads = 1;
         
-        FORI(81) {
-            _trainingSpec.push_back(trainSpec());
-            _cmf.push_back(CMF());
-        }
+        trainData * training = new trainData();
+        training->_spec.resize ( 81 );
+        _training = trainDataPtr ( training );
+        _cmf = cmfPtr ( new vector < CMF > ( 81 ) );
         
         _idt.resize(3);
         _wb.resize(3);
@@ -741,8 +769,8 @@ namespace rta {
     
     Idt::~Idt() {
         vector < Illum >().swap(_Illuminants);
-        vector < CMF >().swap(_cmf);
-        vector < trainSpec >().swap(_trainingSpec);
+        _cmf.reset();
+        _training.reset();
         vector < double >().swap(_wb);
         vector < vector<double> >().swap(_idt);
     }
@@ -878,23 +906,34 @@ namespace rta {
     }
     
     //	=====================================================================
-    //	Load the 190-patch training data
+    //	Load the training data (e.g. the 190-patch set); any number of
+    //  patches is accepted as long as every wavelength has the same count
     //
     //	inputs:
-    //		string : path to the 190-patch training data
+    //		string : path to the training data
     //
     //	outputs:
-    //		_trainingSpec: If successufully parsed, _trainingSpec will be filled
+    //		_training: If successufully parsed, _training will point to
+    //                 the (shared) training data of the file
     
     void Idt::loadTrainingData ( const string & path ) {
         struct stat st;
         assert (!stat( path.c_str(), &st ));
         
-        if ( _trainingSpec.size() > 0 ) {
-            FORI (_trainingSpec.size())
-                _trainingSpec[i]._data.clear();
+        {
+            std::lock_guard < std::mutex > lock ( _tableMutex );
+            unordered_map < string, trainDataPtr >::const_iterator it = _trainingTables.find ( path );
+            if ( it != _trainingTables.end() ) {
+                _training = it->second;
+                return;
+            }
         }
         
+        trainData * training = new trainData();
+        training->_spec.resize ( 81 );
+        vector < trainSpec > * trainingSpec = &training->_spec;
+        trainDataPtr table ( training );
+        
         try
         {
             ptree pt;
@@ -904,20 +943,36 @@ namespace rta {
             
             BOOST_FOREACH ( ptree::value_type &row, pt.get_child ( "spectral_data.data.main" ) )
             {
-                _trainingSpec[i]._wl = atoi((row.first).c_str());
+                (*trainingSpec)[i]._wl = atoi((row.first).c_str());
 
                 BOOST_FOREACH ( ptree::value_type &cell, row.second )
-                    _trainingSpec[i]._data.push_back(cell.second.get_value<double>());
+                    (*trainingSpec)[i]._data.push_back(cell.second.get_value<double>());
                 
-                assert(_trainingSpec[i]._data.size() == 190);
+                assert((*trainingSpec)[i]._data.size() > 0
+                       && (*trainingSpec)[i]._data.size() == (*trainingSpec)[0]._data.size());
                 
                 i += 1;
             }
+            
+            size_t patches = (*trainingSpec)[0]._data.size();
+            training->_patches = patches;
+            training->_matrix.resize ( trainingSpec->size() * patches );
+            FORI ( trainingSpec->size() )
+                std::copy ( (*trainingSpec)[i]._data.begin(),
+                            (*trainingSpec)[i]._data.end(),
+                            training->_matrix.begin() + i * patches );
+            
+            // another thread may have parsed the same file meanwhile;
+            // keep whichever table was published first
+            std::lock_guard < std::mutex > lock ( _tableMutex );
+            table = _trainingTables.insert ( make_pair ( path, table ) ).first->second;
         }
         catch ( std::exception const& e )
         {
             std::cerr << e.what() << std::endl;
         }
+        
+        _training = table;
     }
     
     //	=====================================================================
@@ -927,12 +982,25 @@ namespace rta {
     //		string : path to the CIE 1931 Color Matching Functions data
     //
     //	outputs:
-    //		_cmf: If successufully parsed, _cmf will be filled
+    //		_cmf: If successufully parsed, _cmf will point to the (shared)
+    //            color matching functions of the file
     
     void Idt::loadCMF ( const string & path ) {
         struct stat st;
         assert (!stat( path.c_str(), &st ));
         
+        {
+            std::lock_guard < std::mutex > lock ( _tableMutex );
+            unordered_map < string, cmfPtr >::const_iterator it = _cmfTables.find ( path );
+            if ( it != _cmfTables.end() ) {
+                _cmf = it->second;
+                return;
+            }
+        }
+        
+        vector < CMF > * cmf = new vector < CMF > ( 81 );
+        cmfPtr table ( cmf );
+        
         try
         {
             ptree pt;
@@ -941,12 +1009,12 @@ namespace rta {
             int i = 0;
             BOOST_FOREACH ( ptree::value_type &row, pt.get_child ( "spectral_data.data.main" ) )
             {
-                _cmf[i]._wl = atoi((row.first).c_str());
+                (*cmf)[i]._wl = atoi((row.first).c_str());
                 
-                if ( _cmf[i]._wl < 380 ||
-                    _cmf[i]._wl % 5 )
+                if ( (*cmf)[i]._wl < 380 ||
+                    (*cmf)[i]._wl % 5 )
                      continue;
-                else if ( _cmf[i]._wl > 780 )
+                else if ( (*cmf)[i]._wl > 780 )
                     break;
                 
                 vector < double > data;
@@ -954,17 +1022,22 @@ namespace rta {
                     data.push_back ( cell.second.get_value<double>() );
                 
                 assert(data.size() == 3);
-                _cmf[i]._xbar = data[0];
-                _cmf[i]._ybar = data[1];
-                _cmf[i]._zbar = data[2];
+                (*cmf)[i]._xbar = data[0];
+                (*cmf)[i]._ybar = data[1];
+                (*cmf)[i]._zbar = data[2];
                 
                 i += 1;
             }
+            
+            std::lock_guard < std::mutex > lock ( _tableMutex );
+            table = _cmfTables.insert ( make_pair ( path, table ) ).first->second;
         }
         catch ( std::exception const& e )
         {
             std::cerr << e.what() << std::endl;
         }
+        
+        _cmf = table;
     }
     
     //	=====================================================================
@@ -980,6 +1053,20 @@ namespace rta {
         _Illuminants.push_back(Illuminant);
     }
     
+    //	=====================================================================
+    //	Remove the Illuminants pushed so far, so that setIlluminants()
+    //  can start a new set
+    //
+    //	inputs:
+    //      N/A
+    //
+    //	outputs:
+    //		N/A:   _Illuminants is empty
+    
+    void Idt::clearIlluminants ( ) {
+        vector < Illum >().swap(_Illuminants);
+    }
+    
     //	=====================================================================
     //	Set Verbosity value for the length of IDT generation status message
     //
@@ -993,6 +1080,48 @@ namespace rta {
         _verbosity = verbosity;
     }
     
+    //	=====================================================================
+    //	Seed the IDT regression with a linear least-squares fit instead
+    //  of the identity matrix
+    //
+    //	inputs:
+    //      int: warmStart ("1" to enable)
+    //
+    //	outputs:
+    //		int: _warmStart
+    
+    void Idt::setWarmStart ( const int warmStart ) {
+        _warmStart = warmStart;
+    }
+    
+    //	=====================================================================
+    //	Set the minimum improvement of the RMS Delta E (CIE 1976) between two
+    //  iterations of the IDT regression; "0" runs until the tolerances
+    //
+    //	inputs:
+    //      double: threshold
+    //
+    //	outputs:
+    //		double: _deltaEThreshold
+    
+    void Idt::setDeltaEThreshold ( const double threshold ) {
+        _deltaEThreshold = threshold;
+    }
+    
+    //	=====================================================================
+    //	Set the number of threads evaluating the residual blocks of the
+    //  IDT regression
+    //
+    //	inputs:
+    //      int: threads
+    //
+    //	outputs:
+    //		int: _threads
+    
+    void Idt::setThreads ( const int threads ) {
+        _threads = std::max ( 1, threads );
+    }
+    
     //	=====================================================================
     //	Choose the best Light Source based on White Balance Coefficients from
     //  the camera read by libraw according to a given set of coefficients
@@ -1075,7 +1204,7 @@ namespace rta {
     //		vector < double >: scaled vector by its maximum value
 
     vector < double > Idt::calCM() {
-        vector < RGBSen > rgbsen = _cameraSpst.getSensitivity();
+        const vector < RGBSen > & rgbsen = _cameraSpst._rgbsen;
         vector< vector < double > > rgbsenV (3, vector < double > ( rgbsen.size(), 1.0));
         
         FORI( rgbsen.size() ){
@@ -1091,26 +1220,105 @@ namespace rta {
     }
     
     //	=====================================================================
-    //	Calculate the middle product based on the 190 patch / training data
+    //	Calculate the middle product based on the training data (patches)
     //  and Illuminant/light source data
     //
     //	inputs:
     //		N/A
     //
     //	outputs:
-    //		vector < vector<double> >: 2D vector (81 x 190)
+    //		vector < vector<double> >: 2D vector (81 x patches)
     
     vector < vector < double > > Idt::calTI() const {
-        assert( _bestIllum._data.size() == 81 &&
-                _trainingSpec[0]._data.size() == 190 );
+        size_t patches = _training->_patches;
+        assert( _bestIllum._data.size() == 81 && patches > 0 );
 
-        vector < vector<double> > TI(_bestIllum._data.size(), vector<double>(190));
-        FORIJ(_bestIllum._data.size(), _trainingSpec[0]._data.size())
-            TI[i][j] = _bestIllum._data[i] * (_trainingSpec[i]._data)[j];
+        const double * spectra = &(_training->_matrix[0]);
+        vector < vector<double> > TI(_bestIllum._data.size(), vector<double>(patches));
+        FORIJ(_bestIllum._data.size(), patches)
+            TI[i][j] = _bestIllum._data[i] * spectra[i * patches + j];
         
         return TI;
     }
     
+    //	=====================================================================
+    //	Integrate training spectra against the camera sensitivity (RGB)
+    //  and the color matching functions (XYZ) in one pass over a
+    //  contiguous (81 x patches) matrix; RGB is white balanced with "_wb",
+    //  XYZ is normalized and adapted to the ACES white as in calXYZ()
+    //
+    //	inputs:
+    //		const double * : spectra, row-major (81 x patches)
+    //		size_t         : number of patches
+    //		const double * : per-wavelength weight of the spectra (i.e. the
+    //                       illuminant), null_ptr if already weighted
+    //
+    //	outputs:
+    //		vector < vector<double> > * : RGB (patches x 3), if not null_ptr;
+    //                                    needs the camera sensitivity
+    //		vector < vector<double> > * : XYZ (patches x 3), if not null_ptr
+    
+    void Idt::integrate ( const double * spectra,
+                          size_t patches,
+                          const double * weight,
+                          vector < vector < double > > * RGB,
+                          vector < vector < double > > * XYZ ) const {
+        const vector < RGBSen > & rgbsen = _cameraSpst._rgbsen;
+        const vector < CMF > & cmf = *_cmf;
+        const size_t wls = 81;
+        
+        assert ( ( !RGB || rgbsen.size() >= wls ) && cmf.size() >= wls );
+        
+        // response functions (81 x 6): camera RGB ( zero when only XYZ
+        // is asked for ), then CIE XYZ
+        vector < double > S ( wls * 6, 0.0 );
+        FORI(wls) {
+            double wt = weight ? weight[i] : 1.0;
+            if ( RGB ) {
+                S[i * 6 + 0] = wt * rgbsen[i]._RSen;
+                S[i * 6 + 1] = wt * rgbsen[i]._GSen;
+                S[i * 6 + 2] = wt * rgbsen[i]._BSen;
+            }
+            S[i * 6 + 3] = wt * cmf[i]._xbar;
+            S[i * 6 + 4] = wt * cmf[i]._ybar;
+            S[i * 6 + 5] = wt * cmf[i]._zbar;
+        }
+        
+        vector < double > responses ( patches * 6 );
+        mulTransposedMatrix ( spectra, wls, patches, &S[0], size_t(6), &responses[0] );
+        
+        if ( RGB ) {
+            RGB->assign ( patches, vector < double > (3) );
+            FORIJ(patches, 3)
+                (*RGB)[i][j] = _wb[j] * responses[i * 6 + j];
+        }
+        
+        if ( XYZ ) {
+            const vector < double > & illum = _bestIllum._data;
+            
+            vector < double > ww ( 3, 0.0 );
+            FORI(wls) {
+                ww[0] += cmf[i]._xbar * illum[i];
+                ww[1] += cmf[i]._ybar * illum[i];
+                ww[2] += cmf[i]._zbar * illum[i];
+            }
+            
+            double scale = 1.0 / ww[1];
+            scaleVector ( ww, scale );
+            vector <double> w ( XYZ_w, XYZ_w+3 );
+            vector < vector < double > > CAT = getCAT(ww, w);
+            
+            XYZ->assign ( patches, vector < double > (3) );
+            FORI(patches) {
+                const double * xyz = &responses[i * 6 + 3];
+                FORJ(3)
+                    (*XYZ)[i][j] = scale * ( CAT[j][0] * xyz[0]
+                                             + CAT[j][1] * xyz[1]
+                                             + CAT[j][2] * xyz[2] );
+            }
+        }
+    }
+    
     //	=====================================================================
     //	Calculate White Balance based on the Illuminant data and
     //  highlight mode used in pre-processing with "libraw"
@@ -1152,41 +1360,31 @@ namespace rta {
     //	=====================================================================
     //	Calculate CIE XYZ tristimulus values of scene adopted white
     //  based on training color spectral radiances from CalTI() and color
-    //  adaptation matrix from CalCAT()
+    //  adaptation matrix from CalCAT(). Needs the color matching functions
+    //  (loadCMF()) and the chosen light source (chooseIllumType() or
+    //  chooseIllumSrc()); the camera sensitivity is not used.
     //
     //	inputs:
     //		vector< vector<double> > outcome of CalTI()
     //
     //	outputs:
-    //		vector < vector<double> >: 2D vector (190 x 3)
+    //		vector < vector<double> >: 2D vector (patches x 3)
     
     vector< vector < double > > Idt::calXYZ (const vector < vector < double > > & TI ) const {
-        assert(TI.size() == 81);
-        
-        vector< vector<double> > transTI = transposeVec(TI);
-        vector< vector<double> > colXYZ(3, vector<double>(TI.size(), 1.0));
-
-        FORI(TI.size()){
-            colXYZ[0][i] = _cmf[i]._xbar;
-            colXYZ[1][i] = _cmf[i]._ybar;
-            colXYZ[2][i] = _cmf[i]._zbar;
+        if ( !_cmf || _cmf->size() < 81 || _bestIllum._data.size() != 81 ) {
+            fprintf( stderr, "Error: The color matching functions and the "
+                             "light source must be loaded before calculating "
+                             "the XYZ of the training data.\n" );
+            exit(-1);
         }
         
-        vector< vector<double> > XYZ = transposeVec(mulVector(colXYZ,
-                                                              transTI));
-        
-        FORI(XYZ.size())
-            scaleVector ( XYZ[i],
-                          1.0 / sumVector ( mulVectorElement(colXYZ[1], _bestIllum._data ) ) );
+        assert(TI.size() == 81);
         
-        vector <double> ww = mulVector(colXYZ, _bestIllum._data);
-        scaleVector ( ww, ( 1.0 / ww[1] ) );
-        vector <double> w ( XYZ_w, XYZ_w+3 );
-
-        XYZ = mulVector(XYZ, getCAT(ww, w));
+        vector < double > spectra;
+        flattenVM ( TI, spectra );
         
-        clearVM(ww);
-        clearVM(w);
+        vector< vector<double> > XYZ;
+        integrate ( &spectra[0], TI[0].size(), null_ptr, null_ptr, &XYZ );
 
         return XYZ;
     }
@@ -1200,34 +1398,77 @@ namespace rta {
     //		vector< vector<double> > outcome of CalTI()
     //
     //	outputs:
-    //		vector < vector<double> >: 2D vector (190 x 3)
+    //		vector < vector<double> >: 2D vector (patches x 3)
     
     vector< vector < double > > Idt::calRGB ( const vector < vector < double > > & TI ) const {
         assert(TI.size() == 81);
         
-        vector< vector<double> > transTI = transposeVec(TI);
-        vector< vector<double> > colRGB(3, vector<double>(TI.size(), 1.0));
+        vector < double > spectra;
+        flattenVM ( TI, spectra );
         
-        FORI(TI.size()) {
-            colRGB[0][i] = _cameraSpst._rgbsen[i]._RSen;
-            colRGB[1][i] = _cameraSpst._rgbsen[i]._GSen;
-            colRGB[2][i] = _cameraSpst._rgbsen[i]._BSen;
+        vector< vector<double> > RGB;
+        integrate ( &spectra[0], TI[0].size(), null_ptr, &RGB, null_ptr );
+        
+        return RGB;
+    }
+    
+    //	=====================================================================
+    //	Closed-form least-squares fit of RGB to ACES (via XYZ) with rows of
+    //  the IDT constrained to sum up to 1; used as the starting point of
+    //  curveFit()
+    //
+    //	inputs:
+    //		vector< vector<double> >: RGB
+    //      vector< vector<double> >: XYZ
+    //
+    //	outputs:
+    //      double * : B (6 elements), untouched if the fit fails
+    //      int      : "1" means B was filled
+    
+    int Idt::linearFit ( const vector< vector < double > > & RGB,
+                         const vector< vector < double > > & XYZ,
+                         double * B ) const {
+        assert ( RGB.size() == XYZ.size() && RGB.size() > 2 );
+        
+        vector < vector < double > > M (3, vector < double > (3));
+        FORIJ(3, 3) M[i][j] = acesrgb_XYZ_3[i][j];
+        M = invertVM(M);
+        
+        // each row of the IDT sums up to 1, i.e.
+        // aces - b = B0 * (r - b) + B1 * (g - b)
+        vector < vector < double > > A (RGB.size(), vector < double > (2));
+        vector < vector < double > > Y (RGB.size(), vector < double > (3));
+        FORI(RGB.size()) {
+            A[i][0] = RGB[i][0] - RGB[i][2];
+            A[i][1] = RGB[i][1] - RGB[i][2];
+            
+            FORJ(3) {
+                double aces = M[j][0] * XYZ[i][0] + M[j][1] * XYZ[i][1] + M[j][2] * XYZ[i][2];
+                Y[i][j] = aces - RGB[i][2];
+            }
         }
         
-        vector< vector<double> > RGB = mulVector(transTI, colRGB);
-
-        FORI(RGB.size())
-            RGB[i] = mulVectorElement(_wb, RGB[i]);
+        vector < vector < double > > X = solveVM(A, Y);
         
-        clearVM(transTI);
-        clearVM(colRGB);
+        double BL[6];
+        FORI(3) {
+            BL[i * 2] = X[0][i];
+            BL[i * 2 + 1] = X[1][i];
+        }
         
-        return RGB;
+        FORI(6)
+            if ( !std::isfinite(BL[i]) )
+                return 0;
+        
+        FORI(6) B[i] = BL[i];
+        
+        return 1;
     }
     
     //	=====================================================================
     //	Process cureve fit between XYZ and RGB data with initial set of B
-    //  values.
+    //  values; stops early once the RMS Delta E improves by less than
+    //  "_deltaEThreshold" (if set)
     //
     //	inputs:
     //		vector< vector<double> >: RGB
@@ -1245,12 +1486,21 @@ namespace rta {
         Problem problem;
         vector < vector <double> > outLAB = XYZtoLAB(XYZ);
 
-        CostFunction* cost_function =
-            new AutoDiffCostFunction<Objfun, DYNAMIC, 6>(new Objfun(RGB, outLAB), int(RGB.size()*(RGB[0].size())));
+        // contiguous blocks of patches, one residual block each (a few
+        // blocks per thread); a single block when running single-threaded
+        size_t block = RGB.size();
+        if ( _threads > 1 )
+            block = std::max ( size_t(64), ( RGB.size() + _threads * 4 - 1 ) / ( _threads * 4 ) );
+        for ( size_t start = 0; start < RGB.size(); start += block ) {
+            size_t count = std::min ( block, RGB.size() - start );
+            
+            CostFunction* cost_function =
+                new AutoDiffCostFunction<Objfun, DYNAMIC, 6>(new Objfun(RGB, outLAB, start, count), int(count*(RGB[0].size())));
         
-        problem.AddResidualBlock ( cost_function,
-                                   NULL,
-                                   B );
+            problem.AddResidualBlock ( cost_function,
+                                       NULL,
+                                       B );
+        }
         
         ceres::Solver::Options options;
         options.linear_solver_type = ceres::DENSE_QR;
@@ -1259,6 +1509,11 @@ namespace rta {
         options.function_tolerance = 1e-17;
         options.min_line_search_step_size = 1e-17;
         options.max_num_iterations = 300;
+        options.num_threads = _threads;
+        
+        DeltaECallback callback ( _deltaEThreshold, RGB.size() );
+        if ( _deltaEThreshold > 0.0 )
+            options.callbacks.push_back ( &callback );
         
         if (_verbosity > 2)
             options.minimizer_progress_to_stdout = true;
@@ -1290,8 +1545,7 @@ namespace rta {
             return 1;
         }
         
-        delete cost_function;
-        
+        // the cost functions are owned (and freed) by "problem"
         return 0;
     }
     
@@ -1308,10 +1562,19 @@ namespace rta {
 
     int Idt::calIDT() {
         
+        assert( _bestIllum._data.size() == 81 && _training->_patches > 0 );
+        
         double BStart[6] = {1.0, 0.0, 0.0, 1.0, 0.0, 0.0};
-        vector < vector<double> > TI = calTI();
         
-        return curveFit(calRGB(TI), calXYZ(TI), BStart);
+        // same as calRGB(calTI()) and calXYZ(calTI()), without building TI
+        vector < vector<double> > RGB, XYZ;
+        integrate ( &(_training->_matrix[0]), _training->_patches,
+                    &(_bestIllum._data[0]), &RGB, &XYZ );
+        
+        if ( _warmStart && !linearFit(RGB, XYZ, BStart) && _verbosity > 1 )
+            printf ( "Linear fit failed; regressing from the identity matrix ...\n" );
+        
+        return curveFit(RGB, XYZ, BStart);
     }
     
     //	=====================================================================
@@ -1321,9 +1584,9 @@ namespace rta {
     //         N/A
     //
     //	outputs:
-    //      const Spst: camera sensitivity data that was loaded from the file
+    //      const Spst &: camera sensitivity data that was loaded from the file
     
-    const Spst Idt::getCameraSpst() const {
+    const Spst & Idt::getCameraSpst() const {
         return _cameraSpst;
     }
     
@@ -1334,10 +1597,10 @@ namespace rta {
     //         N/A
     //
     //	outputs:
-    //      const vector < illum >: Illuminant data that was loaded from
+    //      const vector < illum > &: Illuminant data that was loaded from
     //      the file
 
-    const vector < Illum > Idt::getIlluminants() const {
+    const vector < Illum > & Idt::getIlluminants() const {
         return _Illuminants;
     }
     
@@ -1349,9 +1612,9 @@ namespace rta {
     //         N/A
     //
     //	outputs:
-    //      const illum: Illuminant data that has the closest match
+    //      const illum &: Illuminant data that has the closest match
     
-    const Illum Idt::getBestIllum() const {
+    const Illum & Idt::getBestIllum() const {
         assert ( (_bestIllum.getIllumData()).size() != 0 );
         
         return _bestIllum;
@@ -1377,11 +1640,11 @@ namespace rta {
     //         N/A
     //
     //	outputs:
-    //      const vector < trainSpec >: Spectral Training data that was loaded
-    //      from the file
+    //      const vector < trainSpec > &: Spectral Training data that was
+    //      loaded from the file (shared by all Idt instances, read-only)
     
-    const vector < trainSpec > Idt::getTrainingSpec() const {
-        return _trainingSpec;
+    const vector < trainSpec > & Idt::getTrainingSpec() const {
+        return _training->_spec;
     }
     
     //	=====================================================================
@@ -1391,11 +1654,11 @@ namespace rta {
     //         N/A
     //
     //	outputs:
-    //      const CMF: Color Matching Function data that was loaded from
-    //      the file
+    //      const vector < CMF > &: Color Matching Function data that was
+    //      loaded from the file (shared by all Idt instances, read-only)
     
-    const vector < CMF > Idt::getCMF() const {
-        return _cmf;
+    const vector < CMF > & Idt::getCMF() const {
+        return *_cmf;
     }
 
     //	=====================================================================
@@ -1428,6 +1691,308 @@ namespace rta {
     // ------------------------------------------------------//
     
     
+    //  binary camera profile: header followed by "count" entries
+    //  (native byte order)
+    static const char _profileMagic[8] = { 'R', 'T', 'A', 'P', 'R', 'O', 'F', '\0' };
+    static const uint32_t _profileVersion = 1;
+    
+    struct profileHeader {
+        char     _magic[8];
+        uint32_t _version;
+        uint32_t _count;
+        char     _brand[64];
+        char     _model[64];
+    };
+    
+    Profile::Profile() {
+    }
+    
+    Profile::~Profile() {
+        vector < profileEntry >().swap(_entries);
+    }
+    
+    //	=====================================================================
+    //	Set the camera the profile belongs to
+    //
+    //	inputs:
+    //		const char * : camera manufacturer
+    //		const char * : camera model
+    //
+    //	outputs:
+    //		N/A
+    
+    void Profile::setCamera ( const char * brand, const char * model ) {
+        assert ( brand != null_ptr && model != null_ptr );
+        
+        _brand = brand;
+        _model = model;
+    }
+    
+    //	=====================================================================
+    //	Append one pre-calculated entry; entries are kept in ascending CCT
+    //
+    //	inputs:
+    //		profileEntry : WB and IDT at a given CCT
+    //
+    //	outputs:
+    //		N/A
+    
+    void Profile::addEntry ( const profileEntry & entry ) {
+        vector < profileEntry >::iterator it = _entries.begin();
+        while ( it != _entries.end() && it->_cct < entry._cct )
+            ++it;
+        
+        _entries.insert ( it, entry );
+    }
+    
+    //	=====================================================================
+    //	Pre-calculate WB and IDT over a dense table of correlated color
+    //  temperatures (Blackbody 1500K - 3950K every 50K, Daylight 4000K -
+    //  25000K every 100K); the Illuminants of the Idt are replaced
+    //
+    //	inputs:
+    //		Idt & : Idt with camera sensitivity, training data and
+    //              color matching functions loaded
+    //		int   : lowest CCT of the table
+    //		int   : highest CCT of the table
+    //
+    //	outputs:
+    //		int   : number of entries calculated
+    
+    int Profile::build ( Idt & idt, int first, int last ) {
+        const Spst & spst = idt.getCameraSpst();
+        assert ( spst.getSensitivity().size() > 0 );
+        
+        if ( spst.getBrand() && spst.getModel() )
+            setCamera ( spst.getBrand(), spst.getModel() );
+        
+        vector < profileEntry >().swap(_entries);
+        
+        for ( int cct = first; cct <= last; cct += ( cct < 4000 ? 50 : 100 ) ) {
+            Illum illum;
+            if ( cct < 4000 )
+                illum.calBlackBodySPD ( cct );
+            else
+                illum.calDayLightSPD ( cct );
+            
+            idt.clearIlluminants ( );
+            idt.setIlluminants ( illum );
+            idt.chooseIllumType ( illum.getIllumType().c_str(), 0 );
+            
+            if ( !idt.calIDT() ) {
+                fprintf ( stderr, "Warning: IDT regression failed at %dK; "
+                                  "the entry is skipped.\n", cct );
+                continue;
+            }
+            
+            vector < double > wb = idt.getWB();
+            vector < vector < double > > matrix = idt.getIDT();
+            
+            profileEntry entry;
+            entry._cct = cct;
+            FORI(3) {
+                entry._wb[i] = wb[i];
+                FORJ(3) entry._idt[i][j] = matrix[i][j];
+            }
+            _entries.push_back ( entry );
+            
+            if ( idt.getVerbosity() > 1 )
+                printf ( "%s %s: %dK done\n", _brand.c_str(), _model.c_str(), cct );
+        }
+        
+        return _entries.size();
+    }
+    
+    //	=====================================================================
+    //	Write the profile into a binary file
+    //
+    //	inputs:
+    //		string : path to the profile
+    //
+    //	outputs:
+    //		int    : "1" means the profile was written; "0" means error
+    
+    int Profile::write ( const string & path ) const {
+        if ( _entries.empty() )
+            return 0;
+        
+        profileHeader header;
+        memset ( &header, 0, sizeof(profileHeader) );
+        memcpy ( header._magic, _profileMagic, sizeof(_profileMagic) );
+        header._version = _profileVersion;
+        header._count = _entries.size();
+        strncpy ( header._brand, _brand.c_str(), sizeof(header._brand) - 1 );
+        strncpy ( header._model, _model.c_str(), sizeof(header._model) - 1 );
+        
+        FILE * fp = fopen ( path.c_str(), "wb" );
+        if ( !fp ) {
+            fprintf ( stderr, "Error: Cannot write the profile \"%s\".\n",
+                      path.c_str() );
+            return 0;
+        }
+        
+        int ok = ( fwrite ( &header, sizeof(profileHeader), 1, fp ) == 1
+                   && fwrite ( &_entries[0], sizeof(profileEntry),
+                               _entries.size(), fp ) == _entries.size() );
+        
+        return ( fclose ( fp ) == 0 && ok );
+    }
+    
+    //	=====================================================================
+    //	Read a binary profile, optionally only if it belongs to the given
+    //  camera
+    //
+    //	inputs:
+    //		string       : path to the profile
+    //		const char * : camera manufacturer (null_ptr to accept any)
+    //		const char * : camera model (null_ptr to accept any)
+    //
+    //	outputs:
+    //		int          : "1" means the profile was loaded; "0" means the
+    //                     file is not a (matching) profile
+    
+    int Profile::read ( const string & path,
+                        const char * maker,
+                        const char * model ) {
+        FILE * fp = fopen ( path.c_str(), "rb" );
+        if ( !fp )
+            return 0;
+        
+        profileHeader header;
+        if ( fread ( &header, sizeof(profileHeader), 1, fp ) != 1
+             || memcmp ( header._magic, _profileMagic, sizeof(_profileMagic) )
+             || header._version != _profileVersion
+             || header._count == 0 ) {
+            fclose ( fp );
+            return 0;
+        }
+        
+        header._brand[sizeof(header._brand) - 1] = '\0';
+        header._model[sizeof(header._model) - 1] = '\0';
+        
+        if ( ( maker && cmp_str ( maker, header._brand ) )
+             || ( model && cmp_str ( model, header._model ) ) ) {
+            fclose ( fp );
+            return 0;
+        }
+        
+        vector < profileEntry > entries ( header._count );
+        size_t read = fread ( &entries[0], sizeof(profileEntry), header._count, fp );
+        fclose ( fp );
+        
+        if ( read != header._count )
+            return 0;
+        
+        _brand = header._brand;
+        _model = header._model;
+        _entries.swap ( entries );
+        
+        return 1;
+    }
+    
+    //	=====================================================================
+    //	Find the CCT whose WB best matches the as-shot multipliers and
+    //  linearly interpolate WB and IDT between the two closest entries
+    //
+    //	inputs:
+    //		vector < double > : as-shot white balance multipliers (R, G, B)
+    //
+    //	outputs:
+    //		vector < double > : interpolated white balance coefficients
+    //		vector < vector < double > > : interpolated IDT matrix (3 x 3)
+    //		double            : estimated CCT; "0" if the profile is empty
+    
+    double Profile::interpolate ( const vector < double > & mul,
+                                  vector < double > & wb,
+                                  vector < vector < double > > & idt ) const {
+        assert ( mul.size() >= 3 && mul[1] != 0.0 );
+        
+        if ( _entries.empty() )
+            return 0.0;
+        
+        // compare R/G and B/G, as the profile WB is normalized to G
+        double src[2] = { mul[0] / mul[1], mul[2] / mul[1] };
+        
+        size_t best = 0;
+        double sse = dmax;
+        FORI ( _entries.size() ) {
+            double dr = _entries[i]._wb[0] / src[0] - 1.0;
+            double db = _entries[i]._wb[2] / src[1] - 1.0;
+            if ( dr * dr + db * db < sse ) {
+                sse = dr * dr + db * db;
+                best = i;
+            }
+        }
+        
+        // project onto the segments to both neighbours and keep
+        // the closer one
+        size_t a = best, b = best;
+        double t = 0.0, dist = dmax;
+        for ( int side = -1; side <= 1; side += 2 ) {
+            if ( ( side < 0 && best == 0 )
+                 || ( side > 0 && best + 1 >= _entries.size() ) )
+                continue;
+            
+            const profileEntry & e0 = _entries[best];
+            const profileEntry & e1 = _entries[best + side];
+            double d[2] = { e1._wb[0] - e0._wb[0], e1._wb[2] - e0._wb[2] };
+            double len = d[0] * d[0] + d[1] * d[1];
+            
+            double tt = 0.0;
+            if ( len > 0.0 )
+                tt = ( ( src[0] - e0._wb[0] ) * d[0]
+                       + ( src[1] - e0._wb[2] ) * d[1] ) / len;
+            tt = std::max ( 0.0, std::min ( 1.0, tt ) );
+            
+            double r = e0._wb[0] + tt * d[0] - src[0];
+            double bl = e0._wb[2] + tt * d[1] - src[1];
+            if ( r * r + bl * bl < dist ) {
+                dist = r * r + bl * bl;
+                a = best;
+                b = best + side;
+                t = tt;
+            }
+        }
+        
+        const profileEntry & e0 = _entries[a];
+        const profileEntry & e1 = _entries[b];
+        
+        wb.resize(3);
+        idt.resize(3);
+        FORI(3) {
+            wb[i] = e0._wb[i] + t * ( e1._wb[i] - e0._wb[i] );
+            idt[i].resize(3);
+            FORJ(3) idt[i][j] = e0._idt[i][j] + t * ( e1._idt[i][j] - e0._idt[i][j] );
+        }
+        
+        return e0._cct + t * ( e1._cct - e0._cct );
+    }
+    
+    //	=====================================================================
+    //  Get the camera manufacturer the profile belongs to
+    
+    const string & Profile::getBrand() const {
+        return _brand;
+    }
+    
+    //	=====================================================================
+    //  Get the camera model the profile belongs to
+    
+    const string & Profile::getModel() const {
+        return _model;
+    }
+    
+    //	=====================================================================
+    //  Get the pre-calculated entries (in ascending CCT)
+    
+    const vector < profileEntry > & Profile::getEntries() const {
+        return _entries;
+    }
+    
+    
+    // ------------------------------------------------------//
+    
+    
     DNGIdt::DNGIdt() {
         _cameraCalibration1DNG = vector < double > ( 9, 1.0 );
         _cameraCalibration2DNG = vector < double > ( 9, 1.0 );
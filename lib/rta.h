@@ -65,6 +65,7 @@
 #include <stdint.h>
 #include <math.h>
 #include <string>
+#include <memory>
 #include <half.h>
 #include <ctype.h>
 #include <stdlib.h>
@@ -95,6 +96,16 @@ namespace rta {
         vector <double> _data;
     };
     
+    //  Training spectra as loaded (per wavelength) and as one contiguous
+    //  row-major matrix (wavelength x patch) for the spectral integration
+    struct trainData {
+        trainData() : _patches(0) {};
+        
+        vector < trainSpec > _spec;
+        vector < double > _matrix;
+        size_t _patches;
+    };
+    
     struct CMF {
         uint16_t _wl;
         double _xbar;
@@ -112,6 +123,11 @@ namespace rta {
         double _GSen;
         double _BSen;
     };
+    
+    //  Read-only spectral tables; each file is parsed once per process
+    //  and the result is shared (reference-counted) by all Idt instances
+    typedef std::shared_ptr < const struct trainData > trainDataPtr;
+    typedef std::shared_ptr < const vector < CMF > > cmfPtr;
 
     class Idt;
 
@@ -127,7 +143,7 @@ namespace rta {
             void setIllumInc( const int & Inc );
             void setIllumIndex( const double & index );
 
-            const vector < double > getIllumData() const;
+            const vector < double > & getIllumData() const;
             const string getIllumType() const;
             const int getIllumInc() const;
             const double getIllumIndex() const;
@@ -152,6 +168,7 @@ namespace rta {
         public:
             Spst();
             Spst( const Spst& spstobject );
+            Spst & operator= ( const Spst& spstobject );
             Spst( char * brand,
                   char * model,
                   uint8_t increment,
@@ -169,7 +186,7 @@ namespace rta {
             const char * getBrand() const;
             const char * getModel() const;
             const uint8_t getWLIncrement() const;
-            const vector < RGBSen > getSensitivity() const;
+            const vector < RGBSen > & getSensitivity() const;
         
             char * getBrand();
             char * getModel();
@@ -204,7 +221,11 @@ namespace rta {
             void chooseIllumSrc( const vector < double > & src, int highlight );
             void chooseIllumType( const char * type, int highlight );
             void setIlluminants( const Illum & Illuminant );
+            void clearIlluminants( );
             void setVerbosity( const int verbosity );
+            void setWarmStart( const int warmStart );
+            void setDeltaEThreshold( const double threshold );
+            void setThreads( const int threads );
             void scaleLSC( Illum & Illuminant );
         
             vector < double > calCM();
@@ -213,32 +234,80 @@ namespace rta {
             vector < vector <double > > calXYZ( const vector < vector < double > > & TI ) const;
             vector < vector < double > > calRGB( const vector < vector <double > > & TI ) const;
         
+            int linearFit( const vector < vector < double > > & RGB,
+                           const vector < vector < double > > & XYZ,
+                           double * B ) const;
             int curveFit( const vector < vector < double > > & RGB,
                           const vector < vector < double > > & XYZ,
                           double * B );
             int calIDT();
         
-            const Spst getCameraSpst() const;
-            const Illum getBestIllum() const;
-            const vector < trainSpec > getTrainingSpec() const;
-            const vector < Illum > getIlluminants() const;
-            const vector < CMF > getCMF() const;
+            const Spst & getCameraSpst() const;
+            const Illum & getBestIllum() const;
+            const vector < trainSpec > & getTrainingSpec() const;
+            const vector < Illum > & getIlluminants() const;
+            const vector < CMF > & getCMF() const;
             const vector < vector < double > > getIDT() const;
             const vector < double > getWB() const;
             const int getVerbosity() const;
 
         private:
+            void integrate( const double * spectra,
+                            size_t patches,
+                            const double * weight,
+                            vector < vector < double > > * RGB,
+                            vector < vector < double > > * XYZ ) const;
+        
             Spst    _cameraSpst;
             Illum   _bestIllum;
             int     _verbosity;
+            int     _warmStart;
+            double  _deltaEThreshold;
+            int     _threads;
         
-            vector < CMF > _cmf;
-            vector < trainSpec > _trainingSpec;
+            cmfPtr _cmf;
+            trainDataPtr _training;
             vector < Illum > _Illuminants;
             vector < double > _wb;
             vector < vector< double > > _idt;
     };
     
+    //  WB and IDT of a camera pre-calculated at one correlated color
+    //  temperature
+    struct profileEntry {
+        double _cct;
+        double _wb[3];
+        double _idt[3][3];
+    };
+    
+    class Profile {
+        public:
+            Profile();
+            ~Profile();
+        
+            void setCamera ( const char * brand, const char * model );
+            void addEntry ( const profileEntry & entry );
+            int build ( Idt & idt, int first = 1500, int last = 25000 );
+        
+            int write ( const string & path ) const;
+            int read ( const string & path,
+                       const char * maker = null_ptr,
+                       const char * model = null_ptr );
+        
+            double interpolate ( const vector < double > & mul,
+                                 vector < double > & wb,
+                                 vector < vector < double > > & idt ) const;
+        
+            const string & getBrand() const;
+            const string & getModel() const;
+            const vector < profileEntry > & getEntries() const;
+        
+        private:
+            string _brand;
+            string _model;
+            vector < profileEntry > _entries;
+    };
+    
     
     class DNGIdt {
         public:
@@ -277,18 +346,26 @@ namespace rta {
             double _baseExpo;
     };
     
+    //  Residuals of "count" contiguous training patches starting at
+    //  "start" (all patches by default); the regression adds one block
+    //  per range so that ceres can evaluate them in parallel
     struct Objfun {
             Objfun ( const vector < vector <double> > & RGB,
-                     const vector < vector <double> > & outLAB): _RGB(RGB), _outLAB(outLAB) { }
+                     const vector < vector <double> > & outLAB,
+                     size_t start = 0,
+                     size_t count = 0 ) : _RGB(RGB.begin() + start,
+                                               count ? RGB.begin() + start + count : RGB.end()),
+                                          _outLAB(outLAB.begin() + start,
+                                                  count ? outLAB.begin() + start + count : outLAB.end()) { }
         
             template<typename T>
             bool operator() ( const T* B, T * residuals ) const
             {
-                vector < vector <T> > RGBJet(190, vector< T >(3));
-                FORIJ(190, 3) RGBJet[i][j] = T(_RGB[i][j]);
+                vector < vector <T> > RGBJet(_RGB.size(), vector< T >(3));
+                FORIJ(_RGB.size(), 3) RGBJet[i][j] = T(_RGB[i][j]);
             
                 vector < vector <T> > outCalcLAB = XYZtoLAB(getCalcXYZt(RGBJet, B));
-                FORIJ(190, 3) residuals[i * 3 + j] = _outLAB[i][j] - outCalcLAB[i][j];
+                FORIJ(_RGB.size(), 3) residuals[i * 3 + j] = _outLAB[i][j] - outCalcLAB[i][j];
 
                 return true;
            }
@@ -297,5 +374,33 @@ namespace rta {
             const vector< vector <double> > _outLAB;
    };
     
+    //  Stop the IDT regression once the RMS color difference (Delta E)
+    //  of the training patches improves by less than a threshold
+    class DeltaECallback : public IterationCallback {
+        public:
+            DeltaECallback ( double threshold, size_t patches ) : _threshold(threshold),
+                                                                  _patches(patches),
+                                                                  _last(dmax) { }
+        
+            CallbackReturnType operator() ( const IterationSummary & summary )
+            {
+                if ( !summary.step_is_successful && summary.iteration > 0 )
+                    return SOLVER_CONTINUE;
+                
+                // ceres cost is 0.5 * sum of squared residuals
+                double dE = std::sqrt ( 2.0 * summary.cost / _patches );
+                if ( _last - dE < _threshold )
+                    return SOLVER_TERMINATE_SUCCESSFULLY;
+                
+                _last = dE;
+                return SOLVER_CONTINUE;
+            }
+        
+        private:
+            double _threshold;
+            size_t _patches;
+            double _last;
+   };
+    
 }
 #endif
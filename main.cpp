@@ -75,6 +75,12 @@ int main(int argc, char *argv[])
 // Gather all the raw images from arg list
     vector < string > RAWs;
     for ( ; arg < argc; arg++ ) {
+        // "-" reads a raw file from the standard input
+        if ( !strcmp ( argv[arg], "-" ) ) {
+            RAWs.push_back ( argv[arg] );
+            continue;
+        }
+        
         if( stat( argv[arg], &st) != 0 ) {
             fprintf ( stderr, "Error: The directory or file may not exist - \"%s\"...",
                               argv[arg]);
@@ -94,42 +100,23 @@ int main(int argc, char *argv[])
         }
     }
     
-// Load illuminant dataset(s)
-    int read = 0;
     Option opts = Render.getSettings();
-    if (!opts.illumType)
-        read = Render.fetchIlluminant( );
-    else
-        read = Render.fetchIlluminant( opts.illumType );
     
-    if( !read ) {
-        fprintf( stderr, "\nError: No matching light source. "
-                         "Please find available options by "
-                         "\"rawtoaces --valid-illum\".\n");
-        exit (-1);
+// Report metadata only without decoding any pixels
+    if ( opts.use_inspect ) {
+        Render.inspectRaws ( RAWs );
+        return 0;
     }
     
-// Process RAW files ...
-    FORI ( RAWs.size() )
-    {
-        const char * raw = (RAWs[i]).c_str();
-        
-        timerstart_timeval();
-        Render.preprocessRaw (raw);
-        if ( opts.use_timing )
-             timerprint ( "AcesRender::preprocessRaw()", raw );
-
-        timerstart_timeval();
-        Render.postprocessRaw ();
-        if ( opts.use_timing )
-             timerprint ( "AcesRender::postprocessRaw()", raw );
-        
-        timerstart_timeval();
-        Render.outputACES ();
-        if ( opts.use_timing )
-             timerprint( "AcesRender::outputACES()", raw);
-
-    }
+// Check the "--shard" / "--claim" runs over these files
+    if ( opts.use_verify )
+        return Render.verifyRaws ( RAWs );
+    
+// Spectral datasets (camera, illuminants, training data and CMF) are
+// loaded by AcesRender on first use, only if the selected methods need them
+    
+// Process RAW files ( "--threads" files at a time, within "--max-memory" )
+    Render.convertRaws ( RAWs );
 
     return 0;
 }
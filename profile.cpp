@@ -0,0 +1,178 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2013 Academy of Motion Picture Arts and Sciences
+// ("A.M.P.A.S."). Portions contributed by others as indicated.
+// All rights reserved.
+//
+// A worldwide, royalty-free, non-exclusive right to copy, modify, create
+// derivatives, and use, in source and binary forms, is hereby granted,
+// subject to acceptance of this license. Performance of any of the
+// aforementioned acts indicates acceptance to be bound by the following
+// terms and conditions:
+//
+//  * Copies of source code, in whole or in part, must retain the
+//    above copyright notice, this list of conditions and the
+//    Disclaimer of Warranty.
+//
+//  * Use in binary form must retain the above copyright notice,
+//    this list of conditions and the Disclaimer of Warranty in the
+//    documentation and/or other materials provided with the distribution.
+//
+//  * Nothing in this license shall be deemed to grant any rights to
+//    trademarks, copyrights, patents, trade secrets or any other
+//    intellectual property of A.M.P.A.S. or any contributors, except
+//    as expressly stated herein.
+//
+//  * Neither the name "A.M.P.A.S." nor the name of any other
+//    contributors to this software may be used to endorse or promote
+//    products derivative of or based on this software without express
+//    prior written permission of A.M.P.A.S. or the contributors, as
+//    appropriate.
+//
+// This license shall be construed pursuant to the laws of the State of
+// California, and any disputes related thereto shall be subject to the
+// jurisdiction of the courts therein.
+//
+// Disclaimer of Warranty: THIS SOFTWARE IS PROVIDED BY A.M.P.A.S. AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+// BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT ARE DISCLAIMED. IN NO
+// EVENT SHALL A.M.P.A.S., OR ANY CONTRIBUTORS OR DISTRIBUTORS, BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, RESITUTIONARY,
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+// THE POSSIBILITY OF SUCH DAMAGE.
+//
+// WITHOUT LIMITING THE GENERALITY OF THE FOREGOING, THE ACADEMY
+// SPECIFICALLY DISCLAIMS ANY REPRESENTATIONS OR WARRANTIES WHATSOEVER
+// RELATED TO PATENT OR OTHER INTELLECTUAL PROPERTY RIGHTS IN THE ACADEMY
+// COLOR ENCODING SYSTEM, OR APPLICATIONS THEREOF, HELD BY PARTIES OTHER
+// THAN A.M.P.A.S., WHETHER DISCLOSED OR UNDISCLOSED.
+///////////////////////////////////////////////////////////////////////////
+
+#include "lib/rta.h"
+
+using namespace rta;
+
+static void usage ( const char * prog )
+{
+    printf ( "%s - pre-calculate camera profiles for rawtoaces\n"
+             "\n"
+             "Usage:\n"
+             "  %s [options] [camera.json ...]\n"
+             "\n"
+             "For each camera spectral sensitivity file (all files in the \"camera\"\n"
+             "folder of the data paths when none is given), white balance and IDT\n"
+             "matrices are calculated for Blackbody (1500K - 3950K) and Daylight\n"
+             "(4000K - 25000K) light sources and written into a binary profile.\n"
+             "Copy the profiles into the \"profile\" folder of a data path and\n"
+             "rawtoaces interpolates them by the white balance factors instead of\n"
+             "regressing the IDT matrix (--mat-method 0, unless --wb-method 1 gives\n"
+             "the illuminant or --no-profile is set).\n"
+             "\n"
+             "Options:\n"
+             "  -o <dir>  Output folder of the profiles (default: \".\")\n"
+             "  -v        Verbose: print progress\n",
+             prog, prog );
+    exit (-1);
+}
+
+int main ( int argc, char * argv[] )
+{
+    string outDir = ".";
+    int verbosity = 0;
+    vector < string > cameras;
+    
+    for ( int arg = 1; arg < argc; arg++ ) {
+        if ( !strcmp ( argv[arg], "-o" ) && arg + 1 < argc )
+            outDir = argv[++arg];
+        else if ( !strcmp ( argv[arg], "-v" ) )
+            verbosity = 2;
+        else if ( argv[arg][0] == '-' )
+            usage ( argv[0] );
+        else
+            cameras.push_back ( argv[arg] );
+    }
+    
+    // training data and color matching functions of the first data path
+    // that has them
+    const vector < string > & paths = pathsFinder().paths;
+    string dataPath = FILEPATH;
+    struct stat st;
+    FORI ( paths.size() ) {
+        if ( !stat( ( paths[i] + "/training/training_spectral.json" ).c_str(), &st ) ) {
+            dataPath = paths[i] + "/";
+            break;
+        }
+    }
+    
+    if ( cameras.empty() ) {
+        FORI ( paths.size() ) {
+            if ( stat( ( paths[i] + "/camera" ).c_str(), &st ) )
+                continue;
+            
+            vector < string > cFiles = openDir ( paths[i] + "/camera" );
+            FORJ ( cFiles.size() )
+                if ( cFiles[j].find(".json") != std::string::npos )
+                    cameras.push_back ( cFiles[j] );
+        }
+    }
+    
+    if ( cameras.empty() ) {
+        fprintf ( stderr, "Error: No camera spectral sensitivity data found.\n" );
+        exit (-1);
+    }
+    
+    int failed = 0;
+    FORI ( cameras.size() ) {
+        string maker, model;
+        try
+        {
+            ptree pt;
+            read_json ( cameras[i], pt );
+            maker = pt.get<string>( "header.manufacturer" );
+            model = pt.get<string>( "header.model" );
+        }
+        catch ( std::exception const& e )
+        {
+            fprintf ( stderr, "Error: Cannot parse \"%s\" (%s).\n",
+                      cameras[i].c_str(), e.what() );
+            failed++;
+            continue;
+        }
+        
+        Idt idt;
+        idt.setVerbosity ( verbosity );
+        idt.setWarmStart ( 1 );
+        idt.setThreads ( int ( std::thread::hardware_concurrency() ) );
+        if ( !idt.loadCameraSpst ( cameras[i], maker.c_str(), model.c_str() ) ) {
+            fprintf ( stderr, "Error: Cannot load \"%s\".\n", cameras[i].c_str() );
+            failed++;
+            continue;
+        }
+        
+        idt.loadTrainingData ( dataPath + "training/training_spectral.json" );
+        idt.loadCMF ( dataPath + "cmf/cmf_1931.json" );
+        
+        Profile profile;
+        profile.build ( idt );
+        
+        // "<dir>/<camera file name>.prof"
+        string name = cameras[i].substr ( cameras[i].find_last_of ( "/\\" ) + 1 );
+        name = outDir + "/" + name.substr ( 0, name.rfind ( ".json" ) ) + ".prof";
+        
+        if ( !profile.write ( name ) ) {
+            fprintf ( stderr, "Error: Cannot write the profile of %s %s.\n",
+                      maker.c_str(), model.c_str() );
+            failed++;
+            continue;
+        }
+        
+        printf ( "%s %s: %d entries -> %s\n", maker.c_str(), model.c_str(),
+                 int ( profile.getEntries().size() ), name.c_str() );
+    }
+    
+    return ( failed ? -1 : 0 );
+}
@@ -53,6 +53,19 @@
 ///////////////////////////////////////////////////////////////////////////
 
 #include "acesrender.h"
+#include "renderOps.h"
+
+#ifdef HAVE_OpenEXR
+#include <ImfOutputFile.h>
+#include <ImfHeader.h>
+#include <ImfChannelList.h>
+#include <ImfFrameBuffer.h>
+#include <ImfStandardAttributes.h>
+#include <ImfStringAttribute.h>
+#include <ImfIO.h>
+#include <ImfThreading.h>
+#include <OpenEXRConfig.h>
+#endif
 
 //  =====================================================================
 //  Prepare the matching between string flags and single character flag
@@ -72,6 +85,32 @@ void create_key ( unordered_map < string, char >& keys ) {
     keys["--headroom"] = 'M';
     keys["--valid-illums"] = 'z';
     keys["--valid-cameras"] = 'Q';
+    keys["--inspect"] = 'i';
+    keys["--threads"] = 'N';
+    keys["--out-format"] = 'O';
+    keys["--preview"] = 'Y';
+    keys["--fit-de"] = 'D';
+    keys["--cache"] = 'X';
+    keys["--variant"] = 'U';
+    keys["--max-memory"] = 'L';
+    keys["--largest-first"] = 'A';
+    keys["--prefetch"] = 'J';
+    keys["--shard"] = 'Z';
+    keys["--claim"] = 'a';
+    keys["--verify"] = 'y';
+    keys["--manifest"] = 'e';
+    keys["--hash-input"] = 'g';
+    keys["--stdout"] = 'o';
+    keys["--band-rows"] = 'r';
+    keys["--deadline"] = 'u';
+    keys["--priority"] = 'l';
+    keys["--queue"] = 'w';
+    keys["--reserve"] = 'x';
+    keys["--stats"] = '%';
+    keys["--wb-box"] = '+';
+    keys["--wb-estimator"] = '=';
+    keys["--no-profile"] = '!';
+    keys["--fit-threads"] = '^';
     keys["-c"] = 'c';
     keys["-C"] = 'C';
     keys["-P"] = 'P';
@@ -128,6 +167,12 @@ void usage ( const char *prog ) {
             "                            3=Average a grey box for white balance <x y w h>\n"
             "                            4=Use custom white balance  <r g b g>\n"
             "                            (default = 0)\n"
+            "  --wb-box <x y w h>      Another grey box for \"--wb-method 3\"\n"
+            "                          (may be repeated)\n"
+            "  --wb-estimator [0-2]    Average of the grey boxes, per CFA color\n"
+            "                            0=Mean (default)\n"
+            "                            1=Median\n"
+            "                            2=Mean without the lowest and highest 10%%\n"
             "  --mat-method [0-2]      IDT matrix calculation method\n"
             "                            0=Calculate matrix from camera spec sens\n"
             "                            1=Use file metadata color matrix\n"
@@ -135,11 +180,39 @@ void usage ( const char *prog ) {
             // Future feature ? "        3=Use custom matrix <m1r m1g m1b m2r m2g m2b m3r m3g m3b>\n"
             "                            (default = 0)\n"
             "                            (default = /usr/local/include/rawtoaces/data/camera)\n"
+            "  --fit-de float          Stop the IDT regression of \"--mat-method 0\" once\n"
+            "                          the RMS Delta E improves by less than this\n"
+            "                          (default = 0, i.e. run to full precision)\n"
+            "  --fit-threads int       Threads of the IDT regression of each file\n"
+            "                          (default = the cores left to each of the\n"
+            "                          files processed in parallel)\n"
+            "  --no-profile            Regress the IDT matrix of \"--mat-method 0\" even\n"
+            "                          if a camera profile of \"rawtoaces-profile\" is\n"
+            "                          found (profiles are otherwise interpolated\n"
+            "                          unless \"--wb-method 1\" gives the illuminant)\n"
             "  --headroom float        Set highlight headroom factor (default = 6.0)\n"
+            "  --variant <m str h>     Write <file>_aces_v<N>.exr with IDT matrix\n"
+            "                          method m (as \"--mat-method\"), adopted white str\n"
+            "                          (e.g., D60, 3200K or \"na\" for the file white\n"
+            "                          balance; used by m=0 only) and headroom h\n"
+            "                          instead of <file>_aces.exr. Repeat for more\n"
+            "                          variants; all of them share one decode and\n"
+            "                          are written in parallel\n"
+            "  --out-format [0-2]      Output file format\n"
+            "                            0=ACES container (half)\n"
+            "                            1=OpenEXR float, uncompressed\n"
+            "                            2=OpenEXR float, ZIP compressed with\n"
+            "                              multi-threaded writing (non-archival)\n"
+            "                            (default = 0)\n"
+            "                          Float files are named <file>_aces_float.exr\n"
+            "                          (<file>_aces_v<N>_float.exr for \"--variant\")\n"
             "  --cameras               Show a list of supported cameras/models by LibRaw\n"
             "  --valid-illums          Show a list of illuminants\n"
             "  --valid-cameras         Show a list of cameras/models with available\n"
             "                          spectral sensitivity datasets\n"
+            "  --inspect               Print metadata, the chosen WB/IDT and estimated\n"
+            "                          memory/time as one JSON line per file without\n"
+            "                          decoding the pixels\n"
             "\n"
             "Raw conversion options:\n"
             "  -c float                Set adjust maximum threshold (default = 0.75)\n"
@@ -161,11 +234,79 @@ void usage ( const char *prog ) {
             "  -s [0..N-1]             Select one raw image from input file\n"
             "  -G                      Use green_matching() filter\n"
             "  -B <x y w h>            Use cropbox\n"
+            "  --preview [0-2]         Demosaic engine\n"
+            "                            0=libraw (dcraw_process)\n"
+            "                            1=Built-in 2x2 binning (half-size preview)\n"
+            "                            2=Built-in bilinear demosaic\n"
+            "                            (default = 0)\n"
+            "  --band-rows int         Render and write the ACES file this many rows\n"
+            "                          at a time, so that very large images need no\n"
+            "                          full-frame float copy (default = 0, whole frame)\n"
+            "  --cache <dir>           Keep the demosaiced image of each file in this\n"
+            "                          folder and reuse it when only the IDT/white\n"
+            "                          point, headroom or output options change\n"
+            "  --stdout [0-4]          Write to the standard output instead of files\n"
+            "                          (give \"-\" as the file to read from the\n"
+            "                          standard input)\n"
+            "                            0=EXR (\"-O\" selects the kind)\n"
+            "                            1=Interleaved half pixels\n"
+            "                            2=Interleaved float pixels\n"
+            "                            3=Planar half pixels\n"
+            "                            4=Planar float pixels\n"
+            "                          Pixels of each file follow a one-line JSON\n"
+            "                          header with their size and layout\n"
+            "  --manifest <file>       Append the XXH64 of every file written to this\n"
+            "                          file (\"xxhsum -c\" format). Float EXR files\n"
+            "                          are hashed as written; ACES container files\n"
+            "                          are read back once written\n"
+            "  --hash-input            With \"--manifest\", also record the XXH64 of\n"
+            "                          every raw file, hashed as it is read\n"
+            "  --stats                 Write the statistics of every output (per\n"
+            "                          channel min/max/mean, 1st/50th/99th\n"
+            "                          percentiles, clipped values and a\n"
+            "                          quarter-stop histogram), gathered as it is\n"
+            "                          written, to <output>.stats.json\n"
             "\n"
             "Benchmarking options:\n"
             "  -v                      Verbose: print progress messages (repeated -v will add verbosity)\n"
             "  -F                      Use FILE I/O instead of streambuf API\n"
             "  -d                      Detailed timing report\n"
+            "  --threads int           Number of files processed in parallel\n"
+            "                          (default = number of cores)\n"
+            "  --max-memory int        Start a file only while the estimated memory of\n"
+            "                          the files in progress stays within this many MB\n"
+            "                          (default = 0, no limit)\n"
+            "  --largest-first         Start the files with the longest estimated\n"
+            "                          conversion time first\n"
+            "  --deadline float        Abandon a file whose conversion takes longer\n"
+            "                          than this many seconds (default = 0, no limit)\n"
+            "  --priority [0-2]        Priority class of the files on the command line\n"
+            "                            0 = interactive\n"
+            "                            1 = normal (default)\n"
+            "                            2 = background\n"
+            "  --queue <file>          Also convert the files listed in this file or\n"
+            "                          named pipe as lines arrive, one \"[priority] path\"\n"
+            "                          per line (priority 0-2 or its name, default 1);\n"
+            "                          waiting files start by priority, and workers\n"
+            "                          help the bands of the most urgent file first;\n"
+            "                          tar archives and \"--shard\" apply as on the\n"
+            "                          command line\n"
+            "  --reserve int           Workers kept for interactive files, at most\n"
+            "                          \"--threads\" minus one (default = 0)\n"
+            "  --prefetch int          Read each file whole with large sequential\n"
+            "                          reads, up to this many files ahead of the\n"
+            "                          conversion in the background (for network or\n"
+            "                          slow storage; \"-d\" reports the bandwidth)\n"
+            "                          (default = 0, read on demand)\n"
+            "  --shard <i/N>           Convert only the files of shard i (0 to N-1)\n"
+            "                          out of N; nodes given the same paths split\n"
+            "                          them without overlap\n"
+            "  --claim                 Skip the files claimed by another process\n"
+            "                          (<file>_aces.claim), so that nodes sharing the\n"
+            "                          storage can work on the same list\n"
+            "  --verify                Check from the <file>_aces.done markers written\n"
+            "                          by \"--shard\"/\"--claim\" that every file was\n"
+            "                          converted exactly once\n"
 #ifndef WIN32
             "  -E                      Use mmap()-ed buffer instead of plain FILE I/O\n"
 #endif
@@ -178,9 +319,29 @@ void usage ( const char *prog ) {
 //	Defaul Constructor
 
 AcesRender::AcesRender() {
+    _pathToRaw = nullptr;
+    _trainingLoaded = 0;
     _idt = new Idt();
-    _image = new libraw_processed_image_t();
+    _profile = new Profile();
+    _image = nullptr;
     _rawProcessor = new LibRawAces();
+    _inputHash = 0;
+    _pendingUnpack = 0;
+    _cacheMap = nullptr;
+    _cacheMapSize = 0;
+    _scheduler = nullptr;
+    _worker = 0;
+    _prefetcher = nullptr;
+    _archives = nullptr;
+    _sequence = nullptr;
+    _position = 0;
+    _cancel = nullptr;
+    _deadline = std::chrono::steady_clock::time_point::max();
+    _abandoned = 0;
+    _heldDigests = nullptr;
+    _stream = nullptr;
+    _readBytes = 0;
+    _readSeconds = 0.0;
 
     _idtm.resize(3);
     _wbv.resize(3);
@@ -196,12 +357,59 @@ AcesRender::AcesRender() {
     }
 }
 
+//  =====================================================================
+//	Copy Constructor: a renderer with the settings and the loaded
+//  spectral datasets of "acesrender" but its own libraw instance and
+//  buffers (used by the workers of convertRaws())
+
+AcesRender::AcesRender( const AcesRender & acesrender ) {
+    _pathToRaw = nullptr;
+    _trainingLoaded = acesrender._trainingLoaded;
+    _idt = new Idt ( *acesrender._idt );
+    _profile = new Profile ( *acesrender._profile );
+    _image = nullptr;
+    _rawProcessor = new LibRawAces();
+    _rawProcessor->imgdata.params = acesrender._rawProcessor->imgdata.params;
+    _inputHash = 0;
+    _pendingUnpack = 0;
+    _cacheMap = nullptr;
+    _cacheMapSize = 0;
+    _scheduler = nullptr;
+    _worker = 0;
+    _prefetcher = nullptr;
+    _archives = nullptr;
+    _sequence = nullptr;
+    _position = 0;
+    _deadline = std::chrono::steady_clock::time_point::max();
+    _abandoned = 0;
+    _heldDigests = nullptr;
+    _cancel = acesrender._cancel;
+    _stream = nullptr;
+    _readBytes = 0;
+    _readSeconds = 0.0;
+    
+    _opts = acesrender._opts;
+#ifndef WIN32
+    _opts.iobuffer = 0;
+    _opts.msize = 0;
+#endif
+    
+    _idtm = acesrender._idtm;
+    _catm = acesrender._catm;
+    _wbv = acesrender._wbv;
+    _illuminants = acesrender._illuminants;
+    _cameras = acesrender._cameras;
+    _cameraLoaded = acesrender._cameraLoaded;
+    _illumLoaded = acesrender._illumLoaded;
+    _profileLoaded = acesrender._profileLoaded;
+}
+
 //  =====================================================================
 //	Defaul Destructor
 
 AcesRender::~AcesRender() {
     if (_pathToRaw) {
-       delete _pathToRaw;
+        free(_pathToRaw);
         _pathToRaw = nullptr;
     }
 
@@ -210,16 +418,23 @@ AcesRender::~AcesRender() {
         _idt = nullptr;
     }
     
-    if (_image) {
-       delete _image;
-        _image = nullptr;
+    if (_profile) {
+        delete _profile;
+        _profile = nullptr;
     }
     
+    releasePixels();
+    
     if (_rawProcessor) {
         delete _rawProcessor;
         _rawProcessor = nullptr;
     }
     
+    if (_stream) {
+        delete _stream;
+        _stream = nullptr;
+    }
+    
     vector < vector < double > >().swap(_idtm);
     vector < vector < double > >().swap(_catm);
     vector < double >().swap(_wbv);
@@ -283,8 +498,11 @@ const AcesRender & AcesRender::operator=( const AcesRender & acesrender ) {
         
         if ( _idt != nullptr )
             delete _idt;
-        _idt = (Idt *) malloc(sizeof(Idt));
-        memcpy(_idt, acesrender._idt, sizeof(Idt));
+        _idt = new Idt ( *acesrender._idt );
+        
+        if ( _profile != nullptr )
+            delete _profile;
+        _profile = new Profile ( *acesrender._profile );
         
         if ( _rawProcessor != nullptr )
             delete _rawProcessor;
@@ -327,12 +545,38 @@ void AcesRender::initialize ( const dataPath & dp ) {
     _opts.verbosity          = 0;
     _opts.mat_method         = matMethod0;
     _opts.wb_method          = wbMethod0;
+    _opts.out_format         = outFormat0;
+    _opts.preview_mode       = previewMode0;
     _opts.highlight          = 0;
     _opts.scale              = 6.0;
+    _opts.fit_threshold      = 0.0;
+    _opts.cache_dir          = nullptr;
     _opts.highlight          = 0;
     _opts.get_illums         = 0;
     _opts.get_cameras        = 0;
     _opts.get_libraw_cameras = 0;
+    _opts.use_inspect        = 0;
+    _opts.threads            = 0;
+    _opts.max_memory         = 0;
+    _opts.largest_first      = 0;
+    _opts.prefetch           = 0;
+    _opts.band_rows          = 0;
+    _opts.deadline           = 0.0;
+    _opts.priority           = priority1;
+    _opts.queue              = nullptr;
+    _opts.reserve            = 0;
+    _opts.shard_index        = 0;
+    _opts.shard_count        = 1;
+    _opts.use_claim          = 0;
+    _opts.use_verify         = 0;
+    _opts.hash_input         = 0;
+    _opts.manifest           = nullptr;
+    _opts.use_stdout         = 0;
+    _opts.use_stats          = 0;
+    _opts.use_profile        = 1;
+    _opts.fit_threads        = 0;
+    _opts.wb_estimator       = wbEstimator0;
+    _opts.stdout_mode        = stdoutMode0;
     
 #ifndef WIN32
     _opts.iobuffer = 0;
@@ -367,6 +611,33 @@ void AcesRender::initialize ( const dataPath & dp ) {
     OUT.use_auto_wb       = 0;
 }
 
+//	=====================================================================
+//  "--stdout": the output stream takes the place of the standard output,
+//  whose descriptor then points to the standard error, so that messages
+//  printed with printf() do not end up in the stream
+
+static FILE * pixelStream = nullptr;
+
+static void redirectStdout ( ) {
+    fflush ( stdout );
+    
+#ifndef WIN32
+    int fd = dup ( 1 );
+    dup2 ( 2, 1 );
+    pixelStream = fdopen ( fd, "wb" );
+#else
+    int fd = _dup ( 1 );
+    _dup2 ( 2, 1 );
+    _setmode ( fd, _O_BINARY );
+    pixelStream = _fdopen ( fd, "wb" );
+#endif
+    
+    if ( !pixelStream ) {
+        fprintf ( stderr, "\nError: Cannot open the standard output\n" );
+        exit(-1);
+    }
+}
+
 //	=====================================================================
 //	Configure settings by taking in user specified options
 //
@@ -411,8 +682,8 @@ int AcesRender::configureSettings ( int argc, char * argv[] )
             exit(-1);
         }
         
-        if (( cp = strchr ( sp = (char*)"HcnbksStqmBC", opt )) != 0 ) {
-            for (int i=0; i < "111111111142"[cp-sp]-'0'; i++) {
+        if (( cp = strchr ( sp = (char*)"HcnbksStqmBCNOYDLJorulx+=^", opt )) != 0 ) {
+            for (int i=0; i < "11111111114211111111111411"[cp-sp]-'0'; i++) {
                 if (!isdigit(argv[arg+i][0]))
                 {
                     fprintf ( stderr, "\nError: Non-numeric argument to "
@@ -451,6 +722,159 @@ int AcesRender::configureSettings ( int argc, char * argv[] )
             case 'W':  OUT.no_auto_bright      = 1;  break;
             case 'F':  _opts.use_bigfile        = 1;  break;
             case 'd':  _opts.use_timing         = 1;  break;
+            case 'i':  _opts.use_inspect        = 1;  break;
+            case 'N':  _opts.threads            = atoi(argv[arg++]);  break;
+            case 'D':  _opts.fit_threshold      = atof(argv[arg++]);  break;
+            case '^':  _opts.fit_threads        = atoi(argv[arg++]);  break;
+            case 'L':  _opts.max_memory = size_t(atol(argv[arg++])) << 20;  break;
+            case 'A':  _opts.largest_first      = 1;  break;
+            case 'J':  _opts.prefetch           = atoi(argv[arg++]);  break;
+            case 'r':  _opts.band_rows          = atoi(argv[arg++]);  break;
+            case 'u':  _opts.deadline           = atof(argv[arg++]);  break;
+            case 'x':  _opts.reserve            = atoi(argv[arg++]);  break;
+            case '+': {
+                wbBox box;
+                box.x = unsigned ( atoi(argv[arg++]) );
+                box.y = unsigned ( atoi(argv[arg++]) );
+                box.w = unsigned ( atoi(argv[arg++]) );
+                box.h = unsigned ( atoi(argv[arg++]) );
+                _opts.wb_boxes.push_back ( box );
+                break;
+            }
+            case '=': {
+                int estimator = atoi(argv[arg++]);
+                
+                if ( estimator < wbEstimator0 || estimator > wbEstimator2 ) {
+                    fprintf ( stderr, "\nError: Invalid argument to \"%s\" \n",
+                                      key.c_str() );
+                    exit(-1);
+                }
+                _opts.wb_estimator = static_cast < wbEstimators_t > ( estimator );
+                break;
+            }
+            case 'l': {
+                int priority = atoi(argv[arg++]);
+                
+                if ( priority < priority0 || priority > priority2 ) {
+                    fprintf ( stderr, "\nError: Invalid argument to \"%s\" \n",
+                                      key.c_str() );
+                    exit(-1);
+                }
+                _opts.priority = static_cast < priorities_t > ( priority );
+                break;
+            }
+            case 'w':
+                if ( arg >= argc || !argv[arg][0] ) {
+                    fprintf ( stderr, "\nError: \"%s\" requires a file name\n",
+                                      key.c_str() );
+                    exit(-1);
+                }
+                _opts.queue = argv[arg++];
+                break;
+            case 'a':  _opts.use_claim          = 1;  break;
+            case 'y':  _opts.use_verify         = 1;  break;
+            case 'g':  _opts.hash_input         = 1;  break;
+            case '%':  _opts.use_stats          = 1;  break;
+            case '!':  _opts.use_profile        = 0;  break;
+            case 'o': {
+                int mode = atoi(argv[arg++]);
+                
+                if ( mode < stdoutMode0 || mode > stdoutMode4 ) {
+                    fprintf ( stderr, "\nError: Invalid argument to \"%s\" \n",
+                                      key.c_str() );
+                    exit(-1);
+                }
+                _opts.use_stdout = 1;
+                _opts.stdout_mode = stdoutModes_t(mode);
+                break;
+            }
+            case 'e':
+                if ( arg >= argc || !argv[arg][0] ) {
+                    fprintf ( stderr, "\nError: \"%s\" requires a file name\n",
+                                      key.c_str() );
+                    exit(-1);
+                }
+                _opts.manifest = argv[arg++];
+                break;
+            case 'Z': {
+                int index, count;
+                char extra;
+                
+                if ( arg >= argc
+                     || sscanf ( argv[arg], "%d/%d%c", &index, &count, &extra ) != 2
+                     || count < 1 || index < 0 || index >= count ) {
+                    fprintf ( stderr, "\nError: \"%s\" requires i/N with "
+                                      "0 <= i < N\n", key.c_str() );
+                    exit(-1);
+                }
+                _opts.shard_index = index;
+                _opts.shard_count = count;
+                arg++;
+                break;
+            }
+            case 'U': {
+                outputVariant variant;
+                
+                switch ( parseVariant ( argv + arg, variant ) ) {
+                    case 1:
+                        fprintf ( stderr, "\nError: Invalid IDT matrix method to "
+                                          "\"%s\" \n", key.c_str() );
+                        exit(-1);
+                    case 2:
+                        fprintf ( stderr, "\nError: \"%s\" requires a valid "
+                                          "illuminant (e.g., D60, 3200K) or \"na\"\n",
+                                          key.c_str() );
+                        exit(-1);
+                    case 3:
+                        fprintf ( stderr, "\nError: Invalid headroom to \"%s\" \n",
+                                          key.c_str() );
+                        exit(-1);
+                }
+                arg += 3;
+                
+                _opts.variants.push_back ( variant );
+                break;
+            }
+            case 'X': {
+                struct stat st;
+                
+                if ( stat ( argv[arg], &st ) != 0 || !( st.st_mode & S_IFDIR ) ) {
+                    fprintf ( stderr, "\nError: The cache directory does not "
+                                      "exist - \"%s\"\n", argv[arg] );
+                    exit(-1);
+                }
+                _opts.cache_dir = argv[arg++];
+                break;
+            }
+            case 'O': {
+                int format = atoi(argv[arg++]);
+                
+                if ( format < outFormat0 || format > outFormat2 ) {
+                    fprintf ( stderr, "\nError: Invalid argument to \"%s\" \n",
+                                      key.c_str() );
+                    exit(-1);
+                }
+#ifndef HAVE_OpenEXR
+                if ( format != outFormat0 ) {
+                    fprintf ( stderr, "\nError: Float output needs rawtoaces "
+                                      "to be built with OpenEXR\n" );
+                    exit(-1);
+                }
+#endif
+                _opts.out_format = outFormats_t(format);
+                break;
+            }
+            case 'Y': {
+                int mode = atoi(argv[arg++]);
+                
+                if ( mode < previewMode0 || mode > previewMode2 ) {
+                    fprintf ( stderr, "\nError: Invalid argument to \"%s\" \n",
+                                      key.c_str() );
+                    exit(-1);
+                }
+                _opts.preview_mode = previewModes_t(mode);
+                break;
+            }
             case 'Q':  _opts.get_cameras        = 1;  {
                 // gather a list of cameras supported
                 gatherSupportedCameras();
@@ -527,6 +951,10 @@ int AcesRender::configureSettings ( int argc, char * argv[] )
                         }
                         OUT.greybox[i] = static_cast<float>(atof(argv[arg++]));
                     }
+                    
+                    wbBox box = { OUT.greybox[0], OUT.greybox[1],
+                                  OUT.greybox[2], OUT.greybox[3] };
+                    _opts.wb_boxes.insert ( _opts.wb_boxes.begin(), box );
                 }
                 // 4
                 else if ( _opts.wb_method == wbMethod4 ) {
@@ -560,6 +988,28 @@ int AcesRender::configureSettings ( int argc, char * argv[] )
         }
     }
     
+    if ( _opts.wb_boxes.size() && _opts.wb_method != wbMethod3 ) {
+        fprintf ( stderr, "\nError: \"--wb-box\" needs \"--wb-method 3\"\n" );
+        exit(-1);
+    }
+    
+    if ( _opts.use_stdout ) {
+        if ( _opts.variants.size() ) {
+            fprintf ( stderr, "\nError: \"--variant\" cannot be used with "
+                              "\"--stdout\"\n" );
+            exit(-1);
+        }
+        if ( _opts.queue ) {
+            fprintf ( stderr, "\nError: \"--queue\" cannot be used with "
+                              "\"--stdout\"\n" );
+            exit(-1);
+        }
+        
+        // frames are written in the order of the files
+        _opts.largest_first = 0;
+        redirectStdout ();
+    }
+    
     return arg;
 }
 
@@ -574,14 +1024,37 @@ int AcesRender::configureSettings ( int argc, char * argv[] )
 
 void AcesRender::setPixels ( libraw_processed_image_t * image ) {
     assert(image);
-    if ( _image != nullptr ) delete _image;
+    
+    if ( _image != image )
+        releasePixels();
     _image = image;
+}
+
+//	=====================================================================
+//	Release the processed image buffer
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//      N/A        : _image (and the cache file it was read from) released
 
-////    Strange because memcpying on libraw_processed_image_t
-//    will generate an error
-//    if (_image != nullptr ) delete _image;
-//    _image = (libraw_processed_image_t *) malloc(sizeof(libraw_processed_image_t));
-//    memcpy(_image, image, sizeof(libraw_processed_image_t));
+void AcesRender::releasePixels ( ) {
+    if ( _cacheMap != nullptr ) {
+#ifndef WIN32
+        munmap ( _cacheMap, _cacheMapSize );
+#else
+        free ( _cacheMap );
+#endif
+        _cacheMap = nullptr;
+        _cacheMapSize = 0;
+    }
+//  The image is allocated by dcraw_make_mem_image() with malloc(),
+//  so it has to be released through libraw as well
+    else if ( _image != nullptr )
+        LibRaw::dcraw_clear_mem(_image);
+    
+    _image = nullptr;
 }
 
 
@@ -675,1058 +1148,4709 @@ void AcesRender::gatherSupportedCameras ( ) {
 }
 
 //	=====================================================================
-//  Open the RAW file from the path to the file
-//
-//	inputs:
-//      const char *       : path to the raw file
-//
-//	outputs:
-//		int                : "1" means raw file successfully opened;
-//                           "0" means error when opening the file
+//  A RAW file read into memory by readRawFile(). A file read ahead
+//  ( "--prefetch" ) gives its bytes back to the budget when freed.
+
+struct RawFile {
+    RawFile ( ) : data(nullptr), size(0), seconds(0.0),
+                  budget(nullptr), reserved(0) {};
+    ~RawFile ( ) {
+        free ( data );
+        if ( budget )
+            budget->unreserve ( reserved );
+    };
+    
+    string path;
+    char * data;
+    size_t size;
+    double seconds;
+    MemoryBudget * budget;
+    size_t reserved;
+};
 
-int AcesRender::openRawPath ( const char * pathToRaw ) {
-    assert ( pathToRaw != nullptr );
+static const size_t readChunk = size_t(8) << 20;
+
+//  Size of a file in bytes, or 0 if it cannot be found
+static size_t fileSize ( const char * path ) {
+    struct stat st;
+    
+    if ( stat ( path, &st ) )
+        return 0;
+    
+    return size_t(st.st_size);
+}
+
+//  Read a whole file with large sequential reads. The kernel is told the
+//  access pattern so that it reads ahead: network shares serve a few
+//  large requests much faster than the many small ones of unpack().
+//  Returns nullptr if the file cannot be read.
+static RawFile * readRawFile ( const char * path ) {
+    std::chrono::high_resolution_clock::time_point start =
+        std::chrono::high_resolution_clock::now();
+    
+    size_t size = 0, done = 0;
+    char * data = nullptr;
     
 #ifndef WIN32
-//    void *iobuffer=0;
+    int file = open ( path, O_RDONLY );
+    if ( file < 0 )
+        return nullptr;
+    
     struct stat st;
+    if ( fstat ( file, &st ) ) {
+        close ( file );
+        return nullptr;
+    }
     
-    if ( _opts.use_mmap )
-    {
-        int file = open ( pathToRaw, O_RDONLY );
+#if defined(POSIX_FADV_SEQUENTIAL)
+    posix_fadvise ( file, 0, 0, POSIX_FADV_SEQUENTIAL );
+    posix_fadvise ( file, 0, 0, POSIX_FADV_WILLNEED );
+#elif defined(F_RDAHEAD)
+    fcntl ( file, F_RDAHEAD, 1 );
+#endif
+    
+    size = size_t(st.st_size);
+    data = (char *) malloc ( size ? size : 1 );
+    
+    while ( data && done < size ) {
+        ssize_t n = read ( file, data + done, std::min ( size - done, readChunk ) );
         
-        if( file < 0 )
-        {
-            fprintf ( stderr, "\nError: Cannot open %s: %s\n\n",
-                              pathToRaw, strerror(errno) );
-            _opts.ret = 0;
-            
-            return 0;
+        if ( n > 0 )
+            done += size_t(n);
+        else if ( n < 0 && errno == EINTR )
+            continue;
+        else {
+            free ( data );
+            data = nullptr;
         }
+    }
+    close ( file );
+#else
+    FILE * file = fopen ( path, "rb" );
+    if ( !file )
+        return nullptr;
+    
+    fseek ( file, 0, SEEK_END );
+    size = size_t ( ftell ( file ) );
+    fseek ( file, 0, SEEK_SET );
+    data = (char *) malloc ( size ? size : 1 );
+    
+    while ( data && done < size ) {
+        size_t n = fread ( data + done, 1, std::min ( size - done, readChunk ), file );
         
-        if( fstat ( file, &st ) )
-        {
-            fprintf ( stderr, "\nError: Cannot stat %s: %s\n\n",
-                              pathToRaw, strerror(errno) );
-            close( file );
-            _opts.ret = 0;
-            
-            return 0;
+        if ( n > 0 )
+            done += n;
+        else {
+            free ( data );
+            data = nullptr;
         }
-        
-        int pgsz = getpagesize();
-        _opts.msize = (( st.st_size+pgsz-1 ) / pgsz ) * pgsz;
-        _opts.iobuffer = mmap ( NULL, size_t(_opts.msize), PROT_READ, MAP_PRIVATE, file, 0 );
-        if( !_opts.iobuffer )
-        {
-            fprintf ( stderr, "\nError: Cannot mmap %s: %s\n\n",
-                              pathToRaw, strerror(errno) );
-            close( file );
-            _opts.ret = 0;
-            
-            return 0;
+    }
+    fclose ( file );
+#endif
+    
+    if ( !data )
+        return nullptr;
+    
+    RawFile * raw = new RawFile();
+    raw->path = path;
+    raw->data = data;
+    raw->size = size;
+    raw->seconds = std::chrono::duration < double > (
+        std::chrono::high_resolution_clock::now() - start ).count();
+    
+    return raw;
+}
+
+//  Read the standard input to its end ( raw file given as "-" )
+static RawFile * readStdin ( ) {
+    std::chrono::high_resolution_clock::time_point start =
+        std::chrono::high_resolution_clock::now();
+    
+#ifdef WIN32
+    _setmode ( _fileno ( stdin ), _O_BINARY );
+#endif
+    
+    size_t size = 0, capacity = readChunk;
+    char * data = (char *) malloc ( capacity );
+    
+    while ( data ) {
+        if ( size == capacity ) {
+            char * grown = (char *) realloc ( data, capacity * 2 );
+            if ( !grown ) {
+                free ( data );
+                data = nullptr;
+                break;
+            }
+            data = grown;
+            capacity *= 2;
         }
         
-        close( file );
-        if (( _opts.ret = _rawProcessor->open_buffer( _opts.iobuffer,st.st_size ) != LIBRAW_SUCCESS ))
-        {
-            fprintf ( stderr, "\nError: Cannot open_buffer %s: %s\n\n",
-                              pathToRaw, libraw_strerror(_opts.ret) );
+        size_t n = fread ( data + size, 1, capacity - size, stdin );
+        if ( !n ) {
+            if ( ferror ( stdin ) ) {
+                free ( data );
+                data = nullptr;
+            }
+            break;
         }
+        size += n;
     }
-    else
-#endif
-    {
-        if ( _opts.use_bigfile )
-            _opts.ret = _rawProcessor->open_file ( pathToRaw, 1 );
-        else
-            _opts.ret = _rawProcessor->open_file ( pathToRaw );
+    
+    if ( !data || !size ) {
+        free ( data );
+        return nullptr;
     }
     
-    unpack ( pathToRaw );
+    RawFile * raw = new RawFile();
+    raw->path = "-";
+    raw->data = data;
+    raw->size = size;
+    raw->seconds = std::chrono::duration < double > (
+        std::chrono::high_resolution_clock::now() - start ).count();
     
-    return _opts.ret;
+    return raw;
 }
 
+#ifdef HAVE_OpenEXR
+#if OPENEXR_VERSION_MAJOR >= 3
+typedef uint64_t exrOffset_t;
+#else
+typedef Imf::Int64 exrOffset_t;
+#endif
+
 //	=====================================================================
-//  Unpack the RAW file based on the path to the file (after openRawPath)
-//
-//	inputs:
-//      const char *       : path to the raw file
-//
-//	outputs:
-//		int                : "1" means raw file successfully unpacked;
-//                           "0" means error when unpacking the file
+//  OpenEXR output to a file or to the standard output, hashed on the
+//  way for "--manifest". OutputFile writes the line offset table as
+//  zeros after the header and goes back to fill it in when it is
+//  closed. For uncompressed files the offsets are known in advance:
+//  setTable() replaces the zeros by them, so that every byte is hashed
+//  and written once, in order, and the final rewrite is only checked.
+//  Otherwise ( ZIP ) the file is held in memory until finish(), which
+//  estimateFootprint() counts.
+
+class HashOStream : public Imf::OStream {
+    public:
+        HashOStream ( const char * name, FILE * file )
+            : Imf::OStream ( name ), _file(file), _pos(0), _end(0),
+              _tablePos(0), _streaming(0), _error(nullptr) {};
+    
+        virtual void write ( const char c[], int n ) {
+            size_t size = size_t(n);
+            
+            if ( !_streaming ) {
+                if ( _pos + size > _held.size() )
+                    _held.resize ( _pos + size );
+                memcpy ( &_held[_pos], c, size );
+            }
+            else if ( _pos == _end )
+                emit ( c, size );
+            else if ( _pos < _tablePos || _pos + size > _tablePos + _table.size()
+                      || memcmp ( &_table[_pos - _tablePos], c, size ) )
+                _error = "unexpected line offsets";
+            
+            _pos += size;
+            _end = std::max ( _end, _pos );
+        };
+    
+        virtual exrOffset_t tellp ( ) { return exrOffset_t(_pos); };
+        virtual void seekp ( exrOffset_t pos ) { _pos = size_t(pos); };
+    
+        //  Called once OutputFile has written the header and the zeros
+        //  of the table, which are the last bytes held
+        void setTable ( const vector < char > & table ) {
+            assert ( !_streaming && table.size() <= _held.size() );
+            
+            _table = table;
+            _tablePos = _held.size() - table.size();
+            memcpy ( &_held[_tablePos], &table[0], table.size() );
+            
+            emit ( &_held[0], _held.size() );
+            vector < char > ( ).swap ( _held );
+            _streaming = 1;
+        };
+    
+        //  nullptr if every byte has been written, or the error
+        const char * finish ( ) {
+            if ( !_streaming && _held.size() )
+                emit ( &_held[0], _held.size() );
+            vector < char > ( ).swap ( _held );
+            
+            return _error;
+        };
+    
+        uint64_t digest ( ) const { return _hash.digest(); };
+    
+    private:
+        void emit ( const char * data, size_t size ) {
+            _hash.update ( data, size );
+            if ( !_error && fwrite ( data, 1, size, _file ) != size )
+                _error = strerror ( errno );
+        };
+    
+        FILE * _file;
+        Xxh64 _hash;
+        vector < char > _held;
+        vector < char > _table;
+        size_t _pos;
+        size_t _end;
+        size_t _tablePos;
+        int _streaming;
+        const char * _error;
+};
 
-int AcesRender::unpack ( const char * pathToRaw ) {
-    assert ( _opts.ret == LIBRAW_SUCCESS && pathToRaw != nullptr );
+//  Line offset table of an uncompressed scanline OpenEXR file whose
+//  table ends at "start": each line is a chunk of its row number, its
+//  size and its pixels
+static vector < char > exrLineOffsets ( uint64_t start, int height,
+                                        size_t lineBytes ) {
+    vector < char > table ( size_t(height) * 8 );
     
-    if (( _opts.ret = _rawProcessor->unpack() ) != LIBRAW_SUCCESS )
-    {
-        fprintf ( stderr, "\nError: Cannot unpack %s: %s\n\n",
-                           pathToRaw, libraw_strerror (_opts.ret) );
+    FORI ( height ) {
+        uint64_t offset = start + uint64_t(i) * ( 8 + lineBytes );
+        FORJ ( 8 ) table[size_t(i) * 8 + j] = char ( ( offset >> ( 8 * j ) ) & 0xff );
     }
     
-    return _opts.ret;
+    return table;
 }
+#endif
+
+//  Serializes the lines of "--manifest" from all the renderers
+static std::mutex manifestMutex;
+
+//  Guards the size of the global thread pool of OpenEXR
+static std::mutex exrThreadsMutex;
 
 //	=====================================================================
-//	Read camera spectral sensitivity data from path
-//
-//	inputs:
-//      const char *     : camera spectral sensitivity path
-//                         (either in the environment variable of
-//                          "AMPAS_CAMERA_SENSITIVITIES_PATH"
-//                          such as  "/usr/local/include/rawtoaces/data/camera"
-//                          or specified by users)
-//      libraw_iparams_t : main parameters read from RAW
-//
-//	outputs:
-//		int              : "1" means loading/injecting camera spectral
-//                         sensitivity data successfully;
-//                         "0" means error in reading/injecting data
+//  Order of the frames of "--stdout" when files are converted in
+//  parallel: the file at "position" in the batch is written once all
+//  the files before it are written or have failed
 
-int AcesRender::fetchCameraSenPath( const libraw_iparams_t & P )
-{
-    int readC = 0;
+class OutputSequence {
+    public:
+        OutputSequence ( ) : _turn(0) {};
     
-    FORI ( _opts.envPaths.size() ) {
-        vector<string> cFiles = openDir ( static_cast< string >( (_opts.envPaths)[i] )
-                                          +"/camera" );
-        for ( vector<string>::iterator file = cFiles.begin( ); file != cFiles.end( ); ++file ) {
-            string fn( *file );
-            
-            if ( fn.find(".json") == std::string::npos )
-                continue;
-            readC = _idt->loadCameraSpst( fn, P.make, P.model );
-            if ( readC ) return 1;
-        }
-    }
+        void wait ( size_t position ) {
+            std::unique_lock < std::mutex > lock ( _mtx );
+            _cv.wait ( lock, [&] { return _turn >= position; } );
+        };
     
-    return readC;
-}
+        //  The file at "position" is done, written or not
+        void advance ( size_t position ) {
+            std::unique_lock < std::mutex > lock ( _mtx );
+            _cv.wait ( lock, [&] { return _turn >= position; } );
+            _turn = position + 1;
+            _cv.notify_all();
+        };
+    
+    private:
+        size_t _turn;
+        std::mutex _mtx;
+        std::condition_variable _cv;
+};
 
 //	=====================================================================
-//	Fetch light source data to calcuate white balance coefficients
-//
-//	inputs:
-//      const char *  : type of light source ("unknown" if not specified)
-//                      (in the environment variable of "AMPAS_ILLUMINANT_PATH"
-//                       such as "/usr/local/include/rawtoaces/data/Illuminant")
-//
-//	outputs:
-//		int : "1" means loading/injecting light source datasets successfully,
-//            "0" means error / no illumiant data has been loaded
+//  LibRaw datastream over a file read by readRawFile(); it owns the file
 
-
-int AcesRender::fetchIlluminant ( const char * illumType )
-{
-    vector <string> paths;
+class PrefetchDatastream : public LibRaw_buffer_datastream {
+    public:
+        PrefetchDatastream ( RawFile * file )
+            : LibRaw_buffer_datastream ( file->data, file->size ), _file(file) {};
+        virtual ~PrefetchDatastream ( ) { delete _file; };
     
-    FORI ( _opts.envPaths.size() ) {
-        vector <string> iFiles = openDir ( (_opts.envPaths)[i] + "/illuminant" );
-        for ( vector<string>::iterator file = iFiles.begin(); file != iFiles.end(); ++file ) {
-            string fn( *file );
-            if ( fn.find(".json") == std::string::npos )
-                continue;
-            paths.push_back(fn);
-        }
-    }
+        virtual const char * fname ( ) { return _file->path.c_str(); };
     
-    return _idt->loadIlluminant( paths, static_cast<string >(illumType) );
-}
-
+    private:
+        RawFile * _file;
+};
 
 //	=====================================================================
-//  Calculate IDT matrix from camera spectral sensitivity data and the
-//  selected or specified light source data. THe best White balance
-//  coefficients will be generated in the process of obtaining IDT.
-//
-//	inputs:
-//      libraw_iparams_t              : main parameters read from RAW
-//      libraw_colordata_t            : color information from RAW
-//
-//	outputs:
-//		int                           : "1" means IDT matrix generated;
-//                                      "0" means error in calculation.
+//  Reads the files of a batch ( "--prefetch N" ) in the order they will
+//  be converted, on a background thread, staying at most N files ahead
+//  of the converters. The bytes of a file are reserved from the
+//  "--max-memory" budget before it is read; when they do not fit, the
+//  reader waits for the converters to take a file. take() hands a file
+//  over, waiting for it if it is being read, or reading it on the spot
+//  if the reader has not got to it yet.
+
+class RawPrefetcher {
+    public:
+        RawPrefetcher ( const vector < string > & paths, int depth,
+                        MemoryBudget * budget )
+            : _paths(paths), _files(paths.size(), nullptr),
+              _state(paths.size(), queued), _next(0), _taken(0),
+              _depth(size_t(depth)), _budget(budget), _stop(0) {
+            FORI ( _paths.size() ) _index[_paths[i]] = i;
+            _reader = std::thread ( &RawPrefetcher::run, this );
+        };
+    
+        ~RawPrefetcher ( ) {
+            {
+                std::lock_guard < std::mutex > lock ( _mtx );
+                _stop = 1;
+            }
+            _cv.notify_all();
+            _reader.join();
+            
+            FORI ( _files.size() ) delete _files[i];
+        };
+    
+        RawFile * take ( const char * path ) {
+            std::unique_lock < std::mutex > lock ( _mtx );
+            unordered_map < string, size_t >::iterator it = _index.find ( path );
+            
+            if ( it == _index.end() ) {
+                lock.unlock();
+                return readRawFile ( path );
+            }
+            
+            size_t k = it->second;
+            
+            // queued again ( "--queue" ): read it on the spot
+            if ( _state[k] == taken ) {
+                lock.unlock();
+                return readRawFile ( path );
+            }
+            
+            _taken++;
+            _cv.notify_all();
+            
+            if ( _state[k] == queued ) {
+                _state[k] = taken;
+                lock.unlock();
+                return readRawFile ( path );
+            }
+            
+            _cv.wait ( lock, [&] { return _state[k] == read; } );
+            _state[k] = taken;
+            
+            RawFile * file = _files[k];
+            _files[k] = nullptr;
+            
+            return file;
+        };
+    
+        //  The file will not be converted here ( "--claim" ): free it,
+        //  or skip it if it has not been read yet
+        void drop ( const char * path ) {
+            std::lock_guard < std::mutex > lock ( _mtx );
+            unordered_map < string, size_t >::iterator it = _index.find ( path );
+            
+            if ( it == _index.end() )
+                return;
+            
+            size_t k = it->second;
+            if ( _state[k] == taken )
+                return;
+            
+            _taken++;
+            _cv.notify_all();
+            
+            delete _files[k];
+            _files[k] = nullptr;
+            _state[k] = taken;
+        };
+    
+    private:
+        enum { queued, reading, read, taken };
+    
+        void run ( ) {
+            std::unique_lock < std::mutex > lock ( _mtx );
+            
+            while ( 1 ) {
+                _cv.wait ( lock, [this] {
+                    return _stop || _next >= _paths.size()
+                           || _next < _taken + _depth;
+                } );
+                
+                if ( _stop || _next >= _paths.size() )
+                    break;
+                
+                size_t k = _next;
+                if ( _state[k] != queued ) {
+                    _next++;
+                    continue;
+                }
+                
+                size_t taken = _taken;
+                lock.unlock();
+                size_t bytes = fileSize ( _paths[k].c_str() );
+                int reserved = _budget->tryReserve ( bytes );
+                lock.lock();
+                
+                // over the budget: wait for a conversion to start, or for
+                // this file to be read by its converter
+                if ( !reserved || _state[k] != queued ) {
+                    if ( reserved )
+                        _budget->unreserve ( bytes );
+                    else
+                        _cv.wait ( lock, [&] {
+                            return _stop || _taken != taken || _state[k] != queued;
+                        } );
+                    continue;
+                }
+                
+                _next++;
+                _state[k] = reading;
+                lock.unlock();
+                RawFile * file = readRawFile ( _paths[k].c_str() );
+                lock.lock();
+                
+                if ( file ) {
+                    file->budget = _budget;
+                    file->reserved = bytes;
+                }
+                else
+                    _budget->unreserve ( bytes );
+                
+                if ( _state[k] == taken )
+                    delete file;
+                else {
+                    _files[k] = file;
+                    _state[k] = read;
+                }
+                _cv.notify_all();
+            }
+        };
+    
+        vector < string > _paths;
+        unordered_map < string, size_t > _index;
+        vector < RawFile * > _files;
+        vector < int > _state;
+        size_t _next;
+        size_t _taken;
+        size_t _depth;
+        MemoryBudget * _budget;
+        int _stop;
+        std::mutex _mtx;
+        std::condition_variable _cv;
+        std::thread _reader;
+};
 
-int AcesRender::prepareIDT ( const libraw_iparams_t & P, float * M )
-{
-    // _rawProcessor->imgdata.idata
-    int read = fetchCameraSenPath( P );
+//	=====================================================================
+//  Uncompressed tar archives given as input ( ustar, GNU and pax long
+//  names ). Each archive is mmap()-ed once and its regular files become
+//  inputs named "<archive without .tar>/<member path>", which LibRaw
+//  opens with open_buffer() on the slice of the mapping: nothing is
+//  extracted or copied, and the outputs land in that directory tree.
+//  Archives named in "--queue" are added while the workers look up
+//  members, so the index is guarded.
+
+struct RawMember {
+    const char * data;
+    size_t size;
+};
 
-    if ( !read ) {
-        fprintf( stderr, "\nError: No matching cameras found. "
-                         "Please use other options for "
-                         "\"--mat-method\" and/or \"--wb-method\".\n");
-        exit (-1);
-    }
+//  "1" if the path names a tar archive ( by extension and ustar magic )
+static int isTarArchive ( const char * path ) {
+    size_t len = strlen ( path );
+    if ( len < 4 || cmp_str ( path + len - 4, ".tar" ) )
+        return 0;
+    
+    char header[512];
+    FILE * file = fopen ( path, "rb" );
+    if ( !file )
+        return 0;
+    
+    size_t n = fread ( header, 1, sizeof(header), file );
+    fclose ( file );
+    
+    return n == sizeof(header) && !memcmp ( header + 257, "ustar", 5 );
+}
 
-    // loading training data (190 patches)
-    _idt->loadTrainingData ( static_cast < string > ( FILEPATH )
-                             +"training/training_spectral.json" );
-    // loading color matching function
-    _idt->loadCMF ( static_cast < string > ( FILEPATH ) \
-                    +"cmf/cmf_1931.json" );
+//  Create the missing parent directories of a file
+static void makeParentDirs ( const char * path ) {
+#ifndef WIN32
+    string dir ( path );
+    
+    for ( size_t pos = dir.find ( '/', 1 ); pos != string::npos;
+          pos = dir.find ( '/', pos + 1 ) )
+        mkdir ( dir.substr ( 0, pos ).c_str(), 0777 );
+#endif
+}
 
-    _idt->setVerbosity(_opts.verbosity);
-    if ( _opts.illumType )
-        _idt->chooseIllumType( _opts.illumType, _opts.highlight );
-    else {
-        vector < double > mulV (M, M+3);
-        _idt->chooseIllumSrc ( mulV, _opts.highlight );
-    }
+class RawArchives {
+    public:
+        RawArchives ( ) {};
+    
+        ~RawArchives ( ) {
+#ifndef WIN32
+            FORI ( _maps.size() ) munmap ( _maps[i].first, _maps[i].second );
+#endif
+        };
+    
+        //  Map and index an archive; its members are appended to "names"
+        int add ( const char * path, vector < string > & names ) {
+#ifndef WIN32
+            int file = open ( path, O_RDONLY );
+            struct stat st;
+            
+            if ( file < 0 || fstat ( file, &st ) ) {
+                fprintf ( stderr, "\nError: Cannot open %s: %s\n\n",
+                                  path, strerror(errno) );
+                if ( file >= 0 )
+                    close ( file );
+                
+                return 0;
+            }
+            
+            size_t size = size_t(st.st_size);
+            void * base = mmap ( NULL, size, PROT_READ, MAP_PRIVATE, file, 0 );
+            close ( file );
+            
+            if ( base == MAP_FAILED ) {
+                fprintf ( stderr, "\nError: Cannot mmap %s: %s\n\n",
+                                  path, strerror(errno) );
+                return 0;
+            }
+            std::lock_guard < std::mutex > lock ( _mtx );
+            _maps.push_back ( std::make_pair ( base, size ) );
+            
+            string stem ( path, strlen ( path ) - 4 );
+            const char * data = (const char *) base;
+            string longName;
+            uint64_t pos = 0;
+            
+            while ( pos + 512 <= size && data[pos] ) {
+                const char * header = data + pos;
+                
+                if ( memcmp ( header + 257, "ustar", 5 ) ) {
+                    fprintf ( stderr, "\nError: %s is not a ustar archive "
+                                      "past byte %llu\n\n",
+                                      path, (unsigned long long)pos );
+                    break;
+                }
+                
+                uint64_t length = tarNumber ( header + 124, 12 );
+                uint64_t body = pos + 512;
+                
+                if ( body + length > size ) {
+                    fprintf ( stderr, "\nError: %s is truncated\n\n", path );
+                    break;
+                }
+                
+                // the prefix field only exists in POSIX ustar headers
+                string name;
+                if ( longName.size() )
+                    name.swap ( longName );
+                else {
+                    if ( !memcmp ( header + 257, "ustar", 6 ) && header[345] )
+                        name = string ( header + 345, strnlen ( header + 345, 155 ) ) + "/";
+                    name += string ( header, strnlen ( header, 100 ) );
+                }
+                
+                char type = header[156];
+                if ( type == 'L' )
+                    longName = string ( data + body, strnlen ( data + body, size_t(length) ) );
+                else if ( type == 'x' )
+                    longName = paxPath ( data + body, size_t(length) );
+                else if ( ( type == '0' || type == '\0' || type == '7' ) && length ) {
+                    while ( name.compare ( 0, 2, "./" ) == 0 )
+                        name.erase ( 0, 2 );
+                    
+                    if ( name.empty() || name[0] == '/' || name.compare ( 0, 3, "../" ) == 0
+                         || name.find ( "/../" ) != string::npos ) {
+                        fprintf ( stderr, "Warning: Skipping \"%s\" in %s\n",
+                                          name.c_str(), path );
+                    }
+                    else {
+                        RawMember member = { data + body, size_t(length) };
+                        names.push_back ( stem + "/" + name );
+                        _members[names.back()] = member;
+                    }
+                }
+                
+                pos = body + ( ( length + 511 ) / 512 ) * 512;
+            }
+            
+            return 1;
+#else
+            fprintf ( stderr, "\nError: Cannot read %s: tar archives are "
+                              "not supported on this platform\n\n", path );
+            return 0;
+#endif
+        };
+    
+        //  The member stays valid when other archives are added
+        const RawMember * find ( const char * name ) const {
+            std::lock_guard < std::mutex > lock ( _mtx );
+            unordered_map < string, RawMember >::const_iterator it = _members.find ( name );
+            return it == _members.end() ? nullptr : &it->second;
+        };
+    
+    private:
+        vector < std::pair < void *, size_t > > _maps;
+        unordered_map < string, RawMember > _members;
+        mutable std::mutex _mtx;
+};
 
-    if ( _opts.verbosity > 1 )
-        printf ( "Regressing IDT matrix coefficients ...\n" );
+//  Host name and process id, recorded in the "--claim" / "--shard" files
+static string processTag ( ) {
+    char name[256] = "";
+    int pid;
+    
+#ifndef WIN32
+    gethostname ( name, sizeof(name) - 1 );
+    pid = int(getpid());
+#else
+    const char * env = getenv ( "COMPUTERNAME" );
+    if ( env )
+        strncpy ( name, env, sizeof(name) - 1 );
+    pid = int(GetCurrentProcessId());
+#endif
+    
+    char tag[300];
+    snprintf ( tag, sizeof(tag), "%s %d", name[0] ? name : "unknown", pid );
+    
+    return tag;
+}
 
-    if ( _idt->calIDT() )  {
-        _idtm = _idt->getIDT();
-        _wbv = _idt->getWB();
+//  Replace the tar archives by their members, drop the outputs of
+//  earlier runs and keep the files of shard "index" out of "count".
+//  Files are assigned to shards by a hash of their normalized path
+//  ( shardPath() ), so that all nodes given the same files agree
+//  whatever the listing order or the spelling of the paths.
+static void expandInputs ( const vector < string > & paths,
+                           RawArchives & archives,
+                           vector < string > & RAWs,
+                           int index,
+                           int count ) {
+    vector < string > inputs;
+    string cwd;
     
-        return 1;
+#ifndef WIN32
+    char dir[4096];
+    if ( count > 1 && getcwd ( dir, sizeof(dir) ) )
+        cwd = dir;
+#endif
+    
+    FORI ( paths.size() ) {
+        if ( isTarArchive ( paths[i].c_str() ) )
+            archives.add ( paths[i].c_str(), inputs );
+        else if ( !isOutputFile ( paths[i] ) )
+            inputs.push_back ( paths[i] );
     }
     
-    return 0;
+    FORI ( inputs.size() ) {
+        if ( count <= 1 ) {
+            RAWs.push_back ( inputs[i] );
+            continue;
+        }
+        
+        string key = shardPath ( inputs[i], cwd );
+        if ( hashBytes ( key.data(), key.size(), hashBasis )
+             % uint64_t(count) == uint64_t(index) )
+            RAWs.push_back ( inputs[i] );
+    }
 }
 
-
 //	=====================================================================
-//  Calculate just white balance coefficients from camera spectral
-//  sensitivity data and the best or specified light source data.
-//  IDT matrix will not be calculated here, as curve-fitting may
-//  take more time
+//  Open the RAW file from the path to the file
 //
 //	inputs:
-//      libraw_iparams_t   : main parameters read from RAW
-//      libraw_colordata_t : color information from RAW
+//      const char *       : path to the raw file
 //
 //	outputs:
-//		int                : "1" means white balance coefficients generated;
-//                           "0" means error during calculation
-
-int AcesRender::prepareWB ( const libraw_iparams_t & P )
-{
-    int read = fetchCameraSenPath ( P );
+//		int                : "1" means raw file successfully opened;
+//                           "0" means error when opening the file
 
-    if ( !read ) {
-        fprintf( stderr, "\nError: No matching cameras found. "
-                         "Please use other options for "
-                         "\"--wb-method\".\n");
-        exit (-1);
+int AcesRender::openRawPath ( const char * pathToRaw ) {
+    assert ( pathToRaw != nullptr );
+    
+    const void * inMemory = nullptr;
+    size_t inMemorySize = 0;
+    _inputHash = 0;
+    _pendingUnpack = 0;
+    _readBytes = 0;
+    _readSeconds = 0.0;
+    
+#ifndef WIN32
+//    void *iobuffer=0;
+    struct stat st;
+#endif
+    
+    const RawMember * member = _archives ? _archives->find ( pathToRaw ) : nullptr;
+    RawFile * prefetched = nullptr;
+    
+    if ( !strcmp ( pathToRaw, "-" ) ) {
+        if ( !( prefetched = readStdin() ) ) {
+            fprintf ( stderr, "\nError: Cannot read a raw file from the "
+                              "standard input\n\n" );
+            _opts.ret = LIBRAW_IO_ERROR;
+            
+            return 0;
+        }
     }
-
-    assert(_opts.illumType);
-    read = fetchIlluminant( _opts.illumType );
-
-    if( !read ) {
-        fprintf( stderr, "\nError: No matching light source. "
-                         "Please find available options by "
-                         "\"rawtoaces --valid-illum\".\n");
-        exit (-1);
+    else if ( !member && _prefetcher )
+        prefetched = _prefetcher->take ( pathToRaw );
+    
+    // "--hash-input" and "--cache" hash the file in memory, read once
+    // for both the hash and LibRaw
+    int hashInput = _opts.manifest && _opts.hash_input;
+    if ( ( hashInput || _opts.cache_dir ) && !member && !prefetched && !_opts.use_mmap )
+        prefetched = readRawFile ( pathToRaw );
+    
+    if ( member )
+    {
+        inMemory = member->data;
+        inMemorySize = member->size;
+        makeParentDirs ( pathToRaw );
+        
+        if (( _opts.ret = _rawProcessor->open_buffer ( const_cast < char * > (member->data),
+                                                        member->size ) ) != LIBRAW_SUCCESS )
+        {
+            fprintf ( stderr, "\nError: Cannot open_buffer %s: %s\n\n",
+                              pathToRaw, libraw_strerror(_opts.ret) );
+        }
     }
-    else
+    else if ( prefetched )
     {
-        // loading training data (190 patches)
-        _idt->loadTrainingData ( static_cast < string > ( FILEPATH )
-                                +"/training/training_spectral.json" );
-
-        // loading color matching function
-        _idt->loadCMF ( static_cast < string > ( FILEPATH )
-                      +"/cmf/cmf_1931.json" );
-
-        // choose the best light source based on
-        // as-shot white balance coefficients
-       _idt->chooseIllumType ( _opts.illumType, _opts.highlight );
-
-       if ( _opts.verbosity > 1 ) {
-           printf ( "Calculating White Balance Coefficients "
-                    "from Spectral Sensitivity ...\n" );
-           printf ( "Applying Calculated White Balance "
-                    "Coefficients ...\n" );
-       }
-
-       _wbv = _idt->getWB();
-
-       return 1;
+        _readBytes = prefetched->size;
+        _readSeconds = prefetched->seconds;
+        inMemory = prefetched->data;
+        inMemorySize = prefetched->size;
+        
+        delete _stream;
+        _stream = new PrefetchDatastream ( prefetched );
+        if (( _opts.ret = _rawProcessor->open_datastream ( _stream ) ) != LIBRAW_SUCCESS )
+        {
+            fprintf ( stderr, "\nError: Cannot open %s: %s\n\n",
+                              pathToRaw, libraw_strerror(_opts.ret) );
+        }
     }
+#ifndef WIN32
+    else if ( _opts.use_mmap )
+    {
+        int file = open ( pathToRaw, O_RDONLY );
+        
+        if( file < 0 )
+        {
+            fprintf ( stderr, "\nError: Cannot open %s: %s\n\n",
+                              pathToRaw, strerror(errno) );
+            _opts.ret = 0;
+            
+            return 0;
+        }
+        
+        if( fstat ( file, &st ) )
+        {
+            fprintf ( stderr, "\nError: Cannot stat %s: %s\n\n",
+                              pathToRaw, strerror(errno) );
+            close( file );
+            _opts.ret = 0;
+            
+            return 0;
+        }
+        
+        int pgsz = getpagesize();
+        _opts.msize = (( st.st_size+pgsz-1 ) / pgsz ) * pgsz;
+        _opts.iobuffer = mmap ( NULL, size_t(_opts.msize), PROT_READ, MAP_PRIVATE, file, 0 );
+        if( !_opts.iobuffer )
+        {
+            fprintf ( stderr, "\nError: Cannot mmap %s: %s\n\n",
+                              pathToRaw, strerror(errno) );
+            close( file );
+            _opts.ret = 0;
+            
+            return 0;
+        }
+        
+        close( file );
+        inMemory = _opts.iobuffer;
+        inMemorySize = size_t(st.st_size);
+        if (( _opts.ret = _rawProcessor->open_buffer( _opts.iobuffer,st.st_size ) != LIBRAW_SUCCESS ))
+        {
+            fprintf ( stderr, "\nError: Cannot open_buffer %s: %s\n\n",
+                              pathToRaw, libraw_strerror(_opts.ret) );
+        }
+    }
+    else
+#endif
+    {
+        if ( _opts.use_bigfile )
+            _opts.ret = _rawProcessor->open_file ( pathToRaw, 1 );
+        else
+            _opts.ret = _rawProcessor->open_file ( pathToRaw );
+    }
+    
+    if ( hashInput && inMemory && _opts.ret == LIBRAW_SUCCESS ) {
+        Xxh64 h;
+        h.update ( inMemory, inMemorySize );
+        recordDigest ( pathToRaw, h.digest() );
+    }
+    
+//  With "--cache" unpacking waits for postprocessRaw(), which skips it
+//  if the demosaiced image of this file is found in the cache
+    if ( _opts.cache_dir && _opts.ret == LIBRAW_SUCCESS && inMemory ) {
+        _inputHash = hashBytes ( inMemory, inMemorySize, hashBasis );
+        
+        if ( _inputHash ) {
+            _pendingUnpack = 1;
+            return _opts.ret;
+        }
+    }
+    
+    unpack ( pathToRaw );
+    
+    return _opts.ret;
+}
 
-    return 0;
-}
-
-//  =====================================================================
-//  Conduct dcraw process on the RAW
-//
-//  inputs:
-//      const char *       : path to the raw file
-//
-//  outputs:
-//      int                : "1" means raw file successfully pre-processed;
-//                           "0" means error when pre-processing the file
-
-int AcesRender::dcraw ( ) {
-    assert ( _opts.ret ==  LIBRAW_SUCCESS );
-
-    if ( LIBRAW_SUCCESS != ( _opts.ret = _rawProcessor->dcraw_process() ) ) {      
-        fprintf ( stderr, "Error: Cannot do postpocessing: %s\n\n",
-                           libraw_strerror(_opts.ret) );
-        _opts.ret = errno;
+//	=====================================================================
+//  Open the RAW file from a buffer already in memory (e.g., a network
+//  stream or a member of an archive). The buffer is not copied and must
+//  stay valid until outputACES() returns.
+//
+//	inputs:
+//      const void *       : pointer to the raw file data
+//      size_t             : size of the raw file data in bytes
+//
+//	outputs:
+//		int                : "0" (LIBRAW_SUCCESS) means the buffer has been
+//                           opened and unpacked (with "--cache", unpacked
+//                           later if needed); other values are libraw
+//                           error codes
 
-        if ( LIBRAW_FATAL_ERROR( _opts.ret ) )
-            exit(1);
+int AcesRender::openRawBuffer ( const void * buffer, size_t size ) {
+    assert ( buffer != nullptr );
+    
+    _inputHash = 0;
+    _pendingUnpack = 0;
+    
+    if ( !size ) {
+        fprintf ( stderr, "\nError: The raw buffer is empty\n\n" );
+        _opts.ret = LIBRAW_IO_ERROR;
+        
+        return _opts.ret;
     }
+    
+    if (( _opts.ret = _rawProcessor->open_buffer ( const_cast < void * > (buffer),
+                                                    size ) ) != LIBRAW_SUCCESS )
+    {
+        fprintf ( stderr, "\nError: Cannot open_buffer: %s\n\n",
+                          libraw_strerror(_opts.ret) );
+        
+        return _opts.ret;
+    }
+    
+    if ( _opts.cache_dir ) {
+        _inputHash = hashBytes ( buffer, size, hashBasis );
+        _pendingUnpack = 1;
+        
+        return _opts.ret;
+    }
+    
+    return unpack ( "<memory buffer>" );
+}
+
+//	=====================================================================
+//  Unpack the RAW file based on the path to the file (after openRawPath)
+//
+//	inputs:
+//      const char *       : path to the raw file
+//
+//	outputs:
+//		int                : "1" means raw file successfully unpacked;
+//                           "0" means error when unpacking the file
 
+int AcesRender::unpack ( const char * pathToRaw ) {
+    assert ( _opts.ret == LIBRAW_SUCCESS && pathToRaw != nullptr );
+    
+    if (( _opts.ret = _rawProcessor->unpack() ) != LIBRAW_SUCCESS )
+    {
+        fprintf ( stderr, "\nError: Cannot unpack %s: %s\n\n",
+                           pathToRaw, libraw_strerror (_opts.ret) );
+    }
+    
     return _opts.ret;
 }
 
-
-//  =====================================================================
-//  Preprocess the RAW file based on the path to the file
+//	=====================================================================
+//	Read camera spectral sensitivity data from path
 //
-//  inputs:
-//      const char *       : path to the raw file
+//	inputs:
+//      const char *     : camera spectral sensitivity path
+//                         (either in the environment variable of
+//                          "AMPAS_CAMERA_SENSITIVITIES_PATH"
+//                          such as  "/usr/local/include/rawtoaces/data/camera"
+//                          or specified by users)
+//      libraw_iparams_t : main parameters read from RAW
 //
-//  outputs:
-//      int                : "1" means raw file successfully pre-processed;
-//                           "0" means error when pre-processing the file
+//	outputs:
+//		int              : "1" means loading/injecting camera spectral
+//                         sensitivity data successfully;
+//                         "0" means error in reading/injecting data
 
-int AcesRender::preprocessRaw ( const char * path ) {
-    assert ( path != nullptr );
+int AcesRender::fetchCameraSenPath( const libraw_iparams_t & P )
+{
+    string camera = string ( P.make ) + " / " + P.model;
+    if ( camera == _cameraLoaded )
+        return 1;
     
-    size_t len = strlen(path);
-    _pathToRaw = (char *) malloc(len+1);
-    memset(_pathToRaw, 0x0, len);
-    memcpy(_pathToRaw, path, len);
-    _pathToRaw[len] = '\0';
+    _cameraLoaded.clear();
+    if ( !fetchCameraSenPath ( P, _idt ) )
+        return 0;
+    
+    _cameraLoaded = camera;
+    
+    return 1;
+}
 
-   // if ( _opts.verbosity > 2 )
-   //     _rawProcessor->set_progress_handler ( my_progress_callback,
-   //                                         ( void * )"Sample data passed" );
-    // Start rawtoaces
-    if ( _opts.verbosity ) {
-        printf( "\nStarting rawtoaces ...\n");
-        printf ( "Processing %s ...\n", path );
+//	=====================================================================
+//	Fetch camera sensitivity data into the given Idt instance
+//  (used by worker threads that do not share "_idt")
+//
+//	inputs:
+//      libraw_iparams_t : raw image parameters
+//      Idt *            : the Idt instance to be filled
+//
+//	outputs:
+//		int              : "1" means loading camera spectral sensitivity
+//                         data successfully; "0" means no data found
+
+int AcesRender::fetchCameraSenPath( const libraw_iparams_t & P, Idt * idt ) const
+{
+    assert ( idt != nullptr );
+    int readC = 0;
+    
+    FORI ( _opts.envPaths.size() ) {
+        vector<string> cFiles = openDir ( static_cast< string >( (_opts.envPaths)[i] )
+                                          +"/camera" );
+        for ( vector<string>::iterator file = cFiles.begin( ); file != cFiles.end( ); ++file ) {
+            string fn( *file );
+            
+            if ( fn.find(".json") == std::string::npos )
+                continue;
+            readC = idt->loadCameraSpst( fn, P.make, P.model );
+            if ( readC ) return 1;
+        }
     }
     
-#ifdef LIBRAW_USE_OPENMP
-   if( _opts.verbosity )
-       printf ( "Using %d threads\n", omp_get_max_threads() );
-#endif
+    return readC;
+}
+
+//	=====================================================================
+//	Fetch light source data to calcuate white balance coefficients
+//
+//	inputs:
+//      const char *  : type of light source ("unknown" if not specified)
+//                      (in the environment variable of "AMPAS_ILLUMINANT_PATH"
+//                       such as "/usr/local/include/rawtoaces/data/Illuminant")
+//
+//	outputs:
+//		int : "1" means loading/injecting light source datasets successfully,
+//            "0" means error / no illumiant data has been loaded
+
+
+int AcesRender::fetchIlluminant ( const char * illumType )
+{
+    assert ( illumType != nullptr );
     
-    if ( openRawPath ( path ) )
-        unpack ( path );
+    if ( _illumLoaded == illumType )
+        return 1;
     
-    return _opts.ret;
+    _illumLoaded.clear();
+    if ( !fetchIlluminant ( illumType, _idt ) )
+        return 0;
+    
+    _illumLoaded = illumType;
+    
+    return 1;
 }
 
-//  =====================================================================
-//  Postprocess the RAW file 
+//	=====================================================================
+//	Fetch the pre-calculated profile of the camera (generated by
+//  "rawtoaces-profile") from the "profile" folder of the data paths
 //
-//  inputs:
-//      N/A
+//	inputs:
+//      libraw_iparams_t : raw image parameters
 //
-//  outputs:
-//      int                : "1" means raw file successfully pre-processed;
-//                           "0" means error when pre-processing the file
+//	outputs:
+//		int              : "1" means a profile of the camera is loaded;
+//                         "0" means no profile found
 
-int AcesRender::postprocessRaw ( ) {
-    assert ( _opts.ret == LIBRAW_SUCCESS );
-    
-#ifdef OUT
-#undef OUT
-#endif
+int AcesRender::fetchProfile ( const libraw_iparams_t & P )
+{
+    return fetchProfile ( P, _profile, _profileLoaded );
+}
 
-#define OUT _rawProcessor->imgdata.params
-#define P  _rawProcessor->imgdata.idata
-#define C   _rawProcessor->imgdata.color
+//	=====================================================================
+//	Fetch the profile of the camera into the given Profile instance
+//  (used by worker threads that do not share "_profile")
+//
+//	inputs:
+//      libraw_iparams_t : raw image parameters
+//      Profile *        : the Profile instance to be filled
+//      string &         : camera of the profile in it ( "-" + camera
+//                         if none was found ); updated
+//
+//	outputs:
+//		int              : "1" means a profile of the camera is loaded;
+//                         "0" means no profile found
 
-    if ( _opts.verbosity > 1 )
-        printf ( "The camera has been identified as a %s %s ...\n", P.make, P.model );
+int AcesRender::fetchProfile ( const libraw_iparams_t & P, Profile * profile,
+                               string & loaded ) const
+{
+    assert ( profile != nullptr );
     
-    switch ( _opts.wb_method ) {
-    // 0
-        case wbMethod0 : {
-            _opts.use_mul = 1;
-            vector < double > mulV (C.cam_mul, C.cam_mul+3);
-            
-            FORI(3) OUT.user_mul[i] = static_cast<float>(mulV[i]);
+    string camera = string ( P.make ) + " / " + P.model;
+    if ( camera == loaded )
+        return 1;
+    if ( "-" + camera == loaded )
+        return 0;
+    
+    FORI ( _opts.envPaths.size() ) {
+        vector<string> pFiles = openDir ( static_cast< string >( (_opts.envPaths)[i] )
+                                          +"/profile" );
+        for ( vector<string>::iterator file = pFiles.begin( ); file != pFiles.end( ); ++file ) {
+            string fn( *file );
             
-            if ( _opts.verbosity > 1 ) {
-                printf ( "White Balance method is 0 - ");
-                printf ( "Using white balance factors from "
-                         "file metadata ...\n" );
+            if ( fn.find(".prof") == std::string::npos )
+                continue;
+            if ( profile->read ( fn, P.make, P.model ) ) {
+                loaded = camera;
+                return 1;
             }
-            break;
         }
-        // 1
-        case wbMethod1 : {
-            if ( prepareWB ( _rawProcessor->imgdata.idata ) ) {
-                _opts.use_mul = 1;
-                vector < double > wbv = getWB();
-                FORI(3) OUT.user_mul[i] = static_cast<float>(wbv[i]);
-            }
-            else {
-                fprintf ( stderr, "\nError: Cannot obtain a set of White "
-                                  "Balance Coefficient Factors \n" );
-                _opts.ret = errno;
-                return 0;
-            }
-            
-            if ( _opts.verbosity > 1 ) {
-                printf ( "White Balance calculation method is 1 - ");
-                printf ( "Using white balance factors calculated from "
-                         "spec sens and user specified illuminant ...\n" );
+    }
+    
+    // remember the miss so that the folder is scanned once per camera
+    loaded = "-" + camera;
+    
+    return 0;
+}
+
+//	=====================================================================
+//	Load the training data and the color matching functions
+//  needed by the IDT regression; they are read once per process
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//		N/A  : "_idt" filled with training data and CMF
+
+void AcesRender::fetchTrainingData ( )
+{
+    if ( _trainingLoaded )
+        return;
+    
+    // loading training data (190 patches by default)
+    _idt->loadTrainingData ( static_cast < string > ( FILEPATH )
+                             +"training/training_spectral.json" );
+    // loading color matching function
+    _idt->loadCMF ( static_cast < string > ( FILEPATH )
+                    +"cmf/cmf_1931.json" );
+    
+    _trainingLoaded = 1;
+}
+
+//	=====================================================================
+//	Fetch light source data into the given Idt instance
+//  (used by worker threads that do not share "_idt")
+//
+//	inputs:
+//      const char *  : type of light source ("na" if not specified)
+//      Idt *         : the Idt instance to be filled
+//
+//	outputs:
+//		int : "1" means loading light source datasets successfully,
+//            "0" means error / no illumiant data has been loaded
+
+int AcesRender::fetchIlluminant ( const char * illumType, Idt * idt ) const
+{
+    assert ( idt != nullptr );
+    vector <string> paths;
+    
+    FORI ( _opts.envPaths.size() ) {
+        vector <string> iFiles = openDir ( (_opts.envPaths)[i] + "/illuminant" );
+        for ( vector<string>::iterator file = iFiles.begin(); file != iFiles.end(); ++file ) {
+            string fn( *file );
+            if ( fn.find(".json") == std::string::npos )
+                continue;
+            paths.push_back(fn);
+        }
+    }
+    
+    return idt->loadIlluminant( paths, static_cast<string >(illumType) );
+}
+
+
+//	=====================================================================
+//  Calculate IDT matrix from camera spectral sensitivity data and the
+//  selected or specified light source data. THe best White balance
+//  coefficients will be generated in the process of obtaining IDT.
+//
+//	inputs:
+//      libraw_iparams_t              : main parameters read from RAW
+//      libraw_colordata_t            : color information from RAW
+//
+//	outputs:
+//		int                           : "1" means IDT matrix generated;
+//                                      "0" means error in calculation.
+
+int AcesRender::prepareIDT ( const libraw_iparams_t & P, float * M )
+{
+    // pre-calculated camera profile: interpolate by CCT instead of
+    // regressing the IDT matrix, unless the illuminant is given by
+    // "--wb-method 1" or "--no-profile" is set
+    if ( _opts.use_profile && !_opts.illumType && fetchProfile ( P ) ) {
+        vector < double > mulV (M, M+3);
+        double cct = _profile->interpolate ( mulV, _wbv, _idtm );
+        
+        if ( _opts.verbosity > 1 )
+            printf ( "Interpolating IDT matrix from the camera profile "
+                     "(%.0fK) ...\n", cct );
+        
+        return ( cct > 0.0 );
+    }
+    
+    // _rawProcessor->imgdata.idata
+    int read = fetchCameraSenPath( P );
+
+    if ( !read ) {
+        fprintf( stderr, "\nError: No matching cameras found. "
+                         "Please use other options for "
+                         "\"--mat-method\" and/or \"--wb-method\".\n");
+        exit (-1);
+    }
+    
+    read = fetchIlluminant ( _opts.illumType ? _opts.illumType : "na" );
+    
+    if( !read ) {
+        fprintf( stderr, "\nError: No matching light source. "
+                         "Please find available options by "
+                         "\"rawtoaces --valid-illum\".\n");
+        exit (-1);
+    }
+
+    fetchTrainingData ( );
+
+    _idt->setVerbosity(_opts.verbosity);
+    _idt->setWarmStart(1);
+    _idt->setDeltaEThreshold(_opts.fit_threshold);
+    _idt->setThreads(_opts.fit_threads > 0 ? _opts.fit_threads
+                                           : int(std::thread::hardware_concurrency()));
+    if ( _opts.illumType )
+        _idt->chooseIllumType( _opts.illumType, _opts.highlight );
+    else {
+        vector < double > mulV (M, M+3);
+        _idt->chooseIllumSrc ( mulV, _opts.highlight );
+    }
+
+    if ( _opts.verbosity > 1 )
+        printf ( "Regressing IDT matrix coefficients ...\n" );
+
+    if ( _idt->calIDT() )  {
+        _idtm = _idt->getIDT();
+        _wbv = _idt->getWB();
+    
+        return 1;
+    }
+    
+    return 0;
+}
+
+
+//	=====================================================================
+//  Calculate just white balance coefficients from camera spectral
+//  sensitivity data and the best or specified light source data.
+//  IDT matrix will not be calculated here, as curve-fitting may
+//  take more time
+//
+//	inputs:
+//      libraw_iparams_t   : main parameters read from RAW
+//      libraw_colordata_t : color information from RAW
+//
+//	outputs:
+//		int                : "1" means white balance coefficients generated;
+//                           "0" means error during calculation
+
+int AcesRender::prepareWB ( const libraw_iparams_t & P )
+{
+    int read = fetchCameraSenPath ( P );
+
+    if ( !read ) {
+        fprintf( stderr, "\nError: No matching cameras found. "
+                         "Please use other options for "
+                         "\"--wb-method\".\n");
+        exit (-1);
+    }
+
+    assert(_opts.illumType);
+    read = fetchIlluminant( _opts.illumType );
+
+    if( !read ) {
+        fprintf( stderr, "\nError: No matching light source. "
+                         "Please find available options by "
+                         "\"rawtoaces --valid-illum\".\n");
+        exit (-1);
+    }
+    else
+    {
+        // choose the best light source based on
+        // as-shot white balance coefficients
+       _idt->chooseIllumType ( _opts.illumType, _opts.highlight );
+
+       if ( _opts.verbosity > 1 ) {
+           printf ( "Calculating White Balance Coefficients "
+                    "from Spectral Sensitivity ...\n" );
+           printf ( "Applying Calculated White Balance "
+                    "Coefficients ...\n" );
+       }
+
+       _wbv = _idt->getWB();
+
+       return 1;
+    }
+
+    return 0;
+}
+
+//	=====================================================================
+//	White balance from grey boxes ( "--wb-method 3", "--wb-box" ),
+//  measured on the undemosaiced data before dcraw_process(): the
+//  black-subtracted values of each CFA color inside the boxes (in pixels
+//  of the visible, unrotated image) are averaged with "--wb-estimator",
+//  leaving out saturated photosites
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//      int        : "1" means imgdata.params.user_mul has been set;
+//                   "0" means the boxes hold no usable photosites
+
+int AcesRender::greyBoxWB ( ) {
+#ifdef OUT
+#undef OUT
+#endif
+    
+#ifdef P
+#undef P
+#endif
+    
+#ifdef C
+#undef C
+#endif
+    
+#ifdef S
+#undef S
+#endif
+    
+#define OUT _rawProcessor->imgdata.params
+#define P   _rawProcessor->imgdata.idata
+#define C   _rawProcessor->imgdata.color
+#define S   _rawProcessor->imgdata.sizes
+    
+    const libraw_rawdata_t & raw = _rawProcessor->imgdata.rawdata;
+    
+    // photosites of one CFA color, or pixels of 3/4-color raw data
+    const ushort * pixels = raw.raw_image;
+    int channels = 1;
+    if ( !pixels && raw.color4_image ) {
+        pixels = raw.color4_image[0];
+        channels = 4;
+    }
+    else if ( !pixels && raw.color3_image ) {
+        pixels = raw.color3_image[0];
+        channels = 3;
+    }
+    
+    if ( !pixels || P.colors < 3 ) {
+        fprintf ( stderr, "\nError: White balance method 3 needs color raw data\n" );
+        return 0;
+    }
+    
+    unsigned black = OUT.user_black >= 0 ? unsigned(OUT.user_black) : C.black;
+    unsigned maximum = OUT.user_sat > 0 ? unsigned(OUT.user_sat) : C.maximum;
+    size_t pitch = S.raw_pitch ? S.raw_pitch / sizeof(ushort)
+                               : size_t(S.raw_width) * channels;
+    
+    // with a pattern of black levels that does not repeat every 6
+    // photosites, the levels are looked up one photosite at a time
+    unsigned blackCols = C.cblack[5];
+    int periodic = OUT.user_black >= 0 || !C.cblack[4] || !blackCols
+                   || 6 % blackCols == 0;
+    
+    int keep = _opts.wb_estimator != wbEstimator0;
+    double sum[4] = { 0.0, 0.0, 0.0, 0.0 };
+    double count[4] = { 0.0, 0.0, 0.0, 0.0 };
+    vector < vector < float > > samples ( 4 );
+    
+    FORI ( _opts.wb_boxes.size() ) {
+        const wbBox & box = _opts.wb_boxes[i];
+        size_t top    = std::min ( size_t(box.y), size_t(S.height) );
+        size_t bottom = std::min ( size_t(box.y) + box.h, size_t(S.height) );
+        size_t left   = std::min ( size_t(box.x), size_t(S.width) );
+        size_t right  = std::min ( size_t(box.x) + box.w, size_t(S.width) );
+        
+        for ( size_t row = top; row < bottom; row++ ) {
+            const ushort * line = pixels + ( row + S.top_margin ) * pitch
+                                  + ( S.left_margin + left ) * channels;
+            size_t n = right - left;
+            
+            if ( channels > 1 ) {
+                for ( size_t x = 0; x < n; x++ )
+                    FORJ ( channels ) {
+                        unsigned v = line[x * channels + j];
+                        if ( v >= maximum )
+                            continue;
+                        
+                        float value = float(v) - float ( black + ( OUT.user_black >= 0 ? 0
+                                                : cfaBlack ( C.cblack, row, left + x, j ) ) );
+                        sum[j] += value;
+                        count[j]++;
+                        if ( keep )
+                            samples[j].push_back ( value );
+                    }
+                continue;
             }
             
-            break;
+            // colors and black levels of one CFA period along the row
+            // ( 2 photosites for Bayer, 6 for X-Trans )
+            int color[6];
+            float level[6];
+            FORJ ( 6 ) {
+                int c = _rawProcessor->COLOR ( int(row), int(left) + j ) & 3;
+                color[j] = c;
+                level[j] = float ( black + ( OUT.user_black >= 0 ? 0
+                                             : cfaBlack ( C.cblack, row, left + j, c ) ) );
+            }
+            
+            if ( periodic && !keep ) {
+                sumCfaRow ( line, n, maximum, color, level, sum, count );
+                continue;
+            }
+            
+            for ( size_t x = 0; x < n; x++ ) {
+                if ( line[x] >= maximum )
+                    continue;
+                
+                int c = color[x % 6];
+                float value = float(line[x]) - ( periodic ? level[x % 6]
+                              : float ( black + cfaBlack ( C.cblack, row, left + x, c ) ) );
+                sum[c] += value;
+                count[c]++;
+                if ( keep )
+                    samples[c].push_back ( value );
+            }
         }
-        // 2
-        case wbMethod2 : {
-            OUT.use_auto_wb = 1;
+    }
+    
+    // the second green of a 3-color Bayer sensor is green
+    if ( P.colors == 3 ) {
+        sum[1] += sum[3];
+        count[1] += count[3];
+        samples[1].insert ( samples[1].end(), samples[3].begin(), samples[3].end() );
+    }
+    
+    double avg[4] = { 0.0, 0.0, 0.0, 0.0 };
+    FORI ( P.colors ) {
+        avg[i] = greyLevel ( _opts.wb_estimator, sum[i], count[i], samples[i] );
+        
+        if ( avg[i] <= 0.0 ) {
+            fprintf ( stderr, "\nError: The grey box has no usable %s values for "
+                              "white balance\n", i == 0 ? "red" : i == 2 ? "blue" : "green" );
+            return 0;
+        }
+    }
+    
+    // the brightest channel gets 1.0
+    double top = *std::max_element ( avg, avg + P.colors );
+    FORI(4) OUT.user_mul[i] = i < P.colors ? float ( top / avg[i] ) : 0.0f;
+    _opts.use_mul = 1;
+    
+    if ( _opts.verbosity > 1 )
+        printf ( "Grey box white balance factors: %f %f %f %f\n",
+                 OUT.user_mul[0], OUT.user_mul[1], OUT.user_mul[2], OUT.user_mul[3] );
+    
+    return 1;
+}
+
+//  =====================================================================
+//  Conduct dcraw process on the RAW
+//
+//  inputs:
+//      const char *       : path to the raw file
+//
+//  outputs:
+//      int                : "1" means raw file successfully pre-processed;
+//                           "0" means error when pre-processing the file
+
+int AcesRender::dcraw ( ) {
+    assert ( _opts.ret ==  LIBRAW_SUCCESS );
+
+    if ( LIBRAW_SUCCESS != ( _opts.ret = _rawProcessor->dcraw_process() ) ) {      
+        fprintf ( stderr, "Error: Cannot do postpocessing: %s\n\n",
+                           libraw_strerror(_opts.ret) );
+        _opts.ret = errno;
+
+        if ( LIBRAW_FATAL_ERROR( _opts.ret ) )
+            exit(1);
+    }
+
+    return _opts.ret;
+}
+
+
+//  =====================================================================
+//  Built-in fast demosaic for previews ( "--preview 1" or "2" ). Works
+//  directly on the Bayer data of rawdata.raw_image: black subtraction,
+//  white balance, 2x2 binning or bilinear interpolation and the output
+//  color matrix are done in a single multi-threaded pass. The result
+//  has the same scaling and color space as dcraw_process() would give,
+//  so renderACES() is applied to it unchanged.
+//
+//  inputs:
+//      N/A
+//
+//  outputs:
+//      libraw_processed_image_t * : 16-bit RGB image (malloc-ed as by
+//                                   dcraw_make_mem_image()); nullptr if
+//                                   the raw data is not supported and
+//                                   dcraw_process() should be used
+
+libraw_processed_image_t * AcesRender::fastPreview ( ) {
+#ifdef OUT
+#undef OUT
+#endif
+    
+#ifdef P
+#undef P
+#endif
+    
+#ifdef C
+#undef C
+#endif
+    
+#define OUT _rawProcessor->imgdata.params
+#define P   _rawProcessor->imgdata.idata
+#define C   _rawProcessor->imgdata.color
+#define S   _rawProcessor->imgdata.sizes
+    
+    // sRGB (D65) to XYZ, as used by libraw for "output_color" 5
+    static const double xyz_rgb[3][3] = {
+        { 0.412453, 0.357580, 0.180423 },
+        { 0.212671, 0.715160, 0.072169 },
+        { 0.019334, 0.119193, 0.950227 }
+    };
+    
+    if ( !_rawProcessor->imgdata.rawdata.raw_image ||
+         P.filters < 1000 || P.colors != 3 ) {
+        if ( _opts.verbosity > 1 )
+            printf ( "The built-in preview only supports Bayer sensors; "
+                     "using libraw ...\n" );
+        return nullptr;
+    }
+    
+    float mul[4];
+    if ( OUT.user_mul[0] > 0 )
+        FORI(4) mul[i] = OUT.user_mul[i];
+    else if ( OUT.use_camera_wb && C.cam_mul[0] > 0 )
+        FORI(4) mul[i] = C.cam_mul[i];
+    else if ( OUT.use_auto_wb ) {
+        if ( _opts.verbosity > 1 )
+            printf ( "The built-in preview does not average the image for "
+                     "white balance; using libraw ...\n" );
+        return nullptr;
+    }
+    else
+        FORI(4) mul[i] = C.pre_mul[i];
+    
+    unsigned black = OUT.user_black >= 0 ? unsigned(OUT.user_black) : C.black;
+    unsigned maximum = OUT.user_sat > 0 ? unsigned(OUT.user_sat) : C.maximum;
+    
+    PreviewJob job;
+    if ( !previewLevels ( job, mul, OUT.highlight, black, maximum,
+                          OUT.user_black >= 0 ? nullptr : C.cblack, C.pre_mul ) ) {
+        if ( _opts.verbosity > 1 )
+            printf ( "The built-in preview cannot use the black levels or the "
+                     "white balance; using libraw ...\n" );
+        return nullptr;
+    }
+    
+    job.raw       = _rawProcessor->imgdata.rawdata.raw_image;
+    job.pitch     = S.raw_pitch ? S.raw_pitch / sizeof(ushort) : S.raw_width;
+    job.top       = S.top_margin;
+    job.left      = S.left_margin;
+    job.width     = S.width;
+    job.height    = S.height;
+    job.mode      = _opts.preview_mode;
+    job.flip      = OUT.user_flip >= 0 ? OUT.user_flip : S.flip;
+    job.maximum   = 65535.0f;
+    job.outWidth  = job.mode == previewMode1 ? S.width / 2 : S.width;
+    job.outHeight = job.mode == previewMode1 ? S.height / 2 : S.height;
+    
+    FORIJ(8, 2) job.fc[i][j] = _rawProcessor->COLOR ( i, j );
+    
+    //  camera RGB for "output_color" 0 (IDT from spectral sensitivity),
+    //  XYZ otherwise
+    FORIJ(3, 3) job.mat[i][j] = ( i == j ) ? 1.0f : 0.0f;
+    if ( OUT.output_color != 0 ) {
+        int useMatrix = ( OUT.use_camera_matrix == 3 ||
+                          ( OUT.use_camera_matrix == 1 && P.dng_version ) )
+                        && C.cmatrix[0][0] > 0.25;
+        
+        FORIJ(3, 3) {
+            double v = 0.0;
+            for ( int k = 0; k < 3; k++ )
+                v += xyz_rgb[i][k] * ( useMatrix ? C.cmatrix[k][j] : C.rgb_cam[k][j] );
+            job.mat[i][j] = static_cast < float > (v);
+        }
+    }
+    
+    int width  = ( job.flip & 4 ) ? job.outHeight : job.outWidth;
+    int height = ( job.flip & 4 ) ? job.outWidth : job.outHeight;
+    size_t bytes = size_t(width) * height * 3 * sizeof(ushort);
+    
+    libraw_processed_image_t * image = (libraw_processed_image_t *)
+                                       malloc ( sizeof(libraw_processed_image_t) + bytes );
+    if ( !image ) {
+        fprintf ( stderr, "\nError: Cannot allocate the preview image\n" );
+        return nullptr;
+    }
+    
+    image->type      = LIBRAW_IMAGE_BITMAP;
+    image->width     = width;
+    image->height    = height;
+    image->colors    = 3;
+    image->bits      = 16;
+    image->data_size = bytes;
+    job.out          = (ushort *) image->data;
+    
+    if ( _opts.verbosity > 1 )
+        printf ( "Built-in %s preview of %dx%d ...\n",
+                 job.mode == previewMode1 ? "2x2 binning" : "bilinear",
+                 width, height );
+    
+    int threads = _opts.threads > 0 ? _opts.threads
+                                    : int(std::thread::hardware_concurrency());
+    threads = std::max ( 1, std::min ( threads, job.outHeight ) );
+    
+    vector < std::thread > workers;
+    int band = ( job.outHeight + threads - 1 ) / threads;
+    for ( int row = band; row < job.outHeight; row += band )
+        workers.push_back ( std::thread ( previewBand, &job, row,
+                                          std::min ( row + band, job.outHeight ) ) );
+    
+    previewBand ( &job, 0, std::min ( band, job.outHeight ) );
+    
+    FORI ( workers.size() )
+        workers[i].join();
+    
+#undef S
+    
+    return image;
+}
+
+//	=====================================================================
+//  LibRaw progress handler: a non-zero return makes the running LibRaw
+//  call stop with LIBRAW_CANCELLED_BY_CALLBACK
+
+static int interruptCallback ( void * data,
+                               enum LibRaw_progress,
+                               int,
+                               int ) {
+    return static_cast < AcesRender * > (data)->interrupted() != nullptr;
+}
+
+//	=====================================================================
+//	Cancel the conversions of this instance ( and of the workers of
+//  convertRaws() ) through a token: once token->cancel() is called from
+//  any thread, the file in progress stops at the next LibRaw progress
+//  step or between the render and write stages, its buffers are
+//  released, and the next files are skipped until token->reset()
+//
+//	inputs:
+//      CancelToken *  : token checked by the conversions ( nullptr to
+//                       remove it ); it must outlive them
+//
+//	outputs:
+//      N/A
+
+void AcesRender::setCancelToken ( CancelToken * token ) {
+    _cancel = token;
+}
+
+//	=====================================================================
+//	Start the "--deadline" of the file being opened and let LibRaw check
+//  it, and the cancellation token, at each progress step
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//      N/A
+
+void AcesRender::startDeadline ( ) {
+    _deadline = std::chrono::steady_clock::time_point::max();
+    _abandoned = 0;
+    
+    if ( _opts.deadline > 0.0 )
+        _deadline = std::chrono::steady_clock::now()
+                    + std::chrono::duration_cast < std::chrono::steady_clock::duration > (
+                          std::chrono::duration < double > ( _opts.deadline ) );
+    
+    _rawProcessor->set_progress_handler ( interruptCallback, this );
+}
+
+//	=====================================================================
+//	Check whether the current file must be abandoned
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//      const char *  : nullptr to go on, otherwise the reason
+//                      ( "cancelled" or "deadline exceeded" )
+
+const char * AcesRender::interrupted ( ) const {
+    if ( _cancel && _cancel->cancelled() )
+        return "cancelled";
+    
+    if ( _deadline != std::chrono::steady_clock::time_point::max()
+         && std::chrono::steady_clock::now() > _deadline )
+        return "deadline exceeded";
+    
+    return nullptr;
+}
+
+//	=====================================================================
+//	Abandon the current file if it is cancelled or past its deadline,
+//  releasing the decoded image and libraw buffers
+//
+//	inputs:
+//      const char *  : path to the raw file (for the message)
+//
+//	outputs:
+//      int           : "1" means the file has been abandoned
+
+int AcesRender::abandon ( const char * raw ) {
+    const char * reason = interrupted();
+    if ( !reason )
+        return 0;
+    
+    fprintf ( stderr, "\nError: %s: %s\n", raw, reason );
+    releasePixels();
+    recycle();
+    
+    return 1;
+}
+
+//  =====================================================================
+//  Preprocess the RAW file based on the path to the file
+//
+//  inputs:
+//      const char *       : path to the raw file
+//
+//  outputs:
+//      int                : "1" means raw file successfully pre-processed;
+//                           "0" means error when pre-processing the file
+
+int AcesRender::preprocessRaw ( const char * path ) {
+    assert ( path != nullptr );
+    
+    if ( _pathToRaw != nullptr )
+        free ( _pathToRaw );
+    
+    // the outputs of the standard input ( "-" ) are named "stdin_aces..."
+    const char * name = strcmp ( path, "-" ) ? path : "stdin";
+    
+    size_t len = strlen(name);
+    _pathToRaw = (char *) malloc(len+1);
+    memset(_pathToRaw, 0x0, len);
+    memcpy(_pathToRaw, name, len);
+    _pathToRaw[len] = '\0';
+
+   // if ( _opts.verbosity > 2 )
+   //     _rawProcessor->set_progress_handler ( my_progress_callback,
+   //                                         ( void * )"Sample data passed" );
+    startDeadline ();
+    
+    // Start rawtoaces
+    if ( _opts.verbosity ) {
+        printf( "\nStarting rawtoaces ...\n");
+        printf ( "Processing %s ...\n", path );
+    }
+    
+#ifdef LIBRAW_USE_OPENMP
+   if( _opts.verbosity )
+       printf ( "Using %d threads\n", omp_get_max_threads() );
+#endif
+    
+    if ( openRawPath ( path ) )
+        unpack ( path );
+    
+    return _opts.ret;
+}
+
+//  =====================================================================
+//  Preprocess a RAW file that is already in memory
+//
+//  inputs:
+//      const void *       : pointer to the raw file data
+//      size_t             : size of the raw file data in bytes
+//
+//  outputs:
+//      int                : "0" (LIBRAW_SUCCESS) means the buffer has been
+//                           successfully pre-processed; other values are
+//                           libraw error codes
+
+int AcesRender::preprocessRaw ( const void * buffer, size_t size ) {
+    assert ( buffer != nullptr );
+    
+    if ( _pathToRaw != nullptr ) {
+        free ( _pathToRaw );
+        _pathToRaw = nullptr;
+    }
+    
+    startDeadline ();
+    
+    if ( _opts.verbosity ) {
+        printf( "\nStarting rawtoaces ...\n");
+        printf ( "Processing buffer of %lu bytes ...\n", (unsigned long) size );
+    }
+    
+    return openRawBuffer ( buffer, size );
+}
+
+//  =====================================================================
+//  Key of the demosaiced image of the current file in "--cache" (see
+//  renderCacheKey())
+//
+//  inputs:
+//      N/A
+//
+//  outputs:
+//      uint64_t           : the key (also the name of the cache file)
+
+uint64_t AcesRender::cacheKey ( ) const {
+    assert ( _inputHash );
+    
+    return renderCacheKey ( _inputHash, LibRaw::version(),
+                            _rawProcessor->imgdata.params, _opts );
+}
+
+//  =====================================================================
+//  Use the demosaiced image stored in a "--cache" file instead of
+//  unpacking and demosaicing the RAW file
+//
+//  inputs:
+//      const char *       : path to the cache file
+//      uint64_t           : the expected key (see cacheKey())
+//
+//  outputs:
+//      int                : "1" means _image points into the (mapped)
+//                           cache file and color.pre_mul and the DNG
+//                           color data of rawdata.color are restored;
+//                           "0" means no valid cache file was found
+
+int AcesRender::loadCache ( const char * path, uint64_t key ) {
+#ifdef C
+#undef C
+#endif
+    
+#define C   _rawProcessor->imgdata.color
+    
+    struct stat st;
+    size_t headerSize = cacheOffset + offsetof ( libraw_processed_image_t, data );
+    
+    if ( stat ( path, &st ) != 0 || size_t ( st.st_size ) < headerSize )
+        return 0;
+    
+    size_t size = size_t ( st.st_size );
+    void * base = nullptr;
+    
+#ifndef WIN32
+    int file = open ( path, O_RDONLY );
+    if ( file < 0 )
+        return 0;
+    
+//  Private, writable mapping: nothing is written back to the file
+    base = mmap ( NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0 );
+    close ( file );
+    
+    if ( base == MAP_FAILED )
+        return 0;
+#else
+    FILE * file = fopen ( path, "rb" );
+    if ( !file )
+        return 0;
+    
+    base = malloc ( size );
+    if ( !base || fread ( base, 1, size, file ) != size ) {
+        free ( base );
+        fclose ( file );
+        
+        return 0;
+    }
+    fclose ( file );
+#endif
+    
+    if ( !validCache ( base, size, key ) ) {
+#ifndef WIN32
+        munmap ( base, size );
+#else
+        free ( base );
+#endif
+        return 0;
+    }
+    
+    releasePixels();
+    _image = reinterpret_cast < libraw_processed_image_t * >
+             ( static_cast < char * > (base) + cacheOffset );
+    _cacheMap = base;
+    _cacheMapSize = size;
+    
+    restoreCacheColor ( *static_cast < const RenderCacheHeader * > (base),
+                        C.pre_mul, _rawProcessor->imgdata.rawdata.color );
+    
+    return 1;
+}
+
+//  =====================================================================
+//  Store the demosaiced image of the current file in a "--cache" file.
+//  The file is written under a temporary name and renamed, so readers
+//  never see a partial file.
+//
+//  inputs:
+//      const char *       : path to the cache file
+//      uint64_t           : the key (see cacheKey())
+//
+//  outputs:
+//      N/A                : a warning is printed if the file cannot be
+//                           written; the conversion goes on
+
+void AcesRender::saveCache ( const char * path, uint64_t key ) const {
+    assert ( _image != nullptr );
+    
+#ifdef C
+#undef C
+#endif
+    
+#define C   _rawProcessor->imgdata.color
+    
+    RenderCacheHeader header;
+    makeCacheHeader ( header, key, _image, C.pre_mul,
+                      _rawProcessor->imgdata.rawdata.color );
+    
+    char temp[1024];
+#ifndef WIN32
+    snprintf ( temp, sizeof(temp), "%s.%d.tmp", path, int ( getpid() ) );
+#else
+    snprintf ( temp, sizeof(temp), "%s.%lu.tmp", path,
+               (unsigned long) GetCurrentProcessId() );
+#endif
+    
+    if ( !writeCache ( temp, header, _image ) || rename ( temp, path ) != 0 ) {
+        fprintf ( stderr, "\nWarning: Cannot write the cache file %s\n", path );
+        remove ( temp );
+    }
+    else if ( _opts.verbosity > 1 )
+        printf ( "Caching the demosaiced image in %s ...\n", path );
+}
+
+//  =====================================================================
+//  Postprocess the RAW file 
+//
+//  inputs:
+//      N/A
+//
+//  outputs:
+//      int                : "1" means raw file successfully pre-processed;
+//                           "0" means error when pre-processing the file
+
+int AcesRender::postprocessRaw ( ) {
+    assert ( _opts.ret == LIBRAW_SUCCESS );
+    
+#ifdef OUT
+#undef OUT
+#endif
+
+#define OUT _rawProcessor->imgdata.params
+#define P  _rawProcessor->imgdata.idata
+#define C   _rawProcessor->imgdata.color
+
+    if ( _opts.verbosity > 1 )
+        printf ( "The camera has been identified as a %s %s ...\n", P.make, P.model );
+    
+    switch ( _opts.wb_method ) {
+    // 0
+        case wbMethod0 : {
+            _opts.use_mul = 1;
+            vector < double > mulV (C.cam_mul, C.cam_mul+3);
+            
+            FORI(3) OUT.user_mul[i] = static_cast<float>(mulV[i]);
+            
+            if ( _opts.verbosity > 1 ) {
+                printf ( "White Balance method is 0 - ");
+                printf ( "Using white balance factors from "
+                         "file metadata ...\n" );
+            }
+            break;
+        }
+        // 1
+        case wbMethod1 : {
+            if ( prepareWB ( _rawProcessor->imgdata.idata ) ) {
+                _opts.use_mul = 1;
+                vector < double > wbv = getWB();
+                FORI(3) OUT.user_mul[i] = static_cast<float>(wbv[i]);
+            }
+            else {
+                fprintf ( stderr, "\nError: Cannot obtain a set of White "
+                                  "Balance Coefficient Factors \n" );
+                _opts.ret = errno;
+                return 0;
+            }
+            
+            if ( _opts.verbosity > 1 ) {
+                printf ( "White Balance calculation method is 1 - ");
+                printf ( "Using white balance factors calculated from "
+                         "spec sens and user specified illuminant ...\n" );
+            }
+            
+            break;
+        }
+        // 2
+        case wbMethod2 : {
+            OUT.use_auto_wb = 1;
+            
+            if ( _opts.verbosity > 1 ) {
+                printf ( "White Balance calculation method is 2 - ");
+                printf ( "Using white balance factors calculate by "
+                        "averaging the entire image ...\n" );
+            }
+            
+            break;
+        }
+        // 3
+        case wbMethod3 : {
+            // measured by greyBoxWB() once the raw data is unpacked
+            FORI(4) OUT.user_mul[i] = 0.0f;
+            
+            if ( _opts.verbosity > 1 ) {
+                printf ( "White Balance calculation method is 3 - ");
+                printf ( "Using white balance factors calculated by "
+                     "averaging a grey box ...\n" );
+            }
+            
+            break;
+        }
+        // 4
+        case wbMethod4 : {
+            _opts.use_mul = 1;
+            double sc = dmax;
+            
+            FORI ( P.colors ){
+                if ( OUT.user_mul[i] <= sc )
+                    sc = OUT.user_mul[i];
+            }
+            
+            if ( sc != 1.0 ) {
+                fprintf ( stderr, "\nWarning: The smallest channel  "
+                                  "multiplier should be 1.0.\n\n" );
+            }
+            
+            if ( _opts.verbosity > 1 ) {
+                printf ( "White Balance calculation method is 4 - ");
+                printf ( "Using user-supplied white balance factors ...\n" );
+            }
+            
+            break;
+        }
+        default: {
+            fprintf ( stderr, "White Balance method is must be 0, 1, 2, 3, "
+                              "or 4 \n" );
+            exit(-1);
+            break;
+        }
+    }
+
+//  Set parameters for --mat-method
+    switch ( _opts.mat_method ) {
+        // 0
+        case matMethod0 : {
+            OUT.output_color = 0;
+            OUT.use_camera_matrix = 0;
+            
+            if ( _opts.verbosity > 1 ) {
+                printf ( "IDT matrix calculation method is 0 - ");
+                printf ( "Calculating IDT matrix using camera spec sens ...\n" );
+            }
+            
+            break;
+        }
+        // 1
+        case matMethod1 :
+            OUT.use_camera_matrix = 3;
+
+            if ( P.dng_version ) {
+                OUT.use_camera_matrix = 1;
+                
+                if ( _opts.verbosity > 1 )
+                    printf ( "DNG file uses embeded color profile. \n ");
+            }
+
+            if ( _opts.verbosity > 1 ) {
+                printf ( "IDT matrix calculation method is 1 - ");
+                printf ( "Calculating IDT matrix using file metadata ...\n" );
+            }
+            
+            break;
+        // 2
+        case matMethod2 :
+            OUT.use_camera_matrix = 1;
+            
+            if ( _opts.verbosity > 1 ) {
+                printf ( "IDT matrix calculation method is 2 - ");
+                printf ( "Calculating IDT matrix using adobe coeffs included in libraw ...\n" );
+            }
+            
+            break;
+        default:
+            fprintf ( stderr, "IDT matrix calculation method is must be 0, 1, 2 \n" );
+            exit(-1);
+            break;
+    }
+
+//  Variants apply their own IDT matrices to the camera RGB image
+    if ( _opts.variants.size() ) {
+        OUT.output_color = 0;
+        OUT.use_camera_matrix = 0;
+    }
+
+// Set four_color_rgb to 0 when half_size is set to 1
+    if ( OUT.half_size == 1 )
+         OUT.four_color_rgb = 0;
+    
+    if ( P.dng_version && OUT.output_color != 0 ) {
+        OUT.use_camera_matrix = 1;
+        OUT.use_camera_wb     = 1;
+    }
+    
+    libraw_processed_image_t * image = nullptr;
+    char cacheFile[1024];
+    uint64_t key = 0;
+    int cached = 0;
+    
+    if ( _inputHash ) {
+        key = cacheKey();
+        snprintf ( cacheFile, sizeof(cacheFile), "%s/%016llx.rtc",
+                   _opts.cache_dir, (unsigned long long) key );
+        
+        if (( cached = loadCache ( cacheFile, key ) )) {
+            if ( _opts.verbosity > 1 )
+                printf ( "Using the demosaiced image cached in %s ...\n", cacheFile );
+        }
+        else if ( _pendingUnpack ) {
+            _pendingUnpack = 0;
+            if ( unpack ( _pathToRaw ? _pathToRaw : "<memory buffer>" ) != LIBRAW_SUCCESS )
+                return _opts.ret;
+        }
+    }
+    
+    if ( !cached && _opts.wb_method == wbMethod3 && !greyBoxWB() ) {
+        _opts.ret = LIBRAW_UNSPECIFIED_ERROR;
+        return _opts.ret;
+    }
+    
+    if ( !cached && _opts.preview_mode != previewMode0 )
+        image = fastPreview ( );
+    
+    if ( !cached && image == nullptr )
+        _opts.ret = dcraw();
+    
+    if ( _opts.mat_method == matMethod0 && !_opts.variants.size() )
+        if ( !prepareIDT ( P, C.pre_mul ) )
+            _opts.ret = errno;
+    
+    if ( cached )
+        return _opts.ret;
+
+    if ( image == nullptr )
+        image = _rawProcessor->dcraw_make_mem_image ( &(_opts.ret) );
+    setPixels (image);
+    
+    if ( key && image != nullptr && _opts.ret == LIBRAW_SUCCESS )
+        saveCache ( cacheFile, key );
+    
+    return _opts.ret;
+}
+
+//	=====================================================================
+//	Render ACES Buffer
+//
+//	inputs:
+//      double     : factor folded into the last matrix ( floatScale()
+//                   for the float EXR output, 1.0 otherwise )
+//
+//	outputs:
+//      N/A        : either call renderIDT() or renderDNG()
+//                   or renderNonDNG()
+
+float * AcesRender::renderACES ( double scale ) {
+#ifdef P
+#undef P
+#endif
+    
+#define P _rawProcessor->imgdata.idata
+    
+    if ( !_rawProcessor->imgdata.params.output_color )
+        return renderIDT ( scale );
+    else {
+        if ( P.dng_version )
+            return renderDNG ( scale );
+        else
+            return renderNonDNG ( scale );
+    }
+}
+
+//	=====================================================================
+//	Write rendered ACES Buffer into an OpenEXR Image File
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//      int        : "1" means the ACES file has been written;
+//                   "0" means error or interruption
+
+int AcesRender::outputACES ( ) {
+#ifdef C
+#undef C
+#endif
+
+#define C   _rawProcessor->imgdata.color
+    
+    assert ( _pathToRaw != nullptr );
+    char * cp;
+    if (( cp = strrchr ( _pathToRaw, '.' ))) *cp = 0;
+    
+    char outfn[1024];
+    snprintf( outfn, sizeof(outfn), "%s",
+              outputName ( _pathToRaw, _opts.out_format ).c_str() );
+    
+    // "--band-rows": render and write a band at a time
+    int banded = _opts.band_rows > 0 && size_t(_opts.band_rows) < _image->height;
+    vector < vector < vector < double > > > matrices;
+    float * aces = nullptr;
+    
+    // the float EXR output is scaled by the last render matrix
+    double scale = _opts.out_format == outFormat0 ? 1.0
+                                                  : floatScale ( getHighlightRatio() );
+    
+    if ( banded )
+        matrices = renderMatrices ( scale );
+    else
+        aces = renderACES ( scale );
+    
+    if ( interrupted() ) {
+        _abandoned = 1;
+        delete [] aces;
+        recycle();
+        
+        return 0;
+    }
+    
+    if ( !banded && !aces ) {
+        fprintf ( stderr, "\nError: Cannot allocate the ACES buffer of %s\n", outfn );
+        recycle();
+        
+        return 0;
+    }
+    
+    if ( _opts.verbosity > 1 ) {
+        if ( _opts.mat_method && !P.dng_version ) {
+            vector < vector < double > > camXYZ(3, vector< double >(3, 1.0));
+            FORIJ (3,3) camXYZ[i][j] = C.cam_xyz[i][j];
+            vector < vector < double > > camcat = mulVector (camXYZ, _catm);
+            
+            printf ("The Approximate IDT matrix is ...\n");
+            FORI (3) printf ("   %f, %f, %f\n", camcat[i][0], camcat[i][1], camcat[i][2]);
+        }
+        // printing white balance coefficients
+        printf ("The final white balance coefficients are ...\n");
+        printf ("   %f   %f   %f\n", C.pre_mul[0], C.pre_mul[1], C.pre_mul[2]);
+        printf ( "Writing ACES file to %s ...\n", outfn );
+    }
+    
+    int written;
+    if ( banded )
+        written = outputBands ( outfn, matrices );
+    else if ( _opts.out_format == outFormat0 )
+        written = acesWrite ( outfn, aces, getHighlightRatio() );
+    else
+        written = exrWrite ( outfn, aces, getHighlightRatio() );
+    delete [] aces;
+    
+    recycle();
+
+    if ( written && _opts.verbosity ) printf ("Finished\n\n");
+    
+    return written;
+}
+
+//	=====================================================================
+//	Matrices that renderACES() applies to the camera values, in order,
+//  for the band-wise output of "--band-rows". _idtm and _catm are set
+//  as by renderIDT(), renderDNG() or renderNonDNG().
+//
+//	inputs:
+//      double     : factor folded into the last matrix
+//
+//	outputs:
+//      vector < vector < vector < double > > > : channels x channels
+//                                                matrices
+
+vector < vector < vector < double > > > AcesRender::renderMatrices ( double scale ) {
+#ifdef P
+#undef P
+#endif
+    
+#define P _rawProcessor->imgdata.idata
+    
+    assert ( _image );
+    
+    int channels = _image->colors;
+    if ( channels != 3 && channels != 4 ) {
+        fprintf ( stderr, "\nError: Currenly support 3 channels "
+                          "and 4 channels. \n" );
+        exit (1);
+    }
+    
+    vector < vector < vector < double > > > matrices;
+    
+    if ( !_rawProcessor->imgdata.params.output_color )
+        matrices.push_back ( _idtm );
+    else if ( P.dng_version ) {
+        DNGIdt dng ( _rawProcessor->imgdata.rawdata );
+        _catm = dng.getDNGCATMatrix();
+        _idtm = dng.getDNGIDTMatrix();
+        matrices.push_back ( _idtm );
+    }
+    else {
+        if ( _opts.mat_method > 0 ) {
+            vector < double > dIV ( d50, d50 + 3 );
+            vector < double > dOV ( d60, d60 + 3 );
+            _catm = getCAT ( dIV, dOV );
+            matrices.push_back ( _catm );
+        }
+        
+        vector < vector < double > > XYZ_acesrgb ( channels, vector < double > ( channels ) );
+        if ( channels == 3 )
+            FORIJ(3, 3) XYZ_acesrgb[i][j] = XYZ_acesrgb_3[i][j];
+        else
+            FORIJ(4, 4) XYZ_acesrgb[i][j] = XYZ_acesrgb_4[i][j];
+        matrices.push_back ( XYZ_acesrgb );
+    }
+    
+    // the 4th channel passes through, as in applyIDT()
+    FORI ( matrices.size() ) {
+        if ( channels == 4 && matrices[i].size() == 3 ) {
+            matrices[i].resize ( 4, vector < double > ( 4, 0.0 ) );
+            FORJ ( 3 ) matrices[i][j].resize ( 4, 0.0 );
+            matrices[i][3][3] = 1.0;
+        }
+    }
+    
+    FORI ( matrices.back().size() )
+        scaleVector ( matrices.back()[i], scale );
+    
+    return matrices;
+}
+
+//	=====================================================================
+//	Render the ACES values of a band of rows of the processed image
+//
+//	inputs:
+//      vector < vector < vector < double > > > : from renderMatrices()
+//      size_t     : first row of the band
+//      size_t     : number of rows
+//      float *    : rows * width * colors values
+//
+//	outputs:
+//      N/A        : the band is filled
+
+void AcesRender::renderRows ( const vector < vector < vector < double > > > & matrices,
+                              size_t first,
+                              size_t rows,
+                              float * aces ) const {
+    assert ( _image && aces );
+    
+    uint8_t channels = _image->colors;
+    size_t rowSize = size_t(channels) * _image->width;
+    const ushort * pixels = (const ushort *) _image->data + first * rowSize;
+    
+    forBands ( rows, rowSize, [&] ( size_t begin, size_t end ) {
+        for ( size_t i = begin; i < end; i++ )
+            aces[i] = static_cast < float > (pixels[i]);
+        
+        FORI ( matrices.size() )
+            mulVectorArray ( aces + begin, end - begin, channels, matrices[i] );
+    } );
+}
+
+//	=====================================================================
+//	Write the ACES file of the current image "--band-rows" rows at a
+//  time: only one band of float values is held besides the processed
+//  image, instead of the float and half copies of the whole frame
+//
+//	inputs:
+//      const char *   : the name of output file
+//      vector < vector < vector < double > > > : from renderMatrices()
+//
+//	outputs:
+//      int            : "1" means the ACES file has been written;
+//                       "0" means error or interruption
+
+int AcesRender::outputBands ( const char * name,
+                              const vector < vector < vector < double > > > & matrices ) {
+    size_t band = size_t(_opts.band_rows);
+    size_t rowSize = size_t(_image->colors) * _image->width;
+    
+    float * aces = new (std::nothrow) float[band * rowSize];
+    if ( !aces ) {
+        fprintf ( stderr, "\nError: Cannot allocate the band buffer of %s\n", name );
+        return 0;
+    }
+    
+    RowSource source = [&] ( size_t first, size_t rows ) -> float * {
+        if ( interrupted() ) {
+            _abandoned = 1;
+            return nullptr;
+        }
+        
+        renderRows ( matrices, first, rows, aces );
+        return aces;
+    };
+    
+    int written;
+    if ( _opts.out_format == outFormat0 )
+        written = acesWriteRows ( name, getHighlightRatio(), band, source );
+    else
+        written = exrWriteRows ( name, getHighlightRatio(), band, source );
+    
+    delete [] aces;
+    
+    return written;
+}
+
+//	=====================================================================
+//	Render ACES values into a buffer in memory instead of a file
+//
+//	inputs:
+//      AcesBuffer &  : out.type selects half or float pixels; if out.data
+//                      is nullptr the buffer is allocated with malloc(),
+//                      otherwise out.size holds its capacity in bytes
+//
+//	outputs:
+//      int           : "1" means out has been filled with interleaved
+//                      pixels (out.size set to the bytes written) and
+//                      metadata; "0" means error
+
+int AcesRender::outputACES ( AcesBuffer & out ) {
+#ifdef C
+#undef C
+#endif
+    
+#define C   _rawProcessor->imgdata.color
+    
+    assert ( _image != nullptr );
+    
+    float * aces = renderACES();
+    if ( !aces ) {
+        fprintf ( stderr, "\nError: Cannot allocate the ACES buffer\n" );
+        recycle();
+        
+        return 0;
+    }
+    
+    size_t total = size_t(_image->width) * _image->height * _image->colors;
+    size_t bytes = total * ( out.type == pixelHalf ? sizeof ( halfBytes )
+                                                   : sizeof ( float ) );
+    
+    out.allocated = 0;
+    if ( out.data == nullptr ) {
+        if ( !( out.data = malloc ( bytes ) ) ) {
+            fprintf ( stderr, "\nError: Cannot allocate %lu bytes for the "
+                              "output buffer\n", (unsigned long) bytes );
+            delete [] aces;
+            recycle();
+            
+            return 0;
+        }
+        out.allocated = 1;
+    }
+    else if ( out.size < bytes ) {
+        fprintf ( stderr, "\nError: The output buffer is too small "
+                          "(%lu bytes needed)\n", (unsigned long) bytes );
+        out.size = bytes;
+        delete [] aces;
+        recycle();
+        
+        return 0;
+    }
+    
+    out.size = bytes;
+    double sc = getOutputScale ( getHighlightRatio() );
+    
+    if ( out.type == pixelHalf )
+        scaleToHalf ( aces, static_cast < halfBytes * > (out.data),
+                      total, static_cast < float > (sc) );
+    else {
+        float * dst = static_cast < float * > (out.data);
+        for ( size_t i = 0; i < total; i++ )
+            dst[i] = static_cast < float > ( aces[i] * sc );
+    }
+    
+    out.width      = _image->width;
+    out.height     = _image->height;
+    out.channels   = _image->colors;
+    out.dngVersion = P.dng_version;
+    snprintf ( out.make, sizeof(out.make), "%s", P.make );
+    snprintf ( out.model, sizeof(out.model), "%s", P.model );
+    FORI(3) out.wb[i] = C.pre_mul[i];
+    FORIJ(3, 3) out.idt[i][j] = _idtm[i][j];
+    
+    delete [] aces;
+    recycle();
+    
+    return 1;
+}
+
+//	=====================================================================
+//	Write one ACES file per "--variant" from the decoded image. The IDT
+//  matrices are calculated first, then the files are rendered and
+//  written by "--threads" workers. The variants of a file are written
+//  all or none: on an error or an interruption the ones already
+//  written are removed, and their digests are only recorded at the end.
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//      int        : "1" means every variant has been written;
+//                   "0" means error or interruption
+
+int AcesRender::outputVariants ( ) {
+    assert ( _pathToRaw != nullptr && _image != nullptr );
+    
+    char * cp;
+    if (( cp = strrchr ( _pathToRaw, '.' ))) *cp = 0;
+    
+    vector < VariantJob > jobs;
+    int failed = 0;
+    FORI ( _opts.variants.size() ) {
+        const outputVariant & variant = _opts.variants[i];
+        VariantJob job;
+        
+        char outfn[1024];
+        snprintf ( outfn, sizeof(outfn), "%s",
+                   outputName ( _pathToRaw, _opts.out_format, int(i) + 1 ).c_str() );
+        
+        if ( !variantIDT ( variant, job.idt ) ) {
+            fprintf ( stderr, "\nError: Cannot calculate the IDT matrix of "
+                              "variant %d; %s is not written\n", i + 1, outfn );
+            failed = 1;
+            continue;
+        }
+        
+        job.name  = outfn;
+        job.ratio = getHighlightRatio() * variant.scale / _opts.scale;
+        
+        if ( _opts.verbosity > 1 ) {
+            printf ( "The IDT matrix of variant %d is ...\n", i + 1 );
+            FORJ (3) printf ( "   %f, %f, %f\n", job.idt[j][0],
+                              job.idt[j][1], job.idt[j][2] );
+        }
+        
+        jobs.push_back ( job );
+    }
+    
+    size_t next = 0;
+    std::mutex mtx;
+    
+    int threads = _opts.threads;
+    if ( threads <= 0 )
+        threads = std::max ( 1, int(std::thread::hardware_concurrency()) );
+    if ( size_t(threads) > jobs.size() )
+        threads = std::max ( 1, int(jobs.size()) );
+    
+    vector < std::pair < string, uint64_t > > digests;
+    if ( _opts.manifest )
+        _heldDigests = &digests;
+    
+    vector < std::thread > workers;
+    FORI ( threads - 1 )
+        workers.push_back ( std::thread ( &AcesRender::variantWorker, this,
+                                          std::cref(jobs), &next, &mtx, &failed ) );
+    
+    variantWorker ( jobs, &next, &mtx, &failed );
+    
+    FORI ( workers.size() )
+        workers[i].join();
+    
+    _heldDigests = nullptr;
+    recycle();
+    
+    if ( failed || _abandoned ) {
+        FORI ( jobs.size() ) {
+            remove ( jobs[i].name.c_str() );
+            if ( _opts.use_stats )
+                remove ( statsName ( jobs[i].name ).c_str() );
+        }
+        
+        return 0;
+    }
+    
+    FORI ( digests.size() )
+        recordDigest ( digests[i].first.c_str(), digests[i].second );
+    
+    if ( _opts.verbosity ) printf ("Finished\n\n");
+    
+    return 1;
+}
+
+//	=====================================================================
+//	Calculate the IDT matrix of a "--variant" for the camera RGB image
+//
+//	inputs:
+//      outputVariant &  : the variant
+//
+//	outputs:
+//      int              : "1" means idt is filled with the matrix to be
+//                         applied to _image; "0" means error
+
+int AcesRender::variantIDT ( const outputVariant & variant,
+                             vector < vector < double > > & idt ) {
+#ifdef P
+#undef P
+#endif
+#ifdef C
+#undef C
+#endif
+    
+#define P _rawProcessor->imgdata.idata
+#define C _rawProcessor->imgdata.color
+    
+    vector < vector < double > > M;
+    
+    if ( variant.mat_method == matMethod0 ) {
+        char * illumType = _opts.illumType;
+        _opts.illumType = variant.illumType;
+        int read = prepareIDT ( P, C.pre_mul );
+        _opts.illumType = illumType;
+        
+        if ( !read )
+            return 0;
+        
+        //  The image is white balanced with color.pre_mul; move it to the
+        //  white balance of this adopted white (keeping green unchanged)
+        vector < double > correct ( 3, 1.0 );
+        FORI(3) {
+            if ( C.pre_mul[i] <= 0.0 )
+                return 0;
+            correct[i] = _wbv[i] / C.pre_mul[i];
+        }
+        scaleVector ( correct, 1.0 / correct[1] );
+        
+        vector < vector < double > > idtm ( 3, vector < double > ( 3 ) );
+        FORIJ(3, 3) idtm[i][j] = _idtm[i][j];
+        M = mulVector ( idtm, diagVM ( correct ) );
+    }
+    else if ( variant.mat_method == matMethod1 && P.dng_version ) {
+        DNGIdt dng ( _rawProcessor->imgdata.rawdata );
+        M = dng.getDNGIDTMatrix();
+    }
+    else {
+        //  As "--mat-method 1/2" through libraw: camera RGB to linear sRGB
+        //  (the embedded matrix for 1, if there is one), then to XYZ,
+        //  adapted from D50 to D60, and to ACES
+        int embedded = ( variant.mat_method == matMethod1
+                         && C.cmatrix[0][0] > 0.125 );
+        
+        vector < vector < double > > rgbCam ( 3, vector < double > ( 3 ) );
+        vector < vector < double > > rgbXYZ ( 3, vector < double > ( 3 ) );
+        vector < vector < double > > XYZaces ( 3, vector < double > ( 3 ) );
+        FORIJ(3, 3) {
+            rgbCam[i][j]  = embedded ? C.cmatrix[i][j] : C.rgb_cam[i][j];
+            rgbXYZ[i][j]  = srgb_XYZ_3[i][j];
+            XYZaces[i][j] = XYZ_acesrgb_3[i][j];
+        }
+        
+        vector < double > dIV ( d50, d50 + 3 );
+        vector < double > dOV ( d60, d60 + 3 );
+        
+        M = mulVector ( rgbXYZ, transposeVec ( rgbCam ) );
+        M = mulVector ( getCAT ( dIV, dOV ), transposeVec ( M ) );
+        M = mulVector ( XYZaces, transposeVec ( M ) );
+    }
+    
+    if ( _image->colors == 4 ) {
+        idt.assign ( 4, vector < double > ( 4, 0.0 ) );
+        FORIJ(3, 3) idt[i][j] = M[i][j];
+        idt[3][3] = 1.0;
+    }
+    else
+        idt = M;
+    
+    return 1;
+}
+
+//	=====================================================================
+//	Worker of outputVariants(): renders and writes variants until none
+//  is left
+//
+//	inputs:
+//      vector < VariantJob > : the variants to be written
+//      size_t *              : index of the next variant
+//      std::mutex *          : guards the index, the error flag and stdout
+//
+//	outputs:
+//      int *                 : set to "1" if a variant is not written
+
+void AcesRender::variantWorker ( const vector < VariantJob > & jobs,
+                                 size_t * next,
+                                 std::mutex * mtx,
+                                 int * failed ) const {
+    const ushort * pixels = ( const ushort * ) _image->data;
+    size_t total = size_t(_image->width) * _image->height * _image->colors;
+    
+    while ( 1 ) {
+        size_t i;
+        
+        mtx->lock();
+        i = (*next)++;
+        mtx->unlock();
+        
+        if ( i >= jobs.size() )
+            break;
+        if ( interrupted() ) {
+            _abandoned = 1;
+            break;
+        }
+        
+        float * aces = new (std::nothrow) float[total];
+        if ( !aces ) {
+            fprintf ( stderr, "\nError: Cannot allocate the ACES buffer "
+                              "of %s\n", jobs[i].name.c_str() );
+            mtx->lock();
+            *failed = 1;
+            mtx->unlock();
+            continue;
+        }
+        
+        // the float EXR output is scaled by the IDT matrix
+        vector < vector < double > > idt = jobs[i].idt;
+        if ( _opts.out_format != outFormat0 )
+            FORJ ( idt.size() )
+                scaleVector ( idt[j], floatScale ( jobs[i].ratio ) );
+        
+        for ( size_t j = 0; j < total; j++ )
+            aces[j] = static_cast < float > ( pixels[j] );
+        mulVectorArray ( aces, total, _image->colors, idt );
+        
+        if ( _opts.verbosity > 1 ) {
+            mtx->lock();
+            printf ( "Writing ACES file to %s ...\n", jobs[i].name.c_str() );
+            mtx->unlock();
+        }
+        
+        int written;
+        if ( _opts.out_format == outFormat0 )
+            written = acesWrite ( jobs[i].name.c_str(), aces, jobs[i].ratio );
+        else
+            written = exrWrite ( jobs[i].name.c_str(), aces, jobs[i].ratio );
+        
+        delete [] aces;
+        
+        if ( !written ) {
+            mtx->lock();
+            *failed = 1;
+            mtx->unlock();
+        }
+    }
+}
+
+//	=====================================================================
+//	Release the resources of the current RAW file so that the
+//  instance can process the next one
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//      N/A        : mmap-ed input released and libraw recycled
+
+void AcesRender::recycle ( ) {
+#ifndef WIN32
+    if ( _opts.use_mmap && _opts.iobuffer )
+    {
+        munmap ( _opts.iobuffer, size_t(_opts.msize) );
+        _opts.iobuffer = 0;
+    }
+#endif
+    
+    _rawProcessor->recycle();
+    
+    // the prefetched file is owned by the stream, not by libraw
+    if ( _stream ) {
+        delete _stream;
+        _stream = nullptr;
+    }
+}
+
+//	=====================================================================
+//  Apply white balance values to each pixel
+//  ( We actually do not need it here because white-balancing
+//  happens before demosaicing )
+//
+//	inputs:
+//      float *          : pixels (R/G/B)
+//      uint8_t          : number of channels
+//      size_t           : the size of pixels
+//
+//	outputs:
+//		N/A              : pixel values modified by multiplying
+//                         white balance coefficients
+
+void AcesRender::applyWB ( float * pixels, int bits, size_t total )
+{
+    double min_wb = * min_element ( _wbv.begin(), _wbv.end() );
+    double target = 1.0;
+    
+    if ( bits == 8 )
+        target /= INV_255;
+    else if ( bits == 16 )
+        target /= INV_65535;
+    
+    if ( !pixels ) {
+        fprintf ( stderr, "\nThe pixels cannot be found. \n" );
+        exit (1);
+    }
+    else {
+        for ( size_t i = 0; i < total; i+=3 ){
+            pixels[i]   = clip (_wbv[0] * pixels[i] / min_wb, target);
+            pixels[i+1] = clip (_wbv[1] * pixels[i+1] / min_wb, target);
+            pixels[i+2] = clip (_wbv[2] * pixels[i+2] / min_wb, target);
+        }
+    }
+}
+
+//	=====================================================================
+//  Apply IDT matrix to each pixel
+//
+//	inputs:
+//      float *   : pixels (R/G/B)
+//      uint8_t   : number of channels
+//      size_t    : the size of pixels
+//      double    : factor applied with the matrix (_idtm is unchanged)
+//
+//	outputs:
+//		N/A       : pixel values modified by mutiplying IDT matrix
+
+void AcesRender::applyIDT ( float * pixels, int channel, size_t total, double scale )
+{
+    assert(pixels);
+    
+    if ( channel == 4 ){
+        _idtm.resize(4);
+        FORI(4) _idtm[i].resize(4);
+        
+        _idtm[0][3] = 0.0;
+        _idtm[1][3] = 0.0;
+        _idtm[2][3] = 0.0;
+        _idtm[3][0] = 0.0;
+        _idtm[3][1] = 0.0;
+        _idtm[3][2] = 0.0;
+        _idtm[3][3] = 1.0;
+    }
+    
+    if ( channel != 3 && channel != 4 ) {
+        fprintf ( stderr, "\nError: Currenly support 3 channels "
+                          "and 4 channels. \n" );
+        exit (1);
+    }
+    
+    vector < vector < double > > idtm = _idtm;
+    if ( scale != 1.0 )
+        FORI ( idtm.size() ) scaleVector ( idtm[i], scale );
+    
+    size_t rows = _image ? _image->height : 1;
+    if ( total % ( rows * channel ) )
+        rows = 1;
+    
+    forBands ( rows, total / rows, [&] ( size_t first, size_t last ) {
+        mulVectorArray ( pixels + first, last - first, channel, idtm );
+    } );
+}
+
+//	=====================================================================
+//  Apply CAT matrix (e.g., D50 to D60) to each pixel
+//  It will be used if using adobe coeffs from "libraw"
+//
+//	inputs:
+//      float *   : pixels (R/G/B)
+//      uint8_t   : number of channels
+//      size_t    : the size of pixels
+//
+//	outputs:
+//		N/A       : pixel values modified by mutiplying CAT matrix
+
+void AcesRender::applyCAT ( float * pixels, int channel, size_t total )
+{
+    assert(pixels);
+    
+    if ( channel != 3 && channel != 4 ) {
+        fprintf ( stderr, "\nError: Currenly support 3 channels "
+                 "and 4 channels. \n" );
+        exit (1);
+    }
+    
+    // will use calCAT() inside rawtoaces
+    vector < double > dIV (d50, d50 + 3);
+    vector < double > dOV (d60, d60 + 3);
+    _catm = getCAT(dIV, dOV);
+
+    size_t rows = _image ? _image->height : 1;
+    if ( total % ( rows * channel ) )
+        rows = 1;
+    
+    forBands ( rows, total / rows, [&] ( size_t first, size_t last ) {
+        mulVectorArray ( pixels + first, last - first, channel, _catm );
+    } );
+}
+
+//	=====================================================================
+//  Convert DNG RAW to aces file
+//
+//	inputs:
+//      double  : factor folded into the IDT matrix
+//
+//	outputs:
+//		float * : an array of converted aces values
+
+float * AcesRender::renderDNG ( double scale )
+{
+#ifdef P
+#undef P
+#endif
+
+#define P _rawProcessor->imgdata.idata
+
+    assert ( _image && P.dng_version );
+    
+    DNGIdt * dng = new DNGIdt ( _rawProcessor->imgdata.rawdata );
+    _catm = dng->getDNGCATMatrix();
+    _idtm = dng->getDNGIDTMatrix();
+    
+   if ( _opts.verbosity > 1 ) {
+        printf("The Approximate IDT matrix is ...\n");
+        FORI(3) printf("   %f, %f, %f\n", _idtm[i][0], _idtm[i][1], _idtm[i][2]);
+    }
+        
+    ushort * pixels = (ushort *) _image->data;
+    size_t total = size_t(_image->width) * _image->height * _image->colors;
+    float * aces = new  (std::nothrow) float[total];
+    forBands ( _image->height, total / _image->height, [&] ( size_t first, size_t last ) {
+        for ( size_t i = first; i < last; i++ )
+            aces[i] = static_cast < float > (pixels[i]);
+    } );
+
+    if ( _opts.verbosity > 1 )
+        printf ( "Applying IDT Matrix ...\n" );
+    
+    applyIDT ( aces, _image->colors, total, scale );
+    delete dng;
+    
+    return aces;
+}
+
+//	=====================================================================
+//  Convert Non-DNG RAW to aces file (no IDT involved)
+//
+//	inputs:
+//      double  : factor folded into the XYZ to ACES matrix
+//
+//	outputs:
+//		float * : an array of converted aces code values
+
+float * AcesRender::renderNonDNG ( double scale )
+{
+    assert(_image);
+
+    ushort * pixels = (ushort *) _image->data;
+    size_t total = size_t(_image->width) * _image->height * _image->colors;
+    float * aces = new (std::nothrow) float[total];
+    
+    forBands ( _image->height, total / _image->height, [&] ( size_t first, size_t last ) {
+        for ( size_t i = first; i < last; i++ )
+            aces[i] = static_cast <float> (pixels[i]);
+    } );
+    
+    if( _opts.mat_method > 0 ) {
+        applyCAT(aces, _image->colors, total);
+    }
+    
+    vector < vector< double> > XYZ_acesrgb( _image->colors,
+                                            vector < double > (_image->colors));
+    if ( _image->colors == 3 )
+        FORIJ(3, 3) XYZ_acesrgb[i][j] = XYZ_acesrgb_3[i][j];
+    else if ( _image->colors == 4 )
+        FORIJ(4, 4) XYZ_acesrgb[i][j] = XYZ_acesrgb_4[i][j];
+    else {
+        fprintf ( stderr, "\nError: Currenly support 3 channels "
+                          "and 4 channels. \n" );
+        exit (1);
+    }
+    
+    FORI ( XYZ_acesrgb.size() ) scaleVector ( XYZ_acesrgb[i], scale );
+    
+    uint8_t channels = _image->colors;
+    forBands ( _image->height, total / _image->height, [&] ( size_t first, size_t last ) {
+        mulVectorArray ( aces + first, last - first, channels, XYZ_acesrgb );
+    } );
+    
+    return aces;
+}
+
+//	=====================================================================
+//  Convert Non-DNG RAW to aces file through IDT
+//
+//	inputs:
+//      double  : factor folded into the IDT matrix
+//
+//	outputs:
+//		float * : an array of aces values for each pixel
+
+float * AcesRender::renderIDT ( double scale )
+{
+    assert (_image);
+    ushort * pixels = ( ushort * ) _image->data;
+    size_t total = size_t(_image->width) * _image->height * _image->colors;
+    float * aces = new (std::nothrow) float[total];
+    
+    forBands ( _image->height, total / _image->height, [&] ( size_t first, size_t last ) {
+        for ( size_t i = first; i < last; i++ )
+            aces[i] = static_cast <float> (pixels[i]);
+    } );
+
+    if ( _opts.verbosity > 1 )
+    	printf ( "Applying IDT Matrix ...\n" );
+    
+    applyIDT ( aces, _image->colors, total, scale );
+    
+    return aces;
+};
+
+//	=====================================================================
+//  Write processed image file to an aces-compliant openexr file
+//
+//	inputs:
+//      const char *               : the name of output file
+//      float *                    : an array of converted aces values
+//
+//	outputs:
+//		int                        : "1" means the aces file has been
+//                                   written; "0" means error
+
+int AcesRender::acesWrite ( const char * name, float *  aces, float ratio ) const
+{
+    assert(aces);
+    
+    size_t rowSize = size_t(_image->colors) * _image->width;
+    return acesWriteRows ( name, ratio, _image->height,
+                    [&] ( size_t first, size_t ) { return aces + first * rowSize; } );
+}
+
+//	=====================================================================
+//  Write an ACES container file band by band: "source" renders (or
+//  points to) the ACES values of "band" rows at a time, which are
+//  converted to half before the next band is requested. With the name
+//  "-" the file goes to the standard output through a temporary file
+//  next to the raw file; with "--manifest" the written file is read
+//  back and hashed, as aces_Writer only writes to a named file.
+//
+//	inputs:
+//      const char *  : the name of output file
+//      float         : highlight ratio
+//      size_t        : rows per band
+//      RowSource     : ACES values of rows [first, first+rows)
+//                      (may be scaled in place)
+//
+//	outputs:
+//		int           : "1" means the aces file has been written;
+//                      "0" means error or interruption ( nothing is
+//                      left on disk )
+
+int AcesRender::acesWriteRows ( const char * name,
+                                 float ratio,
+                                 size_t band,
+                                 const RowSource & source ) const
+{
+    uint32_t width     = _image->width;
+    uint32_t height    = _image->height;
+    uint8_t  channels  = _image->colors;
+    uint8_t  bits      = _image->bits;
+    size_t   rowSize   = size_t(channels) * width;
+    
+    band = std::max ( size_t(1), std::min ( band, size_t(height) ) );
+    
+    float sc = ( bits == 8 || bits == 16 ) ? getOutputScale ( ratio ) : 1.0;
+    
+    int toStdout = !strcmp ( name, "-" );
+    string output = toStdout ? outputName ( outputStem ( _pathToRaw ), outFormat0 )
+                             : string ( name );
+    string path = output;
+    
+    if ( toStdout ) {
+        char pid[32];
+#ifndef WIN32
+        snprintf ( pid, sizeof(pid), ".%d.tmp", int ( getpid() ) );
+#else
+        snprintf ( pid, sizeof(pid), ".%lu.tmp", (unsigned long) GetCurrentProcessId() );
+#endif
+        path += pid;
+    }
+    
+    halfBytes * halfIn = new (std::nothrow) halfBytes[band * rowSize];
+    if ( !halfIn ) {
+        fprintf ( stderr, "\nError: Cannot allocate the half buffer of %s\n", name );
+        return 0;
+    }
+    
+    vector < std::string > filenames;
+    filenames.push_back(path);
+    
+    aces_Writer x;
+    
+    MetaWriteClip writeParams;
+    
+    writeParams.duration				= 1;
+    writeParams.outputFilenames			= filenames;
+    
+    writeParams.outputRows				= height;
+    writeParams.outputCols				= width;
+    
+    writeParams.hi = x.getDefaultHeaderInfo();
+    writeParams.hi.originalImageFlag	= 1;
+    writeParams.hi.software				= "rawtoaces v0.1";
+    
+    writeParams.hi.channels.clear();
+    
+    switch (channels)
+    {
+        case 3:
+            writeParams.hi.channels.resize(3);
+            writeParams.hi.channels[0].name = "B";
+            writeParams.hi.channels[1].name = "G";
+            writeParams.hi.channels[2].name = "R";
+            break;
+        case 4:
+            writeParams.hi.channels.resize(4);
+            writeParams.hi.channels[0].name = "A";
+            writeParams.hi.channels[1].name = "B";
+            writeParams.hi.channels[2].name = "G";
+            writeParams.hi.channels[3].name = "R";
+            break;
+        case 6:
+            throw std::invalid_argument ( "Stereo RGB support not yet implemented" );
+        case 8:
+            throw std::invalid_argument ( "Stereo RGB support not yet implemented" );
+        default:
+            throw std::invalid_argument ( "Only RGB, RGBA or"
+                                          "stereo RGB[A] file supported" );
+            break;
+    }
+    
+    DynamicMetadata dynamicMeta;
+    dynamicMeta.imageIndex = 0;
+    dynamicMeta.imageCounter = 0;
+    
+    x.configure ( writeParams );
+    x.newImageObject ( dynamicMeta );
+    
+    ImageStats * stats = nullptr;
+    if ( _opts.use_stats )
+        stats = new ImageStats ( channels, float ( _opts.scale * ratio ) );
+    
+    for ( size_t first = 0; first < height; first += band ) {
+        size_t rows = std::min ( band, height - first );
+        float * aces = source ( first, rows );
+        
+        // interrupted: the file is not saved
+        if ( !aces ) {
+            delete [] halfIn;
+            delete stats;
+            return 0;
+        }
+        
+        forBands ( rows, rowSize, [&] ( size_t begin, size_t end ) {
+            if ( !stats ) {
+                scaleToHalf ( aces + begin, halfIn + begin, end - begin, sc );
+                return;
+            }
+            
+            stats->scale ( aces, begin, end, sc, [&] ( size_t first, size_t last ) {
+                scaleToHalf ( aces + first, halfIn + first, last - first, sc );
+            } );
+        } );
+        
+        for ( size_t i = 0; i < rows; i++ )
+            x.storeHalfRow ( halfIn + rowSize * i, uint32_t ( first + i ) );
+    }
+    
+#if 0
+    std::cout << "saving aces file" << std::endl;
+    std::cout << "size " << width << "x" << height << "x"
+              << channels << std::endl;
+    std::cout << "size " << writeParams.outputCols << "x"
+              << writeParams.outputRows << std::endl;
+    std::cout << "duration " << writeParams.duration << std::endl;
+    std::cout << writeParams.hi;
+    std::cout << "\ndynamic meta" << std::endl;
+    std::cout << "imageIndex " << dynamicMeta.imageIndex << std::endl;
+    std::cout << "imageCounter " << dynamicMeta.imageCounter << std::endl;
+    std::cout << "timeCode " << dynamicMeta.timeCode << std::endl;
+    std::cout << "keyCode " << dynamicMeta.keyCode << std::endl;
+    std::cout << "capDate " << dynamicMeta.capDate << std::endl;
+    std::cout << "uuid " << dynamicMeta.uuid << std::endl;
+#endif
+    
+    delete [] halfIn;
+    
+    const char * error = nullptr;
+    uint64_t digest = 0;
+    
+    try
+    {
+        x.saveImageObject ( );
+    }
+    catch ( std::exception const & e )
+    {
+        fprintf ( stderr, "\nError: Cannot write %s: %s\n", name, e.what() );
+        remove ( path.c_str() );
+        delete stats;
+        
+        return 0;
+    }
+    
+    // frames go to the standard output in the order of the files
+    if ( toStdout ) {
+        if ( _sequence )
+            _sequence->wait ( _position );
+        
+        error = streamFile ( path.c_str(), pixelStream, nullptr );
+        if ( !error && fflush ( pixelStream ) )
+            error = strerror ( errno );
+        remove ( path.c_str() );
+    }
+    else if ( _opts.manifest )
+        error = streamFile ( name, nullptr, &digest );
+    
+    if ( error ) {
+        fprintf ( stderr, "\nError: Cannot write %s: %s\n", name, error );
+        if ( !toStdout )
+            remove ( name );
+        delete stats;
+        
+        return 0;
+    }
+    
+    if ( _opts.manifest && !toStdout )
+        recordDigest ( name, digest );
+    
+    // the statistics of the standard output go next to the raw file
+    if ( stats ) {
+        stats->save ( output.c_str(), width, height, _opts.verbosity );
+        delete stats;
+    }
+    
+    return 1;
+}
+
+//	=====================================================================
+//	Append the digest of a file to the "--manifest" file, in the format
+//  of "xxhsum -H1" ( checked by "xxhsum -c" )
+//
+//	inputs:
+//      const char *  : path to the file (input or output)
+//      uint64_t      : XXH64 of its content
+//
+//	outputs:
+//      N/A           : a line is appended to the manifest, or kept in
+//                      _heldDigests while the "--variant" outputs of a
+//                      file are written
+
+void AcesRender::recordDigest ( const char * path, uint64_t digest ) const {
+    assert ( _opts.manifest );
+    
+    std::lock_guard < std::mutex > lock ( manifestMutex );
+    
+    if ( _heldDigests ) {
+        _heldDigests->push_back ( std::make_pair ( string ( path ), digest ) );
+        return;
+    }
+    
+    FILE * file = fopen ( _opts.manifest, "a" );
+    if ( !file ) {
+        fprintf ( stderr, "\nError: Cannot write %s: %s\n",
+                          _opts.manifest, strerror(errno) );
+        return;
+    }
+    
+    fprintf ( file, "%016llx  %s\n", (unsigned long long)digest, path );
+    fclose ( file );
+}
+
+
+//	=====================================================================
+//  Write the rendered ACES values to a 32-bit float OpenEXR file
+//  ( "--out-format 1" or "2" ). The float buffer is handed to OpenEXR
+//  as it is, without a half conversion or a scaling pass; the file is
+//  tagged with the ACES primaries but is not an ACES container
+//  (SMPTE ST 2065-4) file.
+//
+//	inputs:
+//      const char *               : the name of output file
+//      float *                    : an array of aces values, already
+//                                   scaled by floatScale()
+//      float                      : highlight ratio
+//
+//	outputs:
+//		int                        : "1" means the float OpenEXR file
+//                                   has been written; "0" means error
+
+int AcesRender::exrWrite ( const char * name, float * aces, float ratio ) const
+{
+    assert(aces);
+    
+    size_t rowSize = size_t(_image->colors) * _image->width;
+    return exrWriteRows ( name, ratio, _image->height,
+                   [&] ( size_t first, size_t ) { return aces + first * rowSize; } );
+}
+
+//	=====================================================================
+//  Write a float OpenEXR file band by band ( see acesWriteRows() ); to
+//  the standard output if the name is "-"
+//
+//	inputs:
+//      const char *  : the name of output file
+//      float         : highlight ratio
+//      size_t        : rows per band
+//      RowSource     : ACES values of rows [first, first+rows),
+//                      already scaled by floatScale()
+//
+//	outputs:
+//		int           : "1" means the float OpenEXR file has been
+//                      written; "0" means error or interruption
+//                      ( nothing is left on disk )
+
+int AcesRender::exrWriteRows ( const char * name,
+                                float ratio,
+                                size_t band,
+                                const RowSource & source ) const
+{
+#ifdef HAVE_OpenEXR
+    int width         = _image->width;
+    int height        = _image->height;
+    int toStdout      = !strcmp ( name, "-" );
+    uint8_t  channels = _image->colors;
+    size_t   rowSize  = size_t(channels) * width;
+    
+    if ( channels != 3 && channels != 4 )
+        throw std::invalid_argument ( "Only RGB or RGBA file supported" );
+    
+    band = std::max ( size_t(1), std::min ( band, size_t(height) ) );
+    
+    Imf::Compression compression = Imf::NO_COMPRESSION;
+    int threads = 1;
+    
+    if ( _opts.out_format == outFormat2 ) {
+        compression = Imf::ZIP_COMPRESSION;
+        threads = _opts.threads > 0 ? _opts.threads
+                                    : int(std::thread::hardware_concurrency());
+        
+        // OutputFile only queues line buffers: the compression runs on
+        // the global pool of OpenEXR, which has no threads by default
+        std::lock_guard < std::mutex > lock ( exrThreadsMutex );
+        if ( Imf::globalThreadCount() < threads )
+            Imf::setGlobalThreadCount ( threads );
+    }
+    
+    ImageStats * stats = nullptr;
+    if ( _opts.use_stats )
+        stats = new ImageStats ( channels, float ( _opts.scale * ratio ) );
+    
+    Imf::Header header ( width, height, 1.0, Imath::V2f ( 0, 0 ), 1.0,
+                         Imf::INCREASING_Y, compression );
+    
+    // ACES AP0 primaries and white point
+    Imf::Chromaticities ap0 ( Imath::V2f ( 0.7347, 0.2653 ),
+                              Imath::V2f ( 0.0, 1.0 ),
+                              Imath::V2f ( 0.0001, -0.077 ),
+                              Imath::V2f ( 0.32168, 0.33767 ) );
+    Imf::addChromaticities ( header, ap0 );
+    Imf::addAdoptedNeutral ( header, ap0.white );
+    header.insert ( "software", Imf::StringAttribute ( "rawtoaces v0.1" ) );
+    
+    static const char * names[4] = { "R", "G", "B", "A" };
+    size_t xStride = sizeof(float) * channels;
+    size_t yStride = xStride * width;
+    
+    FORI ( channels )
+        header.channels().insert ( names[i], Imf::Channel ( Imf::FLOAT ) );
+    
+    int written = 1;
+    
+    // each band is rendered, scaled and handed to OpenEXR in turn; the
+    // slices point "first" rows before the band, as OpenEXR indexes
+    // them with the row number in the file
+    auto writeBands = [&] ( Imf::OutputFile & file ) {
+        for ( size_t first = 0; first < size_t(height); first += band ) {
+            size_t rows = std::min ( band, height - first );
+            float * aces = source ( first, rows );
             
-            if ( _opts.verbosity > 1 ) {
-                printf ( "White Balance calculation method is 2 - ");
-                printf ( "Using white balance factors calculate by "
-                        "averaging the entire image ...\n" );
-            }
+            if ( !aces )
+                throw std::runtime_error ( "interrupted" );
             
-            break;
-        }
-        // 3
-        case wbMethod3 : {
-            if ( _opts.verbosity > 1 ) {
-                printf ( "White Balance calculation method is 3 - ");
-                printf ( "Using white balance factors calculated by "
-                     "averaging a grey box ...\n" );
-            }
+            if ( stats )
+                forBands ( rows, rowSize, [&] ( size_t begin, size_t end ) {
+                    stats->scale ( aces, begin, end, 1.0f,
+                                   [] ( size_t, size_t ) { } );
+                } );
             
-            break;
+            Imf::FrameBuffer frameBuffer;
+            FORI ( channels )
+                frameBuffer.insert ( names[i], Imf::Slice ( Imf::FLOAT,
+                                                            (char *) ( aces + i ) - first * yStride,
+                                                            xStride, yStride ) );
+            file.setFrameBuffer ( frameBuffer );
+            file.writePixels ( int(rows) );
         }
-        // 4
-        case wbMethod4 : {
-            _opts.use_mul = 1;
-            double sc = dmax;
+    };
+    
+    FILE * out = nullptr;
+    
+    try
+    {
+        if ( toStdout || _opts.manifest ) {
+            out = toStdout ? pixelStream : fopen ( name, "wb" );
+            if ( !out )
+                throw std::runtime_error ( strerror(errno) );
             
-            FORI ( P.colors ){
-                if ( OUT.user_mul[i] <= sc )
-                    sc = OUT.user_mul[i];
+            HashOStream stream ( name, out );
+            int held = compression != Imf::NO_COMPRESSION;
+            {
+                Imf::OutputFile file ( stream, header, std::max ( 1, threads ) );
+                
+                // frames go to the standard output in the order of the
+                // files, from the first byte that is not held
+                if ( !held ) {
+                    if ( toStdout && _sequence )
+                        _sequence->wait ( _position );
+                    stream.setTable ( exrLineOffsets ( stream.tellp(), height,
+                                                       rowSize * sizeof(float) ) );
+                }
+                
+                writeBands ( file );
             }
             
-            if ( sc != 1.0 ) {
-                fprintf ( stderr, "\nWarning: The smallest channel  "
-                                  "multiplier should be 1.0.\n\n" );
-            }
+            if ( held && toStdout && _sequence )
+                _sequence->wait ( _position );
             
-            if ( _opts.verbosity > 1 ) {
-                printf ( "White Balance calculation method is 4 - ");
-                printf ( "Using user-supplied white balance factors ...\n" );
-            }
+            const char * error = stream.finish();
+            if ( toStdout ? fflush ( out ) : fclose ( out ) )
+                error = error ? error : strerror ( errno );
+            out = nullptr;
             
-            break;
+            if ( error )
+                throw std::runtime_error ( error );
+            if ( _opts.manifest && !toStdout )
+                recordDigest ( name, stream.digest() );
         }
-        default: {
-            fprintf ( stderr, "White Balance method is must be 0, 1, 2, 3, "
-                              "or 4 \n" );
-            exit(-1);
-            break;
+        else {
+            Imf::OutputFile file ( name, header, std::max ( 1, threads ) );
+            writeBands ( file );
         }
     }
-
-//  Set parameters for --mat-method
-    switch ( _opts.mat_method ) {
-        // 0
-        case matMethod0 : {
-            OUT.output_color = 0;
-            OUT.use_camera_matrix = 0;
-            
-            if ( _opts.verbosity > 1 ) {
-                printf ( "IDT matrix calculation method is 0 - ");
-                printf ( "Calculating IDT matrix using camera spec sens ...\n" );
-            }
-            
-            break;
+    catch ( std::exception const & e )
+    {
+        fprintf ( stderr, "\nError: Cannot write %s: %s\n", name, e.what() );
+        if ( !toStdout ) {
+            if ( out )
+                fclose ( out );
+            remove ( name );
         }
-        // 1
-        case matMethod1 :
-            OUT.use_camera_matrix = 3;
+        
+        delete stats;
+        stats = nullptr;
+        written = 0;
+    }
+    
+    // the statistics of the standard output go next to the raw file
+    if ( stats ) {
+        string output = toStdout ? outputName ( outputStem ( _pathToRaw ),
+                                                _opts.out_format )
+                                 : string ( name );
+        stats->save ( output.c_str(), width, height, _opts.verbosity );
+        delete stats;
+    }
+    
+    return written;
+#else
+    fprintf ( stderr, "\nError: Float output needs rawtoaces "
+                      "to be built with OpenEXR\n" );
+    
+    return 0;
+#endif
+}
 
-            if ( P.dng_version ) {
-                OUT.use_camera_matrix = 1;
-                
-                if ( _opts.verbosity > 1 )
-                    printf ( "DNG file uses embeded color profile. \n ");
-            }
+//	=====================================================================
+//	Get the factor that maps processed code values to ACES values
+//
+//	inputs:
+//      float      : highlight ratio
+//
+//	outputs:
+//      double     : 1/(2^bits-1) * scale * ratio
 
-            if ( _opts.verbosity > 1 ) {
-                printf ( "IDT matrix calculation method is 1 - ");
-                printf ( "Calculating IDT matrix using file metadata ...\n" );
-            }
-            
-            break;
-        // 2
-        case matMethod2 :
-            OUT.use_camera_matrix = 1;
-            
-            if ( _opts.verbosity > 1 ) {
-                printf ( "IDT matrix calculation method is 2 - ");
-                printf ( "Calculating IDT matrix using adobe coeffs included in libraw ...\n" );
-            }
-            
-            break;
-        default:
-            fprintf ( stderr, "IDT matrix calculation method is must be 0, 1, 2 \n" );
-            exit(-1);
-            break;
-    }
+double AcesRender::getOutputScale ( float ratio ) const {
+    assert(_image);
+    
+    double sc = (_opts.scale) * ratio;
+    
+    if ( _image->bits == 8 )
+        sc *= INV_255;
+    else if ( _image->bits == 16 )
+        sc *= INV_65535;
+    
+    return sc;
+}
 
-// Set four_color_rgb to 0 when half_size is set to 1
-    if ( OUT.half_size == 1 )
-         OUT.four_color_rgb = 0;
+//	=====================================================================
+//	Get the factor folded into the render matrices for the float EXR
+//  output, which has no conversion pass to apply it: getOutputScale()
+//  for 8 and 16-bit images, as in acesWriteRows()
+//
+//	inputs:
+//      float      : highlight ratio
+//
+//	outputs:
+//      double     : the factor
+
+double AcesRender::floatScale ( float ratio ) const {
+    assert(_image);
     
-    if ( P.dng_version && OUT.output_color != 0 ) {
-        OUT.use_camera_matrix = 1;
-        OUT.use_camera_wb     = 1;
-    }
+    if ( _image->bits == 8 || _image->bits == 16 )
+        return getOutputScale ( ratio );
     
-    _opts.ret = dcraw();
-    if ( _opts.mat_method == matMethod0 )
-        if ( !prepareIDT ( P, C.pre_mul ) )
-            _opts.ret = errno;
+    return 1.0;
+}
+
+//	=====================================================================
+//	Get the ratio used to restore highlights ( "-H" )
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//      float      : max(pre_mul) / min(pre_mul) if highlight > 0;
+//                   1.0 otherwise
+
+float AcesRender::getHighlightRatio ( ) const {
+#ifdef C
+#undef C
+#endif
+    
+#define C   _rawProcessor->imgdata.color
+    
+    if ( _opts.highlight > 0 )
+        return ( *(std::max_element ( C.pre_mul, C.pre_mul+3)) /
+                 *(std::min_element ( C.pre_mul, C.pre_mul+3)) );
+    
+    return 1.0;
+}
+
+//	=====================================================================
+//	Get a list of Supported Illuminants
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//      vector < vector < string > > : _illuminant values
+//	=====================================================================
+
+const vector < string > AcesRender::getSupportedIllums ( ) const {
+    return _illuminants;
+}
+
+
+//	=====================================================================
+//	Get a list of Supported Cameras
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//      vector < string > : _cameras values/names
+
+const vector < string > AcesRender::getSupportedCameras ( ) const {
+    return _cameras;
+}
+
+
+//	=====================================================================
+//	Print a list of Cameras Supported by LibRaw
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//      N/A
+
+void AcesRender::printLibRawCameras () {
+    const char ** cl = _rawProcessor->cameraList();
+    while (*(cl+1) != NULL)
+        printf ("%s\n", *cl++);
+}
+
+//	=====================================================================
+//	Get IDT matrix
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//      vector < vector < double > > : _idtm (3x3) values
+
+const vector < vector < double > > AcesRender::getIDTMatrix ( ) const {
+    return _idtm;
+}
+
+//	=====================================================================
+//	Get CAT matrix
+//
+//	inputs:
+//      N/A
+//
+//	outputs:
+//      vector < vector < double > > : _catm (3x3) values
 
-    libraw_processed_image_t * image = _rawProcessor->dcraw_make_mem_image ( &(_opts.ret) );
-    setPixels (image);
-    
-    return _opts.ret;
+const vector < vector < double > > AcesRender::getCATMatrix ( ) const {
+    return _catm;
 }
 
 //	=====================================================================
-//	Render ACES Buffer
+//	Get White Balance Coefficients
 //
 //	inputs:
 //      N/A
 //
 //	outputs:
-//      N/A        : either call renderIDT() or renderDNG()
-//                   or renderNonDNG()
+//      vector < double >  : _wbv (1x3) values
 
-float * AcesRender::renderACES ( ) {
-#ifdef P
-#undef P
-#endif
-    
-#define P _rawProcessor->imgdata.idata
-    
-    if ( !_rawProcessor->imgdata.params.output_color )
-        return renderIDT();
-    else {
-        if ( P.dng_version )
-            return renderDNG();
-        else
-            return renderNonDNG();
-    }
+const vector < double > AcesRender::getWB ( ) const {
+    return _wbv;
 }
 
 //	=====================================================================
-//	Write rendered ACES Buffer into an OpenEXR Image File
+//	Get Image Buffer
 //
 //	inputs:
 //      N/A
 //
 //	outputs:
-//      N/A        : An ACES file will be generated
-
-void AcesRender::outputACES ( ) {
-#ifdef C
-#undef C
-#endif
+//      libraw_processed_image_t : _image
 
-#define C   _rawProcessor->imgdata.color
-    
-    assert ( _pathToRaw != nullptr );
-    char * cp;
-    if (( cp = strrchr ( _pathToRaw, '.' ))) *cp = 0;
-    
-    char outfn[1024];
-    snprintf( outfn, sizeof(outfn), "%s%s", _pathToRaw, "_aces.exr" );
-    
-    float * aces = renderACES();
-    if ( _opts.verbosity > 1 ) {
-        if ( _opts.mat_method && !P.dng_version ) {
-            vector < vector < double > > camXYZ(3, vector< double >(3, 1.0));
-            FORIJ (3,3) camXYZ[i][j] = C.cam_xyz[i][j];
-            vector < vector < double > > camcat = mulVector (camXYZ, _catm);
-            
-            printf ("The Approximate IDT matrix is ...\n");
-            FORI (3) printf ("   %f, %f, %f\n", camcat[i][0], camcat[i][1], camcat[i][2]);
-        }
-        // printing white balance coefficients
-        printf ("The final white balance coefficients are ...\n");
-        printf ("   %f   %f   %f\n", C.pre_mul[0], C.pre_mul[1], C.pre_mul[2]);
-        printf ( "Writing ACES file to %s ...\n", outfn );
-    }
-    
-    if ( _opts.highlight > 0 ) {
-        float ratio = ( *(std::max_element ( C.pre_mul, C.pre_mul+3)) /
-                        *(std::min_element ( C.pre_mul, C.pre_mul+3)) );
-        acesWrite ( outfn, aces, ratio );
-    }
-    else
-        acesWrite ( outfn, aces );
-    
-#ifndef WIN32
-    if ( _opts.use_mmap && _opts.iobuffer )
-    {
-        munmap ( _opts.iobuffer, size_t(_opts.msize) );
-        _opts.iobuffer = 0;
-    }
-#endif
+const libraw_processed_image_t * AcesRender::getImageBuffer() const {
+    assert(_image);
     
-    _rawProcessor->recycle();
-
-    if ( _opts.verbosity ) printf ("Finished\n\n");
+    return _image;
 }
 
 //	=====================================================================
-//  Apply white balance values to each pixel
-//  ( We actually do not need it here because white-balancing
-//  happens before demosaicing )
+//	Fetch user option list
 //
 //	inputs:
-//      float *          : pixels (R/G/B)
-//      uint8_t          : number of channels
-//      uint32_t         : the size of pixels
+//      NA
 //
 //	outputs:
-//		N/A              : pixel values modified by multiplying
-//                         white balance coefficients
+//      Options   :  _opts will be returned
 
-void AcesRender::applyWB ( float * pixels, int bits, uint32_t total )
-{
-    double min_wb = * min_element ( _wbv.begin(), _wbv.end() );
-    double target = 1.0;
-    
-    if ( bits == 8 )
-        target /= INV_255;
-    else if ( bits == 16 )
-        target /= INV_65535;
-    
-    if ( !pixels ) {
-        fprintf ( stderr, "\nThe pixels cannot be found. \n" );
-        exit (1);
-    }
-    else {
-        for ( uint32_t i = 0; i < total; i+=3 ){
-            pixels[i]   = clip (_wbv[0] * pixels[i] / min_wb, target);
-            pixels[i+1] = clip (_wbv[1] * pixels[i+1] / min_wb, target);
-            pixels[i+2] = clip (_wbv[2] * pixels[i+2] / min_wb, target);
-        }
-    }
+const struct Option AcesRender::getSettings ( ) const {
+    return _opts;
 }
 
+
 //	=====================================================================
-//  Apply IDT matrix to each pixel
+//	Estimate the peak memory needed to convert a RAW file from the
+//  header information only (raw buffer, libraw image, processed image,
+//  float ACES buffer and half output buffer)
 //
 //	inputs:
-//      float *   : pixels (R/G/B)
-//      uint8_t   : number of channels
-//      uint32_t  : the size of pixels
-//      vector < vector <double> >: 3 x 3 IDT matrix
+//      libraw_data_t : image data after open_file() / open_buffer()
+//      int           : number of output files written at the same time
+//                      ( "--variant" )
+//      size_t        : rows rendered at a time ( "--band-rows" ), 0 for
+//                      the whole frame
+//      int           : "1" if each output file is held in memory until
+//                      it is written ( ZIP EXR with "--manifest" or
+//                      "--stdout" )
 //
 //	outputs:
-//		N/A       : pixel values modified by mutiplying IDT matrix
+//      size_t        : estimated peak footprint in bytes
 
-void AcesRender::applyIDT ( float * pixels, int channel, uint32_t total )
-{
-    assert(pixels);
+size_t estimateFootprint ( const libraw_data_t & data, int outputs, size_t bandRows,
+                           int heldOutput ) {
+    const libraw_image_sizes_t & S = data.sizes;
+    int shrink = data.params.half_size ? 1 : 0;
     
-    if ( channel == 4 ){
-        _idtm.resize(4);
-        FORI(4) _idtm[i].resize(4);
-        
-        _idtm[0][3] = 0.0;
-        _idtm[1][3] = 0.0;
-        _idtm[2][3] = 0.0;
-        _idtm[3][0] = 0.0;
-        _idtm[3][1] = 0.0;
-        _idtm[3][2] = 0.0;
-        _idtm[3][3] = 1.0;
-    }
+    size_t raw = size_t(S.raw_width) * S.raw_height * sizeof(ushort);
+    if ( !data.idata.filters )
+        raw *= 4;
     
-    if ( channel != 3 && channel != 4 ) {
-        fprintf ( stderr, "\nError: Currenly support 3 channels "
-                          "and 4 channels. \n" );
-        exit (1);
-    }
+    size_t ipixels = size_t(S.width >> shrink) * (S.height >> shrink);
+    size_t image = ipixels * 4 * sizeof(ushort);
+    size_t processed = ipixels * 3 * sizeof(ushort);
+    size_t aces = ipixels * 3 * sizeof(float);
+    size_t halfOut = ipixels * 3 * sizeof(halfBytes);
     
-    pixels = mulVectorArray ( pixels,
-                              total,
-                              channel,
-                              _idtm );
+    size_t rows = S.height >> shrink;
+    if ( bandRows && bandRows < rows )
+        aces = aces / rows * bandRows;
+    
+    // libraw keeps the raw and the 4-channel image until recycle(), so
+    // each stage adds to the previous one: unpack/dcraw_process() holds
+    // "decode", dcraw_make_mem_image() adds the processed image and each
+    // output file being written adds its float ACES buffer and half copy;
+    // the peak is reached while writing
+    size_t decode  = raw + image;
+    size_t process = decode + processed;
+    
+    // a ZIP file is at most about the size of its float pixels
+    size_t held = heldOutput ? ipixels * 3 * sizeof(float) : 0;
+    
+    return process + size_t ( std::max ( 1, outputs ) ) * ( aces + halfOut + held );
 }
 
 //	=====================================================================
-//  Apply CAT matrix (e.g., D50 to D60) to each pixel
-//  It will be used if using adobe coeffs from "libraw"
+//	Estimate the single-thread time to convert a RAW file from the
+//  header information only. The per-pixel costs are rough figures
+//  for each interpolation quality ("-q") and only meant for planning.
 //
 //	inputs:
-//      float *   : pixels (R/G/B)
-//      uint8_t   : number of channels
-//      uint32_t  : the size of pixels
+//      libraw_data_t : image data after open_file() / open_buffer()
 //
 //	outputs:
-//		N/A       : pixel values modified by mutiplying CAT matrix
+//      double        : estimated time in milliseconds
 
-void AcesRender::applyCAT ( float * pixels, int channel, uint32_t total )
-{
-    assert(pixels);
+double estimateRenderTime ( const libraw_data_t & data ) {
+    // linear, VNG, PPG, AHD (ns per pixel)
+    static const double nsPerPixel[4] = { 60.0, 250.0, 120.0, 180.0 };
     
-    if ( channel != 3 && channel != 4 ) {
-        fprintf ( stderr, "\nError: Currenly support 3 channels "
-                 "and 4 channels. \n" );
-        exit (1);
-    }
+    const libraw_image_sizes_t & S = data.sizes;
+    double pixels = double(S.width) * S.height;
+    double ns = nsPerPixel[3];
     
-    // will use calCAT() inside rawtoaces
-    vector < double > dIV (d50, d50 + 3);
-    vector < double > dOV (d60, d60 + 3);
-    _catm = getCAT(dIV, dOV);
-
-    pixels = mulVectorArray ( pixels,
-                              total,
-                              channel,
-                              _catm );
+    // "-h" skips demosaicing; the cost is mostly unpacking the sensor data
+    if ( data.params.half_size )
+        ns = 40.0;
+    else if ( data.params.user_qual >= 0 && data.params.user_qual < 4 )
+        ns = nsPerPixel[data.params.user_qual];
+    
+    return pixels * ns * 1e-6;
 }
 
 //	=====================================================================
-//  Convert DNG RAW to aces file
+//	Inspect RAW files without decoding the pixels ( "--inspect" ).
+//  Files are distributed over "--threads" workers and one JSON line
+//  is printed per file.
 //
 //	inputs:
-//      vector < float > : camera to display matrix
+//      vector < string > : paths to the raw files
 //
 //	outputs:
-//		float * : an array of converted aces values
-
-float * AcesRender::renderDNG ( )
-{
-#ifdef P
-#undef P
-#endif
+//      N/A               : JSON lines written to stdout
 
-#define P _rawProcessor->imgdata.idata
-
-    assert ( _image && P.dng_version );
+void AcesRender::inspectRaws ( const vector < string > & RAWs ) const {
+    size_t next = 0;
+    std::mutex mtx;
     
-    DNGIdt * dng = new DNGIdt ( _rawProcessor->imgdata.rawdata );
-    _catm = dng->getDNGCATMatrix();
-    _idtm = dng->getDNGIDTMatrix();
+    int threads = _opts.threads;
+    if ( threads <= 0 )
+        threads = std::max ( 1, int(std::thread::hardware_concurrency()) );
+    if ( size_t(threads) > RAWs.size() )
+        threads = std::max ( 1, int(RAWs.size()) );
     
-   if ( _opts.verbosity > 1 ) {
-        printf("The Approximate IDT matrix is ...\n");
-        FORI(3) printf("   %f, %f, %f\n", _idtm[i][0], _idtm[i][1], _idtm[i][2]);
-    }
-        
-    ushort * pixels = (ushort *) _image->data;
-    uint32_t total = _image->width * _image->height * _image->colors;
-    float * aces = new  (std::nothrow) float[total];
-    FORI (total)
-        aces[i] = static_cast < float > (pixels[i]);
-
-    if ( _opts.verbosity > 1 )
-        printf ( "Applying IDT Matrix ...\n" );
+    vector < std::thread > workers;
+    FORI ( threads - 1 )
+        workers.push_back ( std::thread ( &AcesRender::inspectWorker, this,
+                                          std::cref(RAWs), &next, &mtx ) );
     
-    applyIDT ( aces, _image->colors, total );
-    delete dng;
+    inspectWorker ( RAWs, &next, &mtx );
     
-    return aces;
+    FORI ( workers.size() )
+        workers[i].join();
 }
 
 //	=====================================================================
-//  Convert Non-DNG RAW to aces file (no IDT involved)
+//	Worker of inspectRaws(); keeps its own libraw and Idt instances
 //
-//	inputs:  N/A
+//	inputs:
+//      vector < string > : paths to the raw files
+//      size_t *          : index of the next file to be inspected
+//      std::mutex *      : guards the index and stdout
 //
 //	outputs:
-//		float * : an array of converted aces code values
-
-float * AcesRender::renderNonDNG ()
-{
-    assert(_image);
+//      N/A               : JSON lines written to stdout
 
-    ushort * pixels = (ushort *) _image->data;
-    uint32_t total = _image->width * _image->height * _image->colors;
-    float * aces = new (std::nothrow) float[total];
+void AcesRender::inspectWorker ( const vector < string > & RAWs,
+                                 size_t * next,
+                                 std::mutex * mtx ) const {
+    LibRawAces * rawProcessor = new LibRawAces();
+    rawProcessor->imgdata.params = _rawProcessor->imgdata.params;
     
-    FORI(total) aces[i] = static_cast <float> (pixels[i]);
+    Idt * idt = new Idt();
+    InspectState state;
     
-    if( _opts.mat_method > 0 ) {
-        applyCAT(aces, _image->colors, total);
+    while ( 1 ) {
+        size_t i;
+        
+        mtx->lock();
+        i = (*next)++;
+        mtx->unlock();
+        
+        if ( i >= RAWs.size() )
+            break;
+        
+        string line = inspectRaw ( RAWs[i].c_str(), rawProcessor, idt, state );
+        
+        mtx->lock();
+        printf ( "%s\n", line.c_str() );
+        fflush ( stdout );
+        mtx->unlock();
+        
+        rawProcessor->recycle();
     }
     
-    vector < vector< double> > XYZ_acesrgb( _image->colors,
-                                            vector < double > (_image->colors));
-    if ( _image->colors == 3 ) {
-        FORIJ(3, 3) XYZ_acesrgb[i][j] = XYZ_acesrgb_3[i][j];
-        aces = mulVectorArray(aces, total, 3, XYZ_acesrgb);
-    }
-    else if ( _image->colors == 4 ){
-        FORIJ(4, 4) XYZ_acesrgb[i][j] = XYZ_acesrgb_4[i][j];
-        aces = mulVectorArray(aces, total, 4, XYZ_acesrgb);
-    }
-    else {
-        fprintf ( stderr, "\nError: Currenly support 3 channels "
-                          "and 4 channels. \n" );
-        exit (1);
-    }
+    delete idt;
+    delete rawProcessor;
+}
+
+//	=====================================================================
+//	Work-stealing scheduler of convertRaws(). Whole files are handed out
+//  by convertWorker(); the row bands of a large file are pushed to the
+//  deque of the worker converting it, which runs them newest first
+//  while idle workers steal the oldest ones. Bands are stolen from the
+//  file with the most urgent priority class first, and a worker between
+//  two bands of its own file first helps any more urgent file.
+
+class TaskScheduler {
+    public:
+        typedef std::function < void ( ) > Task;
     
-    return aces;
+        TaskScheduler ( int workers, WorkSignal * signal )
+            : _queues(workers), _locks(workers), _priority(workers), _signal(signal) {
+            FORI ( workers ) _priority[i] = priority1;
+        };
+    
+        int workers ( ) const { return int(_queues.size()); };
+    
+        //  Priority class of the file the worker is converting
+        void setPriority ( int worker, int priority ) {
+            _priority[worker] = priority;
+        };
+    
+        //  Steal the oldest band of the most urgent file whose priority
+        //  class is below "below"
+        int steal ( int worker, Task & task, int below = priority2 + 1 ) {
+            int n = workers();
+            
+            while ( 1 ) {
+                int best = -1;
+                
+                for ( int k = 1; k < n; k++ ) {
+                    int victim = ( worker + k ) % n;
+                    int priority = _priority[victim];
+                    
+                    if ( priority >= below
+                         || ( best >= 0 && priority >= _priority[best] ) )
+                        continue;
+                    
+                    std::lock_guard < std::mutex > lock ( _locks[victim] );
+                    if ( !_queues[victim].empty() )
+                        best = victim;
+                }
+                
+                if ( best < 0 )
+                    return 0;
+                
+                std::lock_guard < std::mutex > lock ( _locks[best] );
+                if ( !_queues[best].empty() ) {
+                    task = _queues[best].front();
+                    _queues[best].pop_front();
+                    return 1;
+                }
+            }
+        };
+    
+        //  Run body(0) ... body(count-1) as subtasks and return when all
+        //  of them are done
+        void parallelFor ( int worker, size_t count,
+                           const std::function < void ( size_t ) > & body ) {
+            std::atomic < size_t > pending ( count );
+            
+            WorkSignal * signal = _signal;
+            {
+                std::lock_guard < std::mutex > lock ( _locks[worker] );
+                for ( size_t i = 0; i < count; i++ )
+                    _queues[worker].push_back ( [&body, &pending, signal, i] {
+                        body ( i );
+                        if ( --pending == 0 )
+                            signal->notify();
+                    } );
+            }
+            signal->notify();
+            
+            Task task;
+            while ( pending.load() ) {
+                size_t seen = signal->events();
+                
+                if ( steal ( worker, task, _priority[worker] )
+                     || pop ( worker, task ) || steal ( worker, task ) )
+                    task();
+                else if ( pending.load() )
+                    signal->wait ( seen );
+            }
+        };
+    
+    private:
+        int pop ( int worker, Task & task ) {
+            std::lock_guard < std::mutex > lock ( _locks[worker] );
+            
+            if ( _queues[worker].empty() )
+                return 0;
+            
+            task = _queues[worker].back();
+            _queues[worker].pop_back();
+            
+            return 1;
+        };
+    
+        vector < std::deque < Task > > _queues;
+        vector < std::mutex > _locks;
+        vector < std::atomic < int > > _priority;
+        WorkSignal * _signal;
+};
+
+//  Priority class of a "--queue" line: a number ( 0 to 2 ) or a name
+static int parsePriority ( const char * word ) {
+    static const char * names[] = { "interactive", "normal", "background" };
+    
+    FORI ( countSize(names) )
+        if ( !cmp_str ( word, names[i] )
+             || ( isdigit ( word[0] ) && !word[1] && word[0] - '0' == i ) )
+            return i;
+    
+    return -1;
+}
+
+//  Print the time since "start" as timerprint() does and restart it
+static void printTiming ( const char * msg, const char * filename,
+                          std::chrono::high_resolution_clock::time_point & start ) {
+    std::chrono::high_resolution_clock::time_point end =
+        std::chrono::high_resolution_clock::now();
+    float msec = std::chrono::duration < float, std::milli > ( end - start ).count();
+    
+    printf ( "Timing: %s/%s: %6.3f msec\n", filename, msg, msec );
+    start = end;
 }
 
 //	=====================================================================
-//  Convert Non-DNG RAW to aces file through IDT
+//	Run "body" over the rows of the image in bands. With a scheduler
+//  ( convertRaws() ) the bands of a large image are subtasks that idle
+//  workers may take; otherwise all rows are done at once.
 //
-//	inputs:  N/A
+//	inputs:
+//      size_t   : number of rows
+//      size_t   : number of elements in a row
+//      function : body ( first, last ) for the elements [first, last)
 //
 //	outputs:
-//		float * : an array of aces values for each pixel
+//      N/A
 
-float * AcesRender::renderIDT ()
-{
-    assert (_image);
-    ushort * pixels = ( ushort * ) _image->data;
-    uint32_t total = _image->width * _image->height * _image->colors;
-    float * aces = new (std::nothrow) float[total];
-    
-    FORI ( total ) {
-        aces[i] = static_cast <float> (pixels[i]);
+void AcesRender::forBands ( size_t rows, size_t rowSize,
+                            const std::function < void ( size_t, size_t ) > & body ) const {
+    if ( !_scheduler || rows * rowSize < ( size_t(1) << 22 ) ) {
+        body ( 0, rows * rowSize );
+        return;
     }
-
-    if ( _opts.verbosity > 1 )
-    	printf ( "Applying IDT Matrix ...\n" );
     
-    applyIDT ( aces, _image->colors, total );
+    size_t band  = std::max ( size_t(32), rows / ( size_t(_scheduler->workers()) * 8 ) );
+    size_t bands = ( rows + band - 1 ) / band;
     
-    return aces;
-};
+    _scheduler->parallelFor ( _worker, bands, [&] ( size_t i ) {
+        size_t last = std::min ( rows, ( i + 1 ) * band );
+        body ( i * band * rowSize, last * rowSize );
+    } );
+}
 
 //	=====================================================================
-//  Write processed image file to an aces-compliant openexr file
+//	Convert RAW files to ACES. "--threads" workers, each with its own
+//  renderer, take whole files (by priority class, then in the given
+//  order or, with "--largest-first", by decreasing estimated time)
+//  while the "--max-memory" budget allows, and otherwise help with the
+//  row bands of the files in progress. With "--queue", files listed in
+//  the queue file join the batch until its end is reached.
 //
-//	inputs:
-//      const char *               : the name of output file
-//      float *                    : an array of converted aces values
+//	inputs:
+//      vector < string > : paths to the raw files and tar archives
 //
 //	outputs:
-//		N/A                        : an aces file should be generated in
-//                                   the same folder
-
-void AcesRender::acesWrite ( const char * name, float *  aces, float ratio ) const
-{
-    assert(aces);
+//      N/A               : ACES files will be generated
 
-    uint16_t width     = _image->width;
-    uint16_t height    = _image->height;
-    uint8_t  channels  = _image->colors;
-    uint8_t  bits      = _image->bits;
+void AcesRender::convertRaws ( const vector < string > & paths ) {
+    int threads = _opts.threads;
+    if ( threads <= 0 )
+        threads = std::max ( 1, int(std::thread::hardware_concurrency()) );
+    
+    RawArchives archives;
+    vector < string > RAWs;
+    expandInputs ( paths, archives, RAWs, _opts.shard_index, _opts.shard_count );
+    
+    // no more workers than files, unless "--queue" adds files later
+    if ( !_opts.queue && size_t(threads) > RAWs.size() )
+        threads = std::max ( 1, int(RAWs.size()) );
     
-    halfBytes * halfIn = new (std::nothrow) halfBytes[channels * width * height];
+    vector < size_t > order ( RAWs.size() );
+    FORI ( RAWs.size() ) order[i] = i;
+    
+    if ( threads == 1 && !_opts.queue ) {
+        MemoryBudget budget ( _opts.max_memory );
+        RawPrefetcher * prefetcher = nullptr;
+        if ( _opts.prefetch > 0 ) {
+            vector < string > queue;
+            FORI ( RAWs.size() )
+                if ( !archives.find ( RAWs[i].c_str() ) && RAWs[i] != "-" )
+                    queue.push_back ( RAWs[i] );
+            prefetcher = new RawPrefetcher ( queue, _opts.prefetch, &budget );
+        }
         
-    FORI ( channels * width * height ){
-        if ( bits == 8 )
-            aces[i] = (double) aces[i] * INV_255 * (_opts.scale) * ratio;
-        else if ( bits == 16 )
-            aces[i] = (double) aces[i] * INV_65535 * (_opts.scale) * ratio;
+        _archives = &archives;
+        _prefetcher = prefetcher;
+        FORI ( RAWs.size() ) convertRaw ( RAWs[i].c_str() );
+        _prefetcher = nullptr;
+        _archives = nullptr;
         
-        half tmpV ( aces[i] );
-        halfIn[i] = tmpV.bits();
+        delete prefetcher;
+        return;
     }
     
-    vector < std::string > filenames;
-    filenames.push_back(name);
+    // headers only, read by all threads, for the budget and the order
+    vector < size_t > bytes ( RAWs.size(), 0 );
+    vector < double > cost ( RAWs.size(), 0.0 );
     
-    aces_Writer x;
+    // the workers write their "--variant" outputs one at a time, each
+    // of the whole frame
+    int variantThreads = 1;
+    int outputs = _opts.variants.size() ? std::min ( int(_opts.variants.size()),
+                                                     variantThreads ) : 1;
+    size_t bandRows = _opts.variants.size() ? 0
+                                            : size_t ( std::max ( 0, _opts.band_rows ) );
+    int heldOutput = _opts.out_format == outFormat2
+                     && ( _opts.manifest
+                          || ( _opts.use_stdout && _opts.stdout_mode == stdoutMode0 ) );
     
-    MetaWriteClip writeParams;
+    std::function < void ( LibRawAces *, const string &, size_t &, double & ) > scan =
+        [&] ( LibRawAces * header, const string & path, size_t & footprint, double & time ) {
+            const RawMember * member = archives.find ( path.c_str() );
+            int ret = member ? header->open_buffer ( const_cast < char * > (member->data),
+                                                     member->size )
+                             : header->open_file ( path.c_str() );
+            
+            if ( ret == LIBRAW_SUCCESS ) {
+                footprint = estimateFootprint ( header->imgdata, outputs, bandRows,
+                                                heldOutput );
+                time = estimateRenderTime ( header->imgdata );
+            }
+            header->recycle();
+        };
     
-    writeParams.duration				= 1;
-    writeParams.outputFilenames			= filenames;
+    if ( _opts.max_memory || _opts.largest_first ) {
+        size_t next = 0;
+        std::mutex mtx;
+        vector < std::thread > scanners;
+        
+        FORI ( threads ) scanners.push_back ( std::thread ( [&] {
+            LibRawAces * header = new LibRawAces();
+            header->imgdata.params = _rawProcessor->imgdata.params;
+            
+            while ( 1 ) {
+                mtx.lock();
+                size_t k = next++;
+                mtx.unlock();
+                
+                if ( k >= RAWs.size() )
+                    break;
+                
+                scan ( header, RAWs[k], bytes[k], cost[k] );
+            }
+            
+            delete header;
+        } ) );
+        
+        FORI ( scanners.size() ) scanners[i].join();
+    }
     
-    writeParams.outputRows				= height;
-    writeParams.outputCols				= width;
+    if ( _opts.largest_first )
+        std::stable_sort ( order.begin(), order.end(),
+                           [&] ( size_t a, size_t b ) { return cost[a] > cost[b]; } );
     
-    writeParams.hi = x.getDefaultHeaderInfo();
-    writeParams.hi.originalImageFlag	= 1;
-    writeParams.hi.software				= "rawtoaces v0.1";
+    WorkSignal signal;
+    JobQueue queue ( &signal );
+    MemoryBudget budget ( _opts.max_memory );
+    TaskScheduler scheduler ( threads, &signal );
+    OutputSequence sequence;
     
-    writeParams.hi.channels.clear();
+    FORI ( order.size() )
+        queue.push ( RAWs[order[i]], bytes[order[i]], _opts.priority );
     
-    switch (channels)
-    {
-        case 3:
-            writeParams.hi.channels.resize(3);
-            writeParams.hi.channels[0].name = "B";
-            writeParams.hi.channels[1].name = "G";
-            writeParams.hi.channels[2].name = "R";
-            break;
-        case 4:
-            writeParams.hi.channels.resize(4);
-            writeParams.hi.channels[0].name = "A";
-            writeParams.hi.channels[1].name = "B";
-            writeParams.hi.channels[2].name = "G";
-            writeParams.hi.channels[3].name = "R";
-            break;
-        case 6:
-            throw std::invalid_argument ( "Stereo RGB support not yet implemented" );
-        case 8:
-            throw std::invalid_argument ( "Stereo RGB support not yet implemented" );
-        default:
-            throw std::invalid_argument ( "Only RGB, RGBA or"
-                                          "stereo RGB[A] file supported" );
-            break;
+    // "--queue": one file per line, "[priority] <path>", until the end
+    // of the file ( for a named pipe, until its last writer closes it )
+    std::thread reader;
+    if ( _opts.queue )
+        reader = std::thread ( [&] {
+            FILE * file = fopen ( _opts.queue, "r" );
+            if ( !file ) {
+                fprintf ( stderr, "\nError: Cannot read %s: %s\n\n",
+                                  _opts.queue, strerror(errno) );
+                queue.close();
+                return;
+            }
+            
+            LibRawAces * header = nullptr;
+            if ( _opts.max_memory ) {
+                header = new LibRawAces();
+                header->imgdata.params = _rawProcessor->imgdata.params;
+            }
+            
+            char line[4096];
+            while ( fgets ( line, sizeof(line), file ) ) {
+                line[strcspn ( line, "\r\n" )] = 0;
+                
+                char * path = line + strspn ( line, " \t" );
+                int priority = priority1;
+                size_t word = strcspn ( path, " \t" );
+                
+                if ( path[word] ) {
+                    string name ( path, word );
+                    int p = parsePriority ( name.c_str() );
+                    if ( p >= 0 ) {
+                        priority = p;
+                        path += word + strspn ( path + word, " \t" );
+                    }
+                }
+                
+                if ( !path[0] || path[0] == '#' )
+                    continue;
+                
+                // as the paths given on the command line: tar archives
+                // are expanded, outputs skipped and "--shard" applied
+                vector < string > entries;
+                expandInputs ( vector < string > ( 1, string ( path ) ), archives,
+                               entries, _opts.shard_index, _opts.shard_count );
+                
+                FORI ( entries.size() ) {
+                    size_t footprint = 0;
+                    double time = 0.0;
+                    if ( header )
+                        scan ( header, entries[i], footprint, time );
+                    
+                    if ( _opts.verbosity )
+                        printf ( "Queued %s (priority %d)\n", entries[i].c_str(), priority );
+                    queue.push ( entries[i], footprint, priority );
+                }
+            }
+            
+            fclose ( file );
+            delete header;
+            queue.close();
+        } );
+    else
+        queue.close();
+    
+    RawPrefetcher * prefetcher = nullptr;
+    if ( _opts.prefetch > 0 ) {
+        vector < string > files;
+        FORI ( order.size() )
+            if ( !archives.find ( RAWs[order[i]].c_str() ) && RAWs[order[i]] != "-" )
+                files.push_back ( RAWs[order[i]] );
+        prefetcher = new RawPrefetcher ( files, _opts.prefetch, &budget );
     }
     
-    DynamicMetadata dynamicMeta;
-    dynamicMeta.imageIndex = 0;
-    dynamicMeta.imageCounter = 0;
+    // the first "--reserve" workers are kept for interactive files
+    int reserve = std::max ( 0, std::min ( _opts.reserve, threads - 1 ) );
     
-    x.configure ( writeParams );
-    x.newImageObject ( dynamicMeta );
+    // files are converted side by side, so each renderer writes its
+    // "--variant" outputs on a single thread and, unless "--fit-threads"
+    // is given, runs its IDT regression on its share of the cores
+    int fitThreads = _opts.fit_threads > 0 ? _opts.fit_threads
+                                           : std::max ( 1, int(std::thread::hardware_concurrency())
+                                                           / threads );
     
-    FORI ( height ){
-        halfBytes * rgbData = halfIn + width * channels * i;
-        x.storeHalfRow (rgbData, i);
+    vector < AcesRender * > renders;
+    vector < std::thread > workers;
+    FORI ( threads ) {
+        AcesRender * render = new AcesRender ( *this );
+        render->_opts.threads = variantThreads;
+        render->_opts.fit_threads = fitThreads;
+        render->_scheduler = &scheduler;
+        render->_worker = i;
+        render->_prefetcher = prefetcher;
+        render->_archives = &archives;
+        render->_sequence = _opts.use_stdout ? &sequence : nullptr;
+        renders.push_back ( render );
     }
     
-#if 0
-    std::cout << "saving aces file" << std::endl;
-    std::cout << "size " << width << "x" << height << "x"
-              << channels << std::endl;
-    std::cout << "size " << writeParams.outputCols << "x"
-              << writeParams.outputRows << std::endl;
-    std::cout << "duration " << writeParams.duration << std::endl;
-    std::cout << writeParams.hi;
-    std::cout << "\ndynamic meta" << std::endl;
-    std::cout << "imageIndex " << dynamicMeta.imageIndex << std::endl;
-    std::cout << "imageCounter " << dynamicMeta.imageCounter << std::endl;
-    std::cout << "timeCode " << dynamicMeta.timeCode << std::endl;
-    std::cout << "keyCode " << dynamicMeta.keyCode << std::endl;
-    std::cout << "capDate " << dynamicMeta.capDate << std::endl;
-    std::cout << "uuid " << dynamicMeta.uuid << std::endl;
-#endif
+    FORI ( threads )
+        workers.push_back ( std::thread ( &AcesRender::convertWorker, renders[i],
+                                          &queue, &budget, &signal, int ( i < reserve ) ) );
     
-    delete [] halfIn;
+    FORI ( threads ) {
+        workers[i].join();
+        delete renders[i];
+    }
+    
+    if ( reader.joinable() )
+        reader.join();
     
-    x.saveImageObject ( );
+    delete prefetcher;
 }
 
-
 //	=====================================================================
-//	Get a list of Supported Illuminants
+//	Claim a raw file for this process ( "--claim" ) by creating its
+//  "_aces.claim" file, which fails if another process ( on this or
+//  another node sharing the filesystem ) has created it first
 //
 //	inputs:
-//      N/A
+//      const char *      : path to the raw file
 //
 //	outputs:
-//      vector < vector < string > > : _illuminant values
-//	=====================================================================
+//      int               : "1" means the file is ours to convert;
+//                          "0" means it is claimed by another process
 
-const vector < string > AcesRender::getSupportedIllums ( ) const {
-    return _illuminants;
+int AcesRender::claimRaw ( const char * raw ) const {
+    string claim = outputStem ( raw ) + "_aces.claim";
+    makeParentDirs ( claim.c_str() );
+    
+    FILE * file = fopen ( claim.c_str(), "wx" );
+    if ( !file ) {
+        if ( errno != EEXIST )
+            fprintf ( stderr, "\nError: Cannot create %s: %s\n\n",
+                              claim.c_str(), strerror(errno) );
+        else if ( _opts.verbosity )
+            printf ( "Skipping %s: claimed by another process\n", raw );
+        
+        return 0;
+    }
+    
+    fprintf ( file, "%s\n", processTag().c_str() );
+    fclose ( file );
+    
+    return 1;
 }
 
-
 //	=====================================================================
-//	Get a list of Supported Cameras
+//	Give up the claim of a raw file that has not been converted, so that
+//  another run can convert it
 //
 //	inputs:
-//      N/A
+//      const char *      : path to the raw file
 //
 //	outputs:
-//      vector < string > : _cameras values/names
+//      N/A               : <file>_aces.claim is removed
 
-const vector < string > AcesRender::getSupportedCameras ( ) const {
-    return _cameras;
+void AcesRender::unclaimRaw ( const char * raw ) const {
+    string claim = outputStem ( raw ) + "_aces.claim";
+    
+    if ( remove ( claim.c_str() ) && errno != ENOENT )
+        fprintf ( stderr, "\nError: Cannot remove %s: %s\n\n",
+                          claim.c_str(), strerror(errno) );
 }
 
-
 //	=====================================================================
-//	Print a list of Cameras Supported by LibRaw
+//	Record the conversion of a raw file in its "_aces.done" file ( one
+//  line per conversion ), for verifyRaws()
 //
 //	inputs:
-//      N/A
+//      const char *      : path to the raw file
 //
 //	outputs:
-//      N/A
+//      N/A               : a line is appended to <file>_aces.done
 
-void AcesRender::printLibRawCameras () {
-    const char ** cl = _rawProcessor->cameraList();
-    while (*(cl+1) != NULL)
-        printf ("%s\n", *cl++);
+void AcesRender::markConverted ( const char * raw ) const {
+    string done = outputStem ( raw ) + "_aces.done";
+    
+    FILE * file = fopen ( done.c_str(), "a" );
+    if ( !file ) {
+        fprintf ( stderr, "\nError: Cannot write %s: %s\n\n",
+                          done.c_str(), strerror(errno) );
+        return;
+    }
+    
+    fprintf ( file, "%s shard %d/%d\n", processTag().c_str(),
+                    _opts.shard_index, _opts.shard_count );
+    fclose ( file );
 }
 
 //	=====================================================================
-//	Get IDT matrix
+//	Check that every raw file has been converted exactly once by the
+//  "--shard" / "--claim" runs, from their "_aces.done" files
 //
 //	inputs:
-//      N/A
+//      vector < string > : paths to the raw files and tar archives
 //
 //	outputs:
-//      vector < vector < double > > : _idtm (3x3) values
-
-const vector < vector < double > > AcesRender::getIDTMatrix ( ) const {
-    return _idtm;
+//      int               : "0" means every file was converted once;
+//                          "1" means some were missed or repeated
+//                          ( listed on stdout )
+
+int AcesRender::verifyRaws ( const vector < string > & paths ) const {
+    RawArchives archives;
+    vector < string > RAWs;
+    expandInputs ( paths, archives, RAWs, 0, 1 );
+    
+    size_t once = 0, missing = 0, repeated = 0;
+    char line[512];
+    
+    FORI ( RAWs.size() ) {
+        string stem = outputStem ( RAWs[i].c_str() );
+        int count = 0;
+        
+        FILE * file = fopen ( ( stem + "_aces.done" ).c_str(), "r" );
+        if ( file ) {
+            while ( fgets ( line, sizeof(line), file ) )
+                count++;
+            fclose ( file );
+        }
+        
+        if ( count == 1 )
+            once++;
+        else if ( count > 1 ) {
+            repeated++;
+            printf ( "Converted %d times: %s\n", count, RAWs[i].c_str() );
+        }
+        else {
+            missing++;
+            
+            file = fopen ( ( stem + "_aces.claim" ).c_str(), "r" );
+            if ( file && fgets ( line, sizeof(line), file ) ) {
+                line[strcspn ( line, "\n" )] = 0;
+                printf ( "Missing: %s (claimed by %s)\n", RAWs[i].c_str(), line );
+            }
+            else
+                printf ( "Missing: %s\n", RAWs[i].c_str() );
+            
+            if ( file )
+                fclose ( file );
+        }
+    }
+    
+    printf ( "Verified %lu files: %lu converted once, %lu missing, "
+             "%lu converted more than once\n",
+             (unsigned long)RAWs.size(), (unsigned long)once,
+             (unsigned long)missing, (unsigned long)repeated );
+    
+    return ( missing || repeated ) ? 1 : 0;
 }
 
 //	=====================================================================
-//	Get CAT matrix
+//	Worker of convertRaws(): takes the next file if the budget admits
+//  it, otherwise steals row bands of the files in progress, until all
+//  files are done
 //
 //	inputs:
-//      N/A
+//      JobQueue *        : the files waiting, by priority class
+//      MemoryBudget *    : the "--max-memory" budget
+//      WorkSignal *      : wakes the worker when it has nothing to do
+//      int               : "1" for a worker kept for interactive files
+//                          ( "--reserve" ), which only helps with their
+//                          bands too
 //
 //	outputs:
-//      vector < vector < double > > : _catm (3x3) values
-
-const vector < vector < double > > AcesRender::getCATMatrix ( ) const {
-    return _catm;
+//      N/A               : ACES files will be generated
+
+void AcesRender::convertWorker ( JobQueue * queue,
+                                 MemoryBudget * budget,
+                                 WorkSignal * signal,
+                                 int reserved ) {
+    TaskScheduler::Task task;
+    JobQueue::Job job;
+    
+    while ( 1 ) {
+        size_t seen = signal->events();
+        int taken = queue->take ( reserved, budget, job );
+        
+        if ( taken > 0 ) {
+            _position = job.position;
+            _scheduler->setPriority ( _worker, job.priority );
+            convertRaw ( job.path.c_str() );
+            if ( _sequence )
+                _sequence->advance ( job.position );
+            budget->release ( job.bytes );
+            signal->notify();
+        }
+        else if ( taken < 0 && !budget->running() )
+            break;
+        else if ( _scheduler->steal ( _worker, task,
+                                      reserved ? priority1 : priority2 + 1 ) )
+            task();
+        else
+            signal->wait ( seen );
+    }
 }
 
 //	=====================================================================
-//	Get White Balance Coefficients
+//	Convert a single RAW file to ACES
 //
 //	inputs:
-//      N/A
+//      const char *      : path to the raw file
 //
 //	outputs:
-//      vector < double >  : _wbv (1x3) values
+//      int               : "1" means the ACES file(s) have been written;
+//                          "0" means error
 
-const vector < double > AcesRender::getWB ( ) const {
-    return _wbv;
+int AcesRender::convertRaw ( const char * raw ) {
+    std::chrono::high_resolution_clock::time_point start =
+        std::chrono::high_resolution_clock::now();
+    
+    if ( ( _cancel && _cancel->cancelled() )
+         || ( _opts.use_claim && !claimRaw ( raw ) ) ) {
+        if ( _prefetcher )
+            _prefetcher->drop ( raw );
+        return 0;
+    }
+    
+    // a file that is not converted is left for another run
+    auto fail = [&] ( ) {
+        if ( _opts.use_claim )
+            unclaimRaw ( raw );
+        return 0;
+    };
+    
+    if ( preprocessRaw ( raw ) != LIBRAW_SUCCESS ) {
+        recycle();
+        return fail();
+    }
+    if ( abandon ( raw ) )
+        return fail();
+    if ( _opts.use_timing ) {
+        printTiming ( "AcesRender::preprocessRaw()", raw, start );
+        
+        if ( _readSeconds > 0.0 )
+            printf ( "Timing: %s/read: %6.3f msec (%.1f MB/s)\n", raw,
+                     _readSeconds * 1000.0,
+                     double(_readBytes) / _readSeconds / double(1 << 20) );
+    }
+    
+    if ( postprocessRaw () != LIBRAW_SUCCESS ) {
+        if ( !abandon ( raw ) )
+            recycle();
+        return fail();
+    }
+    if ( _opts.use_timing )
+        printTiming ( "AcesRender::postprocessRaw()", raw, start );
+    if ( abandon ( raw ) )
+        return fail();
+    
+    int written;
+    if ( _opts.use_stdout ) {
+        written = outputStdout ();
+        if ( _opts.use_timing )
+            printTiming ( "AcesRender::outputStdout()", raw, start );
+    }
+    else if ( _opts.variants.size() ) {
+        written = outputVariants ();
+        if ( _opts.use_timing )
+            printTiming ( "AcesRender::outputVariants()", raw, start );
+    }
+    else {
+        written = outputACES ();
+        if ( _opts.use_timing )
+            printTiming ( "AcesRender::outputACES()", raw, start );
+    }
+    
+    // an interruption before the writes leaves no output behind
+    if ( _abandoned ) {
+        fprintf ( stderr, "\nError: %s: %s\n", raw,
+                  interrupted() ? interrupted() : "interrupted" );
+        releasePixels();
+        return fail();
+    }
+    
+    if ( !written )
+        return fail();
+    
+    if ( _opts.use_claim || _opts.shard_count > 1 )
+        markConverted ( raw );
+    
+    return 1;
 }
 
 //	=====================================================================
-//	Get Image Buffer
+//	Inspect a single RAW file: parse the header, choose the white
+//  balance and IDT the conversion would use, and estimate its cost
 //
 //	inputs:
-//      N/A
+//      const char *   : path to the raw file
+//      LibRawAces *   : libraw instance owned by the calling thread
+//      Idt *          : Idt instance owned by the calling thread
+//      InspectState & : per-thread cache
 //
 //	outputs:
-//      libraw_processed_image_t : _image
+//      string         : one JSON object (without newline)
 
-const libraw_processed_image_t * AcesRender::getImageBuffer() const {
-    assert(_image);
+#ifdef P
+#undef P
+#endif
     
-    return _image;
+#ifdef C
+#undef C
+#endif
+
+string AcesRender::inspectRaw ( const char * path,
+                                LibRawAces * rawProcessor,
+                                Idt * idt,
+                                InspectState & state ) const {
+    struct timeval start, end;
+    gettimeofday ( &start, NULL );
+    
+    char buf[512];
+    string json = "{\"file\":" + jsonString ( path );
+    
+    int ret = rawProcessor->open_file ( path );
+    if ( ret != LIBRAW_SUCCESS ) {
+        json += ",\"error\":" + jsonString ( libraw_strerror(ret) ) + "}";
+        return json;
+    }
+    
+    const libraw_iparams_t & P = rawProcessor->imgdata.idata;
+    const libraw_colordata_t & C = rawProcessor->imgdata.color;
+    const libraw_image_sizes_t & S = rawProcessor->imgdata.sizes;
+    const libraw_imgother_t & O = rawProcessor->imgdata.other;
+    
+    json += ",\"make\":" + jsonString ( P.make );
+    json += ",\"model\":" + jsonString ( P.model );
+    
+    snprintf ( buf, sizeof(buf),
+               ",\"dng_version\":%u,\"raw_width\":%u,\"raw_height\":%u"
+               ",\"width\":%u,\"height\":%u,\"colors\":%d,\"filters\":%u"
+               ",\"black\":%u,\"maximum\":%u,\"iso\":%g,\"shutter\":%g"
+               ",\"aperture\":%g,\"focal_len\":%g,\"timestamp\":%lld",
+               P.dng_version, S.raw_width, S.raw_height, S.width, S.height,
+               P.colors, P.filters, C.black, C.maximum, O.iso_speed,
+               O.shutter, O.aperture, O.focal_len, (long long) O.timestamp );
+    json += buf;
+    
+    snprintf ( buf, sizeof(buf), ",\"cam_mul\":[%g,%g,%g,%g]",
+               C.cam_mul[0], C.cam_mul[1], C.cam_mul[2], C.cam_mul[3] );
+    json += buf;
+    
+    //  The IDT follows the same choice as renderACES() and prepareIDT()
+    if ( _opts.mat_method == matMethod0 && _opts.use_profile && !_opts.illumType
+         && fetchProfile ( P, &state.profile, state.profileLoaded ) ) {
+        const float * mul = C.cam_mul[0] > 0 ? C.cam_mul : C.pre_mul;
+        vector < double > mulV ( mul, mul+3 );
+        vector < double > wb;
+        vector < vector < double > > M;
+        double cct = state.profile.interpolate ( mulV, wb, M );
+        
+        if ( cct > 0.0 ) {
+            snprintf ( buf, sizeof(buf),
+                       ",\"idt_source\":\"profile\",\"cct\":%.0f,\"wb\":[%g,%g,%g]"
+                       ",\"idt\":[[%.6f,%.6f,%.6f],[%.6f,%.6f,%.6f],[%.6f,%.6f,%.6f]]",
+                       cct, wb[0], wb[1], wb[2],
+                       M[0][0], M[0][1], M[0][2],
+                       M[1][0], M[1][1], M[1][2],
+                       M[2][0], M[2][1], M[2][2] );
+            json += buf;
+        }
+        else
+            json += ",\"idt_source\":\"none\"";
+    }
+    else if ( _opts.mat_method == matMethod0 ) {
+        string camera = string ( P.make ) + " / " + P.model;
+        if ( camera != state.camera ) {
+            state.camera = camera;
+            state.hasSpst = fetchCameraSenPath ( P, idt );
+        }
+        
+        if ( state.hasSpst && !state.loaded ) {
+            state.loaded = fetchIlluminant ( _opts.illumType ? _opts.illumType : "na",
+                                             idt );
+            idt->loadTrainingData ( static_cast < string > ( FILEPATH )
+                                    +"training/training_spectral.json" );
+            idt->loadCMF ( static_cast < string > ( FILEPATH )
+                           +"cmf/cmf_1931.json" );
+        }
+        
+        if ( state.hasSpst && state.loaded ) {
+            if ( _opts.illumType )
+                idt->chooseIllumType ( _opts.illumType, _opts.highlight );
+            else {
+                const float * mul = C.cam_mul[0] > 0 ? C.cam_mul : C.pre_mul;
+                vector < double > mulV ( mul, mul+3 );
+                idt->chooseIllumSrc ( mulV, _opts.highlight );
+            }
+            
+            string illum = idt->getBestIllum().getIllumType();
+            string key = camera + " / " + illum;
+            
+            if ( state.idts.find(key) == state.idts.end() ) {
+                idt->setWarmStart ( 1 );
+                idt->setDeltaEThreshold ( _opts.fit_threshold );
+                if ( idt->calIDT() )
+                    state.idts[key] = idt->getIDT();
+            }
+            
+            vector < double > wb = idt->getWB();
+            json += ",\"idt_source\":\"spectral\",\"illuminant\":" + jsonString ( illum.c_str() );
+            snprintf ( buf, sizeof(buf), ",\"wb\":[%g,%g,%g]", wb[0], wb[1], wb[2] );
+            json += buf;
+            
+            if ( state.idts.find(key) != state.idts.end() ) {
+                const vector < vector < double > > & M = state.idts[key];
+                snprintf ( buf, sizeof(buf),
+                           ",\"idt\":[[%.6f,%.6f,%.6f],[%.6f,%.6f,%.6f],[%.6f,%.6f,%.6f]]",
+                           M[0][0], M[0][1], M[0][2],
+                           M[1][0], M[1][1], M[1][2],
+                           M[2][0], M[2][1], M[2][2] );
+                json += buf;
+            }
+        }
+        else
+            json += ",\"idt_source\":\"none\"";
+    }
+    else if ( P.dng_version ) {
+        //  the color data is only copied into rawdata by unpack()
+        libraw_rawdata_t R = rawProcessor->imgdata.rawdata;
+        R.color = C;
+        
+        DNGIdt * dng = new DNGIdt ( R );
+        vector < vector < double > > M = dng->getDNGIDTMatrix();
+        delete dng;
+        
+        json += ",\"idt_source\":\"dng\"";
+        snprintf ( buf, sizeof(buf),
+                   ",\"idt\":[[%.6f,%.6f,%.6f],[%.6f,%.6f,%.6f],[%.6f,%.6f,%.6f]]",
+                   M[0][0], M[0][1], M[0][2],
+                   M[1][0], M[1][1], M[1][2],
+                   M[2][0], M[2][1], M[2][2] );
+        json += buf;
+    }
+    else {
+        json += ",\"idt_source\":\"metadata\"";
+        snprintf ( buf, sizeof(buf),
+                   ",\"cam_xyz\":[[%.6f,%.6f,%.6f],[%.6f,%.6f,%.6f],[%.6f,%.6f,%.6f]]",
+                   C.cam_xyz[0][0], C.cam_xyz[0][1], C.cam_xyz[0][2],
+                   C.cam_xyz[1][0], C.cam_xyz[1][1], C.cam_xyz[1][2],
+                   C.cam_xyz[2][0], C.cam_xyz[2][1], C.cam_xyz[2][2] );
+        json += buf;
+    }
+    
+    gettimeofday ( &end, NULL );
+    double msec = ( end.tv_sec - start.tv_sec ) * 1000.0 +
+                  ( end.tv_usec - start.tv_usec ) / 1000.0;
+    
+    snprintf ( buf, sizeof(buf),
+               ",\"est_memory\":%llu,\"est_msec\":%.1f,\"inspect_msec\":%.3f}",
+               (unsigned long long) estimateFootprint ( rawProcessor->imgdata ),
+               estimateRenderTime ( rawProcessor->imgdata ),
+               msec );
+    json += buf;
+    
+    return json;
 }
 
 //	=====================================================================
-//	Fetch user option list
+//	Write the ACES image of the current file to the standard output
+//  ( "--stdout" ): an EXR file, or a one-line JSON header followed by
+//  the half or float pixels, interleaved or planar. When files are
+//  converted in parallel, frames are written in the order of the files.
 //
 //	inputs:
-//      NA
+//      N/A
 //
 //	outputs:
-//      Options   :  _opts will be returned
+//      int        : "1" means the frame has been written to the
+//                   standard output; "0" means error
 
-const struct Option AcesRender::getSettings ( ) const {
-    return _opts;
+int AcesRender::outputStdout ( ) {
+    assert ( _image != nullptr && pixelStream != nullptr );
+    
+    if ( _opts.stdout_mode == stdoutMode0 ) {
+        int container = _opts.out_format == outFormat0;
+        float * aces = renderACES ( container ? 1.0 : floatScale ( getHighlightRatio() ) );
+        int written = 0;
+        
+        if ( aces ) {
+            written = container ? acesWrite ( "-", aces, getHighlightRatio() )
+                                : exrWrite ( "-", aces, getHighlightRatio() );
+            delete [] aces;
+        }
+        else
+            fprintf ( stderr, "\nError: Cannot allocate the ACES buffer\n" );
+        
+        recycle();
+        return written;
+    }
+    
+    int half = _opts.stdout_mode == stdoutMode1 || _opts.stdout_mode == stdoutMode3;
+    int planar = _opts.stdout_mode == stdoutMode3 || _opts.stdout_mode == stdoutMode4;
+    string name ( _pathToRaw );
+    
+    AcesBuffer out;
+    out.type = half ? pixelHalf : pixelFloat;
+    if ( !outputACES ( out ) )
+        return 0;
+    
+    void * data = out.data;
+    int written = 0;
+    size_t pixels = size_t(out.width) * out.height;
+    
+    if ( planar && ( data = malloc ( out.size ) ) ) {
+        if ( half )
+            toPlanar ( static_cast < halfBytes * > (out.data),
+                       static_cast < halfBytes * > (data), pixels, out.channels );
+        else
+            toPlanar ( static_cast < float * > (out.data),
+                       static_cast < float * > (data), pixels, out.channels );
+    }
+    
+    if ( data ) {
+        string header = stdoutHeader ( name.c_str(), out.width, out.height,
+                                       out.channels, half, planar, out.size );
+        
+        if ( _sequence )
+            _sequence->wait ( _position );
+        
+        if ( fwrite ( header.data(), 1, header.size(), pixelStream ) != header.size()
+             || fwrite ( data, 1, out.size, pixelStream ) != out.size
+             || fflush ( pixelStream ) )
+            fprintf ( stderr, "\nError: Cannot write to the standard output: %s\n",
+                              strerror(errno) );
+        else
+            written = 1;
+    }
+    else
+        fprintf ( stderr, "\nError: Cannot allocate %lu bytes for the planar "
+                          "pixels\n", (unsigned long) out.size );
+    
+    if ( data != out.data )
+        free ( data );
+    if ( out.allocated )
+        free ( out.data );
+    
+    return written;
 }
-
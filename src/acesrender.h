@@ -69,6 +69,60 @@ using namespace rta;
 
 void create_key ( unordered_map < string, char > & keys );
 void usage ( const char * prog );
+size_t estimateFootprint ( const libraw_data_t & data, int outputs = 1,
+                           size_t bandRows = 0, int heldOutput = 0 );
+double estimateRenderTime ( const libraw_data_t & data );
+
+enum pixelType_t { pixelHalf, pixelFloat };
+
+class MemoryBudget;
+class TaskScheduler;
+class JobQueue;
+class WorkSignal;
+class RawPrefetcher;
+class RawArchives;
+class OutputSequence;
+
+//  Cancellation of conversions in progress ( AcesRender::setCancelToken );
+//  cancel() may be called from any thread
+class CancelToken {
+    public:
+        CancelToken ( ) : _cancelled(0) {};
+    
+        void cancel ( ) { _cancelled = 1; };
+        void reset ( ) { _cancelled = 0; };
+        int cancelled ( ) const { return _cancelled; };
+    
+    private:
+        std::atomic < int > _cancelled;
+};
+
+//  In-memory ACES output for AcesRender::outputACES ( AcesBuffer & ).
+//  If "data" is nullptr the pixel storage is allocated with malloc()
+//  and "allocated" is set; the caller releases it with free().
+struct AcesBuffer {
+    AcesBuffer() : type(pixelHalf), data(nullptr), size(0), allocated(0),
+                   width(0), height(0), channels(0), dngVersion(0) {
+        make[0] = model[0] = '\0';
+        FORI(3) wb[i] = 1.0;
+        FORIJ(3, 3) idt[i][j] = neutral3[i][j];
+    };
+    
+    pixelType_t type;
+    void * data;
+    size_t size;
+    int allocated;
+    
+    uint32_t width;
+    uint32_t height;
+    uint8_t channels;
+    
+    char make[64];
+    char model[64];
+    unsigned dngVersion;
+    double wb[3];
+    double idt[3][3];
+};
 
 class LibRawAces : virtual public LibRaw {
     public:
@@ -87,31 +141,47 @@ class AcesRender {
         int configureSettings ( int argc, char * argv[] );
         int fetchCameraSenPath ( const libraw_iparams_t & P );
         int fetchIlluminant ( const char * illumType = "na" );
+        void fetchTrainingData ( );
+        int fetchProfile ( const libraw_iparams_t & P );
     
         int openRawPath ( const char * pathToRaw );
+        int openRawBuffer ( const void * buffer, size_t size );
         int unpack ( const char * pathToRaw );
         int dcraw ( );
+        libraw_processed_image_t * fastPreview ( );
+        int greyBoxWB ( );
     
         int prepareIDT ( const libraw_iparams_t & P, float * M );
         int prepareWB ( const libraw_iparams_t & P );
         int preprocessRaw ( const char * path );
+        int preprocessRaw ( const void * buffer, size_t size );
         int postprocessRaw ( );
-        void outputACES ( );
+        int outputACES ( );
+        int outputACES ( AcesBuffer & out );
+        int outputVariants ( );
+        int outputStdout ( );
     
         void initialize ( const dataPath & dp );
         void setPixels ( libraw_processed_image_t * image );
         void gatherSupportedIllums ();
         void gatherSupportedCameras ();
         void printLibRawCameras ();
-        void applyWB  ( float * pixels, int bits, uint32_t total );
-        void applyIDT ( float * pixels, int bits, uint32_t total );
-        void applyCAT ( float * pixels, int channel, uint32_t total );
-        void acesWrite ( const char * name, float *  aces, float ratio = 1.0) const;
+        void applyWB  ( float * pixels, int bits, size_t total );
+        void applyIDT ( float * pixels, int bits, size_t total, double scale = 1.0 );
+        void applyCAT ( float * pixels, int channel, size_t total );
+        int acesWrite ( const char * name, float *  aces, float ratio = 1.0) const;
+        int exrWrite ( const char * name, float * aces, float ratio = 1.0 ) const;
+        int outputBands ( const char * name,
+                          const vector < vector < vector < double > > > & matrices );
+        void recycle ( );
     
-        float * renderACES ();
-        float * renderDNG ();
-        float * renderNonDNG ();
-        float * renderIDT ();
+        float * renderACES ( double scale = 1.0 );
+        float * renderDNG ( double scale = 1.0 );
+        float * renderNonDNG ( double scale = 1.0 );
+        float * renderIDT ( double scale = 1.0 );
+        vector < vector < vector < double > > > renderMatrices ( double scale = 1.0 );
+        void renderRows ( const vector < vector < vector < double > > > & matrices,
+                          size_t first, size_t rows, float * aces ) const;
     
         const vector < string > getSupportedIllums () const;
         const vector < string > getSupportedCameras () const;
@@ -120,24 +190,154 @@ class AcesRender {
         const vector < double > getWB () const;
         const libraw_processed_image_t * getImageBuffer() const;
         const struct Option getSettings ( ) const;
+        float getHighlightRatio ( ) const;
+    
+        void inspectRaws ( const vector < string > & RAWs ) const;
+        void convertRaws ( const vector < string > & paths );
+        int verifyRaws ( const vector < string > & paths ) const;
+    
+        void setCancelToken ( CancelToken * token );
+        const char * interrupted ( ) const;
 
     private:
         AcesRender();
+        AcesRender ( const AcesRender & acesrender );
         ~AcesRender();
         static AcesRender & getPrivateInstance();
     
         const AcesRender & operator=( const AcesRender & acesrender );
+        double getOutputScale ( float ratio ) const;
+        double floatScale ( float ratio ) const;
+    
+        uint64_t cacheKey ( ) const;
+        int loadCache ( const char * path, uint64_t key );
+        void saveCache ( const char * path, uint64_t key ) const;
+        void releasePixels ( );
+    
+        //  ACES values of rows [first, first + rows) for the band-wise
+        //  writers; the pointer stays valid until the next call
+        typedef std::function < float * ( size_t first, size_t rows ) > RowSource;
+        int acesWriteRows ( const char * name, float ratio, size_t band,
+                            const RowSource & source ) const;
+        int exrWriteRows ( const char * name, float ratio, size_t band,
+                           const RowSource & source ) const;
+    
+        void startDeadline ( );
+        int abandon ( const char * raw );
+    
+        int claimRaw ( const char * raw ) const;
+        void unclaimRaw ( const char * raw ) const;
+        void markConverted ( const char * raw ) const;
+        void recordDigest ( const char * path, uint64_t digest ) const;
+    
+        //  Per-thread state of "--inspect"; spectral datasets and camera
+        //  profiles are loaded once per thread and IDT results are reused
+        //  per camera/illuminant
+        struct InspectState {
+            InspectState() : loaded(0), hasSpst(0) {};
+            
+            int loaded;
+            int hasSpst;
+            string camera;
+            unordered_map < string, vector < vector < double > > > idts;
+            
+            Profile profile;
+            string profileLoaded;
+        };
+    
+        //  One file of "--variant": the IDT matrix (with the white
+        //  balance correction folded in) and the factor on the headroom
+        struct VariantJob {
+            string name;
+            vector < vector < double > > idt;
+            float ratio;
+        };
+    
+        int variantIDT ( const outputVariant & variant,
+                         vector < vector < double > > & idt );
+        void variantWorker ( const vector < VariantJob > & jobs,
+                             size_t * next,
+                             std::mutex * mtx,
+                             int * failed ) const;
+    
+        int convertRaw ( const char * raw );
+        void convertWorker ( JobQueue * queue,
+                             MemoryBudget * budget,
+                             WorkSignal * signal,
+                             int reserved );
+        void forBands ( size_t rows, size_t rowSize,
+                        const std::function < void ( size_t, size_t ) > & body ) const;
+    
+        int fetchCameraSenPath ( const libraw_iparams_t & P, Idt * idt ) const;
+        int fetchIlluminant ( const char * illumType, Idt * idt ) const;
+        int fetchProfile ( const libraw_iparams_t & P, Profile * profile,
+                           string & loaded ) const;
+        string inspectRaw ( const char * path,
+                            LibRawAces * rawProcessor,
+                            Idt * idt,
+                            InspectState & state ) const;
+        void inspectWorker ( const vector < string > & RAWs,
+                             size_t * next,
+                             std::mutex * mtx ) const;
     
         char * _pathToRaw;
         Idt * _idt;
+        Profile * _profile;
         libraw_processed_image_t * _image;
         LibRawAces * _rawProcessor;
     
+        //  "--cache": hash of the current input (0 if not cached), set
+        //  when unpack() is deferred to a cache miss, and the mapping of
+        //  the cache file "_image" points into (nullptr if malloc-ed)
+        uint64_t _inputHash;
+        int _pendingUnpack;
+        void * _cacheMap;
+        size_t _cacheMapSize;
+    
+        //  scheduler of convertRaws() and the index of the worker running
+        //  this renderer (nullptr / 0 outside of convertRaws())
+        TaskScheduler * _scheduler;
+        int _worker;
+    
+        //  "--prefetch": the background reader of convertRaws(), the
+        //  stream of the current file (nullptr if libraw reads it) and
+        //  how long reading it took
+        RawPrefetcher * _prefetcher;
+        LibRaw_abstract_datastream * _stream;
+        size_t _readBytes;
+        double _readSeconds;
+    
+        //  members of the tar archives given to convertRaws()
+        const RawArchives * _archives;
+    
+        //  "--stdout": order of the frames in convertRaws() and the
+        //  position of the current file in it
+        OutputSequence * _sequence;
+        size_t _position;
+    
+        //  cancellation token ( shared with the workers of convertRaws() )
+        //  and "--deadline" of the current file
+        CancelToken * _cancel;
+        std::chrono::steady_clock::time_point _deadline;
+        mutable std::atomic < int > _abandoned;
+    
+        //  digests of the "--variant" outputs of the current file, held
+        //  until all of them are written ( guarded by the manifest lock )
+        vector < std::pair < string, uint64_t > > * _heldDigests;
+    
         Option _opts;
         vector < vector < double > > _idtm;
         vector < vector < double > > _catm;
         vector < double > _wbv;
         vector < string > _illuminants;
         vector < string > _cameras;
+    
+        //  datasets already loaded into "_idt" (each is loaded once,
+        //  on first use)
+        string _cameraLoaded;
+        string _illumLoaded;
+        int _trainingLoaded;
+        //  camera of the profile in "_profile" ("-" if none was found)
+        string _profileLoaded;
 };
 #endif
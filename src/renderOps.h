@@ -0,0 +1,1447 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2013 Academy of Motion Picture Arts and Sciences
+// ("A.M.P.A.S."). Portions contributed by others as indicated.
+// All rights reserved.
+//
+// A worldwide, royalty-free, non-exclusive right to copy, modify, create
+// derivatives, and use, in source and binary forms, is hereby granted,
+// subject to acceptance of this license. Performance of any of the
+// aforementioned acts indicates acceptance to be bound by the following
+// terms and conditions:
+//
+//  * Copies of source code, in whole or in part, must retain the
+//    above copyright notice, this list of conditions and the
+//    Disclaimer of Warranty.
+//
+//  * Use in binary form must retain the above copyright notice,
+//    this list of conditions and the Disclaimer of Warranty in the
+//    documentation and/or other materials provided with the distribution.
+//
+//  * Nothing in this license shall be deemed to grant any rights to
+//    trademarks, copyrights, patents, trade secrets or any other
+//    intellectual property of A.M.P.A.S. or any contributors, except
+//    as expressly stated herein.
+//
+//  * Neither the name "A.M.P.A.S." nor the name of any other
+//    contributors to this software may be used to endorse or promote
+//    products derivative of or based on this software without express
+//    prior written permission of A.M.P.A.S. or the contributors, as
+//    appropriate.
+//
+// This license shall be construed pursuant to the laws of the State of
+// California, and any disputes related thereto shall be subject to the
+// jurisdiction of the courts therein.
+//
+// Disclaimer of Warranty: THIS SOFTWARE IS PROVIDED BY A.M.P.A.S. AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+// BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT ARE DISCLAIMED. IN NO
+// EVENT SHALL A.M.P.A.S., OR ANY CONTRIBUTORS OR DISTRIBUTORS, BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, RESITUTIONARY,
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+// THE POSSIBILITY OF SUCH DAMAGE.
+//
+// WITHOUT LIMITING THE GENERALITY OF THE FOREGOING, THE ACADEMY
+// SPECIFICALLY DISCLAIMS ANY REPRESENTATIONS OR WARRANTIES WHATSOEVER
+// RELATED TO PATENT OR OTHER INTELLECTUAL PROPERTY RIGHTS IN THE ACADEMY
+// COLOR ENCODING SYSTEM, OR APPLICATIONS THEREOF, HELD BY PARTIES OTHER
+// THAN A.M.P.A.S., WHETHER DISCLOSED OR UNDISCLOSED.
+///////////////////////////////////////////////////////////////////////////
+
+#ifndef _RENDEROPS_h__
+#define _RENDEROPS_h__
+
+//  Helpers of the batch and output code of AcesRender that do not need
+//  a renderer: hashes, the "--cache" file layout and its key, output
+//  names, the "--stdout" pixel stream, tar fields, the "--stats"
+//  statistics, the grey-box white balance, the kernels of the built-in
+//  preview and the memory budget and queue of convertRaws(). They are
+//  kept here, header-only like lib/mathOps.h, so the unit tests can use
+//  them directly.
+
+#include "../lib/define.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <float.h>
+#include <math.h>
+#include <errno.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+
+#ifndef _LIBRAW_CLASS_H
+#include <libraw/libraw.h>
+#endif
+
+//	=====================================================================
+//  64-bit FNV-1a style hash taken eight bytes at a time (with a fold so
+//  that the high bits of each word reach the low bits of the result).
+//  It keys the "--cache" files by the content of the input.
+
+static const uint64_t hashBasis = 0xcbf29ce484222325ULL;
+
+inline uint64_t hashBytes ( const void * data, size_t size, uint64_t h ) {
+    const unsigned char * bytes = static_cast < const unsigned char * > (data);
+    const uint64_t prime = 0x100000001b3ULL;
+    size_t i = 0;
+    
+    for ( ; i + 8 <= size; i += 8 ) {
+        uint64_t word;
+        memcpy ( &word, bytes + i, 8 );
+        h = ( h ^ word ) * prime;
+        h ^= h >> 32;
+    }
+    
+    for ( ; i < size; i++ )
+        h = ( h ^ bytes[i] ) * prime;
+    
+    return h;
+}
+
+//	=====================================================================
+//  Streaming XXH64 ( the digest of "xxhsum -H1" ), for "--manifest"
+
+class Xxh64 {
+    public:
+        Xxh64 ( uint64_t seed = 0 ) : _total(0), _size(0) {
+            _v[0] = seed + prime1 + prime2;
+            _v[1] = seed + prime2;
+            _v[2] = seed;
+            _v[3] = seed - prime1;
+        };
+    
+        void update ( const void * data, size_t size ) {
+            const unsigned char * p = static_cast < const unsigned char * > (data);
+            const unsigned char * end = p + size;
+            _total += size;
+            
+            if ( _size + size < 32 ) {
+                memcpy ( _mem + _size, p, size );
+                _size += size;
+                return;
+            }
+            
+            if ( _size ) {
+                memcpy ( _mem + _size, p, 32 - _size );
+                p += 32 - _size;
+                FORI ( 4 ) _v[i] = round ( _v[i], read64 ( _mem + 8 * i ) );
+                _size = 0;
+            }
+            
+            for ( ; p + 32 <= end; p += 32 )
+                FORI ( 4 ) _v[i] = round ( _v[i], read64 ( p + 8 * i ) );
+            
+            _size = size_t ( end - p );
+            memcpy ( _mem, p, _size );
+        };
+    
+        uint64_t digest ( ) const {
+            uint64_t h;
+            
+            if ( _total >= 32 ) {
+                h = rotl ( _v[0], 1 ) + rotl ( _v[1], 7 )
+                    + rotl ( _v[2], 12 ) + rotl ( _v[3], 18 );
+                FORI ( 4 ) h = ( h ^ round ( 0, _v[i] ) ) * prime1 + prime4;
+            }
+            else
+                h = _v[2] + prime5;
+            
+            h += _total;
+            
+            const unsigned char * p = _mem;
+            const unsigned char * end = _mem + _size;
+            
+            for ( ; p + 8 <= end; p += 8 )
+                h = rotl ( h ^ round ( 0, read64 ( p ) ), 27 ) * prime1 + prime4;
+            
+            if ( p + 4 <= end ) {
+                uint32_t k;
+                memcpy ( &k, p, 4 );
+                h = rotl ( h ^ ( uint64_t(k) * prime1 ), 23 ) * prime2 + prime3;
+                p += 4;
+            }
+            
+            for ( ; p < end; p++ )
+                h = rotl ( h ^ ( *p * prime5 ), 11 ) * prime1;
+            
+            h ^= h >> 33;
+            h *= prime2;
+            h ^= h >> 29;
+            h *= prime3;
+            h ^= h >> 32;
+            
+            return h;
+        };
+    
+    private:
+        static const uint64_t prime1 = 11400714785074694791ULL;
+        static const uint64_t prime2 = 14029467366897019727ULL;
+        static const uint64_t prime3 = 1609587929392839161ULL;
+        static const uint64_t prime4 = 9650029242287828579ULL;
+        static const uint64_t prime5 = 2870177450012600261ULL;
+    
+        static uint64_t rotl ( uint64_t x, int r ) { return ( x << r ) | ( x >> ( 64 - r ) ); };
+    
+        static uint64_t read64 ( const unsigned char * p ) {
+            uint64_t x;
+            memcpy ( &x, p, 8 );
+            return x;
+        };
+    
+        static uint64_t round ( uint64_t acc, uint64_t input ) {
+            return rotl ( acc + input * prime2, 31 ) * prime1;
+        };
+    
+        uint64_t _v[4];
+        uint64_t _total;
+        unsigned char _mem[32];
+        size_t _size;
+};
+
+//	=====================================================================
+//  Read back a file written by aces_Writer, which only writes to a named
+//  file: its bytes are hashed for "--manifest" and/or copied to a stream
+//
+//	inputs:
+//      const char *  : path to the file
+//      FILE *        : stream the file is copied to, or nullptr
+//
+//	outputs:
+//      const char *  : nullptr on success, or the error
+//      uint64_t *    : XXH64 of the file, if not nullptr
+
+inline const char * streamFile ( const char * path, FILE * out, uint64_t * digest ) {
+    FILE * file = fopen ( path, "rb" );
+    if ( !file )
+        return strerror ( errno );
+    
+    vector < char > buffer ( 1 << 20 );
+    Xxh64 hash;
+    const char * error = nullptr;
+    size_t n;
+    
+    while ( !error && ( n = fread ( &buffer[0], 1, buffer.size(), file ) ) > 0 ) {
+        if ( digest )
+            hash.update ( &buffer[0], n );
+        if ( out && fwrite ( &buffer[0], 1, n, out ) != n )
+            error = strerror ( errno );
+    }
+    
+    if ( !error && ferror ( file ) )
+        error = strerror ( errno );
+    fclose ( file );
+    
+    if ( digest )
+        *digest = hash.digest();
+    
+    return error;
+}
+
+//  =====================================================================
+//  Layout of a "--cache" file: this header, then (at "offset") the
+//  libraw_processed_image_t exactly as dcraw_make_mem_image() returns
+//  it, so that the file is mapped and used in place. "preMul" holds
+//  color.pre_mul as left by dcraw_process() (the final WB factors).
+//  The rest is the part of rawdata.color read by DNGIdt, which only
+//  unpack() fills in and so is missing when the cache is used.
+
+struct RenderCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t offset;
+    uint64_t key;
+    uint64_t size;
+    float preMul[4];
+    float camMul[4];
+    float baselineExposure;
+    uint16_t illuminant[2];
+    float calibration[2][4][4];
+    float colorMatrix[2][4][3];
+};
+
+static const char cacheMagic[8] = { 'R', 'T', 'A', 'C', 'A', 'C', 'H', 'E' };
+static const uint32_t cacheVersion = 2;
+static const uint32_t cacheOffset = 512;
+
+//  =====================================================================
+//  Key of the demosaiced image in "--cache": the content of the input,
+//  the LibRaw version and every parameter that changes the output of
+//  dcraw_process() or the built-in preview. The IDT, headroom and
+//  output format are applied afterwards and not included.
+//
+//  inputs:
+//      uint64_t                         : hash of the input (hashBytes())
+//      const char *                     : LibRaw::version()
+//      const libraw_output_params_t &   : the LibRaw parameters
+//      const Option &                   : the rawtoaces options
+//
+//  outputs:
+//      uint64_t                         : the key (also the name of the
+//                                         cache file)
+
+inline uint64_t renderCacheKey ( uint64_t input,
+                                 const char * version,
+                                 const libraw_output_params_t & params,
+                                 const Option & opts ) {
+    uint64_t h = hashBytes ( version, strlen ( version ), input );
+    
+    h = hashBytes ( params.greybox, sizeof ( params.greybox ), h );
+    if ( opts.wb_method == wbMethod3 ) {
+        FORI ( opts.wb_boxes.size() )
+            h = hashBytes ( &opts.wb_boxes[i], sizeof ( wbBox ), h );
+        h = hashBytes ( &opts.wb_estimator, sizeof ( opts.wb_estimator ), h );
+    }
+    h = hashBytes ( params.cropbox, sizeof ( params.cropbox ), h );
+    h = hashBytes ( params.aber, sizeof ( params.aber ), h );
+    h = hashBytes ( params.gamm, sizeof ( params.gamm ), h );
+    h = hashBytes ( params.user_mul, sizeof ( params.user_mul ), h );
+    h = hashBytes ( params.user_cblack, sizeof ( params.user_cblack ), h );
+    
+    int flags[] = { static_cast < int > ( params.shot_select ),
+                    params.half_size, params.four_color_rgb, params.highlight,
+                    params.use_auto_wb, params.use_camera_wb, params.use_camera_matrix,
+                    params.output_color, params.output_bps, params.user_flip,
+                    params.user_qual, params.user_black, params.user_sat,
+                    params.med_passes, params.no_auto_bright, params.use_fuji_rotate,
+                    params.green_matching, static_cast < int > ( opts.preview_mode ) };
+    h = hashBytes ( flags, sizeof ( flags ), h );
+    
+    float levels[] = { params.bright, params.threshold,
+                       params.auto_bright_thr, params.adjust_maximum_thr };
+    h = hashBytes ( levels, sizeof ( levels ), h );
+    
+    const char * files[] = { params.bad_pixels, params.dark_frame };
+    FORI ( 2 ) {
+        if ( files[i] )
+            h = hashBytes ( files[i], strlen ( files[i] ) + 1, h );
+        else
+            h = hashBytes ( &i, sizeof ( i ), h );
+    }
+    
+    return h;
+}
+
+//  =====================================================================
+//  Fill the header of the "--cache" file of an image
+//
+//  inputs:
+//      uint64_t                         : the key (see renderCacheKey())
+//      const libraw_processed_image_t * : the demosaiced image
+//      const float *                    : color.pre_mul
+//      const libraw_colordata_t &       : rawdata.color
+//
+//  outputs:
+//      RenderCacheHeader &              : the header
+
+inline void makeCacheHeader ( RenderCacheHeader & header,
+                              uint64_t key,
+                              const libraw_processed_image_t * image,
+                              const float * preMul,
+                              const libraw_colordata_t & color ) {
+    memset ( &header, 0x0, sizeof ( header ) );
+    memcpy ( header.magic, cacheMagic, sizeof ( cacheMagic ) );
+    header.version = cacheVersion;
+    header.offset  = cacheOffset;
+    header.key     = key;
+    header.size    = offsetof ( libraw_processed_image_t, data )
+                     + size_t(image->width) * image->height
+                       * image->colors * ( image->bits / 8 );
+    
+    FORI(4) {
+        header.preMul[i] = preMul[i];
+        header.camMul[i] = color.cam_mul[i];
+    }
+    
+    header.baselineExposure = color.baseline_exposure;
+    FORI(2) {
+        header.illuminant[i] = color.dng_color[i].illuminant;
+        memcpy ( header.calibration[i], color.dng_color[i].calibration,
+                 sizeof ( header.calibration[i] ) );
+        memcpy ( header.colorMatrix[i], color.dng_color[i].colormatrix,
+                 sizeof ( header.colorMatrix[i] ) );
+    }
+}
+
+//  =====================================================================
+//  Copy the color data of a "--cache" header back to LibRaw
+//
+//  inputs:
+//      const RenderCacheHeader &        : a valid header
+//
+//  outputs:
+//      float *                          : color.pre_mul
+//      libraw_colordata_t &             : rawdata.color, as DNGIdt reads it
+
+inline void restoreCacheColor ( const RenderCacheHeader & header,
+                                float * preMul,
+                                libraw_colordata_t & color ) {
+    FORI(4) {
+        preMul[i] = header.preMul[i];
+        color.cam_mul[i] = header.camMul[i];
+    }
+    
+    color.baseline_exposure = header.baselineExposure;
+    FORI(2) {
+        color.dng_color[i].illuminant = header.illuminant[i];
+        memcpy ( color.dng_color[i].calibration, header.calibration[i],
+                 sizeof ( header.calibration[i] ) );
+        memcpy ( color.dng_color[i].colormatrix, header.colorMatrix[i],
+                 sizeof ( header.colorMatrix[i] ) );
+    }
+}
+
+//  =====================================================================
+//  Check a "--cache" file read or mapped in memory
+//
+//  inputs:
+//      const void *       : the content of the file
+//      size_t             : its size
+//      uint64_t           : the expected key
+//
+//  outputs:
+//      int                : "1" means the header and the image at
+//                           cacheOffset are valid for the key
+
+inline int validCache ( const void * base, size_t size, uint64_t key ) {
+    size_t headerSize = cacheOffset + offsetof ( libraw_processed_image_t, data );
+    if ( size < headerSize )
+        return 0;
+    
+    const RenderCacheHeader * header = static_cast < const RenderCacheHeader * > (base);
+    const libraw_processed_image_t * image =
+        reinterpret_cast < const libraw_processed_image_t * >
+        ( static_cast < const char * > (base) + cacheOffset );
+    
+    if ( memcmp ( header->magic, cacheMagic, sizeof ( cacheMagic ) )
+         || header->version != cacheVersion
+         || header->offset != cacheOffset
+         || header->key != key
+         || header->size != size - cacheOffset )
+        return 0;
+    
+    size_t pixels = size_t ( image->width ) * image->height
+                    * image->colors * ( image->bits / 8 );
+    
+    // data_size is 32-bit in libraw
+    return image->data_size == static_cast < unsigned int > (pixels)
+           && headerSize + pixels <= size;
+}
+
+//  =====================================================================
+//  Write a "--cache" file
+//
+//  inputs:
+//      const char *                     : path to the file
+//      const RenderCacheHeader &        : its header (see makeCacheHeader())
+//      const libraw_processed_image_t * : the demosaiced image
+//
+//  outputs:
+//      int                              : "1" means the file is written
+
+inline int writeCache ( const char * path,
+                        const RenderCacheHeader & header,
+                        const libraw_processed_image_t * image ) {
+    char padding[cacheOffset];
+    memset ( padding, 0x0, sizeof ( padding ) );
+    
+    FILE * file = fopen ( path, "wb" );
+    int written = file
+                  && fwrite ( &header, sizeof ( header ), 1, file ) == 1
+                  && fwrite ( padding, cacheOffset - sizeof ( header ), 1, file ) == 1
+                  && fwrite ( image, header.size, 1, file ) == 1;
+    
+    if ( file && fclose ( file ) != 0 )
+        written = 0;
+    
+    return written;
+}
+
+//	=====================================================================
+//  Name of an output of a raw file: <stem>_aces.exr, or
+//  <stem>_aces_v<N>.exr for the N-th "--variant" ( N from 1 ); float
+//  EXR outputs end in "_float.exr" instead of ".exr"
+//
+//  inputs:
+//      const string &     : the path to the raw file without extension
+//      outFormats_t       : "--out-format"
+//      int                : the variant ( 0 for the main output )
+//
+//  outputs:
+//      string             : the path of the output
+
+inline string outputName ( const string & stem, outFormats_t format, int variant = 0 ) {
+    string name = stem + "_aces";
+    
+    if ( variant > 0 ) {
+        char number[16];
+        snprintf ( number, sizeof(number), "_v%d", variant );
+        name += number;
+    }
+    
+    return name + ( format == outFormat0 ? ".exr" : "_float.exr" );
+}
+
+//	=====================================================================
+//  Name of the "--stats" sidecar of an output: its ".exr" replaced by
+//  ".stats.json"
+
+inline string statsName ( const string & output ) {
+    string path ( output );
+    
+    if ( path.size() > 4 && !cmp_str ( path.c_str() + path.size() - 4, ".exr" ) )
+        path.erase ( path.size() - 4 );
+    
+    return path + ".stats.json";
+}
+
+//	=====================================================================
+//	Escape a string to be written as a JSON value
+//
+//	inputs:
+//      const char * : string
+//
+//	outputs:
+//      string       : quoted and escaped string
+
+inline string jsonString ( const char * str ) {
+    string out ( "\"" );
+    
+    for ( const char * c = str; *c; c++ ) {
+        if ( *c == '"' || *c == '\\' ) {
+            out += '\\';
+            out += *c;
+        }
+        else if ( (unsigned char)(*c) < 0x20 ) {
+            char buf[8];
+            snprintf ( buf, sizeof(buf), "\\u%04x", (unsigned char)(*c) );
+            out += buf;
+        }
+        else
+            out += *c;
+    }
+    
+    return out + "\"";
+}
+
+//	=====================================================================
+//	One-line JSON header of a frame of the "--stdout 1-4" pixel stream,
+//  written before its pixels
+//
+//	inputs:
+//      const char * : the raw file
+//      unsigned     : width
+//      unsigned     : height
+//      int          : channels ( 3 = RGB, 4 = RGBA )
+//      int          : "1" for half pixels, "0" for float
+//      int          : "1" for planar pixels, "0" for interleaved
+//      size_t       : bytes of pixels following the header
+//
+//	outputs:
+//      string       : the header, with its newline
+
+inline string stdoutHeader ( const char * file, unsigned width, unsigned height,
+                             int channels, int halfPixels, int planar, size_t bytes ) {
+    char buf[256];
+    snprintf ( buf, sizeof(buf),
+               ",\"width\":%u,\"height\":%u,\"channels\":\"%s\",\"type\":\"%s\","
+               "\"layout\":\"%s\",\"bytes\":%llu}\n",
+               width, height, channels == 4 ? "RGBA" : "RGB",
+               halfPixels ? "half" : "float", planar ? "planar" : "interleaved",
+               (unsigned long long) bytes );
+    
+    return "{\"file\":" + jsonString ( file ) + buf;
+}
+
+//	=====================================================================
+//	Planar copy of interleaved pixels ( "--stdout 3/4" ): all values of
+//  the first channel, then of the second, ...
+
+template < typename T >
+inline void toPlanar ( const T * in, T * out, size_t pixels, int channels ) {
+    FORI ( channels ) {
+        T * plane = out + i * pixels;
+        for ( size_t p = 0; p < pixels; p++ )
+            plane[p] = in[p * channels + i];
+    }
+}
+
+//	=====================================================================
+//	Statistics of an ACES output ( "--stats" ), gathered while its values
+//  are scaled for writing: per channel minimum, maximum and mean, the
+//  values at or below 0 and at or above the clip level ( the ACES value
+//  of a full-scale code value ), and a histogram in quarter stops, from
+//  which the 1st, 50th and 99th percentiles are read. Each band fills
+//  a partial of its own, merged into the total at its end.
+
+class ImageStats {
+    public:
+        enum { firstStop = -24, stops = 40, binsPerStop = 4,
+               bins = stops * binsPerStop };
+    
+        ImageStats ( int channels, float clip )
+            : _channels(channels), _clip(clip), _pixels(0), _clippedPixels(0),
+              _hist(size_t(channels) * bins, 0) {
+            FORI ( 4 ) {
+                _min[i]  = FLT_MAX;
+                _max[i]  = -FLT_MAX;
+                _sum[i]  = 0.0;
+                _low[i]  = 0;
+                _high[i] = 0;
+            }
+        };
+    
+        //  Add "count" values ( whole pixels ), multiplied by "scale"
+        void add ( const float * values, size_t count, float scale ) {
+            for ( size_t i = 0; i + _channels <= count; i += _channels ) {
+                int clipped = 0;
+                
+                for ( int c = 0; c < _channels; c++ ) {
+                    float v = values[i + c] * scale;
+                    
+                    _min[c] = std::min ( _min[c], v );
+                    _max[c] = std::max ( _max[c], v );
+                    _sum[c] += v;
+                    
+                    if ( !( v > 0.0f ) ) {
+                        _low[c]++;
+                        continue;
+                    }
+                    if ( v >= _clip ) {
+                        _high[c]++;
+                        clipped = 1;
+                    }
+                    
+                    // stop and quarter from the exponent and mantissa
+                    uint32_t bits;
+                    memcpy ( &bits, &v, sizeof(bits) );
+                    int bin = ( int ( ( bits >> 23 ) & 0xff ) - 127 - firstStop ) * binsPerStop
+                              + int ( ( bits >> 21 ) & 3 );
+                    _hist[size_t(c) * bins + std::max ( 0, std::min ( int(bins) - 1, bin ) )]++;
+                }
+                
+                _clippedPixels += clipped;
+                _pixels++;
+            }
+        };
+    
+        //  Scale [begin, end) of a band with "convert" in blocks small
+        //  enough to be added while they are still in cache
+        void scale ( const float * values, size_t begin, size_t end, float scale,
+                     const std::function < void ( size_t, size_t ) > & convert ) {
+            ImageStats partial ( _channels, _clip );
+            size_t block = size_t(_channels) * 4096;
+            
+            for ( size_t first = begin; first < end; first += block ) {
+                size_t last = std::min ( end, first + block );
+                convert ( first, last );
+                partial.add ( values + first, last - first, scale );
+            }
+            
+            std::lock_guard < std::mutex > lock ( _mtx );
+            FORI ( _channels ) {
+                _min[i]   = std::min ( _min[i], partial._min[i] );
+                _max[i]   = std::max ( _max[i], partial._max[i] );
+                _sum[i]  += partial._sum[i];
+                _low[i]  += partial._low[i];
+                _high[i] += partial._high[i];
+            }
+            FORI ( _hist.size() ) _hist[i] += partial._hist[i];
+            _pixels        += partial._pixels;
+            _clippedPixels += partial._clippedPixels;
+        };
+    
+        //  Value below which "fraction" of the values of a channel lie, to
+        //  the quarter stop of the histogram ( the lower edge of its bin );
+        //  0 if it is among the values at or below 0
+        float percentile ( int channel, double fraction ) const {
+            if ( !_pixels )
+                return 0.0f;
+            
+            uint64_t rank = std::min ( _pixels - 1, uint64_t ( fraction * double(_pixels) ) );
+            uint64_t count = _low[channel];
+            
+            FORI ( bins ) {
+                if ( rank < count )
+                    return i ? binValue ( i - 1 ) : 0.0f;
+                count += _hist[size_t(channel) * bins + i];
+            }
+            
+            return binValue ( bins - 1 );
+        };
+    
+        //  Lower edge of a histogram bin
+        static float binValue ( int bin ) {
+            return ldexpf ( 1.0f + float ( bin % binsPerStop ) / binsPerStop,
+                            firstStop + bin / binsPerStop );
+        };
+    
+        //  Write them as JSON next to the output: <name>.stats.json, with
+        //  the ".exr" extension of the output replaced
+        void save ( const char * output, int width, int height,
+                    int verbosity ) const {
+            string path = statsName ( output );
+            
+            static const char * names[4] = { "R", "G", "B", "A" };
+            char buf[256];
+            
+            snprintf ( buf, sizeof(buf), ",\"width\":%d,\"height\":%d,\"clip_level\":%g"
+                       ",\"clipped_pixels\":%llu,\"first_stop\":%d,\"bins_per_stop\":%d",
+                       width, height, _clip, (unsigned long long)_clippedPixels,
+                       int(firstStop), int(binsPerStop) );
+            string json = "{\"file\":" + jsonString ( output ) + buf + ",\"channels\":{";
+            
+            FORI ( _channels ) {
+                double mean = _pixels ? _sum[i] / double(_pixels) : 0.0;
+                snprintf ( buf, sizeof(buf), "%s\"%s\":{\"min\":%g,\"max\":%g,\"mean\":%g"
+                           ",\"p1\":%g,\"p50\":%g,\"p99\":%g"
+                           ",\"nonpositive\":%llu,\"clipped\":%llu,\"histogram\":[",
+                           i ? "," : "", names[i], _pixels ? _min[i] : 0.0f,
+                           _pixels ? _max[i] : 0.0f, mean,
+                           percentile ( i, 0.01 ), percentile ( i, 0.5 ), percentile ( i, 0.99 ),
+                           (unsigned long long)_low[i], (unsigned long long)_high[i] );
+                json += buf;
+                
+                FORJ ( bins ) {
+                    snprintf ( buf, sizeof(buf), "%s%llu", j ? "," : "",
+                               (unsigned long long)_hist[size_t(i) * bins + j] );
+                    json += buf;
+                }
+                json += "]}";
+            }
+            json += "}}\n";
+            
+            if ( verbosity )
+                printf ( "Writing statistics to %s ...\n", path.c_str() );
+            
+            FILE * file = fopen ( path.c_str(), "w" );
+            if ( !file || fputs ( json.c_str(), file ) == EOF ) {
+                fprintf ( stderr, "\nError: Cannot write %s: %s\n",
+                                  path.c_str(), strerror(errno) );
+                if ( file )
+                    fclose ( file );
+                return;
+            }
+            if ( fclose ( file ) )
+                fprintf ( stderr, "\nError: Cannot write %s: %s\n",
+                                  path.c_str(), strerror(errno) );
+        };
+    
+    private:
+        int _channels;
+        float _clip;
+        float _min[4];
+        float _max[4];
+        double _sum[4];
+        uint64_t _low[4];
+        uint64_t _high[4];
+        uint64_t _pixels;
+        uint64_t _clippedPixels;
+        vector < uint64_t > _hist;
+        std::mutex _mtx;
+};
+
+//	=====================================================================
+//  Parse the three arguments of "--variant" <m str h>
+//
+//  inputs:
+//      char * const *     : the arguments; the illuminant is lower-cased
+//                           in place
+//
+//  outputs:
+//      outputVariant &    : the variant ( illumType is nullptr for "na" )
+//      int                : "0" on success; "1" for an invalid IDT matrix
+//                           method, "2" for an invalid illuminant and "3"
+//                           for an invalid headroom
+
+inline int parseVariant ( char * const * args, outputVariant & variant ) {
+    if ( !isdigit ( args[0][0] ) || atoi ( args[0] ) > 2 )
+        return 1;
+    variant.mat_method = matMethods_t ( atoi ( args[0] ) );
+    
+    variant.illumType = args[1];
+    lowerCase ( variant.illumType );
+    if ( !strcmp ( variant.illumType, "na" ) )
+        variant.illumType = nullptr;
+    else if ( !isValidCT ( string ( variant.illumType ) ) )
+        return 2;
+    
+    if ( !isdigit ( args[2][0] ) || atof ( args[2] ) <= 0.0 )
+        return 3;
+    variant.scale = static_cast < float > ( atof ( args[2] ) );
+    
+    return 0;
+}
+
+//	=====================================================================
+//  Fields of the tar archives given as input
+
+//  Numeric field of a tar header: octal, or base-256 for the sizes of
+//  8 GB and more written by GNU tar
+inline uint64_t tarNumber ( const char * field, size_t len ) {
+    uint64_t value = 0;
+    
+    if ( (unsigned char)field[0] & 0x80 ) {
+        value = (unsigned char)field[0] & 0x7f;
+        for ( size_t i = 1; i < len; i++ )
+            value = ( value << 8 ) | (unsigned char)field[i];
+        
+        return value;
+    }
+    
+    for ( size_t i = 0; i < len && field[i]; i++ ) {
+        if ( field[i] >= '0' && field[i] <= '7' )
+            value = value * 8 + uint64_t ( field[i] - '0' );
+        else if ( field[i] != ' ' )
+            break;
+    }
+    
+    return value;
+}
+
+//  "path" record of a pax extended header ( "<len> path=<value>\n" )
+inline string paxPath ( const char * records, size_t size ) {
+    size_t pos = 0;
+    
+    while ( pos < size ) {
+        const char * rec = records + pos;
+        size_t len = 0, i = 0;
+        
+        while ( pos + i < size && isdigit ( rec[i] ) )
+            len = len * 10 + size_t ( rec[i++] - '0' );
+        
+        if ( !len || pos + len > size || len < i + 7 )
+            break;
+        if ( !strncmp ( rec + i, " path=", 6 ) )
+            return string ( rec + i + 6, len - i - 7 );
+        
+        pos += len;
+    }
+    
+    return "";
+}
+
+//	=====================================================================
+//  Name of the outputs of a raw file, without the "_aces..." suffix
+
+inline string outputStem ( const char * raw ) {
+    string stem ( raw );
+    size_t dot = stem.rfind ( '.' );
+    
+    if ( dot != string::npos )
+        stem.erase ( dot );
+    
+    return stem;
+}
+
+//  "1" for the files written next to the raw files by a conversion:
+//  outputs ( "_aces.exr", "_aces_v<n>.exr", with "_float" before ".exr"
+//  for float EXR ), their "--stats" sidecars ( ".stats.json" ) and
+//  "--claim" / "--shard" bookkeeping ( "_aces.claim", "_aces.done" )
+inline int isOutputFile ( const string & path ) {
+    size_t pos = path.rfind ( "_aces" );
+    if ( pos == string::npos || path.find ( '/', pos ) != string::npos )
+        return 0;
+    
+    const char * tail = path.c_str() + pos + 5;
+    if ( !strcmp ( tail, ".claim" ) || !strcmp ( tail, ".done" ) )
+        return 1;
+    
+    if ( !strncmp ( tail, "_v", 2 ) && isdigit ( tail[2] ) )
+        for ( tail += 2; isdigit ( *tail ); tail++ ) ;
+    if ( !strncmp ( tail, "_float", 6 ) )
+        tail += 6;
+    
+    return !strcmp ( tail, ".exr" ) || !strcmp ( tail, ".stats.json" );
+}
+
+//	=====================================================================
+//  Path of an input as hashed by "--shard": relative to the working
+//  directory when it is below it, without "." components, repeated
+//  slashes or "<dir>/.." pairs. Nodes that list the same files with
+//  different spellings, or from different mount points of the working
+//  directory, then agree on the shard of each file.
+//
+//  inputs:
+//      const string &     : the path of the input
+//      const string &     : the absolute working directory ( may be empty )
+//
+//  outputs:
+//      string             : the normalized path
+
+inline string shardPath ( const string & path, const string & cwd ) {
+    string rest = path;
+    int absolute = !path.empty() && path[0] == '/';
+    size_t n = cwd.size();
+    
+    if ( absolute && n > 1 && !path.compare ( 0, n, cwd )
+         && ( path.size() == n || path[n] == '/' ) ) {
+        rest = path.substr ( n );
+        absolute = 0;
+    }
+    
+    vector < string > parts;
+    size_t pos = 0;
+    
+    while ( pos <= rest.size() ) {
+        size_t end = rest.find ( '/', pos );
+        if ( end == string::npos )
+            end = rest.size();
+        
+        string part = rest.substr ( pos, end - pos );
+        pos = end + 1;
+        
+        if ( part.empty() || part == "." )
+            continue;
+        if ( part == ".." && parts.size() && parts.back() != ".." )
+            parts.pop_back();
+        else if ( part != ".." || !absolute )
+            parts.push_back ( part );
+    }
+    
+    string normalized = absolute ? "/" : "";
+    FORI ( parts.size() ) {
+        if ( i )
+            normalized += '/';
+        normalized += parts[i];
+    }
+    
+    return normalized;
+}
+
+//	=====================================================================
+//  Grey-box white balance of "--wb-method 3" / "--wb-box", measured on
+//  the undemosaiced data by AcesRender::greyBoxWB()
+
+//  Black level of the photosite at ( row, col ) of the visible image, of
+//  CFA color "color", on top of imgdata.color.black: cblack[color] plus
+//  the cblack[6...] pattern of cblack[4] rows by cblack[5] columns
+inline unsigned cfaBlack ( const unsigned * cblack, size_t row, size_t col,
+                           int color ) {
+    unsigned level = cblack[color];
+    
+    if ( cblack[4] && cblack[5] )
+        level += cblack[6 + ( row % cblack[4] ) * cblack[5] + col % cblack[5]];
+    
+    return level;
+}
+
+//  Sums of one row of a box for the mean, over whole periods of 6
+//  photosites ( 3 Bayer periods, or one X-Trans period ) without
+//  branches: the values below "maximum" of photosite j of each period
+//  go to sum[color[j]] and count[color[j]], less level[j]. The colors
+//  and black levels have to repeat every 6 photosites.
+//
+//  inputs:
+//      const ushort *     : the first photosite of the row in the box
+//      size_t             : the number of photosites
+//      unsigned           : the saturation level
+//      const int *        : the CFA colors of the first 6 photosites
+//      const float *      : the black levels of the first 6 photosites
+//
+//  outputs:
+//      double *           : sums of the black-subtracted values, per color
+//      double *           : counts of the values, per color
+
+inline void sumCfaRow ( const ushort * line, size_t n, unsigned maximum,
+                        const int color[6], const float level[6],
+                        double sum[4], double count[4] ) {
+    uint64_t s[6] = { 0, 0, 0, 0, 0, 0 };
+    uint32_t k[6] = { 0, 0, 0, 0, 0, 0 };
+    size_t x = 0;
+    
+    for ( ; x + 6 <= n; x += 6 )
+        FORJ ( 6 ) {
+            unsigned v = line[x + j];
+            unsigned valid = v < maximum;
+            s[j] += valid ? v : 0;
+            k[j] += valid;
+        }
+    for ( int j = 0; x < n; x++, j++ ) {
+        unsigned v = line[x];
+        if ( v < maximum ) {
+            s[j] += v;
+            k[j]++;
+        }
+    }
+    
+    FORJ ( 6 ) {
+        sum[color[j]]   += double(s[j]) - double(k[j]) * level[j];
+        count[color[j]] += k[j];
+    }
+}
+
+//  Grey level of one CFA color with "--wb-estimator"
+//
+//  inputs:
+//      wbEstimators_t     : 0 = "sum" / "count", 1 = the median of
+//                           "samples", 2 = the mean of "samples" without
+//                           the lowest and highest 10%
+//      double             : the sum of the black-subtracted values
+//      double             : the number of values
+//      vector < float > & : the values themselves for 1 and 2 ( reordered )
+//
+//  outputs:
+//      double             : the grey level; 0 if there are no values
+
+inline double greyLevel ( wbEstimators_t estimator, double sum, double count,
+                          vector < float > & samples ) {
+    if ( estimator == wbEstimator0 )
+        return count > 0 ? sum / count : 0.0;
+    
+    if ( !samples.size() )
+        return 0.0;
+    
+    if ( estimator == wbEstimator1 ) {
+        std::nth_element ( samples.begin(), samples.begin() + samples.size() / 2,
+                           samples.end() );
+        return samples[samples.size() / 2];
+    }
+    
+    size_t low  = samples.size() / 10;
+    size_t high = samples.size() - low;
+    
+    std::nth_element ( samples.begin(), samples.begin() + low, samples.end() );
+    std::nth_element ( samples.begin() + low, samples.begin() + high - 1, samples.end() );
+    
+    double total = 0.0;
+    for ( size_t i = low; i < high; i++ )
+        total += samples[i];
+    
+    return total / double ( high - low );
+}
+
+//	=====================================================================
+//  Built-in fast demosaic of AcesRender::fastPreview() ( "--preview 1"
+//  or "2" ) on the Bayer data of rawdata.raw_image
+
+//  Parameters shared by the threads of the preview
+
+struct PreviewJob {
+    const ushort * raw;
+    size_t pitch;
+    int top;
+    int left;
+    int width;
+    int height;
+    int outWidth;
+    int outHeight;
+    int mode;
+    int flip;
+    int fc[8][2];
+    float black[4];
+    const unsigned * cblack;
+    float scale[4];
+    float maximum;
+    float mat[3][3];
+    ushort * out;
+};
+
+//  Black levels and white balance factors of the preview: "black" plus
+//  cblack[0-3] ( "cblack" is nullptr with "user_black" ) and "mul"
+//  normalized to the lowest factor ( the highest with "highlight" )
+//  and scaled so that "maximum" maps to 65535. The normalized factors
+//  also go to "preMul", as scale_colors() of libraw leaves
+//  color.pre_mul after dcraw_process(). A cblack pattern is kept in
+//  "job.cblack" when its columns repeat with the Bayer pairs.
+//
+//  inputs:
+//      const float *      : the white balance factors ( mul[3] = 0 for mul[1] )
+//      int                : "highlight"
+//      unsigned           : the black level
+//      unsigned           : the saturation level
+//      const unsigned *   : imgdata.color.cblack, or nullptr
+//
+//  outputs:
+//      int                : "1" on success; "0" if the levels or the
+//                           factors cannot be used by the preview
+//      float *            : the normalized factors
+
+inline int previewLevels ( PreviewJob & job, const float factors[4], int highlight,
+                           unsigned black, unsigned maximum,
+                           const unsigned * cblack, float preMul[4] ) {
+    float mul[4];
+    FORI(4) mul[i] = factors[i];
+    if ( !mul[3] )
+        mul[3] = mul[1];
+    
+    float dmin = *std::min_element ( mul, mul + 4 );
+    float dmax = *std::max_element ( mul, mul + 4 );
+    
+    if ( maximum <= black || dmin <= 0 )
+        return 0;
+    
+    job.cblack = nullptr;
+    if ( cblack && cblack[4] && cblack[5] ) {
+        if ( 2 % cblack[5] )
+            return 0;
+        job.cblack = cblack;
+    }
+    
+    FORI(4) {
+        job.black[i] = black + ( cblack ? cblack[i] : 0 );
+        job.scale[i] = mul[i] / ( highlight ? dmax : dmin ) *
+                       65535.0 / ( maximum - black );
+        preMul[i] = mul[i] / ( highlight ? dmax : dmin );
+    }
+    
+    return 1;
+}
+
+//  Black-subtracted, white-balanced and clipped samples of one row of
+//  the visible area. A row of a Bayer pattern has two colors, so the
+//  loop works on pairs of columns with fixed factors.
+inline void previewRow ( const PreviewJob & job, int row, float * dst ) {
+    const ushort * src = job.raw + size_t( row + job.top ) * job.pitch + job.left;
+    int c0 = job.fc[row & 7][0];
+    int c1 = job.fc[row & 7][1];
+    float b0 = job.black[c0], s0 = job.scale[c0];
+    float b1 = job.black[c1], s1 = job.scale[c1];
+    
+    if ( job.cblack ) {
+        const unsigned * pattern = job.cblack + 6 + ( row % job.cblack[4] ) * job.cblack[5];
+        b0 += pattern[0];
+        b1 += pattern[1 % job.cblack[5]];
+    }
+    float maximum = job.maximum;
+    int pairs = job.width / 2;
+    
+    for ( int i = 0; i < pairs; i++ ) {
+        float v0 = ( src[2 * i] - b0 ) * s0;
+        float v1 = ( src[2 * i + 1] - b1 ) * s1;
+        dst[2 * i]     = std::min ( std::max ( v0, 0.0f ), maximum );
+        dst[2 * i + 1] = std::min ( std::max ( v1, 0.0f ), maximum );
+    }
+    
+    if ( job.width & 1 ) {
+        float v0 = ( src[job.width - 1] - b0 ) * s0;
+        dst[job.width - 1] = std::min ( std::max ( v0, 0.0f ), maximum );
+    }
+}
+
+//  Weights of the 3x3 neighbours of ( row, col ) in the bilinear
+//  average of each color: the center color takes the center sample,
+//  the other two the mean of their neighbours. Neighbours outside the
+//  visible area get no weight.
+inline void previewWeights ( const PreviewJob & job, int row, int col, float w[3][9] ) {
+    int n[3] = { 0, 0, 0 };
+    int c0 = job.fc[row & 7][col & 1];
+    c0 = ( c0 == 3 ) ? 1 : c0;
+    
+    FORIJ ( 3, 9 ) w[i][j] = 0.0f;
+    
+    for ( int k = 0; k < 9; k++ ) {
+        int rr = row + k / 3 - 1;
+        int cc = col + k % 3 - 1;
+        if ( rr < 0 || rr >= job.height || cc < 0 || cc >= job.width )
+            continue;
+        
+        int c = job.fc[rr & 7][cc & 1];
+        c = ( c == 3 ) ? 1 : c;
+        if ( c == c0 && k != 4 )
+            continue;
+        
+        w[c][k] = 1.0f;
+        n[c]++;
+    }
+    
+    FORIJ ( 3, 9 ) w[i][j] = n[i] ? w[i][j] / n[i] : 0.0f;
+}
+
+//  Weighted sum of the 3x3 neighbours of column "col" of the lines
+inline void previewApply ( const float * const lines[3], int col,
+                                  const float w[3][9], float * rgb[3] ) {
+    FORI(3) {
+        float v = 0.0f;
+        for ( int k = 0; k < 9; k++ )
+            v += w[i][k] * lines[k / 3][col + k % 3 - 1];
+        rgb[i][col] = v;
+    }
+}
+
+//  Apply the output matrix and the orientation (as dcraw's flip_index())
+//  to one output row and store it
+inline void previewStore ( const PreviewJob & job, int row, float * const rgb[3] ) {
+    int r = ( job.flip & 2 ) ? job.outHeight - 1 - row : row;
+    ptrdiff_t base, step;
+    
+    if ( job.flip & 4 ) {
+        step = ( job.flip & 1 ) ? -ptrdiff_t(job.outHeight) : ptrdiff_t(job.outHeight);
+        base = ( job.flip & 1 ) ? ptrdiff_t(job.outWidth - 1) * job.outHeight + r : r;
+    }
+    else {
+        step = ( job.flip & 1 ) ? -1 : 1;
+        base = ptrdiff_t(r) * job.outWidth + ( ( job.flip & 1 ) ? job.outWidth - 1 : 0 );
+    }
+    
+    ushort * out = job.out + base * 3;
+    for ( int col = 0; col < job.outWidth; col++ ) {
+        float v[3];
+        FORI(3) {
+            v[i] = job.mat[i][0] * rgb[0][col] + job.mat[i][1] * rgb[1][col]
+                   + job.mat[i][2] * rgb[2][col];
+            v[i] = std::min ( std::max ( v[i], 0.0f ), 65535.0f );
+        }
+        
+        ushort * pixel = out + col * step * 3;
+        FORI(3) pixel[i] = static_cast < ushort > ( v[i] );
+    }
+}
+
+//  Render rows [rowStart, rowEnd) of the (unflipped) output. The raw
+//  rows are converted once into float lines, padded by a zero column
+//  on each side, and each output row is computed by loops over the
+//  columns with fixed weights.
+inline void previewBand ( const PreviewJob * job, int rowStart, int rowEnd ) {
+    int stride = job->width + 2;
+    vector < float > buffer ( size_t(stride) * 4, 0.0f );
+    vector < float > planes ( size_t(job->outWidth) * 3 );
+    
+    //  lines 0-2 hold raw rows, line 3 stays zero for the rows outside
+    //  the visible area
+    float * slot[4];
+    int loaded[3] = { -1, -1, -1 };
+    FORI(4) slot[i] = &buffer[0] + size_t(i) * stride + 1;
+    
+    auto line = [&] ( int row ) -> const float * {
+        if ( row < 0 || row >= job->height )
+            return slot[3];
+        
+        int s = row % 3;
+        if ( loaded[s] != row ) {
+            previewRow ( *job, row, slot[s] );
+            loaded[s] = row;
+        }
+        return slot[s];
+    };
+    
+    float * rgb[3];
+    FORI(3) rgb[i] = &planes[0] + size_t(i) * job->outWidth;
+    
+    for ( int row = rowStart; row < rowEnd; row++ ) {
+        if ( job->mode == previewMode1 ) {
+            // 2x2 binning: average each color within the CFA block
+            const float * l0 = line ( 2 * row );
+            const float * l1 = line ( 2 * row + 1 );
+            float w[3][4] = { { 0.0f } };
+            int n[3] = { 0, 0, 0 };
+            
+            FORJ(4) {
+                int c = job->fc[( 2 * row + j / 2 ) & 7][j & 1];
+                c = ( c == 3 ) ? 1 : c;
+                w[c][j] = 1.0f;
+                n[c]++;
+            }
+            FORIJ(3, 4) w[i][j] = n[i] ? w[i][j] / n[i] : 0.0f;
+            
+            FORI(3) {
+                for ( int col = 0; col < job->outWidth; col++ )
+                    rgb[i][col] = w[i][0] * l0[2 * col] + w[i][1] * l0[2 * col + 1]
+                                  + w[i][2] * l1[2 * col] + w[i][3] * l1[2 * col + 1];
+            }
+        }
+        else {
+            // bilinear: average the neighbours of each missing color;
+            // the weights repeat every other column inside the row
+            const float * const lines[3] = { line ( row - 1 ), line ( row ),
+                                             line ( row + 1 ) };
+            int width = job->width;
+            float w[2][3][9];
+            
+            previewWeights ( *job, row, 0, w[0] );
+            previewApply ( lines, 0, w[0], rgb );
+            
+            if ( width > 1 ) {
+                previewWeights ( *job, row, width - 1, w[0] );
+                previewApply ( lines, width - 1, w[0], rgb );
+            }
+            
+            if ( width > 3 ) {
+                previewWeights ( *job, row, 2, w[0] );
+                previewWeights ( *job, row, 1, w[1] );
+                
+                for ( int p = 0; p < 2; p++ )
+                    for ( int col = 2 - p; col < width - 1; col += 2 )
+                        previewApply ( lines, col, w[p], rgb );
+            }
+            else if ( width == 3 ) {
+                previewWeights ( *job, row, 1, w[1] );
+                previewApply ( lines, 1, w[1], rgb );
+            }
+        }
+        
+        previewStore ( *job, row, rgb );
+    }
+}
+
+//	=====================================================================
+//	Memory budget of "--max-memory" shared by the workers of
+//  convertRaws() and the prefetcher. A file is admitted while the
+//  estimated footprints of the files in progress and its own fit in
+//  the limit; a file larger than the limit runs alone. A limit of 0
+//  admits every file.
+
+class MemoryBudget {
+    public:
+        MemoryBudget ( size_t limit ) : _limit(limit), _used(0), _running(0) {};
+    
+        int tryAcquire ( size_t bytes ) {
+            std::lock_guard < std::mutex > lock ( _mtx );
+            
+            if ( _limit && _running && _used + bytes > _limit )
+                return 0;
+            
+            _used += bytes;
+            _running++;
+            
+            return 1;
+        };
+    
+        void release ( size_t bytes ) {
+            std::lock_guard < std::mutex > lock ( _mtx );
+            _used -= bytes;
+            _running--;
+        };
+    
+        //  Bytes held ahead of a conversion ( "--prefetch" ): unlike a
+        //  file, they are never let over the limit
+        int tryReserve ( size_t bytes ) {
+            std::lock_guard < std::mutex > lock ( _mtx );
+            
+            if ( _limit && _used + bytes > _limit )
+                return 0;
+            
+            _used += bytes;
+            
+            return 1;
+        };
+    
+        void unreserve ( size_t bytes ) {
+            std::lock_guard < std::mutex > lock ( _mtx );
+            _used -= bytes;
+        };
+    
+        int running ( ) {
+            std::lock_guard < std::mutex > lock ( _mtx );
+            return _running;
+        };
+    
+    private:
+        size_t _limit;
+        size_t _used;
+        int _running;
+        std::mutex _mtx;
+};
+
+//	=====================================================================
+//	Wakes the idle workers of convertRaws() when there may be something
+//  for them to do: a file was queued or finished, row bands were pushed
+//  or the bands of a file are all done. A worker takes the count before
+//  looking for work and waits only if it has not changed since.
+
+class WorkSignal {
+    public:
+        WorkSignal ( ) : _events(0) {};
+    
+        size_t events ( ) {
+            std::lock_guard < std::mutex > lock ( _mtx );
+            return _events;
+        };
+    
+        void notify ( ) {
+            {
+                std::lock_guard < std::mutex > lock ( _mtx );
+                _events++;
+            }
+            _cv.notify_all();
+        };
+    
+        //  Wait until notify() is called after events() returned "seen"
+        void wait ( size_t seen ) {
+            std::unique_lock < std::mutex > lock ( _mtx );
+            _cv.wait ( lock, [&] { return _events != seen; } );
+        };
+    
+    private:
+        size_t _events;
+        std::mutex _mtx;
+        std::condition_variable _cv;
+};
+
+//	=====================================================================
+//	Files waiting for a worker of convertRaws(), by priority class
+//  ( "--priority", "--queue" ). A worker starts the first file of the
+//  most urgent class as soon as the "--max-memory" budget admits it,
+//  and no less urgent file starts in the meantime; the "--reserve"
+//  workers only start interactive files. Files may be added while the
+//  workers run, until close().
+
+class JobQueue {
+    public:
+        struct Job {
+            string path;
+            size_t bytes;
+            size_t position;
+            int priority;
+        };
+    
+        JobQueue ( WorkSignal * signal ) : _submitted(0), _closed(0), _signal(signal) {};
+    
+        void push ( const string & path, size_t bytes, int priority ) {
+            {
+                std::lock_guard < std::mutex > lock ( _mtx );
+                Job job = { path, bytes, _submitted++, priority };
+                _jobs[priority].push_back ( job );
+            }
+            _signal->notify();
+        };
+    
+        //  No more files will be added
+        void close ( ) {
+            {
+                std::lock_guard < std::mutex > lock ( _mtx );
+                _closed = 1;
+            }
+            _signal->notify();
+        };
+    
+        //  "1": "job" is to be converted; "0": no file can start now;
+        //  "-1": no file is left for this worker and none will come
+        int take ( int interactiveOnly, MemoryBudget * budget, Job & job ) {
+            std::lock_guard < std::mutex > lock ( _mtx );
+            int last = interactiveOnly ? priority0 : priority2;
+            
+            for ( int p = priority0; p <= last; p++ ) {
+                if ( _jobs[p].empty() )
+                    continue;
+                
+                if ( !budget->tryAcquire ( _jobs[p].front().bytes ) )
+                    return 0;
+                
+                job = _jobs[p].front();
+                _jobs[p].pop_front();
+                
+                return 1;
+            }
+            
+            return _closed ? -1 : 0;
+        };
+    
+    private:
+        std::deque < Job > _jobs[priority2 + 1];
+        size_t _submitted;
+        int _closed;
+        std::mutex _mtx;
+        WorkSignal * _signal;
+};
+
+#endif
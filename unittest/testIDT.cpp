@@ -496,6 +496,33 @@ BOOST_AUTO_TEST_CASE ( TestIDT_LoadTrainingData ) {
     delete idtTest;
 };
 
+BOOST_AUTO_TEST_CASE ( TestIDT_SharedSpectralData ) {
+    Idt * idtTest1 = new Idt();
+    Idt * idtTest2 = new Idt();
+    
+    boost::filesystem::path pathTS = boost::filesystem::absolute\
+                                     ("../../data/training/training_spectral.json");
+    boost::filesystem::path pathCMF = boost::filesystem::absolute\
+                                      ("../../data/cmf/cmf_1931.json");
+    
+    idtTest1->loadTrainingData ( pathTS.string() );
+    idtTest1->loadCMF ( pathCMF.string() );
+    idtTest2->loadTrainingData ( pathTS.string() );
+    idtTest2->loadCMF ( pathCMF.string() );
+    
+    BOOST_CHECK ( &(idtTest1->getTrainingSpec()) == &(idtTest2->getTrainingSpec()) );
+    BOOST_CHECK ( &(idtTest1->getCMF()) == &(idtTest2->getCMF()) );
+    
+    delete idtTest1;
+    
+    const vector < trainSpec > & TS_test = idtTest2->getTrainingSpec();
+    BOOST_CHECK_EQUAL ( TS_test.size(), 81 );
+    BOOST_CHECK_CLOSE ( TS_test[0]._data[0], 0.0600000000, 1e-5 );
+    BOOST_CHECK_CLOSE ( (idtTest2->getCMF())[0]._xbar, 0.001368, 1e-5 );
+    
+    delete idtTest2;
+};
+
 BOOST_AUTO_TEST_CASE ( TestIDT_LoadCMF ) {
     Idt * idtTest = new Idt();
     
@@ -2398,6 +2425,193 @@ BOOST_AUTO_TEST_CASE ( TestIDT_CalIDT ) {
     delete idtTest;
 };
 
+BOOST_AUTO_TEST_CASE ( TestIDT_LinearFit ) {
+    Idt * idtTest = new Idt();
+    
+    double B[6] = { 1.0915, -0.2517, -0.0090, 1.2147, -0.1313, -0.7362 };
+    
+    vector < vector < double > > RGB ( 190, vector < double > ( 3 ) );
+    FORIJ ( 190, 3 )
+        RGB[i][j] = 0.05 + 0.9 * ( ( i * 37 + j * 101 ) % 190 ) / 190.0;
+    
+    vector < vector < double > > XYZ = getCalcXYZt ( RGB, B );
+    
+    double B_test[6] = { 1.0, 0.0, 0.0, 1.0, 0.0, 0.0 };
+    BOOST_CHECK ( idtTest->linearFit ( RGB, XYZ, B_test ) );
+    
+    FORI ( 6 )
+        BOOST_CHECK_CLOSE ( B[i], B_test[i], 1e-5 );
+    
+    delete idtTest;
+};
 
+BOOST_AUTO_TEST_CASE ( TestIDT_ObjfunBlocks ) {
+    double B[6] = { 1.0915, -0.2517, -0.0090, 1.2147, -0.1313, -0.7362 };
+    double BStart[6] = { 1.0, 0.0, 0.0, 1.0, 0.0, 0.0 };
+    
+    // a training set of any size, not only 190 patches
+    vector < vector < double > > RGB ( 300, vector < double > ( 3 ) );
+    FORIJ ( 300, 3 )
+        RGB[i][j] = 0.05 + 0.9 * ( ( i * 37 + j * 101 ) % 300 ) / 300.0;
+    
+    vector < vector < double > > outLAB = XYZtoLAB ( getCalcXYZt ( RGB, B ) );
+    
+    vector < double > all ( 900 ), blocks ( 900 );
+    Objfun ( RGB, outLAB ) ( BStart, &all[0] );
+    Objfun ( RGB, outLAB, 0, 128 ) ( BStart, &blocks[0] );
+    Objfun ( RGB, outLAB, 128, 128 ) ( BStart, &blocks[128 * 3] );
+    Objfun ( RGB, outLAB, 256, 44 ) ( BStart, &blocks[256 * 3] );
+    
+    FORI ( 900 )
+        BOOST_CHECK_EQUAL ( all[i], blocks[i] );
+    
+    vector < double > zero ( 900 );
+    Objfun ( RGB, outLAB ) ( B, &zero[0] );
+    FORI ( 900 )
+        BOOST_CHECK_SMALL ( zero[i], 1e-9 );
+};
+
+BOOST_AUTO_TEST_CASE ( TestIDT_DeltaECallback ) {
+    double B[6] = { 1.0, 0.0, 0.0, 1.0, 0.0, 0.0 };
+    
+    // the ACES white and an 18% grey, L*a*b* ( 100, 0, 0 ) and
+    // ( 49.4961, 0, 0 ), against targets 5 units of Delta E away
+    vector < vector < double > > RGB ( 2, vector < double > ( 3 ) );
+    FORJ ( 3 ) {
+        RGB[0][j] = 1.0;
+        RGB[1][j] = 0.18;
+    }
+    
+    double LAB[2][3] = {
+        { 103.0, 4.0, 0.0 },
+        { 49.4961, 0.0, 5.0 }
+    };
+    double shift[2][3] = {
+        { 3.0, 4.0, 0.0 },
+        { 0.0, 0.0, 5.0 }
+    };
+    
+    vector < vector < double > > outLAB ( 2, vector < double > ( 3 ) );
+    FORIJ ( 2, 3 ) outLAB[i][j] = LAB[i][j];
+    
+    double residuals[6];
+    Objfun ( RGB, outLAB ) ( B, residuals );
+    FORIJ ( 2, 3 )
+        BOOST_CHECK_SMALL ( residuals[i * 3 + j] - shift[i][j], 1e-3 );
+    
+    // ceres cost of the residuals is 25, i.e. an RMS Delta E of 5
+    double cost = 0.0;
+    FORI ( 6 ) cost += 0.5 * residuals[i] * residuals[i];
+    
+    DeltaECallback callback ( 0.1, 2 );
+    IterationSummary summary;
+    
+    summary.iteration = 0;
+    summary.step_is_successful = true;
+    summary.cost = cost;
+    BOOST_CHECK_EQUAL ( callback ( summary ), SOLVER_CONTINUE );
+    
+    // an RMS Delta E of 4.8: improved by more than the threshold
+    summary.iteration = 1;
+    summary.cost = 4.8 * 4.8;
+    BOOST_CHECK_EQUAL ( callback ( summary ), SOLVER_CONTINUE );
+    
+    // unsuccessful steps are not measured
+    summary.iteration = 2;
+    summary.step_is_successful = false;
+    summary.cost = 100.0;
+    BOOST_CHECK_EQUAL ( callback ( summary ), SOLVER_CONTINUE );
+    
+    // an RMS Delta E of 4.75: improved by less than the threshold
+    summary.iteration = 3;
+    summary.step_is_successful = true;
+    summary.cost = 4.75 * 4.75;
+    BOOST_CHECK_EQUAL ( callback ( summary ), SOLVER_TERMINATE_SUCCESSFULLY );
+};
 
+BOOST_AUTO_TEST_CASE ( TestIDT_CalXYZCamera ) {
+    // the XYZ of the training data does not depend on the camera
+    const char * cameras[2][3] = {
+        { "../../data/camera/nikon_d200_380_780_5.json", "nikon", "d200" },
+        { "../../data/camera/arri_d21_380_780_5.json", "arri", "d21" }
+    };
+    vector < vector < double > > XYZ[2];
+    
+    FORI ( 2 ) {
+        Idt * idtTest = new Idt();
+        
+        boost::filesystem::path pathSpst = boost::filesystem::absolute \
+        (cameras[i][0]);
+        idtTest->loadCameraSpst ( pathSpst.string(), cameras[i][1], cameras[i][2] );
+        
+        boost::filesystem::path pathIllum = boost::filesystem::absolute \
+        ("../../data/illuminant/iso7589_stutung_380_780_5.json");
+        vector < string > illumPaths;
+        illumPaths.push_back( pathIllum.string() );
+        idtTest->loadIlluminant ( illumPaths, "iso7589" );
+        
+        boost::filesystem::path pathCMF = boost::filesystem::absolute\
+        ("../../data/cmf/cmf_1931.json");
+        idtTest->loadCMF ( pathCMF.string() );
+        
+        boost::filesystem::path pathTS = boost::filesystem::absolute\
+        ("../../data/training/training_spectral.json");
+        idtTest->loadTrainingData ( pathTS.string() );
+        
+        idtTest->chooseIllumType("iso7589", 0);
+        XYZ[i] = idtTest->calXYZ ( idtTest->calTI() );
+        
+        delete idtTest;
+    }
+    
+    BOOST_CHECK_EQUAL ( XYZ[0].size(), 190 );
+    BOOST_CHECK_EQUAL ( XYZ[1].size(), 190 );
+    FORIJ ( 190, 3 )
+        BOOST_CHECK_CLOSE ( XYZ[0][i][j], XYZ[1][i][j], 1e-9 );
+};
 
+BOOST_AUTO_TEST_CASE ( TestIDT_Copy ) {
+    // an Idt that has not loaded a camera yet
+    Idt * idtDefault = new Idt();
+    Idt * idtCopy = new Idt ( *idtDefault );
+    
+    BOOST_CHECK ( idtCopy->getCameraSpst().getBrand() == nullptr );
+    BOOST_CHECK ( idtCopy->getCameraSpst().getModel() == nullptr );
+    BOOST_CHECK_EQUAL ( idtCopy->getCameraSpst().getSensitivity().size(), 81 );
+    
+    delete idtDefault;
+    delete idtCopy;
+    
+    // a loaded one: the copy owns its brand and model
+    Idt * idtTest = new Idt();
+    
+    boost::filesystem::path pathSpst = boost::filesystem::absolute \
+    ("../../data/camera/nikon_d200_380_780_5.json");
+    BOOST_CHECK ( idtTest->loadCameraSpst ( pathSpst.string(), "nikon", "d200" ) );
+    
+    Idt * idtLoaded = new Idt ( *idtTest );
+    const Spst & spst = idtTest->getCameraSpst();
+    const Spst & spstCopy = idtLoaded->getCameraSpst();
+    
+    BOOST_CHECK_EQUAL ( string ( spstCopy.getBrand() ), string ( spst.getBrand() ) );
+    BOOST_CHECK_EQUAL ( string ( spstCopy.getModel() ), string ( spst.getModel() ) );
+    BOOST_CHECK ( spstCopy.getBrand() != spst.getBrand() );
+    BOOST_CHECK_EQUAL ( spstCopy.getWLIncrement(), spst.getWLIncrement() );
+    
+    BOOST_CHECK_EQUAL ( spstCopy.getSensitivity().size(), spst.getSensitivity().size() );
+    FORI ( spst.getSensitivity().size() ) {
+        BOOST_CHECK_EQUAL ( spstCopy.getSensitivity()[i]._RSen, spst.getSensitivity()[i]._RSen );
+        BOOST_CHECK_EQUAL ( spstCopy.getSensitivity()[i]._GSen, spst.getSensitivity()[i]._GSen );
+        BOOST_CHECK_EQUAL ( spstCopy.getSensitivity()[i]._BSen, spst.getSensitivity()[i]._BSen );
+    }
+    
+    delete idtTest;
+    
+    // assigning a loaded Idt over a default one
+    Idt idtAssigned;
+    idtAssigned = *idtLoaded;
+    BOOST_CHECK_EQUAL ( string ( idtAssigned.getCameraSpst().getBrand() ), "nikon" );
+    BOOST_CHECK_EQUAL ( string ( idtAssigned.getCameraSpst().getModel() ), "d200" );
+    
+    delete idtLoaded;
+};
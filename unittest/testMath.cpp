@@ -367,6 +367,79 @@ BOOST_AUTO_TEST_CASE ( Test_MulVectorArray ) {
         BOOST_CHECK_CLOSE ( data[i], data_test[i], 1e-5 );
 };
 
+BOOST_AUTO_TEST_CASE ( Test_ScaleToHalf ) {
+    float data[19] = { 0.0, 1.0, 2.0, 65535.0, 32768.0, 0.5, 1e-3,
+                       1e-7, -3.25, 1e10, 4095.0, 100.0, 12345.678,
+                       0.333333, 7.0, 8.0, 65519.0, 65520.0, 2.5e-8 };
+    float scale = 1.0 / 65535.0 * 6.0;
+    
+    unsigned short out[19];
+    scaleToHalf ( data, out, 19, scale );
+    
+    FORI ( 19 ) {
+        half tmpV ( data[i] * scale );
+        BOOST_CHECK_EQUAL ( out[i], tmpV.bits() );
+    }
+    
+    scaleToHalf ( data, out, 19, 1.0 );
+    
+    FORI ( 19 ) {
+        half tmpV ( data[i] );
+        BOOST_CHECK_EQUAL ( out[i], tmpV.bits() );
+    }
+};
+
+//  Both conversion paths, called directly, against Imath::half on the
+//  edge cases: NaN, infinities, overflow, denormals and values halfway
+//  between two halves ( which round to the even one )
+BOOST_AUTO_TEST_CASE ( Test_ScaleToHalfPaths ) {
+    const float inf = numeric_limits < float >::infinity();
+    const float nan = numeric_limits < float >::quiet_NaN();
+    
+    float data[28] = { 0.0f, -0.0f, nan, -nan, inf, -inf,
+                       65504.0f, 65519.0f, 65520.0f, -65520.0f, 1e10f,
+                       ldexpf ( 1.0f, -24 ),                  // smallest denormal
+                       ldexpf ( 1.0f, -25 ),                  // halfway to 0
+                       ldexpf ( 3.0f, -25 ),                  // halfway, rounds up
+                       ldexpf ( 5.0f, -25 ),                  // halfway, rounds down
+                       ldexpf ( 1023.0f, -24 ),               // largest denormal
+                       ldexpf ( 2047.0f, -25 ),               // halfway to the normals
+                       ldexpf ( 1.0f, -14 ),                  // smallest normal
+                       1.0f + ldexpf ( 1.0f, -11 ),           // halfway, rounds down
+                       1.0f + ldexpf ( 3.0f, -11 ),           // halfway, rounds up
+                       -( 2.0f + ldexpf ( 1.0f, -10 ) ),
+                       1.0f + ldexpf ( 1.0f, -11 ) + ldexpf ( 1.0f, -20 ),
+                       1e-30f, 1e-40f, 0.333333f, 4095.0f, 12345.678f, -3.25f };
+    
+    const float scales[3] = { 1.0f, 0.5f, 1.0f / 65535.0f * 6.0f };
+    unsigned short out[28];
+    
+#ifdef RTA_F16C_DISPATCH
+    int hasF16C = __builtin_cpu_supports ( "avx" ) && __builtin_cpu_supports ( "f16c" );
+#endif
+    
+    FORI ( 3 ) {
+        float scale = scales[i];
+        
+        scaleToHalfScalar ( data, out, 28, scale );
+        FORJ ( 28 ) {
+            half tmpV ( data[j] * scale );
+            BOOST_CHECK_EQUAL ( out[j], tmpV.bits() );
+        }
+        
+#ifdef RTA_F16C_DISPATCH
+        // 3 blocks of 8 samples and a scalar tail of 4
+        if ( hasF16C ) {
+            scaleToHalfF16C ( data, out, 28, scale );
+            FORJ ( 28 ) {
+                half tmpV ( data[j] * scale );
+                BOOST_CHECK_EQUAL ( out[j], tmpV.bits() );
+            }
+        }
+#endif
+    }
+};
+
 BOOST_AUTO_TEST_CASE ( Test_SolveVM ) {
     double M1[3][3] = {
         { 1.0000000000, 0.0000000000, 0.0000000000 },
@@ -1005,3 +1078,28 @@ BOOST_AUTO_TEST_CASE ( Test_GetCalcXYZt ) {
         BOOST_CHECK_CLOSE ( XYZ_test[i][j], XYZ[i][j], 1e-5 );
 };
 
+
+BOOST_AUTO_TEST_CASE ( Test_MulTransposedMatrix ) {
+    // wider than one block of columns
+    const size_t rows = 81, cols = 300, n = 6;
+    
+    vector < vector < double > > A ( rows, vector < double > ( cols ) );
+    vector < vector < double > > B ( rows, vector < double > ( n ) );
+    FORIJ ( rows, cols ) A[i][j] = ( ( i * 31 + j * 17 ) % 97 ) / 97.0;
+    FORIJ ( rows, n ) B[i][j] = ( ( i * 13 + j * 7 ) % 29 ) / 29.0 - 0.5;
+    
+    vector < double > flatA, flatB;
+    flattenVM ( A, flatA );
+    flattenVM ( B, flatB );
+    BOOST_CHECK_EQUAL ( flatA.size(), rows * cols );
+    BOOST_CHECK_EQUAL ( flatA[2 * cols + 5], A[2][5] );
+    
+    vector < double > C ( cols * n );
+    mulTransposedMatrix ( &flatA[0], rows, cols, &flatB[0], n, &C[0] );
+    
+    // A^T * B = transpose(A) * B, i.e. mulVector(transpose(A), transpose(B))
+    vector < vector < double > > C_test = mulVector ( transposeVec ( A ), transposeVec ( B ) );
+    
+    FORIJ ( cols, n )
+        BOOST_CHECK_CLOSE ( C[i * n + j], C_test[i][j], 1e-10 );
+};
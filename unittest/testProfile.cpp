@@ -0,0 +1,210 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2013 Academy of Motion Picture Arts and Sciences
+// ("A.M.P.A.S."). Portions contributed by others as indicated.
+// All rights reserved.
+//
+// A worldwide, royalty-free, non-exclusive right to copy, modify, create
+// derivatives, and use, in source and binary forms, is hereby granted,
+// subject to acceptance of this license. Performance of any of the
+// aforementioned acts indicates acceptance to be bound by the following
+// terms and conditions:
+//
+//  * Copies of source code, in whole or in part, must retain the
+//    above copyright notice, this list of conditions and the
+//    Disclaimer of Warranty.
+//
+//  * Use in binary form must retain the above copyright notice,
+//    this list of conditions and the Disclaimer of Warranty in the
+//    documentation and/or other materials provided with the distribution.
+//
+//  * Nothing in this license shall be deemed to grant any rights to
+//    trademarks, copyrights, patents, trade secrets or any other
+//    intellectual property of A.M.P.A.S. or any contributors, except
+//    as expressly stated herein.
+//
+//  * Neither the name "A.M.P.A.S." nor the name of any other
+//    contributors to this software may be used to endorse or promote
+//    products derivative of or based on this software without express
+//    prior written permission of A.M.P.A.S. or the contributors, as
+//    appropriate.
+//
+// This license shall be construed pursuant to the laws of the State of
+// California, and any disputes related thereto shall be subject to the
+// jurisdiction of the courts therein.
+//
+// Disclaimer of Warranty: THIS SOFTWARE IS PROVIDED BY A.M.P.A.S. AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+// BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT ARE DISCLAIMED. IN NO
+// EVENT SHALL A.M.P.A.S., OR ANY CONTRIBUTORS OR DISTRIBUTORS, BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, RESITUTIONARY,
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+// THE POSSIBILITY OF SUCH DAMAGE.
+//
+// WITHOUT LIMITING THE GENERALITY OF THE FOREGOING, THE ACADEMY
+// SPECIFICALLY DISCLAIMS ANY REPRESENTATIONS OR WARRANTIES WHATSOEVER
+// RELATED TO PATENT OR OTHER INTELLECTUAL PROPERTY RIGHTS IN THE ACADEMY
+// COLOR ENCODING SYSTEM, OR APPLICATIONS THEREOF, HELD BY PARTIES OTHER
+// THAN A.M.P.A.S., WHETHER DISCLOSED OR UNDISCLOSED.
+///////////////////////////////////////////////////////////////////////////
+
+#define BOOST_TEST_MAIN
+#include <boost/test/unit_test.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/test/floating_point_comparison.hpp>
+
+#include "../lib/mathOps.h"
+#include "../lib/rta.h"
+
+using namespace std;
+using namespace rta;
+
+BOOST_AUTO_TEST_CASE ( TestProfile_AddEntry ) {
+    Profile * profileTest = new Profile();
+    
+    profileEntry e1 = { 5000.0, { 2.0, 1.0, 1.5 }, { { 1.0, 0.0, 0.0 }, { 0.0, 1.0, 0.0 }, { 0.0, 0.0, 1.0 } } };
+    profileEntry e2 = { 3000.0, { 1.5, 1.0, 2.5 }, { { 1.0, 0.0, 0.0 }, { 0.0, 1.0, 0.0 }, { 0.0, 0.0, 1.0 } } };
+    
+    profileTest->addEntry ( e1 );
+    profileTest->addEntry ( e2 );
+    
+    BOOST_CHECK_EQUAL ( profileTest->getEntries().size(), 2 );
+    BOOST_CHECK_EQUAL ( profileTest->getEntries()[0]._cct, 3000.0 );
+    BOOST_CHECK_EQUAL ( profileTest->getEntries()[1]._cct, 5000.0 );
+    
+    delete profileTest;
+};
+
+BOOST_AUTO_TEST_CASE ( TestProfile_WriteRead ) {
+    Profile * profileTest = new Profile();
+    
+    profileEntry e1 = { 3000.0, { 1.5, 1.0, 2.5 }, { { 1.1, 0.1, -0.2 }, { 0.0, 0.9, 0.1 }, { 0.0, -0.1, 1.1 } } };
+    profileEntry e2 = { 5000.0, { 2.0, 1.0, 1.5 }, { { 0.9, 0.1, 0.0 }, { 0.0, 1.1, -0.1 }, { 0.1, 0.0, 0.9 } } };
+    
+    profileTest->setCamera ( "nikon", "d200" );
+    profileTest->addEntry ( e1 );
+    profileTest->addEntry ( e2 );
+    
+    boost::filesystem::path path = boost::filesystem::temp_directory_path()
+                                   / boost::filesystem::unique_path ( "%%%%-%%%%.prof" );
+    BOOST_CHECK ( profileTest->write ( path.string() ) );
+    
+    Profile * profileRead = new Profile();
+    BOOST_CHECK ( !profileRead->read ( path.string(), "canon", "d200" ) );
+    BOOST_CHECK ( profileRead->read ( path.string(), "Nikon", "D200" ) );
+    
+    BOOST_CHECK_EQUAL ( profileRead->getBrand(), "nikon" );
+    BOOST_CHECK_EQUAL ( profileRead->getModel(), "d200" );
+    BOOST_CHECK_EQUAL ( profileRead->getEntries().size(), 2 );
+    FORI(3) {
+        BOOST_CHECK_EQUAL ( profileRead->getEntries()[1]._wb[i], e2._wb[i] );
+        FORJ(3) BOOST_CHECK_EQUAL ( profileRead->getEntries()[0]._idt[i][j], e1._idt[i][j] );
+    }
+    
+    boost::filesystem::remove ( path );
+    delete profileRead;
+    delete profileTest;
+};
+
+BOOST_AUTO_TEST_CASE ( TestProfile_Interpolate ) {
+    Profile * profileTest = new Profile();
+    
+    profileEntry e1 = { 3000.0, { 1.5, 1.0, 2.5 }, { { 1.0, 0.0, 0.0 }, { 0.0, 1.0, 0.0 }, { 0.0, 0.0, 1.0 } } };
+    profileEntry e2 = { 4000.0, { 2.0, 1.0, 1.5 }, { { 2.0, 0.0, 0.0 }, { 0.0, 1.0, 0.0 }, { 0.0, 0.0, 0.5 } } };
+    profileEntry e3 = { 5000.0, { 2.5, 1.0, 1.0 }, { { 3.0, 0.0, 0.0 }, { 0.0, 1.0, 0.0 }, { 0.0, 0.0, 0.2 } } };
+    
+    profileTest->addEntry ( e1 );
+    profileTest->addEntry ( e2 );
+    profileTest->addEntry ( e3 );
+    
+    vector < double > wb;
+    vector < vector < double > > idt;
+    
+    // exactly on an entry (multipliers need not be normalized)
+    double mul1[3] = { 4.0, 2.0, 3.0 };
+    double cct = profileTest->interpolate ( vector < double > ( mul1, mul1 + 3 ), wb, idt );
+    BOOST_CHECK_CLOSE ( cct, 4000.0, 1e-5 );
+    BOOST_CHECK_CLOSE ( wb[0], 2.0, 1e-5 );
+    BOOST_CHECK_CLOSE ( idt[0][0], 2.0, 1e-5 );
+    
+    // half way between the 2nd and the 3rd entries
+    double mul2[3] = { 2.25, 1.0, 1.25 };
+    cct = profileTest->interpolate ( vector < double > ( mul2, mul2 + 3 ), wb, idt );
+    BOOST_CHECK_CLOSE ( cct, 4500.0, 1e-5 );
+    BOOST_CHECK_CLOSE ( wb[2], 1.25, 1e-5 );
+    BOOST_CHECK_CLOSE ( idt[0][0], 2.5, 1e-5 );
+    BOOST_CHECK_CLOSE ( idt[2][2], 0.35, 1e-5 );
+    
+    // beyond the table: clamped to the last entry
+    double mul3[3] = { 4.0, 1.0, 0.5 };
+    cct = profileTest->interpolate ( vector < double > ( mul3, mul3 + 3 ), wb, idt );
+    BOOST_CHECK_CLOSE ( cct, 5000.0, 1e-5 );
+    
+    delete profileTest;
+};
+
+BOOST_AUTO_TEST_CASE ( TestProfile_Build ) {
+    boost::filesystem::path pathSpst = boost::filesystem::absolute \
+    ("../../data/camera/nikon_d200_380_780_5.json");
+    boost::filesystem::path pathTS = boost::filesystem::absolute \
+    ("../../data/training/training_spectral.json");
+    boost::filesystem::path pathCMF = boost::filesystem::absolute \
+    ("../../data/cmf/cmf_1931.json");
+    
+    Idt * idtTest = new Idt();
+    BOOST_CHECK ( idtTest->loadCameraSpst ( pathSpst.string(), "nikon", "d200" ) );
+    idtTest->loadTrainingData ( pathTS.string() );
+    idtTest->loadCMF ( pathCMF.string() );
+    
+    // an Illuminant loaded before is replaced by those of the table
+    Illum previous;
+    previous.calDayLightSPD ( 6500 );
+    idtTest->setIlluminants ( previous );
+    
+    // both sides of the switch from Blackbody to Daylight
+    Profile * profileTest = new Profile();
+    BOOST_CHECK_EQUAL ( profileTest->build ( *idtTest, 3900, 4100 ), 4 );
+    BOOST_CHECK_EQUAL ( profileTest->getBrand(), "nikon" );
+    BOOST_CHECK_EQUAL ( profileTest->getModel(), "d200" );
+    BOOST_CHECK_EQUAL ( idtTest->getIlluminants().size(), 1 );
+    
+    const vector < profileEntry > & entries = profileTest->getEntries();
+    const double ccts[4] = { 3900.0, 3950.0, 4000.0, 4100.0 };
+    
+    // each entry as calIDT() gives it on its own at the same CCT
+    FORI ( entries.size() ) {
+        BOOST_CHECK_EQUAL ( entries[i]._cct, ccts[i] );
+        
+        Illum illum;
+        if ( ccts[i] < 4000 )
+            illum.calBlackBodySPD ( int(ccts[i]) );
+        else
+            illum.calDayLightSPD ( int(ccts[i]) );
+        
+        Idt * idtRef = new Idt();
+        idtRef->loadCameraSpst ( pathSpst.string(), "nikon", "d200" );
+        idtRef->loadTrainingData ( pathTS.string() );
+        idtRef->loadCMF ( pathCMF.string() );
+        idtRef->setIlluminants ( illum );
+        idtRef->chooseIllumType ( illum.getIllumType().c_str(), 0 );
+        BOOST_CHECK ( idtRef->calIDT() );
+        
+        vector < double > wb = idtRef->getWB();
+        vector < vector < double > > idt = idtRef->getIDT();
+        
+        FORJ ( 3 ) {
+            BOOST_CHECK_CLOSE ( entries[i]._wb[j], wb[j], 1e-9 );
+            for ( int k = 0; k < 3; k++ )
+                BOOST_CHECK_CLOSE ( entries[i]._idt[j][k], idt[j][k], 1e-9 );
+        }
+        
+        delete idtRef;
+    }
+    
+    delete profileTest;
+    delete idtTest;
+};
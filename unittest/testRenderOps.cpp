@@ -0,0 +1,737 @@
+///////////////////////////////////////////////////////////////////////////
+// Copyright (c) 2013 Academy of Motion Picture Arts and Sciences
+// ("A.M.P.A.S."). Portions contributed by others as indicated.
+// All rights reserved.
+//
+// A worldwide, royalty-free, non-exclusive right to copy, modify, create
+// derivatives, and use, in source and binary forms, is hereby granted,
+// subject to acceptance of this license. Performance of any of the
+// aforementioned acts indicates acceptance to be bound by the following
+// terms and conditions:
+//
+//  * Copies of source code, in whole or in part, must retain the
+//    above copyright notice, this list of conditions and the
+//    Disclaimer of Warranty.
+//
+//  * Use in binary form must retain the above copyright notice,
+//    this list of conditions and the Disclaimer of Warranty in the
+//    documentation and/or other materials provided with the distribution.
+//
+//  * Nothing in this license shall be deemed to grant any rights to
+//    trademarks, copyrights, patents, trade secrets or any other
+//    intellectual property of A.M.P.A.S. or any contributors, except
+//    as expressly stated herein.
+//
+//  * Neither the name "A.M.P.A.S." nor the name of any other
+//    contributors to this software may be used to endorse or promote
+//    products derivative of or based on this software without express
+//    prior written permission of A.M.P.A.S. or the contributors, as
+//    appropriate.
+//
+// This license shall be construed pursuant to the laws of the State of
+// California, and any disputes related thereto shall be subject to the
+// jurisdiction of the courts therein.
+//
+// Disclaimer of Warranty: THIS SOFTWARE IS PROVIDED BY A.M.P.A.S. AND
+// CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+// BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE, AND NON-INFRINGEMENT ARE DISCLAIMED. IN NO
+// EVENT SHALL A.M.P.A.S., OR ANY CONTRIBUTORS OR DISTRIBUTORS, BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, RESITUTIONARY,
+// OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+// THE POSSIBILITY OF SUCH DAMAGE.
+//
+// WITHOUT LIMITING THE GENERALITY OF THE FOREGOING, THE ACADEMY
+// SPECIFICALLY DISCLAIMS ANY REPRESENTATIONS OR WARRANTIES WHATSOEVER
+// RELATED TO PATENT OR OTHER INTELLECTUAL PROPERTY RIGHTS IN THE ACADEMY
+// COLOR ENCODING SYSTEM, OR APPLICATIONS THEREOF, HELD BY PARTIES OTHER
+// THAN A.M.P.A.S., WHETHER DISCLOSED OR UNDISCLOSED.
+///////////////////////////////////////////////////////////////////////////
+
+#define BOOST_TEST_MAIN
+#include <boost/test/unit_test.hpp>
+#include <boost/filesystem.hpp>
+
+#include "../src/renderOps.h"
+
+using namespace std;
+
+//  A small 16-bit RGB image laid out as dcraw_make_mem_image() returns it
+static vector < char > makeImage ( ushort width, ushort height ) {
+    size_t pixels = size_t(width) * height * 3 * 2;
+    vector < char > buffer ( offsetof ( libraw_processed_image_t, data ) + pixels );
+    
+    libraw_processed_image_t * image = reinterpret_cast < libraw_processed_image_t * > ( &buffer[0] );
+    image->type      = LIBRAW_IMAGE_BITMAP;
+    image->width     = width;
+    image->height    = height;
+    image->colors    = 3;
+    image->bits      = 16;
+    image->data_size = static_cast < unsigned int > (pixels);
+    
+    FORI ( pixels ) image->data[i] = static_cast < unsigned char > ( i * 7 );
+    
+    return buffer;
+}
+
+BOOST_AUTO_TEST_CASE ( Test_HashBytes ) {
+    const char text[] = "rawtoaces cache key";
+    uint64_t h = hashBytes ( text, sizeof(text), hashBasis );
+    
+    BOOST_CHECK_EQUAL ( h, hashBytes ( text, sizeof(text), hashBasis ) );
+    BOOST_CHECK ( h != hashBytes ( text, sizeof(text) - 1, hashBasis ) );
+    BOOST_CHECK ( h != hashBytes ( text, sizeof(text), hashBasis + 1 ) );
+    BOOST_CHECK_EQUAL ( hashBytes ( text, 0, hashBasis ), hashBasis );
+};
+
+BOOST_AUTO_TEST_CASE ( Test_RenderCacheKey ) {
+    libraw_output_params_t params;
+    memset ( &params, 0x0, sizeof ( params ) );
+    
+    Option opts;
+    opts.wb_method = wbMethod0;
+    opts.wb_estimator = wbEstimator0;
+    opts.preview_mode = previewMode0;
+    
+    uint64_t key = renderCacheKey ( 1, "0.19.0", params, opts );
+    
+    BOOST_CHECK_EQUAL ( key, renderCacheKey ( 1, "0.19.0", params, opts ) );
+    BOOST_CHECK ( key != renderCacheKey ( 2, "0.19.0", params, opts ) );
+    BOOST_CHECK ( key != renderCacheKey ( 1, "0.20.0", params, opts ) );
+    
+    // parameters of the demosaicing change the key
+    libraw_output_params_t half = params;
+    half.half_size = 1;
+    BOOST_CHECK ( key != renderCacheKey ( 1, "0.19.0", half, opts ) );
+    
+    libraw_output_params_t mul = params;
+    mul.user_mul[0] = 2.0f;
+    BOOST_CHECK ( key != renderCacheKey ( 1, "0.19.0", mul, opts ) );
+    
+    Option preview = opts;
+    preview.preview_mode = previewMode1;
+    BOOST_CHECK ( key != renderCacheKey ( 1, "0.19.0", params, preview ) );
+    
+    // the grey boxes only count for "--wb-method 3"
+    wbBox box = { 10, 20, 30, 40 };
+    Option boxes = opts;
+    boxes.wb_boxes.push_back ( box );
+    BOOST_CHECK_EQUAL ( key, renderCacheKey ( 1, "0.19.0", params, boxes ) );
+    
+    boxes.wb_method = wbMethod3;
+    Option estimator = boxes;
+    estimator.wb_estimator = wbEstimator1;
+    BOOST_CHECK ( key != renderCacheKey ( 1, "0.19.0", params, boxes ) );
+    BOOST_CHECK ( renderCacheKey ( 1, "0.19.0", params, boxes )
+                  != renderCacheKey ( 1, "0.19.0", params, estimator ) );
+};
+
+BOOST_AUTO_TEST_CASE ( Test_RenderCacheRoundTrip ) {
+    vector < char > buffer = makeImage ( 5, 3 );
+    const libraw_processed_image_t * image =
+        reinterpret_cast < const libraw_processed_image_t * > ( &buffer[0] );
+    
+    float preMul[4] = { 2.1f, 1.0f, 1.6f, 1.0f };
+    libraw_colordata_t * color = new libraw_colordata_t;
+    memset ( color, 0x0, sizeof ( libraw_colordata_t ) );
+    FORI(4) color->cam_mul[i] = 1.5f + i;
+    color->baseline_exposure = -0.5f;
+    for ( int k = 0; k < 2; k++ ) {
+        color->dng_color[k].illuminant = ushort ( 17 + 4 * k );
+        FORIJ(4, 4) color->dng_color[k].calibration[i][j] = 0.1f * ( i + j + k );
+        FORIJ(4, 3) color->dng_color[k].colormatrix[i][j] = 0.25f * ( i - j + k );
+    }
+    
+    RenderCacheHeader header;
+    makeCacheHeader ( header, 42, image, preMul, *color );
+    BOOST_CHECK_EQUAL ( header.size, buffer.size() );
+    
+    boost::filesystem::path path = boost::filesystem::temp_directory_path()
+                                   / boost::filesystem::unique_path();
+    BOOST_CHECK ( writeCache ( path.string().c_str(), header, image ) );
+    
+    FILE * file = fopen ( path.string().c_str(), "rb" );
+    BOOST_REQUIRE ( file );
+    vector < char > content ( cacheOffset + buffer.size() + 1 );
+    size_t size = fread ( &content[0], 1, content.size(), file );
+    fclose ( file );
+    boost::filesystem::remove ( path );
+    
+    BOOST_CHECK_EQUAL ( size, cacheOffset + buffer.size() );
+    BOOST_CHECK ( validCache ( &content[0], size, 42 ) );
+    BOOST_CHECK ( !validCache ( &content[0], size, 43 ) );
+    BOOST_CHECK ( !validCache ( &content[0], size - 1, 42 ) );
+    BOOST_CHECK ( !memcmp ( &content[cacheOffset], &buffer[0], buffer.size() ) );
+    
+    float preMul_test[4] = { 0.0f };
+    libraw_colordata_t * color_test = new libraw_colordata_t;
+    memset ( color_test, 0x0, sizeof ( libraw_colordata_t ) );
+    restoreCacheColor ( *reinterpret_cast < const RenderCacheHeader * > ( &content[0] ),
+                        preMul_test, *color_test );
+    
+    FORI(4) {
+        BOOST_CHECK_EQUAL ( preMul[i], preMul_test[i] );
+        BOOST_CHECK_EQUAL ( color->cam_mul[i], color_test->cam_mul[i] );
+    }
+    BOOST_CHECK_EQUAL ( color->baseline_exposure, color_test->baseline_exposure );
+    FORI(2) {
+        BOOST_CHECK_EQUAL ( color->dng_color[i].illuminant,
+                            color_test->dng_color[i].illuminant );
+        BOOST_CHECK ( !memcmp ( color->dng_color[i].calibration,
+                                color_test->dng_color[i].calibration,
+                                sizeof ( color->dng_color[i].calibration ) ) );
+        BOOST_CHECK ( !memcmp ( color->dng_color[i].colormatrix,
+                                color_test->dng_color[i].colormatrix,
+                                sizeof ( color->dng_color[i].colormatrix ) ) );
+    }
+    
+    // a corrupt header is rejected
+    content[0] = 'X';
+    BOOST_CHECK ( !validCache ( &content[0], size, 42 ) );
+    
+    delete color;
+    delete color_test;
+};
+
+BOOST_AUTO_TEST_CASE ( Test_OutputName ) {
+    BOOST_CHECK_EQUAL ( outputName ( "dir/IMG_0001", outFormat0 ), "dir/IMG_0001_aces.exr" );
+    BOOST_CHECK_EQUAL ( outputName ( "dir/IMG_0001", outFormat1 ), "dir/IMG_0001_aces_float.exr" );
+    BOOST_CHECK_EQUAL ( outputName ( "dir/IMG_0001", outFormat2 ), "dir/IMG_0001_aces_float.exr" );
+    BOOST_CHECK_EQUAL ( outputName ( "IMG", outFormat0, 1 ), "IMG_aces_v1.exr" );
+    BOOST_CHECK_EQUAL ( outputName ( "IMG", outFormat2, 12 ), "IMG_aces_v12_float.exr" );
+};
+
+BOOST_AUTO_TEST_CASE ( Test_StatsName ) {
+    BOOST_CHECK_EQUAL ( statsName ( "dir/IMG_0001_aces_v2.exr" ), "dir/IMG_0001_aces_v2.stats.json" );
+    BOOST_CHECK_EQUAL ( statsName ( "IMG_aces_float.EXR" ), "IMG_aces_float.stats.json" );
+    BOOST_CHECK_EQUAL ( statsName ( "-" ), "-.stats.json" );
+    BOOST_CHECK ( isOutputFile ( statsName ( outputName ( "IMG", outFormat2, 3 ) ) ) );
+};
+
+BOOST_AUTO_TEST_CASE ( Test_ParseVariant ) {
+    char method[] = "0", illum[] = "D55", headroom[] = "4.5";
+    char * args[] = { method, illum, headroom };
+    outputVariant variant;
+    
+    BOOST_CHECK_EQUAL ( parseVariant ( args, variant ), 0 );
+    BOOST_CHECK_EQUAL ( variant.mat_method, matMethod0 );
+    BOOST_CHECK_EQUAL ( string ( variant.illumType ), "d55" );
+    BOOST_CHECK_CLOSE ( variant.scale, 4.5f, 1e-5 );
+    
+    char method1[] = "1", na[] = "NA", headroom1[] = "6";
+    char * args1[] = { method1, na, headroom1 };
+    BOOST_CHECK_EQUAL ( parseVariant ( args1, variant ), 0 );
+    BOOST_CHECK_EQUAL ( variant.mat_method, matMethod1 );
+    BOOST_CHECK ( variant.illumType == nullptr );
+    
+    char cct[] = "3200K";
+    char * args2[] = { method, cct, headroom };
+    BOOST_CHECK_EQUAL ( parseVariant ( args2, variant ), 0 );
+    BOOST_CHECK_EQUAL ( string ( variant.illumType ), "3200k" );
+    
+    char badMethod[] = "3", badIllum[] = "D5a", zero[] = "0", negative[] = "-1";
+    char * args3[] = { badMethod, illum, headroom };
+    BOOST_CHECK_EQUAL ( parseVariant ( args3, variant ), 1 );
+    char * args4[] = { method, badIllum, headroom };
+    BOOST_CHECK_EQUAL ( parseVariant ( args4, variant ), 2 );
+    char * args5[] = { method, na, zero };
+    BOOST_CHECK_EQUAL ( parseVariant ( args5, variant ), 3 );
+    char * args6[] = { method, na, negative };
+    BOOST_CHECK_EQUAL ( parseVariant ( args6, variant ), 3 );
+};
+
+BOOST_AUTO_TEST_CASE ( Test_TarNumber ) {
+    BOOST_CHECK_EQUAL ( tarNumber ( "00000001750\0", 12 ), uint64_t(1000) );
+    BOOST_CHECK_EQUAL ( tarNumber ( "    17 \0\0\0\0\0", 12 ), uint64_t(15) );
+    BOOST_CHECK_EQUAL ( tarNumber ( "0000000\0", 8 ), uint64_t(0) );
+    
+    // base-256 size of 8 GB written by GNU tar
+    const char big[12] = { char(0x80), 0, 0, 0, 0, 0, 0, 0x02, 0, 0, 0, 0 };
+    BOOST_CHECK_EQUAL ( tarNumber ( big, 12 ), uint64_t(1) << 33 );
+};
+
+BOOST_AUTO_TEST_CASE ( Test_PaxPath ) {
+    string records = "30 mtime=1350244992.023960108\n"
+                     "32 path=shoot/day1/IMG_0001.CR2\n";
+    BOOST_CHECK_EQUAL ( paxPath ( records.c_str(), records.size() ),
+                        "shoot/day1/IMG_0001.CR2" );
+    
+    string other = "30 mtime=1350244992.023960108\n";
+    BOOST_CHECK_EQUAL ( paxPath ( other.c_str(), other.size() ), "" );
+    
+    // a record running past the end is ignored
+    BOOST_CHECK_EQUAL ( paxPath ( records.c_str(), records.size() - 1 ), "" );
+};
+
+BOOST_AUTO_TEST_CASE ( Test_OutputStem ) {
+    BOOST_CHECK_EQUAL ( outputStem ( "dir/IMG_0001.CR2" ), "dir/IMG_0001" );
+    BOOST_CHECK_EQUAL ( outputStem ( "IMG.0001.NEF" ), "IMG.0001" );
+    BOOST_CHECK_EQUAL ( outputStem ( "IMG_0001" ), "IMG_0001" );
+};
+
+BOOST_AUTO_TEST_CASE ( Test_IsOutputFile ) {
+    BOOST_CHECK ( isOutputFile ( "dir/IMG_0001_aces.exr" ) );
+    BOOST_CHECK ( isOutputFile ( "dir/IMG_0001_aces_float.exr" ) );
+    BOOST_CHECK ( isOutputFile ( "dir/IMG_0001_aces_v2.exr" ) );
+    BOOST_CHECK ( isOutputFile ( "dir/IMG_0001_aces_v12_float.exr" ) );
+    BOOST_CHECK ( isOutputFile ( "dir/IMG_0001_aces.stats.json" ) );
+    BOOST_CHECK ( isOutputFile ( "dir/IMG_0001_aces.claim" ) );
+    BOOST_CHECK ( isOutputFile ( "dir/IMG_0001_aces.done" ) );
+    
+    BOOST_CHECK ( !isOutputFile ( "dir/IMG_0001.CR2" ) );
+    BOOST_CHECK ( !isOutputFile ( "dir/IMG_0001_aces.CR2" ) );
+    BOOST_CHECK ( !isOutputFile ( "dir/IMG_0001_aces_v.exr" ) );
+    BOOST_CHECK ( !isOutputFile ( "dir/IMG_0001_aces_float_v1.exr" ) );
+    BOOST_CHECK ( !isOutputFile ( "shoot_aces/IMG_0001.CR2" ) );
+};
+
+BOOST_AUTO_TEST_CASE ( Test_ShardPath ) {
+    BOOST_CHECK_EQUAL ( shardPath ( "shoot/IMG_0001.CR2", "/mnt/a" ), "shoot/IMG_0001.CR2" );
+    BOOST_CHECK_EQUAL ( shardPath ( "./shoot//IMG_0001.CR2", "/mnt/a" ), "shoot/IMG_0001.CR2" );
+    BOOST_CHECK_EQUAL ( shardPath ( "shoot/day1/../IMG_0001.CR2", "/mnt/a" ),
+                        "shoot/IMG_0001.CR2" );
+    BOOST_CHECK_EQUAL ( shardPath ( "../b/IMG_0001.CR2", "/mnt/a" ), "../b/IMG_0001.CR2" );
+    
+    // absolute paths below the working directory are made relative
+    BOOST_CHECK_EQUAL ( shardPath ( "/mnt/a/shoot/IMG_0001.CR2", "/mnt/a" ),
+                        "shoot/IMG_0001.CR2" );
+    BOOST_CHECK_EQUAL ( shardPath ( "/net/share/shoot/IMG_0001.CR2", "/net/share" ),
+                        shardPath ( "shoot/IMG_0001.CR2", "/mnt/a" ) );
+    BOOST_CHECK_EQUAL ( shardPath ( "/mnt/ab/IMG_0001.CR2", "/mnt/a" ), "/mnt/ab/IMG_0001.CR2" );
+    BOOST_CHECK_EQUAL ( shardPath ( "/mnt/./b/../c/IMG_0001.CR2", "" ), "/mnt/c/IMG_0001.CR2" );
+    BOOST_CHECK_EQUAL ( shardPath ( "/../IMG_0001.CR2", "" ), "/IMG_0001.CR2" );
+};
+
+BOOST_AUTO_TEST_CASE ( Test_Xxh64 ) {
+    // reference digests of xxhsum -H1
+    Xxh64 empty;
+    BOOST_CHECK_EQUAL ( empty.digest(), 0xEF46DB3751D8E999ULL );
+    
+    Xxh64 abc;
+    abc.update ( "abc", 3 );
+    BOOST_CHECK_EQUAL ( abc.digest(), 0x44BC2CF5AD770999ULL );
+    
+    const char * text = "Nobody inspects the spammish repetition";
+    Xxh64 whole;
+    whole.update ( text, strlen ( text ) );
+    BOOST_CHECK_EQUAL ( whole.digest(), 0xFBCEA83C8A378BF1ULL );
+    
+    // the same digest whatever the pieces the data comes in
+    Xxh64 pieces;
+    pieces.update ( text, 5 );
+    pieces.update ( text + 5, 30 );
+    pieces.update ( text + 35, strlen ( text ) - 35 );
+    BOOST_CHECK_EQUAL ( pieces.digest(), whole.digest() );
+};
+
+BOOST_AUTO_TEST_CASE ( Test_StreamFile ) {
+    boost::filesystem::path path = boost::filesystem::temp_directory_path()
+                                   / boost::filesystem::unique_path();
+    
+    // larger than the 1 MB read buffer, so that it is read in pieces
+    string content ( ( 1 << 20 ) + 12345, 'x' );
+    FORI ( content.size() ) content[i] = char ( i * 7 + ( i >> 11 ) );
+    
+    FILE * file = fopen ( path.string().c_str(), "wb" );
+    BOOST_REQUIRE ( file != nullptr );
+    fwrite ( content.data(), 1, content.size(), file );
+    fclose ( file );
+    
+    Xxh64 whole;
+    whole.update ( content.data(), content.size() );
+    
+    uint64_t digest = 0;
+    BOOST_CHECK ( streamFile ( path.string().c_str(), nullptr, &digest ) == nullptr );
+    BOOST_CHECK_EQUAL ( digest, whole.digest() );
+    
+    // copied as it is, without a digest
+    FILE * copy = tmpfile();
+    BOOST_REQUIRE ( copy != nullptr );
+    BOOST_CHECK ( streamFile ( path.string().c_str(), copy, nullptr ) == nullptr );
+    
+    rewind ( copy );
+    string copied ( content.size() + 1, 0 );
+    BOOST_CHECK_EQUAL ( fread ( &copied[0], 1, copied.size(), copy ), content.size() );
+    copied.resize ( content.size() );
+    BOOST_CHECK ( copied == content );
+    fclose ( copy );
+    
+    boost::filesystem::remove ( path );
+    BOOST_CHECK ( streamFile ( path.string().c_str(), nullptr, &digest ) != nullptr );
+};
+
+BOOST_AUTO_TEST_CASE ( Test_JsonString ) {
+    BOOST_CHECK_EQUAL ( jsonString ( "IMG_0001.CR2" ), "\"IMG_0001.CR2\"" );
+    BOOST_CHECK_EQUAL ( jsonString ( "a\"b\\c" ), "\"a\\\"b\\\\c\"" );
+    BOOST_CHECK_EQUAL ( jsonString ( "tab\there\n" ), "\"tab\\u0009here\\u000a\"" );
+};
+
+BOOST_AUTO_TEST_CASE ( Test_StdoutHeader ) {
+    BOOST_CHECK_EQUAL ( stdoutHeader ( "dir/IMG_0001.CR2", 6000, 4000, 3, 1, 0,
+                                       size_t(6000) * 4000 * 3 * 2 ),
+                        "{\"file\":\"dir/IMG_0001.CR2\",\"width\":6000,\"height\":4000,"
+                        "\"channels\":\"RGB\",\"type\":\"half\",\"layout\":\"interleaved\","
+                        "\"bytes\":144000000}\n" );
+    
+    BOOST_CHECK_EQUAL ( stdoutHeader ( "a\"b.nef", 2, 1, 4, 0, 1, 32 ),
+                        "{\"file\":\"a\\\"b.nef\",\"width\":2,\"height\":1,"
+                        "\"channels\":\"RGBA\",\"type\":\"float\",\"layout\":\"planar\","
+                        "\"bytes\":32}\n" );
+};
+
+BOOST_AUTO_TEST_CASE ( Test_ToPlanar ) {
+    // 3 RGB pixels of half bits
+    const uint16_t rgb[9] = { 0x10, 0x11, 0x12,
+                              0x20, 0x21, 0x22,
+                              0x30, 0x31, 0x32 };
+    const uint16_t rgbPlanar[9] = { 0x10, 0x20, 0x30,
+                                    0x11, 0x21, 0x31,
+                                    0x12, 0x22, 0x32 };
+    uint16_t out[9];
+    
+    toPlanar ( rgb, out, 3, 3 );
+    FORI ( 9 ) BOOST_CHECK_EQUAL ( out[i], rgbPlanar[i] );
+    
+    // 2 RGBA pixels of floats
+    const float rgba[8] = { 0.1f, 0.2f, 0.3f, 1.0f,
+                            0.4f, 0.5f, 0.6f, 0.5f };
+    const float rgbaPlanar[8] = { 0.1f, 0.4f, 0.2f, 0.5f,
+                                  0.3f, 0.6f, 1.0f, 0.5f };
+    float outf[8];
+    
+    toPlanar ( rgba, outf, 2, 4 );
+    FORI ( 8 ) BOOST_CHECK_EQUAL ( outf[i], rgbaPlanar[i] );
+};
+
+BOOST_AUTO_TEST_CASE ( Test_ImageStats ) {
+    // four RGB pixels; two are clipped, the last one is also non-positive in blue
+    const float values[12] = { 0.25f, 0.5f, 1.0f,
+                               0.5f,  0.5f, 2.0f,
+                               1.0f,  0.5f, 4.0f,
+                               8.0f,  0.5f, -1.0f };
+    
+    ImageStats stats ( 3, 6.0f );
+    stats.scale ( values, 0, 6, 2.0f, [] ( size_t, size_t ) { } );
+    stats.scale ( values, 6, 12, 2.0f, [] ( size_t, size_t ) { } );
+    
+    // red: 0.5, 1, 2 and 16 ( clipped )
+    BOOST_CHECK_CLOSE ( stats.percentile ( 0, 0.01 ), 0.5f, 1e-5 );
+    BOOST_CHECK_CLOSE ( stats.percentile ( 0, 0.5 ), 2.0f, 1e-5 );
+    BOOST_CHECK_CLOSE ( stats.percentile ( 0, 0.99 ), 16.0f, 1e-5 );
+    
+    // green: 1.0 four times
+    BOOST_CHECK_CLOSE ( stats.percentile ( 1, 0.5 ), 1.0f, 1e-5 );
+    
+    // blue: -2, 2, 4 and 8; the lowest is not positive
+    BOOST_CHECK_EQUAL ( stats.percentile ( 2, 0.01 ), 0.0f );
+    BOOST_CHECK_CLOSE ( stats.percentile ( 2, 0.99 ), 8.0f, 1e-5 );
+    
+    // 2.5 lies in the quarter stop starting at 2.5, 3 in the one at 3
+    BOOST_CHECK_CLOSE ( ImageStats::binValue ( ( 1 - ImageStats::firstStop ) * 4 + 1 ), 2.5f, 1e-5 );
+    BOOST_CHECK_CLOSE ( ImageStats::binValue ( ( 1 - ImageStats::firstStop ) * 4 + 2 ), 3.0f, 1e-5 );
+    
+    boost::filesystem::path dir = boost::filesystem::temp_directory_path()
+                                  / boost::filesystem::unique_path();
+    boost::filesystem::create_directories ( dir );
+    string output = ( dir / "IMG_aces.exr" ).string();
+    
+    stats.save ( output.c_str(), 2, 2, 0 );
+    
+    FILE * file = fopen ( statsName ( output ).c_str(), "r" );
+    BOOST_REQUIRE ( file != nullptr );
+    char buf[8192];
+    size_t n = fread ( buf, 1, sizeof(buf) - 1, file );
+    fclose ( file );
+    buf[n] = 0;
+    string json ( buf );
+    
+    BOOST_CHECK ( json.find ( "\"file\":" + jsonString ( output.c_str() ) ) != string::npos );
+    BOOST_CHECK ( json.find ( "\"width\":2,\"height\":2,\"clip_level\":6,\"clipped_pixels\":2" )
+                  != string::npos );
+    BOOST_CHECK ( json.find ( "\"R\":{\"min\":0.5,\"max\":16,\"mean\":4.875,"
+                              "\"p1\":0.5,\"p50\":2,\"p99\":16,"
+                              "\"nonpositive\":0,\"clipped\":1," ) != string::npos );
+    BOOST_CHECK ( json.find ( "\"G\":{\"min\":1,\"max\":1,\"mean\":1," ) != string::npos );
+    BOOST_CHECK ( json.find ( "\"B\":{\"min\":-2,\"max\":8,\"mean\":3,"
+                              "\"p1\":0,\"p50\":4,\"p99\":8,"
+                              "\"nonpositive\":1,\"clipped\":1," ) != string::npos );
+    BOOST_CHECK_EQUAL ( json[json.size() - 1], '\n' );
+    
+    boost::filesystem::remove_all ( dir );
+};
+
+BOOST_AUTO_TEST_CASE ( Test_MemoryBudget ) {
+    MemoryBudget budget ( 100 );
+    
+    // a file larger than the limit runs alone
+    BOOST_CHECK_EQUAL ( budget.tryAcquire ( 150 ), 1 );
+    BOOST_CHECK_EQUAL ( budget.tryAcquire ( 10 ), 0 );
+    budget.release ( 150 );
+    BOOST_CHECK_EQUAL ( budget.running(), 0 );
+    
+    BOOST_CHECK_EQUAL ( budget.tryAcquire ( 60 ), 1 );
+    BOOST_CHECK_EQUAL ( budget.tryAcquire ( 40 ), 1 );
+    BOOST_CHECK_EQUAL ( budget.tryAcquire ( 1 ), 0 );
+    BOOST_CHECK_EQUAL ( budget.running(), 2 );
+    budget.release ( 40 );
+    
+    // prefetched bytes never go over the limit, even with no file running
+    BOOST_CHECK_EQUAL ( budget.tryReserve ( 50 ), 0 );
+    BOOST_CHECK_EQUAL ( budget.tryReserve ( 40 ), 1 );
+    BOOST_CHECK_EQUAL ( budget.tryAcquire ( 1 ), 0 );
+    budget.release ( 60 );
+    BOOST_CHECK_EQUAL ( budget.tryReserve ( 70 ), 0 );
+    budget.unreserve ( 40 );
+    BOOST_CHECK_EQUAL ( budget.tryReserve ( 70 ), 1 );
+    
+    MemoryBudget unlimited ( 0 );
+    BOOST_CHECK_EQUAL ( unlimited.tryAcquire ( size_t(1) << 40 ), 1 );
+    BOOST_CHECK_EQUAL ( unlimited.tryAcquire ( size_t(1) << 40 ), 1 );
+    BOOST_CHECK_EQUAL ( unlimited.tryReserve ( size_t(1) << 40 ), 1 );
+};
+
+BOOST_AUTO_TEST_CASE ( Test_JobQueue ) {
+    WorkSignal signal;
+    JobQueue queue ( &signal );
+    MemoryBudget budget ( 100 );
+    JobQueue::Job job;
+    
+    size_t seen = signal.events();
+    queue.push ( "normal", 50, priority1 );
+    queue.push ( "background", 10, priority2 );
+    queue.push ( "interactive", 60, priority0 );
+    BOOST_CHECK ( signal.events() != seen );
+    
+    // the most urgent class first; the order of submission is kept
+    BOOST_CHECK_EQUAL ( queue.take ( 0, &budget, job ), 1 );
+    BOOST_CHECK_EQUAL ( job.path, "interactive" );
+    BOOST_CHECK_EQUAL ( job.position, size_t(2) );
+    
+    // the next file does not fit, and no less urgent file passes it
+    BOOST_CHECK_EQUAL ( queue.take ( 0, &budget, job ), 0 );
+    budget.release ( 60 );
+    BOOST_CHECK_EQUAL ( queue.take ( 0, &budget, job ), 1 );
+    BOOST_CHECK_EQUAL ( job.path, "normal" );
+    BOOST_CHECK_EQUAL ( job.priority, int(priority1) );
+    
+    // a reserved worker only starts interactive files
+    BOOST_CHECK_EQUAL ( queue.take ( 1, &budget, job ), 0 );
+    BOOST_CHECK_EQUAL ( queue.take ( 0, &budget, job ), 1 );
+    BOOST_CHECK_EQUAL ( job.path, "background" );
+    
+    BOOST_CHECK_EQUAL ( queue.take ( 0, &budget, job ), 0 );
+    seen = signal.events();
+    queue.close();
+    BOOST_CHECK ( signal.events() != seen );
+    BOOST_CHECK_EQUAL ( queue.take ( 0, &budget, job ), -1 );
+    BOOST_CHECK_EQUAL ( queue.take ( 1, &budget, job ), -1 );
+};
+
+BOOST_AUTO_TEST_CASE ( Test_CfaBlack ) {
+    libraw_colordata_t color;
+    memset ( &color, 0, sizeof(color) );
+    unsigned * cblack = color.cblack;
+    cblack[0] = 10;
+    cblack[1] = 20;
+    cblack[2] = 30;
+    cblack[3] = 40;
+    
+    BOOST_CHECK_EQUAL ( cfaBlack ( cblack, 5, 7, 2 ), 30U );
+    
+    // a pattern of 2 rows by 4 columns, which does not divide 6 photosites
+    cblack[4] = 2;
+    cblack[5] = 4;
+    FORI ( 8 ) cblack[6 + i] = unsigned(i);
+    
+    BOOST_CHECK_EQUAL ( cfaBlack ( cblack, 0, 0, 0 ), 10U );
+    BOOST_CHECK_EQUAL ( cfaBlack ( cblack, 0, 3, 1 ), 23U );
+    BOOST_CHECK_EQUAL ( cfaBlack ( cblack, 1, 6, 3 ), 46U );
+    BOOST_CHECK_EQUAL ( cfaBlack ( cblack, 3, 9, 2 ), 35U );
+};
+
+BOOST_AUTO_TEST_CASE ( Test_SumCfaRow ) {
+    // a Bayer row of red and green, with a saturated red and a tail
+    // shorter than a period
+    const ushort line[9] = { 110, 220, 130, 240, 4095, 260, 150, 280, 170 };
+    const int color[6] = { 0, 1, 0, 1, 0, 1 };
+    const float level[6] = { 10, 20, 10, 20, 10, 20 };
+    
+    double sum[4] = { 0, 0, 0, 0 };
+    double count[4] = { 0, 0, 0, 0 };
+    sumCfaRow ( line, 9, 4095, color, level, sum, count );
+    
+    BOOST_CHECK_CLOSE ( sum[0], 100.0 + 120.0 + 140.0 + 160.0, 1e-9 );
+    BOOST_CHECK_EQUAL ( count[0], 4.0 );
+    BOOST_CHECK_CLOSE ( sum[1], 200.0 + 220.0 + 240.0 + 260.0, 1e-9 );
+    BOOST_CHECK_EQUAL ( count[1], 4.0 );
+    BOOST_CHECK_EQUAL ( sum[2], 0.0 );
+    BOOST_CHECK_EQUAL ( count[2], 0.0 );
+};
+
+BOOST_AUTO_TEST_CASE ( Test_GreyLevel ) {
+    vector < float > none;
+    BOOST_CHECK_EQUAL ( greyLevel ( wbEstimator0, 0.0, 0.0, none ), 0.0 );
+    BOOST_CHECK_EQUAL ( greyLevel ( wbEstimator1, 0.0, 0.0, none ), 0.0 );
+    BOOST_CHECK_EQUAL ( greyLevel ( wbEstimator2, 0.0, 0.0, none ), 0.0 );
+    
+    BOOST_CHECK_CLOSE ( greyLevel ( wbEstimator0, 300.0, 4.0, none ), 75.0, 1e-9 );
+    
+    // ten values with an outlier at each end
+    const float values[10] = { 900, 12, 10, 11, 13, 14, 10, 12, 11, -500 };
+    
+    vector < float > samples ( values, values + 10 );
+    BOOST_CHECK_EQUAL ( greyLevel ( wbEstimator1, 0.0, 0.0, samples ), 12.0 );
+    
+    samples.assign ( values, values + 10 );
+    BOOST_CHECK_CLOSE ( greyLevel ( wbEstimator2, 0.0, 0.0, samples ),
+                        ( 12 + 10 + 11 + 13 + 14 + 10 + 12 + 11 ) / 8.0, 1e-9 );
+};
+
+BOOST_AUTO_TEST_CASE ( Test_PreviewLevels ) {
+    libraw_colordata_t color;
+    memset ( &color, 0, sizeof(color) );
+    unsigned * cblack = color.cblack;
+    
+    PreviewJob job;
+    float preMul[4];
+    
+    // maximum - black = 65535: the factors are the scales themselves
+    const float mul[4] = { 2.0f, 1.0f, 1.5f, 0.0f };
+    BOOST_CHECK_EQUAL ( previewLevels ( job, mul, 0, 100, 65635, nullptr, preMul ), 1 );
+    
+    const float lowest[4] = { 2.0f, 1.0f, 1.5f, 1.0f };
+    FORI ( 4 ) {
+        BOOST_CHECK_EQUAL ( job.black[i], 100.0f );
+        BOOST_CHECK_CLOSE ( job.scale[i], lowest[i], 1e-5 );
+        BOOST_CHECK_CLOSE ( preMul[i], lowest[i], 1e-5 );
+    }
+    BOOST_CHECK ( job.cblack == nullptr );
+    
+    // with "highlight", normalized to the highest factor
+    BOOST_CHECK_EQUAL ( previewLevels ( job, mul, 2, 100, 65635 * 2 - 100, nullptr,
+                                        preMul ), 1 );
+    FORI ( 4 ) {
+        BOOST_CHECK_CLOSE ( job.scale[i], lowest[i] / 4.0, 1e-5 );
+        BOOST_CHECK_CLOSE ( preMul[i], lowest[i] / 2.0, 1e-5 );
+    }
+    
+    // per-color black levels and a pattern of 2 rows by 2 columns
+    cblack[0] = 1;
+    cblack[1] = 2;
+    cblack[2] = 3;
+    cblack[3] = 4;
+    cblack[4] = 2;
+    cblack[5] = 2;
+    BOOST_CHECK_EQUAL ( previewLevels ( job, mul, 0, 100, 65635, cblack, preMul ), 1 );
+    FORI ( 4 ) BOOST_CHECK_EQUAL ( job.black[i], 101.0f + i );
+    BOOST_CHECK ( job.cblack == cblack );
+    
+    // a pattern that does not repeat with the Bayer pairs, no range or
+    // a zero factor are left to libraw
+    cblack[5] = 3;
+    BOOST_CHECK_EQUAL ( previewLevels ( job, mul, 0, 100, 65635, cblack, preMul ), 0 );
+    BOOST_CHECK_EQUAL ( previewLevels ( job, mul, 0, 100, 100, nullptr, preMul ), 0 );
+    
+    const float zero[4] = { 2.0f, 0.0f, 1.5f, 1.0f };
+    BOOST_CHECK_EQUAL ( previewLevels ( job, zero, 0, 100, 65635, nullptr, preMul ), 0 );
+};
+
+//  A preview job on "raw" ( visible area at "top", "left" ) with an
+//  identity output matrix and no rotation
+static void previewJob ( PreviewJob & job, const ushort * raw, size_t pitch,
+                         int top, int left, int width, int height, int mode,
+                         const int fc[2][2], ushort * out ) {
+    job.raw       = raw;
+    job.pitch     = pitch;
+    job.top       = top;
+    job.left      = left;
+    job.width     = width;
+    job.height    = height;
+    job.mode      = mode;
+    job.flip      = 0;
+    job.maximum   = 65535.0f;
+    job.outWidth  = mode == previewMode1 ? width / 2 : width;
+    job.outHeight = mode == previewMode1 ? height / 2 : height;
+    job.out       = out;
+    
+    FORIJ ( 8, 2 ) job.fc[i][j] = fc[i & 1][j];
+    FORIJ ( 3, 3 ) job.mat[i][j] = i == j ? 1.0f : 0.0f;
+}
+
+BOOST_AUTO_TEST_CASE ( Test_PreviewBinning ) {
+    // RGGB ( the second green as color 3 ), 4x4 visible inside a margin
+    // of one photosite
+    const int fc[2][2] = { { 0, 1 }, { 3, 2 } };
+    const ushort raw[6 * 6] = {
+        0,   0,   0,   0,   0,  0,
+        0, 110,  60, 210,  80,  0,
+        0,  70,  36,  90,  46,  0,
+        0, 310, 100, 410, 120,  0,
+        0, 110,  56, 130,  66,  0,
+        0,   0,   0,   0,   0,  0
+    };
+    
+    libraw_colordata_t color;
+    memset ( &color, 0, sizeof(color) );
+    
+    PreviewJob job;
+    ushort out[2 * 2 * 3];
+    float preMul[4];
+    const float mul[4] = { 2.0f, 1.0f, 1.5f, 0.0f };
+    
+    previewJob ( job, raw, 6, 1, 1, 4, 4, previewMode1, fc, out );
+    BOOST_REQUIRE ( previewLevels ( job, mul, 0, 10, 65545, color.cblack, preMul ) );
+    previewBand ( &job, 0, job.outHeight );
+    
+    // red x2, the mean of the greens, blue x1.5, black 10
+    const ushort binned[12] = { 200, 55, 39,    400, 75, 54,
+                                600, 95, 69,    800, 115, 84 };
+    FORI ( 12 ) BOOST_CHECK_EQUAL ( out[i], binned[i] );
+    
+    // 10 more black on the odd rows, as a pattern of 2 rows by 1 column
+    color.cblack[4] = 2;
+    color.cblack[5] = 1;
+    color.cblack[7] = 10;
+    BOOST_REQUIRE ( previewLevels ( job, mul, 0, 10, 65545, color.cblack, preMul ) );
+    previewBand ( &job, 0, job.outHeight );
+    
+    const ushort patterned[12] = { 200, 50, 24,    400, 70, 39,
+                                   600, 90, 54,    800, 110, 69 };
+    FORI ( 12 ) BOOST_CHECK_EQUAL ( out[i], patterned[i] );
+};
+
+BOOST_AUTO_TEST_CASE ( Test_PreviewBilinear ) {
+    // BGGR, 5x3 so that both edge columns and both edge rows are partial
+    const int fc[2][2] = { { 2, 1 }, { 3, 0 } };
+    const ushort raw[3 * 5] = {
+        30,  60,  90, 120, 150,
+        14, 300,  24, 600,  38,
+        60,  90, 120, 150, 180
+    };
+    
+    PreviewJob job;
+    ushort out[5 * 3 * 3];
+    float preMul[4];
+    const float mul[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
+    
+    previewJob ( job, raw, 5, 0, 0, 5, 3, previewMode2, fc, out );
+    BOOST_REQUIRE ( previewLevels ( job, mul, 0, 0, 65535, nullptr, preMul ) );
+    
+    // two bands, as two threads would render them
+    previewBand ( &job, 0, 1 );
+    previewBand ( &job, 1, 3 );
+    
+    // each color is the mean of its neighbours inside the frame; e.g.
+    // green of the top-left blue is ( 60 + 14 ) / 2, red of the top
+    // middle blue is ( 300 + 600 ) / 2
+    const ushort bilinear[45] = {
+        300, 37, 30,   300, 60, 60,    450, 68, 90,    600, 120, 120,   600, 79, 150,
+        300, 14, 45,   300, 47, 75,    450, 24, 105,   600, 83, 135,    600, 38, 165,
+        300, 52, 60,   300, 90, 90,    450, 88, 120,   600, 150, 150,   600, 94, 180
+    };
+    FORI ( 45 ) BOOST_CHECK_EQUAL ( out[i], bilinear[i] );
+};